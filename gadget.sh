@@ -10,7 +10,17 @@ PRODUCT="Malincam"
 # These variables will be assumed throughout the rest of the document
 CONFIGFS="/sys/kernel/config"
 GADGET="$CONFIGFS/usb_gadget/g1"
-FUNCTION="$GADGET/functions/uvc.0"
+# One UVC function per camera, malincam pairs them with cameras in order. Override with UVC_FUNCTIONS=2
+UVC_FUNCTIONS=${UVC_FUNCTIONS:-1}
+# Raw sensor data instead of MJPEG, for MALINCAM_RAW=packed|unpacked. malincam logs the values its camera mode needs,
+# e.g. RAW_FOURCC=BG16 RAW_BITS=16 RAW_WIDTH=2028 RAW_HEIGHT=1080
+RAW_FOURCC=${RAW_FOURCC:-}
+RAW_BITS=${RAW_BITS:-16}
+RAW_WIDTH=${RAW_WIDTH:-2028}
+RAW_HEIGHT=${RAW_HEIGHT:-1080}
+# UVC control bitmaps, see uvc_setup_controls
+UVC_PU_CONTROLS=${UVC_PU_CONTROLS:-0x0201}
+UVC_CT_CONTROLS=${UVC_CT_CONTROLS:-0x0a0a}
 UDC=$(ls /sys/class/udc) # will identify the 'first' UDC
 
 uvc_setup_basics() {
@@ -60,7 +70,20 @@ uvc_create_frame() {
 EOF
 }
 
+uvc_setup_raw() {
+	uvc_create_frame $RAW_WIDTH $RAW_HEIGHT uncompressed raw
+
+	# GUID is the fourcc followed by the usual 0000-0010-8000-00aa00389b71, has to be set before linking the header
+	printf "%-4.4s\x00\x00\x10\x00\x80\x00\x00\xaa\x00\x38\x9b\x71" "$RAW_FOURCC" > $FUNCTION/streaming/uncompressed/raw/guidFormat
+	echo $RAW_BITS > $FUNCTION/streaming/uncompressed/raw/bBitsPerPixel
+}
+
 uvc_setup_modes() {
+	if [ -n "$RAW_FOURCC" ]; then
+		uvc_setup_raw
+		return
+	fi
+
 	uvc_create_frame 1332 976 mjpeg mjpeg
 	#create_frame 1920 1080 mjpeg mjpeg
 	#create_frame 1280 720 uncompressed yuyv
@@ -93,7 +116,11 @@ uvc_link_headers() {
 	pushd $FUNCTION/streaming/header/h
 
 	#TODO ln -s ../../uncompressed/yuyv
-	ln -s ../../mjpeg/mjpeg
+	if [ -n "$RAW_FOURCC" ]; then
+		ln -s ../../uncompressed/raw
+	else
+		ln -s ../../mjpeg/mjpeg
+	fi
 
 	# This section ensures that the header will be transmitted for each
 	# speed's set of descriptors. If support for a particular speed is not
@@ -114,15 +141,16 @@ uvc_link_headers() {
 
 # Set up regular (non-XU) UVC controls
 uvc_setup_controls() {
-	# TODO specify real controls that we have
+	# Controls that malincam maps onto V4L2 controls, see uvc_v4l2_mappings in src/UVC.c. Only those that resolve on
+	# Pi cameras and ISPs are advertised, hosts show every advertised control and unmapped ones STALL. malincam logs
+	# each mapped control at startup, advertise more with UVC_PU_CONTROLS/UVC_CT_CONTROLS for other sensors.
 
-	# Set the Processing Unit's bmControls, flagging Brightness, Contrast
-	# and Hue as available controls:
-	echo 0x05 > $FUNCTION/control/processing/default/bmControls
+	# Processing Unit bmControls: Brightness(D0), Gain(D9)
+	echo $UVC_PU_CONTROLS > $FUNCTION/control/processing/default/bmControls
 
-	# Set the Camera Terminal's bmControls, flagging Focus Absolute and
-	# Focus Relative as available controls:
-	echo 0x60 > $FUNCTION/control/terminal/camera/default/bmControls
+	# Camera Terminal bmControls: Auto-Exposure Mode(D1), Exposure Time Absolute(D3), Zoom Absolute(D9),
+	# PanTilt Absolute(D11). Zoom and pan/tilt fall back to digital crop
+	echo $UVC_CT_CONTROLS > $FUNCTION/control/terminal/camera/default/bmControls
 }
 
 uvc_setup_bandwidth() {
@@ -162,24 +190,25 @@ uvc_create() {
 	uvc_setup_basics
 
 	uvc_make_config
-	uvc_make_function
 
-	ln -s "$FUNCTION" "$GADGET"/configs/c.1
+	for i in $(seq 0 $(( UVC_FUNCTIONS - 1 ))); do
+		FUNCTION="$GADGET/functions/uvc.$i"
+		uvc_make_function
+		ln -s "$FUNCTION" "$GADGET"/configs/c.1
+	done
 
 	echo "$UDC" > $GADGET/UDC
 }
 
-uvc_destroy() {
-	echo "" > $GADGET/UDC || echo "$?"
-
-	rm $GADGET/configs/c.1/uvc.0 || echo "$?"
-	rm $GADGET/configs/c.1/strings/0x409/* || echo "$?"
-	rmdir $GADGET/configs/c.1/strings/0x409 || echo "$?"
-	rm $GADGET/configs/c.1 || echo "$?"
+uvc_destroy_function() {
+	rm $GADGET/configs/c.1/$(basename $FUNCTION) || echo "$?"
 
 	rm $FUNCTION/control/class/*/h || echo "$?"
 	rm $FUNCTION/streaming/class/*/h || echo "$?"
 	rm $FUNCTION/streaming/header/h/u || echo "$?"
+	rm $FUNCTION/streaming/header/h/raw || echo "$?"
+	rmdir $FUNCTION/streaming/uncompressed/raw/*p || echo "$?"
+	rmdir $FUNCTION/streaming/uncompressed/raw || echo "$?"
 	#rmdir $FUNCTION/streaming/uncompressed/yuyv/*/ || echo "$?"
 	#rmdir $FUNCTION/streaming/uncompressed/yuyv || echo "$?"
 	rmdir $FUNCTION/streaming/mjpeg/mjpeg/*p || echo "$?"
@@ -190,6 +219,18 @@ uvc_destroy() {
 	rmdir $FUNCTION/streaming/header/h || echo "$?"
 	rmdir $FUNCTION/control/header/h || echo "$?"
 	rmdir $FUNCTION || echo "$?"
+}
+
+uvc_destroy() {
+	echo "" > $GADGET/UDC || echo "$?"
+
+	for FUNCTION in "$GADGET"/functions/uvc.*; do
+		uvc_destroy_function
+	done
+
+	rm $GADGET/configs/c.1/strings/0x409/* || echo "$?"
+	rmdir $GADGET/configs/c.1/strings/0x409 || echo "$?"
+	rm $GADGET/configs/c.1 || echo "$?"
 
 	rmdir $GADGET/strings/0x409 || echo "$?"
 
@@ -1,6 +1,7 @@
 #include "Node.h"
 
 #include "device.h"
+#include "V4l2Control.h"
 #include "common.h"
 
 #include <string.h>
@@ -49,3 +50,21 @@ int nodeStop(Node *node) {
 
 	return output_status ? output_status : status;
 }
+
+int nodeCommitControls(Node *node) {
+	if (!node->controls || !v4l2ControlsPending(node->controls))
+		return 0;
+
+	const int result = v4l2ControlsCommit(node->controls);
+	if (result < 0)
+		LOGE("Unable to commit %s controls: %s(%d)", node->name, strerror(-result), result);
+
+	return result;
+}
+
+int nodeProcessControlEvents(Node *node) {
+	if (!node->controls)
+		return 0;
+
+	return v4l2ControlsProcessEvents(node->controls);
+}
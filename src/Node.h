@@ -2,6 +2,7 @@
 
 // TODO struct Stream;
 struct DeviceStream;
+struct V4l2Controls;
 struct Node;
 
 typedef void (NodeDtorFunc)(struct Node*);
@@ -25,6 +26,10 @@ typedef struct Node {
 
 	// Output: stream that produces buffers. V4L2 CAPTURE
 	struct DeviceStream *output;
+
+	// Image controls of this node (e.g. sensor exposure/gain, ISP white balance). Optional.
+	// Changes are staged and applied together at frame boundaries, see nodeCommitControls()
+	struct V4l2Controls *controls;
 } Node;
 
 /* TODO
@@ -46,6 +51,14 @@ int nodeStart(Node *node);
 // TODO drain sequence?
 int nodeStop(Node *node);
 
+// Applies staged control changes in one go
+// Returns number of applied controls, or <0 on error
+int nodeCommitControls(Node *node);
+
+// Updates cached control values from pending V4L2_EVENT_CTRL events
+// Returns number of updated controls, or <0 on error
+int nodeProcessControlEvents(Node *node);
+
 static inline void nodeDestroy(Node *node) {
 	node->dtorFunc(node);
 }
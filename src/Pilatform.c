@@ -2,45 +2,82 @@
 
 #include "Node.h"
 #include "device.h"
+#include "geometry.h"
+#include "negotiate.h"
 #include "subdev.h"
+#include "media.h"
 
+#include "v4l2-print.h"
 #include "common.h"
 
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h> // major, minor, makedev
+#include <dirent.h> // opendir
+#include <fcntl.h> // open
+#include <unistd.h> // close
 #include <stdlib.h>
+#include <stddef.h> // offsetof
 #include <memory.h>
-
-// 120fps sensor settings for HQ camera
-#define SENSOR_WIDTH 1332
-#define SENSOR_HEIGHT 990
-#define SENSOR_BUSFMT MEDIA_BUS_FMT_SRGGB10_1X10
-//#define SENSOR_BUSFMT MEDIA_BUS_FMT_SGRBG10_1X10
-
-// TODO detect flipping
-#define CAMERA_PIXFMT V4L2_PIX_FMT_SBGGR10P
-//#define CAMERA_PIXFMT V4L2_PIX_FMT_SRGGB10P
-//#define CAMERA_PIXFMT V4L2_PIX_FMT_SGRBG10P
-
-//#define CROP_TO_720P
-#define CROP_TO_976
-#ifdef CROP_TO_720P
-#define ISP_CROP_WIDTH 1280
-#define ISP_CROP_HEIGHT 720
-#elif defined(CROP_TO_976)
-// Needed for using JPEG encoder
-#define ISP_CROP_WIDTH 1332
-#define ISP_CROP_HEIGHT 976
-#else
-#define ISP_CROP_WIDTH SENSOR_WIDTH
-#define ISP_CROP_HEIGHT SENSOR_HEIGHT
-#endif
-
-#define ISP_OUTPUT_PIXFMT V4L2_PIX_FMT_YUV420
+#include <errno.h>
+
+// Video output size asked of the geometry solver, which fits it to the sensor mode and the encoders
+#define VIDEO_WIDTH 1332
+#define VIDEO_HEIGHT 976
+
+// ISP output the encoders take, in order of preference. Geometry is for 4:2:0.
+// Only single buffer variants: pumps pass buffer per plane formats (YUV420M, NV12M) plane by plane, but frame
+// server clients, stills, scene detection and network sinks map only the first plane of ISP buffers
+static const uint32_t isp_output_formats[] = {
+	V4L2_PIX_FMT_YUV420, V4L2_PIX_FMT_NV12,
+};
+
+// Crop offsets and size on the raw frame keep the bayer pattern phase
+#define ISP_CROP_ALIGN 2
+
+// bcm2835-isp YUV420 output lines
+static const GeometryAlign isp_output_align = {.width = 2, .height = 2, .stride = 64};
+
+// bcm2835-codec and JPEG encoder input. Chroma planes are expected at stride * height aligned to 16, i.e. whole
+// macroblock/MCU rows, so an ISP output height that isn't aligned already gets its chroma read from the wrong offset
+static const GeometryAlign encoder_input_align = {.width = 2, .height = 16, .stride = 32};
+
+// Unicam stores raw CSI-2 data as is, i.e. MIPI packed
+static const struct {
+	uint32_t mbus_code;
+	uint32_t pixelformat;
+} unicam_formats[] = {
+	{MEDIA_BUS_FMT_SBGGR8_1X8, V4L2_PIX_FMT_SBGGR8},
+	{MEDIA_BUS_FMT_SGBRG8_1X8, V4L2_PIX_FMT_SGBRG8},
+	{MEDIA_BUS_FMT_SGRBG8_1X8, V4L2_PIX_FMT_SGRBG8},
+	{MEDIA_BUS_FMT_SRGGB8_1X8, V4L2_PIX_FMT_SRGGB8},
+	{MEDIA_BUS_FMT_Y8_1X8, V4L2_PIX_FMT_GREY},
+	{MEDIA_BUS_FMT_SBGGR10_1X10, V4L2_PIX_FMT_SBGGR10P},
+	{MEDIA_BUS_FMT_SGBRG10_1X10, V4L2_PIX_FMT_SGBRG10P},
+	{MEDIA_BUS_FMT_SGRBG10_1X10, V4L2_PIX_FMT_SGRBG10P},
+	{MEDIA_BUS_FMT_SRGGB10_1X10, V4L2_PIX_FMT_SRGGB10P},
+	{MEDIA_BUS_FMT_Y10_1X10, V4L2_PIX_FMT_Y10P},
+	{MEDIA_BUS_FMT_SBGGR12_1X12, V4L2_PIX_FMT_SBGGR12P},
+	{MEDIA_BUS_FMT_SGBRG12_1X12, V4L2_PIX_FMT_SGBRG12P},
+	{MEDIA_BUS_FMT_SGRBG12_1X12, V4L2_PIX_FMT_SGRBG12P},
+	{MEDIA_BUS_FMT_SRGGB12_1X12, V4L2_PIX_FMT_SRGGB12P},
+};
+
+static uint32_t unicamPixelFormat(uint32_t mbus_code) {
+	for (int i = 0; i < (int)COUNTOF(unicam_formats); ++i)
+		if (unicam_formats[i].mbus_code == mbus_code)
+			return unicam_formats[i].pixelformat;
+	return 0;
+}
 
 typedef struct {
 	Node node;
 
 	Subdev *sensor;
 	Device *camera;
+
+	// Duration of one sensor line for current mode, 0 if unknown
+	uint32_t line_ns;
 } PiCamera;
 
 static void cameraDtor(Node *node) {
@@ -53,14 +90,98 @@ static void cameraDtor(Node *node) {
 	free(cam);
 }
 
-struct Node *piOpenCamera(void) {
-	static const char* const sensor_node = "/dev/v4l-subdev0";
-	static const char* const camera_node = "/dev/video0";
+// Selects and sets the sensor mode for args, see subdevSelectMode()
+static int sensorSetMode(Subdev *sensor, PiCameraArgs args, SubdevSet *out, uint32_t *out_line_ns) {
+	// Smallest binned mode that still covers the output, so that small outputs don't read out the full sensor
+	const V4l2Control *const sensor_pixel_rate = v4l2ControlGet(&sensor->controls, V4L2_CID_PIXEL_RATE);
+	const SubdevMode *const mode = subdevSelectMode(sensor, &(SubdevModeRequest){
+		.pad = 0,
+		.width = args.width ? args.width : VIDEO_WIDTH,
+		.height = args.height ? args.height : VIDEO_HEIGHT,
+		.fps = args.fps,
+		.pixel_rate = sensor_pixel_rate ? sensor_pixel_rate->value : 0,
+	});
+	if (!mode) {
+		LOGE("Sensor has no usable raw modes");
+		return -ENOENT;
+	}
+
+	*out = (SubdevSet){
+		.pad = 0,
+
+		// TODO where to crop?
+		.mbus_code = mode->mbus_code,
+		.width = mode->width,
+		.height = mode->height,
+	};
+	if (0 != subdevSet(sensor, out)) {
+		LOGE("Failed to set up subdev");
+		return -EINVAL;
+	}
+
+	v4l2ControlsProcessEvents(&sensor->controls);
+
+	*out_line_ns = 0;
+	const V4l2Control *const pixel_rate = v4l2ControlGet(&sensor->controls, V4L2_CID_PIXEL_RATE);
+	const V4l2Control *const hblank = v4l2ControlGet(&sensor->controls, V4L2_CID_HBLANK);
+	if (pixel_rate && hblank && pixel_rate->value > 0) {
+		*out_line_ns = (out->width + hblank->value) * 1000000000ll / pixel_rate->value;
+		LOGI("Sensor line time=%uns (pixel_rate=%lld hblank=%lld)",
+			*out_line_ns, (long long)pixel_rate->value, (long long)hblank->value);
+	}
+
+	return 0;
+}
+
+// Camera capture stream for the sensor format
+static int cameraPrepare(Device *camera, const SubdevSet *ss) {
+	// Bayer order follows flips, so this is known only after the format is set
+	const uint32_t camera_pixfmt = unicamPixelFormat(ss->mbus_code);
+	if (!camera_pixfmt) {
+		LOGE("No unicam pixel format for %s(%#x)", v4l2MbusFmtName(ss->mbus_code), ss->mbus_code);
+		return -EINVAL;
+	}
+
+	// Modes differ in bit depth, and formats are enumerated per media bus code
+	if (0 != deviceStreamQueryFormats(&camera->capture, ss->mbus_code)) {
+		LOGE("Failed to query camera:capture stream formats");
+		return -EINVAL;
+	}
+
+	NegotiatedEdge edge;
+	if (0 != negotiateEdge(&(NegotiateEdgeArgs){
+			.name = "camera",
+			.src = &camera->capture,
+			.pixelformats = &camera_pixfmt,
+			.pixelformats_count = 1,
+		}, &edge))
+		return -EINVAL;
+
+	const DeviceStreamPrepareOpts camera_capture_opts = {
+		.buffers_count = 3,
+		.buffer_memory = edge.src_memory,
+
+		.pixelformat = edge.pixelformat,
+		.width = ss->width,
+		.height = ss->height,
+	};
+
+	if (0 != deviceStreamPrepare(&camera->capture, &camera_capture_opts)) {
+		LOGE("Unable to prepare camera:capture stream");
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+struct Node *piOpenCamera(const PiCameraNodes *nodes, PiCameraArgs args) {
+	const char *const sensor_node = nodes->sensor;
+	const char *const camera_node = nodes->camera;
 
 	Device *camera = NULL;
 
 	// 1. Open and set up sensor subdevice
-	Subdev *const sensor = subdevOpen(sensor_node, 2);
+	Subdev *const sensor = subdevOpen(sensor_node, nodes->sensor_pads);
 	if (!sensor) {
 		LOGE("Failed to open sensor subdev %s", sensor_node);
 		return NULL;
@@ -81,8 +202,8 @@ struct Node *piOpenCamera(void) {
 
 				case 180:
 					{
-						v4l2ControlSetById(&sensor->controls, V4L2_CID_HFLIP, 1);
-						v4l2ControlSetById(&sensor->controls, V4L2_CID_VFLIP, 1);
+						v4l2ControlStageById(&sensor->controls, V4L2_CID_HFLIP, 1);
+						v4l2ControlStageById(&sensor->controls, V4L2_CID_VFLIP, 1);
 
 						/* TODO ...
 						V4l2Control *const hflip = v4l2ControlGet(&sensor->controls, V4L2_CID_HFLIP);
@@ -120,25 +241,19 @@ struct Node *piOpenCamera(void) {
 	}
 
 	// TODO ...
-	v4l2ControlSetById(&sensor->controls, V4L2_CID_ANALOGUE_GAIN, 896);
+	v4l2ControlStageById(&sensor->controls, V4L2_CID_ANALOGUE_GAIN, 896);
 
-	SubdevSet ss = {
-		.pad = 0,
+	// Flips modify bayer layout, so these need to be applied before setting format
+	if (v4l2ControlsCommit(&sensor->controls) < 0)
+		LOGE("Failed to set up sensor controls");
 
-		// TODO where to crop?
-		.mbus_code = SENSOR_BUSFMT,
-		.width = SENSOR_WIDTH,
-		.height = SENSOR_HEIGHT,
-
-		// Lower fps
-		//.mbus_code = MEDIA_BUS_FMT_SRGGB12_1X12,
-		//.width = 2664,
-		//.height = 1980,
-	};
-	if (0 != subdevSet(sensor, &ss)) {
-		LOGE("Failed to set up subdev");
+	// Mode change below updates blanking and exposure ranges, learn about them via events
+	v4l2ControlsSubscribe(&sensor->controls);
+
+	SubdevSet ss;
+	uint32_t line_ns = 0;
+	if (0 != sensorSetMode(sensor, args, &ss, &line_ns))
 		goto fail;
-	}
 
 	// 2. Open camera device
 	camera = deviceOpen(camera_node);
@@ -147,24 +262,8 @@ struct Node *piOpenCamera(void) {
 		goto fail;
 	}
 
-	if (0 != deviceStreamQueryFormats(&camera->capture, ss.mbus_code)) {
-		LOGE("Failed to query camera:capture stream formats");
+	if (0 != cameraPrepare(camera, &ss))
 		goto fail;
-	}
-
-	const DeviceStreamPrepareOpts camera_capture_opts = {
-		.buffers_count = 3,
-		.buffer_memory = BUFFER_MEMORY_DMABUF_EXPORT,
-
-		.pixelformat = CAMERA_PIXFMT,
-		.width = SENSOR_WIDTH,
-		.height = SENSOR_HEIGHT,
-	};
-
-	if (0 != deviceStreamPrepare(&camera->capture, &camera_capture_opts)) {
-		LOGE("Unable to prepare camera:capture stream");
-		goto fail;
-	}
 
 	PiCamera *node = calloc(sizeof(PiCamera), 1);
 
@@ -174,6 +273,8 @@ struct Node *piOpenCamera(void) {
 	node->sensor = sensor;
 
 	node->node.output = &camera->capture;
+	node->node.controls = &sensor->controls;
+	node->line_ns = line_ns;
 
 	return &node->node;
 
@@ -187,6 +288,35 @@ fail:
 	return NULL;
 }
 
+int piCameraSetMode(struct Node *camera, PiCameraArgs args) {
+	PiCamera *const cam = (PiCamera*)camera;
+
+	const int result = deviceStreamRelease(&cam->camera->capture);
+	if (result != 0)
+		return result;
+
+	SubdevSet ss;
+	if (0 != sensorSetMode(cam->sensor, args, &ss, &cam->line_ns))
+		return -EINVAL;
+
+	return cameraPrepare(cam->camera, &ss);
+}
+
+void piCameraMaxSize(struct Node *camera, uint32_t *width, uint32_t *height) {
+	const Subdev *const sensor = ((PiCamera*)camera)->sensor;
+	*width = *height = 0;
+	for (int i = 0; i < arraySize(&sensor->modes); ++i) {
+		const SubdevMode *const mode = arrayAtConst(&sensor->modes, SubdevMode, i);
+		if ((uint64_t)mode->width * mode->height > (uint64_t)*width * *height) {
+			*width = mode->width;
+			*height = mode->height;
+		}
+	}
+}
+
+uint32_t piCameraLineTimeNs(struct Node *camera) {
+	return ((PiCamera*)camera)->line_ns;
+}
 typedef struct {
 	Node node;
 
@@ -204,14 +334,87 @@ static void ispDtor(Node *node) {
 	free(isp);
 }
 
-struct Node *piOpenISP(void) {
-#define DEBAYER_ISP_OUT_DEV "/dev/video13"
-#define DEBAYER_ISP_CAP_DEV "/dev/video14"
+// Input takes raw camera frames, output is what the encoders take as is, see geometry.h
+static int ispPrepare(Device *isp_out, Device *isp_cap, struct Node *camera, enum PiIspMode mode) {
+	const struct v4l2_pix_format *const raw = &camera->output->format.fmt.pix;
+	const int still = mode == PiIspStill;
+
+	// Stills are the full camera frame
+	Geometry geometry;
+	const GeometryRequest request = {
+		.sensor_width = raw->width,
+		.sensor_height = raw->height,
+		.crop_align = ISP_CROP_ALIGN,
+		.width = still ? 0 : VIDEO_WIDTH,
+		.height = still ? 0 : VIDEO_HEIGHT,
+		.stages = {isp_output_align, encoder_input_align},
+		.stages_count = 2,
+	};
+	if (0 != geometrySolve(&request, &geometry))
+		return -EINVAL;
+
+	// Raw frames straight from the camera
+	NegotiatedEdge input;
+	if (0 != negotiateEdge(&(NegotiateEdgeArgs){
+			.name = "cam_to_isp",
+			.src = camera->output,
+			.dst = &isp_out->output,
+			.pixelformats = &raw->pixelformat,
+			.pixelformats_count = 1,
+		}, &input))
+		return -EINVAL;
+
+	const DeviceStreamPrepareOpts isp_output_opts = {
+		.buffers_count = 3,
+		.buffer_memory = input.dst_memory,
+
+		.pixelformat = input.pixelformat,
+		.width = raw->width,
+		.height = raw->height,
+
+		.crop = geometry.crop,
+	};
+
+	if (0 != deviceStreamPrepare(&isp_out->output, &isp_output_opts)) {
+		LOGE("Unable to prepare isp_out:output stream");
+		return -EINVAL;
+	}
+
+	// Encoders are opened after, and take whatever this is
+	NegotiatedEdge output;
+	if (0 != negotiateEdge(&(NegotiateEdgeArgs){
+			.name = "isp",
+			.src = &isp_cap->capture,
+			.pixelformats = isp_output_formats,
+			.pixelformats_count = COUNTOF(isp_output_formats),
+		}, &output))
+		return -EINVAL;
+
+	const DeviceStreamPrepareOpts isp_capture_opts = {
+		// Every pooled encoder holds some while encoding, see encoder-pool.h.
+		// A still is a single frame, and full resolution buffers are large
+		.buffers_count = still ? 2 : 5,
+		.buffer_memory = output.src_memory,
+		.pixelformat = output.pixelformat,
+		.width = geometry.width,
+		.height = geometry.height,
+		.bytesperline = geometry.stride,
+	};
+
+	if (0 != deviceStreamPrepare(&isp_cap->capture, &isp_capture_opts)) {
+		LOGE("Unable to prepare isp_cap:capture stream");
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+struct Node *piOpenISP(const PiIspNodes *nodes, struct Node *camera) {
 	Device *isp_out = NULL;
 	Device *isp_cap = NULL;
 
 	// 3. Open Bayer to YUV encoder
-	isp_out = deviceOpen(DEBAYER_ISP_OUT_DEV);
+	isp_out = deviceOpen(nodes->output);
 	if (!isp_out) {
 		LOGE("Failed to open isp_out device");
 		goto fail;
@@ -223,28 +426,13 @@ struct Node *piOpenISP(void) {
 	}
 
 	// TODO ...
-	v4l2ControlSetById(&isp_out->controls, V4L2_CID_RED_BALANCE, 3285);
-	v4l2ControlSetById(&isp_out->controls, V4L2_CID_BLUE_BALANCE, 1618);
-	v4l2ControlSetById(&isp_out->controls, V4L2_CID_DIGITAL_GAIN, 1000);
+	v4l2ControlStageById(&isp_out->controls, V4L2_CID_RED_BALANCE, 3285);
+	v4l2ControlStageById(&isp_out->controls, V4L2_CID_BLUE_BALANCE, 1618);
+	v4l2ControlStageById(&isp_out->controls, V4L2_CID_DIGITAL_GAIN, 1000);
+	if (v4l2ControlsCommit(&isp_out->controls) < 0)
+		LOGE("Failed to set up isp controls");
 
-	const DeviceStreamPrepareOpts isp_output_opts = {
-		.buffers_count = 3,
-		.buffer_memory = BUFFER_MEMORY_DMABUF_IMPORT,
-
-		.pixelformat = CAMERA_PIXFMT,
-		.width = SENSOR_WIDTH,
-		.height = SENSOR_HEIGHT,
-
-		.crop_width = ISP_CROP_WIDTH,
-		.crop_height = ISP_CROP_HEIGHT,
-	};
-
-	if (0 != deviceStreamPrepare(&isp_out->output, &isp_output_opts)) {
-		LOGE("Unable to prepare isp_out:output stream");
-		goto fail;
-	}
-
-	isp_cap = deviceOpen(DEBAYER_ISP_CAP_DEV);
+	isp_cap = deviceOpen(nodes->capture);
 	if (!isp_cap) {
 		LOGE("Failed to open isp_cap device");
 		goto fail;
@@ -255,26 +443,16 @@ struct Node *piOpenISP(void) {
 		goto fail;
 	}
 
-	const DeviceStreamPrepareOpts isp_capture_opts = {
-		.buffers_count = 3,
-		.buffer_memory = BUFFER_MEMORY_DMABUF_EXPORT,
-		.pixelformat = ISP_OUTPUT_PIXFMT,
-		.width = isp_out->output.compose.width,
-		.height = isp_out->output.compose.height,
-		/* .width = ss.width, */
-		/* .height = ss.height, */
-	};
-
-	if (0 != deviceStreamPrepare(&isp_cap->capture, &isp_capture_opts)) {
-		LOGE("Unable to prepare isp_cap:capture stream");
+	if (0 != ispPrepare(isp_out, isp_cap, camera, PiIspVideo))
 		goto fail;
-	}
 
 	PiIsp *node = (PiIsp*)calloc(sizeof(PiIsp), 1);
 	node->node.name = "isp";
 	node->node.output = &isp_cap->capture;
 	node->node.input = &isp_out->output;
 	node->node.dtorFunc = ispDtor;
+	node->node.controls = &isp_out->controls;
+	v4l2ControlsSubscribe(node->node.controls);
 
 	node->output = isp_out;
 	node->capture = isp_cap;
@@ -291,6 +469,18 @@ fail:
 	return NULL;
 }
 
+int piIspSetMode(struct Node *isp_node, struct Node *camera, enum PiIspMode mode) {
+	PiIsp *const isp = (PiIsp*)isp_node;
+
+	int result = deviceStreamRelease(&isp->capture->capture);
+	if (result == 0)
+		result = deviceStreamRelease(&isp->output->output);
+	if (result != 0)
+		return result;
+
+	return ispPrepare(isp->output, isp->capture, camera, mode);
+}
+
 typedef struct {
 	Node node;
 
@@ -306,7 +496,12 @@ static void encoderDtor(Node *node) {
 	free(encoder);
 }
 
-static struct Node *piOpenEncoderImpl(const char *name, uint32_t pixfmt, const char* device_node) {
+// Encoder input takes src buffers as they are: same size and stride
+static struct Node *piOpenEncoderImpl(const char *name, uint32_t pixfmt, const char* device_node, const DeviceStream *src, int buffers_count) {
+	const int src_mp = IS_STREAM_MPLANE(src);
+	const uint32_t width = src_mp ? src->format.fmt.pix_mp.width : src->format.fmt.pix.width;
+	const uint32_t height = src_mp ? src->format.fmt.pix_mp.height : src->format.fmt.pix.height;
+	const uint32_t stride = src_mp ? src->format.fmt.pix_mp.plane_fmt[0].bytesperline : src->format.fmt.pix.bytesperline;
 
 	// 4. Open YUV to MJPEG encoder
 	// /dev/video11
@@ -321,12 +516,23 @@ static struct Node *piOpenEncoderImpl(const char *name, uint32_t pixfmt, const c
 		goto fail;
 	}
 
+	NegotiatedEdge input;
+	if (0 != negotiateEdge(&(NegotiateEdgeArgs){
+			.name = name,
+			.src = src,
+			.dst = &encoder->output,
+			.pixelformats = isp_output_formats,
+			.pixelformats_count = COUNTOF(isp_output_formats),
+		}, &input))
+		goto fail;
+
 	DeviceStreamPrepareOpts encoder_output_opts = {
-		.buffers_count = 3,
-		.buffer_memory = BUFFER_MEMORY_DMABUF_IMPORT,
-		.pixelformat = ISP_OUTPUT_PIXFMT,
-		.width = ISP_CROP_WIDTH,
-		.height = ISP_CROP_HEIGHT,
+		.buffers_count = buffers_count,
+		.buffer_memory = input.dst_memory,
+		.pixelformat = input.pixelformat,
+		.width = width,
+		.height = height,
+		.bytesperline = stride,
 	};
 
 	if (0 != deviceStreamPrepare(&encoder->output, &encoder_output_opts)) {
@@ -339,11 +545,19 @@ static struct Node *piOpenEncoderImpl(const char *name, uint32_t pixfmt, const c
 		goto fail;
 	}
 
+	NegotiatedEdge output;
+	if (0 != negotiateEdge(&(NegotiateEdgeArgs){
+			.name = name,
+			.src = &encoder->capture,
+			.pixelformats = &pixfmt,
+			.pixelformats_count = 1,
+		}, &output))
+		goto fail;
+
 	const DeviceStreamPrepareOpts encoder_capture_opts = {
-		.buffers_count = 3,
-		//.buffer_memory = BUFFER_MEMORY_MMAP,
-		.buffer_memory = BUFFER_MEMORY_DMABUF_EXPORT,
-		.pixelformat = pixfmt,
+		.buffers_count = buffers_count,
+		.buffer_memory = output.src_memory,
+		.pixelformat = output.pixelformat,
 		.width = encoder_output_opts.width,
 		.height = encoder_output_opts.height,
 		/* .width = ss.width, */
@@ -372,19 +586,377 @@ fail:
 	return NULL;
 }
 
-struct Node *piOpenEncoder(enum PiEncoderType type) {
-#define ENCODER_DEV "/dev/video11"
-#define JPEG_ENCODER_DEV "/dev/video31"
-
+struct Node *piOpenEncoder(const PiTopology *topo, enum PiEncoderType type, const struct Node *isp) {
 	switch (type) {
 		case PiEncoderMJPEG:
-			return piOpenEncoderImpl("encoder_mjpeg", V4L2_PIX_FMT_MJPEG, ENCODER_DEV);
+			return piOpenEncoderImpl("encoder_mjpeg", V4L2_PIX_FMT_MJPEG, topo->encoder, isp->output, 3);
 		case PiEncoderH264:
-			return piOpenEncoderImpl("encoder_h264", V4L2_PIX_FMT_H264, ENCODER_DEV);
+			return piOpenEncoderImpl("encoder_h264", V4L2_PIX_FMT_H264, topo->encoder, isp->output, 3);
 		case PiEncoderJPEG:
-			return piOpenEncoderImpl("encoder_jpeg", V4L2_PIX_FMT_JPEG, JPEG_ENCODER_DEV);
+			return piOpenEncoderImpl("encoder_jpeg", V4L2_PIX_FMT_JPEG, topo->jpeg_encoder, isp->output, 3);
 		default:
 			LOGE("Invalid encoder type %d", type);
 			return NULL;
 	}
 }
+
+struct Node *piOpenStillEncoder(const PiTopology *topo, const struct Node *isp) {
+	return piOpenEncoderImpl("encoder_still", V4L2_PIX_FMT_JPEG, topo->jpeg_encoder, isp->output, 1);
+}
+
+static const PiTopology pi_topology_default = {
+	.cameras = {{
+		.sensor = "/dev/v4l-subdev0",
+		.sensor_pads = 2,
+		.camera = "/dev/video0",
+	}},
+	.cameras_count = 1,
+	.isps = {{
+		.output = "/dev/video13",
+		.capture = "/dev/video14",
+	}},
+	.isps_count = 1,
+	.encoder = "/dev/video11",
+	.jpeg_encoder = "/dev/video31",
+	.uvc_gadgets = {"/dev/video2"},
+	.uvc_gadgets_count = 1,
+};
+
+static const struct {
+	const char *key;
+	size_t offset;
+} pi_topology_nodes[] = {
+	// Slots of all PI_MAX_CAMERAS cameras
+#define PI_TOPOLOGY_NODE(field) { #field, offsetof(PiTopology, field) }
+	PI_TOPOLOGY_NODE(cameras[0].sensor),
+	PI_TOPOLOGY_NODE(cameras[0].camera),
+	PI_TOPOLOGY_NODE(cameras[1].sensor),
+	PI_TOPOLOGY_NODE(cameras[1].camera),
+	PI_TOPOLOGY_NODE(isps[0].output),
+	PI_TOPOLOGY_NODE(isps[0].capture),
+	PI_TOPOLOGY_NODE(isps[1].output),
+	PI_TOPOLOGY_NODE(isps[1].capture),
+	PI_TOPOLOGY_NODE(encoder),
+	PI_TOPOLOGY_NODE(jpeg_encoder),
+	PI_TOPOLOGY_NODE(uvc_gadgets[0]),
+	PI_TOPOLOGY_NODE(uvc_gadgets[1]),
+#undef PI_TOPOLOGY_NODE
+};
+
+#define PI_TOPOLOGY_NODE_AT(topo, i) ((char*)(topo) + pi_topology_nodes[i].offset)
+
+#define PI_TOPOLOGY_CACHE_HEADER "# malincam topology v2"
+
+static int devnodeRdev(const char *path, dev_t *out) {
+	struct stat st;
+	if (0 != stat(path, &st) || !S_ISCHR(st.st_mode))
+		return -ENOENT;
+
+	*out = st.st_rdev;
+	return 0;
+}
+
+// A camera on another CSI port adds a media device, and then the cache is stale even though all its nodes are there
+static int mediaDevicesCount(void) {
+	int count = 0;
+	for (;; ++count) {
+		char path[32];
+		snprintf(path, sizeof(path), "/dev/media%d", count);
+
+		dev_t rdev;
+		if (0 != devnodeRdev(path, &rdev))
+			return count;
+	}
+}
+
+static void topologyCountSlots(PiTopology *topo) {
+	topo->cameras_count = 0;
+	while (topo->cameras_count < PI_MAX_CAMERAS && topo->cameras[topo->cameras_count].sensor[0]
+			&& topo->cameras[topo->cameras_count].camera[0] && topo->cameras[topo->cameras_count].sensor_pads > 0)
+		topo->cameras_count++;
+
+	topo->isps_count = 0;
+	while (topo->isps_count < PI_MAX_CAMERAS && topo->isps[topo->isps_count].output[0]
+			&& topo->isps[topo->isps_count].capture[0])
+		topo->isps_count++;
+
+	topo->uvc_gadgets_count = 0;
+	while (topo->uvc_gadgets_count < PI_MAX_CAMERAS && topo->uvc_gadgets[topo->uvc_gadgets_count][0])
+		topo->uvc_gadgets_count++;
+}
+
+// Cache lines are "<key> <devnode> <major>:<minor>", "cameras[<n>].sensor_pads <count>" and "media_devices <count>".
+// Valid only if every node is still there with the same device numbers
+static int topologyCacheLoad(PiTopology *out, const char *path) {
+	FILE *const f = fopen(path, "r");
+	if (!f)
+		return -errno;
+
+	PiTopology topo = {0};
+	int media_devices = -1;
+	int valid = 1;
+
+	char line[128];
+	if (!fgets(line, sizeof(line), f) || 0 != strncmp(line, PI_TOPOLOGY_CACHE_HEADER, strlen(PI_TOPOLOGY_CACHE_HEADER)))
+		valid = 0;
+
+	while (valid && fgets(line, sizeof(line), f)) {
+		char key[32], devnode[PI_DEVNODE_SIZE];
+		unsigned int maj, min;
+		int index, value;
+
+		if (1 == sscanf(line, "media_devices %d", &media_devices))
+			continue;
+
+		if (2 == sscanf(line, "cameras[%d].sensor_pads %d", &index, &value)) {
+			if (index < 0 || index >= PI_MAX_CAMERAS) {
+				valid = 0;
+				break;
+			}
+			topo.cameras[index].sensor_pads = value;
+			continue;
+		}
+
+		if (4 != sscanf(line, "%31s %31s %u:%u", key, devnode, &maj, &min)) {
+			valid = 0;
+			break;
+		}
+
+		int i = 0;
+		for (; i < (int)COUNTOF(pi_topology_nodes); ++i)
+			if (0 == strcmp(key, pi_topology_nodes[i].key))
+				break;
+
+		dev_t rdev;
+		if (i == (int)COUNTOF(pi_topology_nodes) || 0 != devnodeRdev(devnode, &rdev) || rdev != makedev(maj, min)) {
+			LOGI("Topology cache entry %s %s %u:%u is stale", key, devnode, maj, min);
+			valid = 0;
+			break;
+		}
+
+		strcpy(PI_TOPOLOGY_NODE_AT(&topo, i), devnode);
+	}
+
+	fclose(f);
+
+	if (!valid || media_devices != mediaDevicesCount())
+		return -ESTALE;
+
+	topologyCountSlots(&topo);
+	if (!topo.cameras_count || !topo.isps_count || !topo.uvc_gadgets_count || !topo.encoder[0] || !topo.jpeg_encoder[0])
+		return -ESTALE;
+
+	*out = topo;
+	return 0;
+}
+
+static void topologyCacheStore(const PiTopology *topo, const char *path) {
+	FILE *const f = fopen(path, "w");
+	if (!f) {
+		LOGE("Unable to write topology cache %s: %d, %s", path, errno, strerror(errno));
+		return;
+	}
+
+	fprintf(f, "%s\n", PI_TOPOLOGY_CACHE_HEADER);
+	fprintf(f, "media_devices %d\n", mediaDevicesCount());
+	for (int i = 0; i < (int)COUNTOF(pi_topology_nodes); ++i) {
+		const char *const devnode = PI_TOPOLOGY_NODE_AT(topo, i);
+		dev_t rdev = 0;
+		if (!devnode[0] || 0 != devnodeRdev(devnode, &rdev))
+			continue;
+		fprintf(f, "%s %s %u:%u\n", pi_topology_nodes[i].key, devnode, major(rdev), minor(rdev));
+	}
+	for (int i = 0; i < topo->cameras_count; ++i)
+		fprintf(f, "cameras[%d].sensor_pads %d\n", i, topo->cameras[i].sensor_pads);
+
+	fclose(f);
+}
+
+static int captureProducesFormat(const char *devnode, uint32_t pixelformat) {
+	const int fd = open(devnode, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+
+	static const uint32_t types[] = {V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE, V4L2_BUF_TYPE_VIDEO_CAPTURE};
+	int found = 0;
+	for (int t = 0; t < (int)COUNTOF(types) && !found; ++t) {
+		for (uint32_t i = 0; !found; ++i) {
+			struct v4l2_fmtdesc fmt = {.index = i, .type = types[t]};
+			if (0 != ioctl(fd, VIDIOC_ENUM_FMT, &fmt))
+				break;
+			found = fmt.pixelformat == pixelformat;
+		}
+	}
+
+	close(fd);
+	return found;
+}
+
+// All MEDIA_ENT_F_PROC_VIDEO_* functions share it
+#define MEDIA_ENT_F_PROC_VIDEO_BASE (MEDIA_ENT_F_BASE + 0x4000)
+
+static void discoverMediaGraph(const MediaGraph *graph, PiTopology *topo) {
+	// Sensor -> unicam image node. Every CSI port is a media device of its own
+	for (int n = 0; topo->cameras_count < PI_MAX_CAMERAS; ++n) {
+		const MediaEntity *const sensor = mediaGraphFindByFunction(graph, MEDIA_ENT_F_CAM_SENSOR, n);
+		if (!sensor)
+			break;
+
+		const MediaEntity *const camera = mediaGraphLinkedSink(graph, sensor, 0, MEDIA_ENT_F_IO_V4L);
+		if (!sensor->devnode[0] || !camera || !camera->devnode[0])
+			continue;
+
+		PiCameraNodes *const nodes = topo->cameras + topo->cameras_count++;
+		strcpy(nodes->sensor, sensor->devnode);
+		nodes->sensor_pads = sensor->pads_count;
+		strcpy(nodes->camera, camera->devnode);
+		LOGI("Found camera %d: sensor %s (%s, %d pads) -> %s (%s)", topo->cameras_count - 1,
+			sensor->entity.name, sensor->devnode, sensor->pads_count, camera->entity.name, camera->devnode);
+	}
+
+	for (int i = 0; i < graph->entities_count; ++i) {
+		const MediaEntity *const proc = graph->entities + i;
+		if ((proc->entity.function & ~0xffu) != MEDIA_ENT_F_PROC_VIDEO_BASE)
+			continue;
+
+		const MediaEntity *const in = mediaGraphLinkedSource(graph, proc, MEDIA_ENT_F_IO_V4L);
+		const MediaEntity *const out = mediaGraphLinkedSink(graph, proc, -1, MEDIA_ENT_F_IO_V4L);
+		if (!in || !out || !in->devnode[0] || !out->devnode[0])
+			continue;
+
+		if (proc->entity.function == MEDIA_ENT_F_PROC_VIDEO_ENCODER) {
+			// m2m encoder: both ends are the same node
+			if (!topo->encoder[0] && captureProducesFormat(in->devnode, V4L2_PIX_FMT_H264)) {
+				strcpy(topo->encoder, in->devnode);
+				LOGI("Found encoder %s (%s)", proc->entity.name, in->devnode);
+			} else if (!topo->jpeg_encoder[0] && captureProducesFormat(in->devnode, V4L2_PIX_FMT_JPEG)) {
+				strcpy(topo->jpeg_encoder, in->devnode);
+				LOGI("Found JPEG encoder %s (%s)", proc->entity.name, in->devnode);
+			}
+			continue;
+		}
+
+		// ISP with separate input and output nodes, m2m "isp" codec has a single node and isn't it
+		if (proc->entity.function == MEDIA_ENT_F_PROC_VIDEO_DECODER || 0 == strcmp(in->devnode, out->devnode))
+			continue;
+
+		if (topo->isps_count < PI_MAX_CAMERAS) {
+			PiIspNodes *const nodes = topo->isps + topo->isps_count++;
+			strcpy(nodes->output, in->devnode);
+			strcpy(nodes->capture, out->devnode);
+			LOGI("Found ISP %d %s: %s (%s) -> %s (%s)", topo->isps_count - 1, proc->entity.name,
+				in->entity.name, in->devnode, out->entity.name, out->devnode);
+		}
+	}
+}
+
+// UVC gadgets have no media device, look for their driver.
+// Functions get their video devices in configfs link order, so device numbers keep function order
+static void discoverUvcGadgets(PiTopology *topo) {
+	DIR *const dir = opendir("/sys/class/video4linux");
+	if (!dir)
+		return;
+
+	struct {
+		char devnode[PI_DEVNODE_SIZE];
+		dev_t rdev;
+	} gadgets[8];
+	int gadgets_count = 0;
+
+	const struct dirent *ent;
+	while (gadgets_count < (int)COUNTOF(gadgets) && (ent = readdir(dir))) {
+		if (0 != strncmp(ent->d_name, "video", 5))
+			continue;
+
+		char devnode[PI_DEVNODE_SIZE];
+		dev_t rdev;
+		if ((size_t)snprintf(devnode, sizeof(devnode), "/dev/%s", ent->d_name) >= sizeof(devnode)
+				|| 0 != devnodeRdev(devnode, &rdev))
+			continue;
+
+		const int fd = open(devnode, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+		if (fd < 0)
+			continue;
+
+		struct v4l2_capability caps = {0};
+		if (0 == ioctl(fd, VIDIOC_QUERYCAP, &caps) && 0 == strcmp((const char*)caps.driver, "g_uvc")) {
+			// Insertion sort by device number
+			int j = gadgets_count++;
+			for (; j > 0 && gadgets[j - 1].rdev > rdev; --j)
+				gadgets[j] = gadgets[j - 1];
+			strcpy(gadgets[j].devnode, devnode);
+			gadgets[j].rdev = rdev;
+		}
+
+		close(fd);
+	}
+
+	closedir(dir);
+
+	for (int i = 0; i < gadgets_count && topo->uvc_gadgets_count < PI_MAX_CAMERAS; ++i) {
+		strcpy(topo->uvc_gadgets[topo->uvc_gadgets_count++], gadgets[i].devnode);
+		LOGI("Found UVC gadget %d (%s)", topo->uvc_gadgets_count - 1, gadgets[i].devnode);
+	}
+}
+
+void piDiscover(PiTopology *out, const char *cache_path) {
+	if (cache_path && 0 == topologyCacheLoad(out, cache_path)) {
+		LOGI("Using cached topology from %s: cameras=%d isps=%d uvc_gadgets=%d",
+			cache_path, out->cameras_count, out->isps_count, out->uvc_gadgets_count);
+		return;
+	}
+
+	PiTopology topo = {0};
+
+	for (int i = 0;; ++i) {
+		char path[32];
+		snprintf(path, sizeof(path), "/dev/media%d", i);
+
+		MediaGraph graph;
+		const int result = mediaGraphLoad(path, &graph);
+		if (result == -ENOENT)
+			break;
+		if (result != 0)
+			continue;
+
+		LOGI("%s: driver=%s model=%s", path, graph.info.driver, graph.info.model);
+		discoverMediaGraph(&graph, &topo);
+		mediaGraphDestroy(&graph);
+	}
+
+	discoverUvcGadgets(&topo);
+
+	// Don't persist defaults, next start should look again
+	const int complete = topo.cameras_count && topo.isps_count && topo.encoder[0] && topo.jpeg_encoder[0]
+		&& topo.uvc_gadgets_count;
+
+	const PiTopology *const def = &pi_topology_default;
+	if (!topo.cameras_count) {
+		LOGE("No cameras found, using default %s -> %s", def->cameras[0].sensor, def->cameras[0].camera);
+		topo.cameras[0] = def->cameras[0];
+		topo.cameras_count = def->cameras_count;
+	}
+	if (!topo.isps_count) {
+		LOGE("No ISP found, using default %s -> %s", def->isps[0].output, def->isps[0].capture);
+		topo.isps[0] = def->isps[0];
+		topo.isps_count = def->isps_count;
+	}
+	if (!topo.encoder[0]) {
+		LOGE("No H.264 encoder found, using default %s", def->encoder);
+		strcpy(topo.encoder, def->encoder);
+	}
+	if (!topo.jpeg_encoder[0]) {
+		LOGE("No JPEG encoder found, using default %s", def->jpeg_encoder);
+		strcpy(topo.jpeg_encoder, def->jpeg_encoder);
+	}
+	if (!topo.uvc_gadgets_count) {
+		LOGE("No UVC gadget found, using default %s", def->uvc_gadgets[0]);
+		strcpy(topo.uvc_gadgets[0], def->uvc_gadgets[0]);
+		topo.uvc_gadgets_count = def->uvc_gadgets_count;
+	}
+
+	*out = topo;
+
+	if (cache_path && complete)
+		topologyCacheStore(&topo, cache_path);
+}
@@ -1,10 +1,91 @@
 #pragma once
 
+#include <stdint.h>
+
 struct Node;
 
-struct Node *piOpenCamera(void);
+#define PI_DEVNODE_SIZE 32
+
+// CM4 and Pi 5 have two CSI ports
+#define PI_MAX_CAMERAS 2
+
+typedef struct {
+	char sensor[PI_DEVNODE_SIZE];
+	int sensor_pads;
+
+	// Unicam image node, fed by the sensor's image pad
+	char camera[PI_DEVNODE_SIZE];
+} PiCameraNodes;
+
+typedef struct {
+	// ISP input (V4L2 OUTPUT) and main output (V4L2 CAPTURE)
+	char output[PI_DEVNODE_SIZE];
+	char capture[PI_DEVNODE_SIZE];
+} PiIspNodes;
+
+// Device nodes of the pipelines
+typedef struct {
+	// In media device order, i.e. CSI port order
+	PiCameraNodes cameras[PI_MAX_CAMERAS];
+	int cameras_count;
+
+	// ISP instances, each can serve one camera at a time
+	PiIspNodes isps[PI_MAX_CAMERAS];
+	int isps_count;
+
+	// m2m encoders producing H.264/MJPEG and JPEG. Each open is a separate context,
+	// the driver schedules jobs of all contexts on the one hardware block
+	char encoder[PI_DEVNODE_SIZE];
+	char jpeg_encoder[PI_DEVNODE_SIZE];
+
+	// One per configfs UVC function, in function order
+	char uvc_gadgets[PI_MAX_CAMERAS][PI_DEVNODE_SIZE];
+	int uvc_gadgets_count;
+} PiTopology;
+
+#define PI_TOPOLOGY_DEFAULT_CACHE_PATH "/var/cache/malincam.topology"
+
+// Finds device nodes by media controller entity functions and links, and UVC gadgets by their driver.
+// Result is cached at cache_path (NULL disables caching) and reused while the cached device numbers still match
+// and no media devices have come or gone.
+// Nodes that cannot be found keep the defaults of Pi 4 with a single HQ camera.
+void piDiscover(PiTopology *out, const char *cache_path);
 
-struct Node *piOpenISP(void);
+typedef struct {
+	// Output size the sensor mode has to cover, 0 for the default ISP output size
+	uint32_t width, height;
+
+	// Minimum frame rate, 0 for any
+	uint32_t fps;
+} PiCameraArgs;
+
+// Picks sensor mode for the requested output, see subdevSelectMode()
+struct Node *piOpenCamera(const PiCameraNodes *nodes, PiCameraArgs args);
+
+// Switches sensor to the mode for args and reallocates camera buffers for it. Camera must be stopped
+// Returns 0 on success, -errno on failure
+int piCameraSetMode(struct Node *camera, PiCameraArgs args);
+
+// Largest enumerated sensor mode, i.e. the full sensor
+void piCameraMaxSize(struct Node *camera, uint32_t *width, uint32_t *height);
+
+// Sensor line duration for the configured mode, 0 if the sensor doesn't report pixel rate and blanking
+uint32_t piCameraLineTimeNs(struct Node *camera);
+
+enum PiIspMode {
+	// Centered crop of the video output aspect, scaled to the video output size
+	PiIspVideo,
+
+	// Full camera frame in, full size out
+	PiIspStill,
+};
+
+// ISP input matches camera's raw output format
+struct Node *piOpenISP(const PiIspNodes *nodes, struct Node *camera);
+
+// Re-prepares ISP streams after camera mode change. ISP must be stopped, input crop is reset
+// Returns 0 on success, -errno on failure
+int piIspSetMode(struct Node *isp, struct Node *camera, enum PiIspMode mode);
 
 enum PiEncoderType {
 	PiEncoderMJPEG,
@@ -12,4 +93,8 @@ enum PiEncoderType {
 	PiEncoderJPEG,
 };
 
-struct Node *piOpenEncoder(enum PiEncoderType type);
+// Input takes ISP output buffers as they are, in the current ISP mode
+struct Node *piOpenEncoder(const PiTopology *topo, enum PiEncoderType type, const struct Node *isp);
+
+// JPEG encoder context for full resolution stills, with a single buffer each way. ISP must be in PiIspStill mode
+struct Node *piOpenStillEncoder(const PiTopology *topo, const struct Node *isp);
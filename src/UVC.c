@@ -1,7 +1,13 @@
 #include "UVC.h"
 
+#include "uvc-print.h"
+#include "trace.h"
+#include "metrics.h"
+#include "ptz.h"
+#include "probes.h"
 #include "Node.h"
 #include "device.h"
+#include "negotiate.h"
 #include "common.h"
 
 #include <linux/usb/g_uvc.h>
@@ -24,193 +30,6 @@
 #define UVC_REQ_ERROR_INVALUD_VALUE 0x08
 #define UVC_REQ_ERROR_UNKNOWN 0xFF
 
-// These are hardcoded in uvc-gadget, see drivers/usb/gadget/function/f_uvc.c
-// Alternatively, configfs could be parsed instead lol:
-// /sys/kernel/config/usb_gadget/g1/functions/uvc.0/control/bInterfaceNumber
-// /sys/kernel/config/usb_gadget/g1/functions/uvc.0/streaming/bInterfaceNumber
-#define UVC_INTF_VIDEO_CONTROL			0
-#define UVC_INTF_VIDEO_STREAMING		1
-
-// Units/terminals structure and IDs are also hardcoded,
-// see `uvc_alloc_inst()` function in the same file
-#define UVC_VC_ENT_INTERFACE 0
-#define UVC_VC_ENT_CAMERA_TERMINAL_ID 1
-#define UVC_VC_ENT_PROCESSING_UNIT_ID 2
-#define UVC_VC_ENT_OUTPUT_TERMINAL_ID 3
-
-#define UVC_VS_ENT_INTERFACE 0
-
-static const char *requestName(int request) {
-	switch (request) {
-		case UVC_GET_LEN: return "UVC_GET_LEN";
-		case UVC_GET_INFO: return "UVC_GET_INFO";
-		case UVC_SET_CUR: return "UVC_SET_CUR";
-		case UVC_GET_CUR: return "UVC_GET_CUR";
-		case UVC_GET_MIN: return "UVC_GET_MIN";
-		case UVC_GET_DEF: return "UVC_GET_DEF";
-		case UVC_GET_MAX: return "UVC_GET_MAX";
-		case UVC_GET_RES: return "UVC_GET_RES";
-	}
-	return "UNKNOWN";
-}
-
-static const char *usbSpeedName(enum usb_device_speed speed) {
-	switch (speed) {
-		case USB_SPEED_UNKNOWN: return "USB_SPEED_UNKNOWN";
-		case USB_SPEED_LOW: return "USB_SPEED_LOW";
-		case USB_SPEED_FULL: return "USB_SPEED_FULL";
-		case USB_SPEED_HIGH: return "USB_SPEED_HIGH";
-		case USB_SPEED_WIRELESS: return "USB_SPEED_WIRELESS";
-		case USB_SPEED_SUPER: return "USB_SPEED_SUPER";
-		case USB_SPEED_SUPER_PLUS: return "USB_SPEED_SUPER_PLUS";
-	}
-
-	return "UNKNOWN";
-}
-
-static const char *usbUvcIntefaceName(int interface) {
-	switch (interface) {
-		case UVC_INTF_VIDEO_CONTROL: return "UVC_INTF_VIDEO_CONTROL";
-		case UVC_INTF_VIDEO_STREAMING: return "UVC_INTF_VIDEO_STREAMING";
-		default: return "UNKNOWN";
-	}
-}
-
-static const char *usbUvcEntityName(int interface, int entity_id) {
-	switch(interface) {
-		case UVC_INTF_VIDEO_CONTROL:
-			switch (entity_id) {
-				case UVC_VC_ENT_INTERFACE: return "UVC_VC_ENT_INTERFACE";
-				case UVC_VC_ENT_CAMERA_TERMINAL_ID: return "UVC_VC_ENT_CAMERA_TERMINAL_ID";
-				case UVC_VC_ENT_PROCESSING_UNIT_ID: return "UVC_VC_ENT_PROCESSING_UNIT_ID";
-				case UVC_VC_ENT_OUTPUT_TERMINAL_ID: return "UVC_VC_ENT_OUTPUT_TERMINAL_ID";
-				default: return "UNKNOWN";
-			}
-		case UVC_INTF_VIDEO_STREAMING:
-			switch (entity_id) {
-				case 0: return "UVC_VS_ENT_INTERFACE";
-				default: return "UNKNOWN";
-			}
-		default: return "UNKNOWN";
-	}
-}
-
-static const char *usbUvcControlName(int interface, int entity_id, int control_selector) {
-	switch(interface) {
-		case UVC_INTF_VIDEO_CONTROL:
-			switch (entity_id) {
-				case UVC_VC_ENT_INTERFACE:
-					switch (control_selector) {
-						case UVC_VC_CONTROL_UNDEFINED: return "UVC_VC_CONTROL_UNDEFINED";
-						case UVC_VC_VIDEO_POWER_MODE_CONTROL: return "UVC_VC_VIDEO_POWER_MODE_CONTROL";
-						case UVC_VC_REQUEST_ERROR_CODE_CONTROL: return "UVC_VC_REQUEST_ERROR_CODE_CONTROL";
-						default: return "UNKNOWN";
-					}
-				case UVC_VC_ENT_CAMERA_TERMINAL_ID:
-					switch (control_selector) {
-						case UVC_CT_CONTROL_UNDEFINED: return "UVC_CT_CONTROL_UNDEFINED";
-						case UVC_CT_SCANNING_MODE_CONTROL: return "UVC_CT_SCANNING_MODE_CONTROL";
-						case UVC_CT_AE_MODE_CONTROL: return "UVC_CT_AE_MODE_CONTROL";
-						case UVC_CT_AE_PRIORITY_CONTROL: return "UVC_CT_AE_PRIORITY_CONTROL";
-						case UVC_CT_EXPOSURE_TIME_ABSOLUTE_CONTROL: return "UVC_CT_EXPOSURE_TIME_ABSOLUTE_CONTROL";
-						case UVC_CT_EXPOSURE_TIME_RELATIVE_CONTROL: return "UVC_CT_EXPOSURE_TIME_RELATIVE_CONTROL";
-						case UVC_CT_FOCUS_ABSOLUTE_CONTROL: return "UVC_CT_FOCUS_ABSOLUTE_CONTROL";
-						case UVC_CT_FOCUS_RELATIVE_CONTROL: return "UVC_CT_FOCUS_RELATIVE_CONTROL";
-						case UVC_CT_FOCUS_AUTO_CONTROL: return "UVC_CT_FOCUS_AUTO_CONTROL";
-						case UVC_CT_IRIS_ABSOLUTE_CONTROL: return "UVC_CT_IRIS_ABSOLUTE_CONTROL";
-						case UVC_CT_IRIS_RELATIVE_CONTROL: return "UVC_CT_IRIS_RELATIVE_CONTROL";
-						case UVC_CT_ZOOM_ABSOLUTE_CONTROL: return "UVC_CT_ZOOM_ABSOLUTE_CONTROL";
-						case UVC_CT_ZOOM_RELATIVE_CONTROL: return "UVC_CT_ZOOM_RELATIVE_CONTROL";
-						case UVC_CT_PANTILT_ABSOLUTE_CONTROL: return "UVC_CT_PANTILT_ABSOLUTE_CONTROL";
-						case UVC_CT_PANTILT_RELATIVE_CONTROL: return "UVC_CT_PANTILT_RELATIVE_CONTROL";
-						case UVC_CT_ROLL_ABSOLUTE_CONTROL: return "UVC_CT_ROLL_ABSOLUTE_CONTROL";
-						case UVC_CT_ROLL_RELATIVE_CONTROL: return "UVC_CT_ROLL_RELATIVE_CONTROL";
-						case UVC_CT_PRIVACY_CONTROL: return "UVC_CT_PRIVACY_CONTROL";
-						default: return "UNKNOWN";
-					}
-				case UVC_VC_ENT_PROCESSING_UNIT_ID:
-					switch (control_selector) {
-						case UVC_PU_CONTROL_UNDEFINED: return "UVC_PU_CONTROL_UNDEFINED";
-						case UVC_PU_BACKLIGHT_COMPENSATION_CONTROL: return "UVC_PU_BACKLIGHT_COMPENSATION_CONTROL";
-						case UVC_PU_BRIGHTNESS_CONTROL: return "UVC_PU_BRIGHTNESS_CONTROL";
-						case UVC_PU_CONTRAST_CONTROL: return "UVC_PU_CONTRAST_CONTROL";
-						case UVC_PU_GAIN_CONTROL: return "UVC_PU_GAIN_CONTROL";
-						case UVC_PU_POWER_LINE_FREQUENCY_CONTROL: return "UVC_PU_POWER_LINE_FREQUENCY_CONTROL";
-						case UVC_PU_HUE_CONTROL: return "UVC_PU_HUE_CONTROL";
-						case UVC_PU_SATURATION_CONTROL: return "UVC_PU_SATURATION_CONTROL";
-						case UVC_PU_SHARPNESS_CONTROL: return "UVC_PU_SHARPNESS_CONTROL";
-						case UVC_PU_GAMMA_CONTROL: return "UVC_PU_GAMMA_CONTROL";
-						case UVC_PU_WHITE_BALANCE_TEMPERATURE_CONTROL: return "UVC_PU_WHITE_BALANCE_TEMPERATURE_CONTROL";
-						case UVC_PU_WHITE_BALANCE_TEMPERATURE_AUTO_CONTROL: return "UVC_PU_WHITE_BALANCE_TEMPERATURE_AUTO_CONTROL";
-						case UVC_PU_WHITE_BALANCE_COMPONENT_CONTROL: return "UVC_PU_WHITE_BALANCE_COMPONENT_CONTROL";
-						case UVC_PU_WHITE_BALANCE_COMPONENT_AUTO_CONTROL: return "UVC_PU_WHITE_BALANCE_COMPONENT_AUTO_CONTROL";
-						case UVC_PU_DIGITAL_MULTIPLIER_CONTROL: return "UVC_PU_DIGITAL_MULTIPLIER_CONTROL";
-						case UVC_PU_DIGITAL_MULTIPLIER_LIMIT_CONTROL: return "UVC_PU_DIGITAL_MULTIPLIER_LIMIT_CONTROL";
-						case UVC_PU_HUE_AUTO_CONTROL: return "UVC_PU_HUE_AUTO_CONTROL";
-						case UVC_PU_ANALOG_VIDEO_STANDARD_CONTROL: return "UVC_PU_ANALOG_VIDEO_STANDARD_CONTROL";
-						case UVC_PU_ANALOG_LOCK_STATUS_CONTROL: return "UVC_PU_ANALOG_LOCK_STATUS_CONTROL";
-						default: return "UNKNOWN";
-					}
-				case UVC_VC_ENT_OUTPUT_TERMINAL_ID:
-					switch (control_selector) {
-						default: return "UNKNOWN";
-					}
-				default: return "UNKNOWN";
-			}
-		case UVC_INTF_VIDEO_STREAMING:
-			switch (entity_id) {
-				case 0:
-					switch (control_selector) {
-						case UVC_VS_CONTROL_UNDEFINED: return "UVC_VS_CONTROL_UNDEFINED";
-						case UVC_VS_PROBE_CONTROL: return "UVC_VS_PROBE_CONTROL";
-						case UVC_VS_COMMIT_CONTROL: return "UVC_VS_COMMIT_CONTROL";
-						case UVC_VS_STILL_PROBE_CONTROL: return "UVC_VS_STILL_PROBE_CONTROL";
-						case UVC_VS_STILL_COMMIT_CONTROL: return "UVC_VS_STILL_COMMIT_CONTROL";
-						case UVC_VS_STILL_IMAGE_TRIGGER_CONTROL: return "UVC_VS_STILL_IMAGE_TRIGGER_CONTROL";
-						case UVC_VS_STREAM_ERROR_CODE_CONTROL: return "UVC_VS_STREAM_ERROR_CODE_CONTROL";
-						case UVC_VS_GENERATE_KEY_FRAME_CONTROL: return "UVC_VS_GENERATE_KEY_FRAME_CONTROL";
-						case UVC_VS_UPDATE_FRAME_SEGMENT_CONTROL: return "UVC_VS_UPDATE_FRAME_SEGMENT_CONTROL";
-						case UVC_VS_SYNC_DELAY_CONTROL: return "UVC_VS_SYNC_DELAY_CONTROL";
-						default: return "UNKNOWN";
-					}
-				default: return "UNKNOWN";
-			}
-		default: return "UNKNOWN";
-	}
-}
-
-static void usbPrintSetupPacket(const char *prefix, const struct usb_ctrlrequest *req) {
-	const char transfer_direction = (req->bRequestType & USB_DIR_IN) ? '>' : '<';
-
-	char type = '?';
-	switch (req->bRequestType & USB_TYPE_MASK) {
-		case USB_TYPE_STANDARD: type = 'S'; break;
-		case USB_TYPE_CLASS: type = 'C'; break;
-		case USB_TYPE_VENDOR: type = 'V'; break;
-	}
-
-	char recipient = '?';
-	switch (req->bRequestType & USB_RECIP_MASK) {
-		case USB_RECIP_DEVICE: recipient = 'D'; break;
-		case USB_RECIP_INTERFACE: recipient = 'I'; break;
-		case USB_RECIP_ENDPOINT: recipient = 'E'; break;
-		case USB_RECIP_OTHER: recipient = 'O'; break;
-		case USB_RECIP_PORT: recipient = 'P'; break;
-		case USB_RECIP_RPIPE: recipient = 'R'; break;
-	}
-
-	const int if_or_endpoint = req->wIndex & 0xff;
-	const int entity_id = req->wIndex >> 8;
-
-	LOGI("%sbRequestType=%c%c%c(%02x) bRequest=%s(%02x) wIndex=[ent=%d if=%d](%04x) wValue=%04x wLength=%d",
-		prefix,
-		transfer_direction, type, recipient, req->bRequestType,
-		requestName(req->bRequest), req->bRequest,
-		entity_id, if_or_endpoint, req->wIndex,
-		req->wValue,
-		req->wLength);
-}
-
 typedef union {
 	uint32_t tag;
 	struct {
@@ -257,10 +76,10 @@ struct UvcGadget;
 struct UsbUvcControl;
 
 // Returns UVC_REQ_*
-typedef int (UsbUvcControlGetFunc)(struct UvcGadget *uvc, UsbUvcControlDispatchArgs args);
+typedef int (UsbUvcControlGetFunc)(struct UvcGadget *uvc, const struct UsbUvcControl *control, UsbUvcControlDispatchArgs args);
 
 // Called on UVC_GET_INFO
-typedef u8 (UsbUvcControlGetInfoFunc)(struct UvcGadget *uvc, UsbUvcControlDispatchArgs args, u8 info_default);
+typedef u8 (UsbUvcControlGetInfoFunc)(struct UvcGadget *uvc, const struct UsbUvcControl *control, UsbUvcControlDispatchArgs args, u8 info_default);
 
 // Called on data phase of UVC_SET_CUR
 typedef int (UsbUvcControlSetDataFunc)(struct UvcGadget *uvc, const struct UsbUvcControl *control, const struct uvc_request_data *data);
@@ -277,40 +96,117 @@ typedef struct UsbUvcControl {
 	UsbUvcControlGetInfoFunc *get_info;
 	UsbUvcControlGetFunc *get;
 	UsbUvcControlSetDataFunc *set_data;
+
+	// Handler-specific
+	uintptr_t arg;
 } UsbUvcControl;
 
+// Interfaces, entities and control selectors are all small numbers, see uvc-print.h and linux/usb/video.h
+#define UVC_DISPATCH_INTERFACES 2
+#define UVC_DISPATCH_ENTITIES 4
+#define UVC_DISPATCH_SELECTORS 32
 
+// Direct lookup table by dispatch tag fields
 typedef struct {
-	const UsbUvcControl *controls;
-	int controls_count;
+	const UsbUvcControl *lut[UVC_DISPATCH_INTERFACES][UVC_DISPATCH_ENTITIES][UVC_DISPATCH_SELECTORS];
 } UsbUvcDispatch;
 
-static const UsbUvcControl *usbUvcDispatchFindControlByTag(const UsbUvcDispatch *dispatch, uint32_t dispatch_tag) {
-	for (int i = 0; i < dispatch->controls_count; ++i) {
-		const UsbUvcControl *const ctrl = dispatch->controls + i;
-		if (ctrl->dispatch.tag == dispatch_tag)
-			return ctrl;
+static int usbUvcDispatchAdd(UsbUvcDispatch *dispatch, const UsbUvcControl *ctrl) {
+	const UsbDispatchTag tag = ctrl->dispatch;
+	if (tag.c.interface >= UVC_DISPATCH_INTERFACES || tag.c.entity_id >= UVC_DISPATCH_ENTITIES
+		|| tag.c.control_selector >= UVC_DISPATCH_SELECTORS) {
+		LOGE("%s: interface=%d entity=%d control=%d is out of dispatch table bounds", __func__,
+			tag.c.interface, tag.c.entity_id, tag.c.control_selector);
+		return -ERANGE;
 	}
-	return NULL;
+
+	dispatch->lut[tag.c.interface][tag.c.entity_id][tag.c.control_selector] = ctrl;
+	return 0;
+}
+
+static const UsbUvcControl *usbUvcDispatchFindControlByTag(const UsbUvcDispatch *dispatch, UsbDispatchTag tag) {
+	if (tag.c.interface >= UVC_DISPATCH_INTERFACES || tag.c.entity_id >= UVC_DISPATCH_ENTITIES
+		|| tag.c.control_selector >= UVC_DISPATCH_SELECTORS)
+		return NULL;
+
+	return dispatch->lut[tag.c.interface][tag.c.entity_id][tag.c.control_selector];
 }
 
+// UVC Processing Unit or Camera Terminal control backed by a V4L2 control
+typedef struct {
+	u8 entity_id;
+	u8 control_selector;
+
+	// Field size in bytes: 1, 2 or 4
+	u8 len;
+	u8 is_signed;
+
+	// Candidates, first one found is used
+	uint32_t v4l2_ids[2];
+} UvcV4l2ControlMapping;
+
+typedef struct {
+	const UvcV4l2ControlMapping *map;
+
+	// Controls set owning v4l2, changes are staged there
+	V4l2Controls *owner;
+	V4l2Control *v4l2;
+
+	// Precomputed at startup: v4l2 = uvc * mul / div
+	int64_t mul, div;
+
+	UsbUvcControl usb;
+} UvcMappedControl;
+
+#define UVC_MAPPED_CONTROLS_MAX 16
+
+// 4.3.1.2 of USB UVC 1.5 spec
+typedef struct __attribute__((packed)) {
+	u8 bFormatIndex;
+	u8 bFrameIndex;
+	u8 bCompressionIndex;
+	uint32_t dwMaxVideoFrameSize;
+	uint32_t dwMaxPayloadTransferSize;
+} UvcStillProbeCommit;
+
+// bTrigger of 4.3.1.3 of USB UVC 1.5 spec
+#define UVC_STILL_TRIGGER_NORMAL 0
+#define UVC_STILL_TRIGGER_TRANSMIT 1
+#define UVC_STILL_TRIGGER_TRANSMIT_BULK 2
+#define UVC_STILL_TRIGGER_ABORT 3
+
 typedef struct UvcGadget {
 	Node node;
 
 	uvc_event_streamon_f *event_streamon;
+	void *event_arg;
 
 	Device *gadget;
+	UvcStreamFormat format;
+
+	// NULL if metrics are disabled
+	MetricsUvc *metrics;
+
+	UvcMappedControl mapped[UVC_MAPPED_CONTROLS_MAX];
+	int mapped_count;
+
+	// Digital pan/tilt/zoom, NULL if not available
+	Ptz *ptz;
 
+	// Still image method 2/3, width 0 if not available
 	struct {
-		struct {
-			//UvcVcPuBrigtnessValue value;
-			//UvcVcPuBrigtnessMeta meta;
-			V4l2Control *v4l2;
-		} vc_pu_brightness;
-	} controls;
+		uvc_event_still_f *event;
+		uint32_t width, height;
+
+		// Negotiated via VS_STILL_PROBE/COMMIT_CONTROL
+		UvcStillProbeCommit probe;
+
+		// VS_STILL_IMAGE_TRIGGER_CONTROL, set by the control thread, reset by the frame thread when the still is done
+		u8 trigger;
+	} still;
 
 	struct {
-		// TODO UsbUvcDispatch dispatch;
+		UsbUvcDispatch dispatch;
 
 		// Last request error code as per 4.2.1.2 of UVC 1.5 spec
 		// VC_REQUEST_ERROR_CODE_CONTROL
@@ -324,7 +220,7 @@ typedef struct UvcGadget {
 #define USB_UVC_DISPATCH_NO_CONTROL -1
 // Values >= 0 are UVC_REQ_ERROR_*
 static int usbUvcDispatchRequest(const UsbUvcDispatch *dispatch, struct UvcGadget *uvc, UsbUvcControlDispatchArgs args) {
-	const UsbUvcControl *const ctrl = usbUvcDispatchFindControlByTag(dispatch, args.dispatch.tag);
+	const UsbUvcControl *const ctrl = usbUvcDispatchFindControlByTag(dispatch, args.dispatch);
 	if (!ctrl)
 		return USB_UVC_DISPATCH_NO_CONTROL;
 
@@ -337,7 +233,7 @@ static int usbUvcDispatchRequest(const UsbUvcDispatch *dispatch, struct UvcGadge
 
 		case UVC_GET_INFO:
 			{
-				const u8 info_caps = ctrl->get_info ? ctrl->get_info(uvc, args, ctrl->info_caps) : ctrl->info_caps;
+				const u8 info_caps = ctrl->get_info ? ctrl->get_info(uvc, ctrl, args, ctrl->info_caps) : ctrl->info_caps;
 				args.response->data[0] = info_caps;
 				args.response->length = 1;
 			}
@@ -365,7 +261,7 @@ static int usbUvcDispatchRequest(const UsbUvcDispatch *dispatch, struct UvcGadge
 					__func__, args.dispatch.c.interface, args.dispatch.c.entity_id, args.dispatch.c.control_selector);
 				return UVC_REQ_ERROR_INVALID_REQUEST;
 			}
-			return ctrl->get(uvc, args);
+			return ctrl->get(uvc, ctrl, args);
 
 		default:
 			LOGE("%s: interface=%d entity=%d control=%d invalid request=%d",
@@ -375,8 +271,8 @@ static int usbUvcDispatchRequest(const UsbUvcDispatch *dispatch, struct UvcGadge
 	}
 }
 
-static int uvcHandleVcInterfaceErrorCodeControl(UvcGadget *uvc, UsbUvcControlDispatchArgs args) {
-	UNUSED(uvc);
+static int uvcHandleVcInterfaceErrorCodeControl(UvcGadget *uvc, const UsbUvcControl *control, UsbUvcControlDispatchArgs args) {
+	UNUSED(control);
 	if (args.req->bRequest == UVC_GET_CUR) {
 		args.response->length = 1;
 		args.response->data[0] = uvc->usb.bRequestErrorCode;
@@ -384,12 +280,12 @@ static int uvcHandleVcInterfaceErrorCodeControl(UvcGadget *uvc, UsbUvcControlDis
 	}
 
 	LOGE("%s: unexpected request %s(%d)", __func__,
-		requestName(args.req->bRequest), args.req->bRequest);
+		uvcRequestName(args.req->bRequest), args.req->bRequest);
 	return UVC_REQ_ERROR_INVALID_REQUEST;
 }
 
-static int uvcHandleVsInterfaceProbeCommitControl(UvcGadget *uvc, UsbUvcControlDispatchArgs args) {
-	UNUSED(uvc);
+static int uvcHandleVsInterfaceProbeCommitControl(UvcGadget *uvc, const UsbUvcControl *control, UsbUvcControlDispatchArgs args) {
+	UNUSED(control);
 
 	struct uvc_streaming_control *const stream_ctrl = (void*)&args.response->data;
 	args.response->length = sizeof(struct uvc_streaming_control);
@@ -410,7 +306,7 @@ static int uvcHandleVsInterfaceProbeCommitControl(UvcGadget *uvc, UsbUvcControlD
 				//.wCompQuality = // TODO not set?
 				//.wCompWindowSize = // TODO not set?
 				//.wDelay = // TODO not set?
-				.dwMaxVideoFrameSize = 1332 * 976 * 2, // TODO based on real w, h, format
+				.dwMaxVideoFrameSize = uvc->format.frame_size,
 
 				// Use 1024, otherwise `No fast enough alt setting for requested bandwidth` will happen in dmesg
 				// TODO further reading: https://www.thegoodpenguin.co.uk/blog/multiple-uvc-cameras-on-linux/
@@ -444,59 +340,433 @@ static int uvcVsInterfaceProbeCommit(struct UvcGadget *uvc, const struct UsbUvcC
 	return 0;
 }
 
-typedef struct {
-	s16 wBrightness;
-} UvcVcPuBrigtnessValue;
+// See 4.2.2.3 (Processing Unit) and 4.2.2.1 (Camera Terminal) of USB UVC 1.5 spec for field sizes and units
+static const UvcV4l2ControlMapping uvc_v4l2_mappings[] = {
+	{ UVC_VC_ENT_PROCESSING_UNIT_ID, UVC_PU_BACKLIGHT_COMPENSATION_CONTROL, 2, 0, {V4L2_CID_BACKLIGHT_COMPENSATION} },
+	{ UVC_VC_ENT_PROCESSING_UNIT_ID, UVC_PU_BRIGHTNESS_CONTROL, 2, 1, {V4L2_CID_BRIGHTNESS} },
+	{ UVC_VC_ENT_PROCESSING_UNIT_ID, UVC_PU_CONTRAST_CONTROL, 2, 0, {V4L2_CID_CONTRAST} },
+	{ UVC_VC_ENT_PROCESSING_UNIT_ID, UVC_PU_GAIN_CONTROL, 2, 0, {V4L2_CID_ANALOGUE_GAIN, V4L2_CID_GAIN} },
+	// V4L2 menu values match UVC: disabled, 50Hz, 60Hz, auto
+	{ UVC_VC_ENT_PROCESSING_UNIT_ID, UVC_PU_POWER_LINE_FREQUENCY_CONTROL, 1, 0, {V4L2_CID_POWER_LINE_FREQUENCY} },
+	{ UVC_VC_ENT_PROCESSING_UNIT_ID, UVC_PU_HUE_CONTROL, 2, 1, {V4L2_CID_HUE} },
+	{ UVC_VC_ENT_PROCESSING_UNIT_ID, UVC_PU_SATURATION_CONTROL, 2, 0, {V4L2_CID_SATURATION} },
+	{ UVC_VC_ENT_PROCESSING_UNIT_ID, UVC_PU_SHARPNESS_CONTROL, 2, 0, {V4L2_CID_SHARPNESS} },
+	{ UVC_VC_ENT_PROCESSING_UNIT_ID, UVC_PU_GAMMA_CONTROL, 2, 0, {V4L2_CID_GAMMA} },
+	{ UVC_VC_ENT_PROCESSING_UNIT_ID, UVC_PU_WHITE_BALANCE_TEMPERATURE_CONTROL, 2, 0, {V4L2_CID_WHITE_BALANCE_TEMPERATURE} },
+	{ UVC_VC_ENT_PROCESSING_UNIT_ID, UVC_PU_WHITE_BALANCE_TEMPERATURE_AUTO_CONTROL, 1, 0, {V4L2_CID_AUTO_WHITE_BALANCE} },
+	// 100us units. V4L2_CID_EXPOSURE is in sensor lines and needs UvcOpenArgs.exposure_line_ns
+	{ UVC_VC_ENT_CAMERA_TERMINAL_ID, UVC_CT_EXPOSURE_TIME_ABSOLUTE_CONTROL, 4, 0, {V4L2_CID_EXPOSURE_ABSOLUTE, V4L2_CID_EXPOSURE} },
+	{ UVC_VC_ENT_CAMERA_TERMINAL_ID, UVC_CT_ZOOM_ABSOLUTE_CONTROL, 2, 0, {V4L2_CID_ZOOM_ABSOLUTE} },
+};
 
-static u8 uvcVcPuBrightnessGetInfo(struct UvcGadget *uvc, UsbUvcControlDispatchArgs args, u8 info_default) {
-	UNUSED(args);
-	UNUSED(info_default);
-	return (uvc->controls.vc_pu_brightness.v4l2) 
-		? UVC_CONTROL_CAP_GET | UVC_CONTROL_CAP_SET
-		: 0;
+static int64_t uvcMappedToUvc(const UvcMappedControl *mc, int64_t v4l2_value) {
+	int64_t value = v4l2_value * mc->div / mc->mul;
+
+	// Clamp to field size
+	const int bits = mc->map->len * 8;
+	const int64_t min = mc->map->is_signed ? -(1ll << (bits - 1)) : 0;
+	const int64_t max = mc->map->is_signed ? (1ll << (bits - 1)) - 1 : (1ll << bits) - 1;
+	if (value < min) value = min;
+	if (value > max) value = max;
+	return value;
 }
 
-static int uvcVcPuBrightnessGet(UvcGadget *uvc, UsbUvcControlDispatchArgs args) {
-	V4l2Control *const v4l2 = uvc->controls.vc_pu_brightness.v4l2;
-	if (!v4l2)
-		return UVC_REQ_ERROR_INVALID_CONTROL;
+static void uvcPutValue(u8 *data, int len, int64_t value) {
+	for (int i = 0; i < len; ++i)
+		data[i] = (value >> (i * 8)) & 0xff;
+}
+
+static int64_t uvcReadValue(const u8 *data, int len, int is_signed) {
+	uint32_t raw = 0;
+	for (int i = 0; i < len; ++i)
+		raw |= (uint32_t)data[i] << (i * 8);
+
+	if (is_signed && len < 4 && (raw & (1u << (len * 8 - 1))))
+		raw |= ~0u << (len * 8);
 
-	UvcVcPuBrigtnessValue *const value = (void*)args.response->data;
-	args.response->length = sizeof(UvcVcPuBrigtnessValue);
+	return is_signed ? (int64_t)(int32_t)raw : (int64_t)raw;
+}
 
+static u8 uvcMappedGetInfo(struct UvcGadget *uvc, const UsbUvcControl *control, UsbUvcControlDispatchArgs args, u8 info_default) {
+	UNUSED(uvc);
+	UNUSED(args);
+	const UvcMappedControl *const mc = (const UvcMappedControl*)control->arg;
+	const uint32_t flags = mc->v4l2->query.flags;
+
+	u8 caps = info_default;
+	if (flags & V4L2_CTRL_FLAG_READ_ONLY)
+		caps &= ~UVC_CONTROL_CAP_SET;
+	if (flags & V4L2_CTRL_FLAG_INACTIVE)
+		caps |= UVC_CONTROL_CAP_DISABLED;
+	if (flags & V4L2_CTRL_FLAG_VOLATILE)
+		caps |= UVC_CONTROL_CAP_AUTOUPDATE;
+
+	return caps;
+}
+
+// Answered from cached V4L2 control state, no ioctls
+static int uvcMappedGet(UvcGadget *uvc, const UsbUvcControl *control, UsbUvcControlDispatchArgs args) {
+	UNUSED(uvc);
+	const UvcMappedControl *const mc = (const UvcMappedControl*)control->arg;
+	const V4l2Control *const v4l2 = mc->v4l2;
+
+	int64_t value = 0;
 	switch (args.req->bRequest) {
-		case UVC_GET_CUR:
-			value->wBrightness = v4l2->value;
+		case UVC_GET_CUR: value = uvcMappedToUvc(mc, v4l2->value); break;
+		case UVC_GET_MIN: value = uvcMappedToUvc(mc, v4l2->query.minimum); break;
+		case UVC_GET_MAX: value = uvcMappedToUvc(mc, v4l2->query.maximum); break;
+		case UVC_GET_DEF: value = uvcMappedToUvc(mc, v4l2->query.default_value); break;
+		case UVC_GET_RES:
+			value = uvcMappedToUvc(mc, v4l2->query.step);
+			if (value < 1)
+				value = 1;
 			break;
-		case UVC_GET_MIN:
-			value->wBrightness = v4l2->query.minimum;
+		default:
+			return UVC_REQ_ERROR_INVALID_REQUEST;
+	}
+
+	uvcPutValue(args.response->data, mc->map->len, value);
+	args.response->length = mc->map->len;
+	return UVC_REQ_ERROR_NO_ERROR;
+}
+
+static int uvcRequestDataLengthValid(struct UvcGadget *uvc, const struct UsbUvcControl *control, const struct uvc_request_data *data) {
+	if (data->length >= control->len)
+		return 1;
+
+	LOGE("%s: %s: short data length=%d, expected %d", __func__,
+		uvcControlName(control->dispatch.c.interface, control->dispatch.c.entity_id, control->dispatch.c.control_selector),
+		data->length, control->len);
+	uvc->usb.bRequestErrorCode = UVC_REQ_ERROR_INVALUD_VALUE;
+	return 0;
+}
+
+// Staged, applied at the next frame boundary together with other changes
+static int uvcMappedSet(struct UvcGadget *uvc, const struct UsbUvcControl *control, const struct uvc_request_data *data) {
+	const UvcMappedControl *const mc = (const UvcMappedControl*)control->arg;
+	if (!uvcRequestDataLengthValid(uvc, control, data))
+		return 0;
+
+	const int64_t uvc_value = uvcReadValue((const u8*)data->data, mc->map->len, mc->map->is_signed);
+	const int64_t value = uvc_value * mc->mul / mc->div;
+	const int result = v4l2ControlStage(mc->owner, mc->v4l2, value);
+	switch (result) {
+		case 0:
+			uvc->usb.bRequestErrorCode = UVC_REQ_ERROR_NO_ERROR;
 			break;
-		case UVC_GET_DEF:
-			value->wBrightness = v4l2->query.default_value;
+		case -ERANGE:
+			uvc->usb.bRequestErrorCode = UVC_REQ_ERROR_OUT_OF_RANGE;
 			break;
+		default:
+			LOGE("%s: unable to stage %s=%lld: %d", __func__,
+				mc->v4l2->query.name, (long long)value, result);
+			uvc->usb.bRequestErrorCode = UVC_REQ_ERROR_UNKNOWN;
+			break;
+	}
+
+	// Data phase has already been acknowledged, errors are reported via VC_REQUEST_ERROR_CODE_CONTROL
+	return 0;
+}
+
+// wObjectiveFocalLength, see 4.2.2.1.11 of USB UVC 1.5 spec
+static int uvcHandleDigitalZoomGet(UvcGadget *uvc, const UsbUvcControl *control, UsbUvcControlDispatchArgs args) {
+	int64_t value = 0;
+	switch (args.req->bRequest) {
+		case UVC_GET_CUR: value = ptzGetZoom(uvc->ptz); break;
+		case UVC_GET_MIN: value = PTZ_ZOOM_MIN; break;
+		case UVC_GET_MAX: value = PTZ_ZOOM_MAX; break;
+		case UVC_GET_DEF: value = PTZ_ZOOM_DEFAULT; break;
+		case UVC_GET_RES: value = 1; break;
+		default:
+			return UVC_REQ_ERROR_INVALID_REQUEST;
+	}
+
+	uvcPutValue(args.response->data, control->len, value);
+	args.response->length = control->len;
+	return UVC_REQ_ERROR_NO_ERROR;
+}
+
+static int uvcDigitalZoomSet(struct UvcGadget *uvc, const struct UsbUvcControl *control, const struct uvc_request_data *data) {
+	if (!uvcRequestDataLengthValid(uvc, control, data))
+		return 0;
+
+	const int64_t value = uvcReadValue((const u8*)data->data, control->len, 0);
+	if (value < PTZ_ZOOM_MIN || value > PTZ_ZOOM_MAX) {
+		uvc->usb.bRequestErrorCode = UVC_REQ_ERROR_OUT_OF_RANGE;
+		return 0;
+	}
+
+	ptzSetZoom(uvc->ptz, value);
+	uvc->usb.bRequestErrorCode = UVC_REQ_ERROR_NO_ERROR;
+	return 0;
+}
+
+// dwPanAbsolute, dwTiltAbsolute, see 4.2.2.1.14 of USB UVC 1.5 spec
+static int uvcHandleDigitalPanTiltGet(UvcGadget *uvc, const UsbUvcControl *control, UsbUvcControlDispatchArgs args) {
+	int32_t pan = 0, tilt = 0;
+	switch (args.req->bRequest) {
+		case UVC_GET_CUR: ptzGetPanTilt(uvc->ptz, &pan, &tilt); break;
+		case UVC_GET_MIN: pan = tilt = -PTZ_PAN_TILT_MAX; break;
+		case UVC_GET_MAX: pan = tilt = PTZ_PAN_TILT_MAX; break;
+		case UVC_GET_DEF: pan = tilt = 0; break;
+		case UVC_GET_RES: pan = tilt = PTZ_PAN_TILT_STEP; break;
+		default:
+			return UVC_REQ_ERROR_INVALID_REQUEST;
+	}
+
+	uvcPutValue(args.response->data, 4, pan);
+	uvcPutValue(args.response->data + 4, 4, tilt);
+	args.response->length = control->len;
+	return UVC_REQ_ERROR_NO_ERROR;
+}
+
+static int uvcDigitalPanTiltSet(struct UvcGadget *uvc, const struct UsbUvcControl *control, const struct uvc_request_data *data) {
+	if (!uvcRequestDataLengthValid(uvc, control, data))
+		return 0;
+
+	const int64_t pan = uvcReadValue((const u8*)data->data, 4, 1);
+	const int64_t tilt = uvcReadValue((const u8*)data->data + 4, 4, 1);
+	if (pan < -PTZ_PAN_TILT_MAX || pan > PTZ_PAN_TILT_MAX || tilt < -PTZ_PAN_TILT_MAX || tilt > PTZ_PAN_TILT_MAX) {
+		uvc->usb.bRequestErrorCode = UVC_REQ_ERROR_OUT_OF_RANGE;
+		return 0;
+	}
+
+	ptzSetPanTilt(uvc->ptz, pan, tilt);
+	uvc->usb.bRequestErrorCode = UVC_REQ_ERROR_NO_ERROR;
+	return 0;
+}
+
+// Used when the sensor has no optical zoom or pan/tilt
+static const UsbUvcControl digital_ptz_dispatch_table[] = {
+	{
+		.dispatch = MAKE_DISPATCH_TAG(UVC_INTF_VIDEO_CONTROL, UVC_VC_ENT_CAMERA_TERMINAL_ID, UVC_CT_ZOOM_ABSOLUTE_CONTROL),
+		.info_caps = UVC_CONTROL_CAP_GET | UVC_CONTROL_CAP_SET,
+		.len = 2,
+		.get = uvcHandleDigitalZoomGet,
+		.set_data = uvcDigitalZoomSet,
+	},
+	{
+		.dispatch = MAKE_DISPATCH_TAG(UVC_INTF_VIDEO_CONTROL, UVC_VC_ENT_CAMERA_TERMINAL_ID, UVC_CT_PANTILT_ABSOLUTE_CONTROL),
+		.info_caps = UVC_CONTROL_CAP_GET | UVC_CONTROL_CAP_SET,
+		.len = 8,
+		.get = uvcHandleDigitalPanTiltGet,
+		.set_data = uvcDigitalPanTiltSet,
+	},
+};
+
+// There is a single still frame size: the full sensor, JPEG compressed
+static UvcStillProbeCommit uvcStillDefault(const UvcGadget *uvc) {
+	return (UvcStillProbeCommit){
+		.bFormatIndex = 1,
+		.bFrameIndex = 1,
+		.bCompressionIndex = 1,
+		// YUV 4:2:0 size, JPEG is always smaller
+		.dwMaxVideoFrameSize = uvc->still.width * uvc->still.height * 3 / 2,
+		.dwMaxPayloadTransferSize = 1024,
+	};
+}
+
+static int uvcHandleVsStillProbeCommitGet(UvcGadget *uvc, const UsbUvcControl *control, UsbUvcControlDispatchArgs args) {
+	UvcStillProbeCommit value;
+	switch (args.req->bRequest) {
+		case UVC_GET_CUR: value = uvc->still.probe; break;
+		case UVC_GET_MIN:
 		case UVC_GET_MAX:
-			value->wBrightness = v4l2->query.minimum;
+		case UVC_GET_DEF: value = uvcStillDefault(uvc); break;
+		default:
+			return UVC_REQ_ERROR_INVALID_REQUEST;
+	}
+
+	memcpy(args.response->data, &value, sizeof(value));
+	args.response->length = control->len;
+	return UVC_REQ_ERROR_NO_ERROR;
+}
+
+static int uvcVsStillProbeCommitSet(struct UvcGadget *uvc, const struct UsbUvcControl *control, const struct uvc_request_data *data) {
+	if (!uvcRequestDataLengthValid(uvc, control, data))
+		return 0;
+
+	UvcStillProbeCommit value;
+	memcpy(&value, data->data, sizeof(value));
+	LOGI("%s: %s bFormatIndex=%d bFrameIndex=%d bCompressionIndex=%d", __func__,
+		control->dispatch.c.control_selector == UVC_VS_STILL_PROBE_CONTROL ? "probe" : "commit",
+		value.bFormatIndex, value.bFrameIndex, value.bCompressionIndex);
+
+	if (value.bFormatIndex != 1 || value.bFrameIndex != 1 || value.bCompressionIndex != 1) {
+		uvc->usb.bRequestErrorCode = UVC_REQ_ERROR_OUT_OF_RANGE;
+		return 0;
+	}
+
+	// Device fills in the sizes
+	uvc->still.probe = uvcStillDefault(uvc);
+	uvc->usb.bRequestErrorCode = UVC_REQ_ERROR_NO_ERROR;
+	return 0;
+}
+
+static int uvcHandleVsStillTriggerGet(UvcGadget *uvc, const UsbUvcControl *control, UsbUvcControlDispatchArgs args) {
+	if (args.req->bRequest != UVC_GET_CUR)
+		return UVC_REQ_ERROR_INVALID_REQUEST;
+
+	args.response->data[0] = __atomic_load_n(&uvc->still.trigger, __ATOMIC_ACQUIRE);
+	args.response->length = control->len;
+	return UVC_REQ_ERROR_NO_ERROR;
+}
+
+static int uvcVsStillTriggerSet(struct UvcGadget *uvc, const struct UsbUvcControl *control, const struct uvc_request_data *data) {
+	if (!uvcRequestDataLengthValid(uvc, control, data))
+		return 0;
+
+	const u8 trigger = data->data[0];
+	uvc->usb.bRequestErrorCode = UVC_REQ_ERROR_NO_ERROR;
+	switch (trigger) {
+		case UVC_STILL_TRIGGER_NORMAL:
+		case UVC_STILL_TRIGGER_ABORT:
+			// Capture is a single short step on the frame thread, there is nothing to abort midway
 			break;
-		case UVC_GET_RES:
-			value->wBrightness = 1;
+
+		case UVC_STILL_TRIGGER_TRANSMIT:
+		case UVC_STILL_TRIGGER_TRANSMIT_BULK:
+			{
+				u8 expected = UVC_STILL_TRIGGER_NORMAL;
+				if (!__atomic_compare_exchange_n(&uvc->still.trigger, &expected, trigger, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+					LOGE("%s: still capture is already in progress", __func__);
+					uvc->usb.bRequestErrorCode = UVC_REQ_ERROR_WRONG_STATE;
+					break;
+				}
+
+				if (0 != uvc->still.event(uvc->event_arg)) {
+					__atomic_store_n(&uvc->still.trigger, UVC_STILL_TRIGGER_NORMAL, __ATOMIC_RELEASE);
+					uvc->usb.bRequestErrorCode = UVC_REQ_ERROR_NOT_READY;
+				}
+			}
+			break;
+
+		default:
+			uvc->usb.bRequestErrorCode = UVC_REQ_ERROR_OUT_OF_RANGE;
 			break;
 	}
-	
+
 	return 0;
 }
 
-static int uvcVcPuBrightnessSet(struct UvcGadget *uvc, const struct UsbUvcControl *control, const struct uvc_request_data *data) {
-	UNUSED(control);
+static const UsbUvcControl still_dispatch_table[] = {
+	{
+		.dispatch = MAKE_DISPATCH_TAG(UVC_INTF_VIDEO_STREAMING, UVC_VS_ENT_INTERFACE, UVC_VS_STILL_PROBE_CONTROL),
+		.info_caps = UVC_CONTROL_CAP_GET | UVC_CONTROL_CAP_SET,
+		.len = sizeof(UvcStillProbeCommit),
+		.get = uvcHandleVsStillProbeCommitGet,
+		.set_data = uvcVsStillProbeCommitSet,
+	},
+	{
+		.dispatch = MAKE_DISPATCH_TAG(UVC_INTF_VIDEO_STREAMING, UVC_VS_ENT_INTERFACE, UVC_VS_STILL_COMMIT_CONTROL),
+		.info_caps = UVC_CONTROL_CAP_GET | UVC_CONTROL_CAP_SET,
+		.len = sizeof(UvcStillProbeCommit),
+		.get = uvcHandleVsStillProbeCommitGet,
+		.set_data = uvcVsStillProbeCommitSet,
+	},
+	{
+		.dispatch = MAKE_DISPATCH_TAG(UVC_INTF_VIDEO_STREAMING, UVC_VS_ENT_INTERFACE, UVC_VS_STILL_IMAGE_TRIGGER_CONTROL),
+		.info_caps = UVC_CONTROL_CAP_GET | UVC_CONTROL_CAP_SET,
+		.len = 1,
+		.get = uvcHandleVsStillTriggerGet,
+		.set_data = uvcVsStillTriggerSet,
+	},
+};
 
-	V4l2Control *const v4l2 = uvc->controls.vc_pu_brightness.v4l2;
-	ASSERT(v4l2);
+struct MetricsUvc *uvcGetMetrics(struct Node *uvc_node) {
+	return ((UvcGadget*)uvc_node)->metrics;
+}
 
-	const UvcVcPuBrigtnessValue *const value = (const void*)&data->data;
-	LOGI("%s: wBrightness=%d", __func__, value->wBrightness);
+void uvcStillComplete(struct Node *uvc_node) {
+	UvcGadget *const uvc = (UvcGadget*)uvc_node;
+	__atomic_store_n(&uvc->still.trigger, UVC_STILL_TRIGGER_NORMAL, __ATOMIC_RELEASE);
+}
 
-	// TODO v4l2ControlSetById(
+static V4l2Control *findV4l2Control(V4l2Controls *const *sources, uint32_t id, V4l2Controls **out_owner) {
+	for (int i = 0; i < UVC_MAX_CONTROL_SOURCES && sources[i]; ++i) {
+		V4l2Control *const ctrl = v4l2ControlGet(sources[i], id);
+		if (ctrl) {
+			*out_owner = sources[i];
+			return ctrl;
+		}
+	}
 
-	return 0;
+	return NULL;
+}
+
+static void uvcMapControls(UvcGadget *uvc, const UvcOpenArgs *args) {
+	for (int i = 0; i < (int)COUNTOF(uvc_v4l2_mappings); ++i) {
+		const UvcV4l2ControlMapping *const map = uvc_v4l2_mappings + i;
+		const char *const name = uvcControlName(UVC_INTF_VIDEO_CONTROL, map->entity_id, map->control_selector);
+
+		V4l2Controls *owner = NULL;
+		V4l2Control *v4l2 = NULL;
+		for (int j = 0; j < (int)COUNTOF(map->v4l2_ids) && map->v4l2_ids[j] && !v4l2; ++j)
+			v4l2 = findV4l2Control(args->controls, map->v4l2_ids[j], &owner);
+
+		if (!v4l2) {
+			LOGI("%s: %s is not available", __func__, name);
+			continue;
+		}
+
+		int64_t mul = 1, div = 1;
+		if (v4l2->query.id == V4L2_CID_EXPOSURE) {
+			if (!args->exposure_line_ns) {
+				LOGE("%s: %s needs sensor line time to map onto V4L2_CID_EXPOSURE", __func__, name);
+				continue;
+			}
+
+			// 100us units to lines
+			mul = 100000;
+			div = args->exposure_line_ns;
+		}
+
+		if (uvc->mapped_count == UVC_MAPPED_CONTROLS_MAX) {
+			LOGE("%s: too many mapped controls, %s is skipped", __func__, name);
+			break;
+		}
+
+		UvcMappedControl *const mc = uvc->mapped + uvc->mapped_count;
+		*mc = (UvcMappedControl){
+			.map = map,
+			.owner = owner,
+			.v4l2 = v4l2,
+			.mul = mul,
+			.div = div,
+			.usb = {
+				.dispatch = MAKE_DISPATCH_TAG(UVC_INTF_VIDEO_CONTROL, map->entity_id, map->control_selector),
+				.info_caps = UVC_CONTROL_CAP_GET | UVC_CONTROL_CAP_SET,
+				.len = map->len,
+				.get_info = uvcMappedGetInfo,
+				.get = uvcMappedGet,
+				.set_data = uvcMappedSet,
+				.arg = (uintptr_t)mc,
+			},
+		};
+
+		if (0 != usbUvcDispatchAdd(&uvc->usb.dispatch, &mc->usb))
+			continue;
+
+		uvc->mapped_count++;
+		LOGI("%s: %s -> %s(%08x) scale=%lld/%lld", __func__, name,
+			v4l2->query.name, v4l2->query.id, (long long)mul, (long long)div);
+	}
+
+	uvc->ptz = args->ptz;
+	if (!uvc->ptz)
+		return;
+
+	for (int i = 0; i < (int)COUNTOF(digital_ptz_dispatch_table); ++i) {
+		const UsbUvcControl *const ctrl = digital_ptz_dispatch_table + i;
+		const char *const name = uvcControlName(ctrl->dispatch.c.interface, ctrl->dispatch.c.entity_id, ctrl->dispatch.c.control_selector);
+
+		// Optical control takes precedence
+		if (usbUvcDispatchFindControlByTag(&uvc->usb.dispatch, ctrl->dispatch))
+			continue;
+
+		if (0 == usbUvcDispatchAdd(&uvc->usb.dispatch, ctrl))
+			LOGI("%s: %s -> digital crop", __func__, name);
+	}
 }
 
 // See 4.2.2.1.2 of USB UVC 1.5 spec
@@ -509,19 +779,23 @@ typedef struct {
 	u8 bAutoExposureMode;
 } UvcVcCamAeModeValue;
 
-static int uvcHandleVcCamAeModeGet(UvcGadget *uvc, UsbUvcControlDispatchArgs args) {
-	UNUSED(uvc);
+// There's no auto exposure loop, report fixed mode: MANUAL if exposure time can be set, AUTO otherwise
+static int uvcHandleVcCamAeModeGet(UvcGadget *uvc, const UsbUvcControl *control, UsbUvcControlDispatchArgs args) {
+	UNUSED(control);
 	UvcVcCamAeModeValue *const value = (void*)args.response->data;
 	args.response->length = sizeof(UvcVcCamAeModeValue);
 
+	const UsbDispatchTag exposure_tag = MAKE_DISPATCH_TAG(UVC_INTF_VIDEO_CONTROL, UVC_VC_ENT_CAMERA_TERMINAL_ID, UVC_CT_EXPOSURE_TIME_ABSOLUTE_CONTROL);
+	const int manual = !!usbUvcDispatchFindControlByTag(&uvc->usb.dispatch, exposure_tag);
+
 	switch (args.req->bRequest) {
 		case UVC_GET_CUR:
 		case UVC_GET_DEF:
 		case UVC_GET_RES:
-			value->bAutoExposureMode = UVC_VC_CAM_AE_MODE_AUTO;
+			value->bAutoExposureMode = manual ? UVC_VC_CAM_AE_MODE_MANUAL : UVC_VC_CAM_AE_MODE_AUTO;
 			break;
 		default:
-			LOGE("%s: unexpected request=%s (%d)", __func__, requestName(args.req->bRequest), args.req->bRequest);
+			LOGE("%s: unexpected request=%s (%d)", __func__, uvcRequestName(args.req->bRequest), args.req->bRequest);
 			return UVC_REQ_ERROR_INVALID_REQUEST;
 	}
 	
@@ -541,14 +815,6 @@ static const UsbUvcControl default_dispatch_table[] = {
 		.len = sizeof(UvcVcCamAeModeValue),
 		.get = uvcHandleVcCamAeModeGet,
 	},
-	{
-		.dispatch = MAKE_DISPATCH_TAG(UVC_INTF_VIDEO_CONTROL, UVC_VC_ENT_PROCESSING_UNIT_ID, UVC_PU_BRIGHTNESS_CONTROL),
-		.info_caps = 0,
-		.get_info = uvcVcPuBrightnessGetInfo,
-		.len = sizeof(UvcVcPuBrigtnessValue),
-		.get = uvcVcPuBrightnessGet,
-		.set_data = uvcVcPuBrightnessSet,
-	},
 	{
 		.dispatch = MAKE_DISPATCH_TAG(UVC_INTF_VIDEO_STREAMING, UVC_VS_ENT_INTERFACE, UVC_VS_PROBE_CONTROL),
 		.info_caps = UVC_CONTROL_CAP_GET | UVC_CONTROL_CAP_SET,
@@ -565,10 +831,6 @@ static const UsbUvcControl default_dispatch_table[] = {
 	},
 };
 
-static const UsbUvcDispatch default_dispatch = {
-	.controls = default_dispatch_table,
-	.controls_count = COUNTOF(default_dispatch_table),
-};
 
 static void uvcDtor(Node *node) {
 	if (!node)
@@ -637,9 +899,32 @@ struct Node *uvcOpen(UvcOpenArgs args) {
 	gadget->node.input = &dev->output;
 
 	gadget->event_streamon = args.event_streamon;
+	gadget->event_arg = args.event_arg;
 
 	gadget->gadget = dev;
-	// TODO construct from controls gadget->usb.dispatch = uvc_dispatch;
+	gadget->format = args.format.pixelformat ? args.format : (UvcStreamFormat){
+		.pixelformat = V4L2_PIX_FMT_MJPEG,
+		.width = 1332,
+		.height = 976,
+		.frame_size = 1332 * 976 * 2,
+	};
+	// Gadgets are told apart by their video device
+	const char *const slash = strrchr(args.dev_name, '/');
+	gadget->metrics = metricsUvc(slash ? slash + 1 : args.dev_name);
+
+	for (int i = 0; i < (int)COUNTOF(default_dispatch_table); ++i)
+		usbUvcDispatchAdd(&gadget->usb.dispatch, default_dispatch_table + i);
+	uvcMapControls(gadget, &args);
+
+	if (args.event_still && args.still_width) {
+		gadget->still.event = args.event_still;
+		gadget->still.width = args.still_width;
+		gadget->still.height = args.still_height;
+		gadget->still.probe = uvcStillDefault(gadget);
+		for (int i = 0; i < (int)COUNTOF(still_dispatch_table); ++i)
+			usbUvcDispatchAdd(&gadget->usb.dispatch, still_dispatch_table + i);
+		LOGI("%s: still images %ux%u", __func__, args.still_width, args.still_height);
+	}
 
 	return &gadget->node;
 
@@ -666,19 +951,11 @@ static int processEventSetup(UvcGadget *uvc, const struct usb_ctrlrequest *req)
 
 	const UsbUvcControlDispatchArgs args = usbUvcControlDispatchArgs(req, &response);
 
-	LOGI("%s: interface=%s(%d) entity=%s(%d) control=%s(%d)", __func__,
-		usbUvcIntefaceName(args.dispatch.c.interface), args.dispatch.c.interface,
-		usbUvcEntityName(args.dispatch.c.interface, args.dispatch.c.entity_id), args.dispatch.c.entity_id,
-		usbUvcControlName(args.dispatch.c.interface, args.dispatch.c.entity_id, args.dispatch.c.control_selector), args.dispatch.c.control_selector);
-
-	// TODO controls dispatch const int result = usbUvcDispatchRequest(&uvc->usb.dispatch, uvc, args);
-	const int result = usbUvcDispatchRequest(&default_dispatch, uvc, args);
+	const int result = usbUvcDispatchRequest(&uvc->usb.dispatch, uvc, args);
 	switch (result) {
 		case USB_UVC_DISPATCH_NO_CONTROL:
-			LOGE("%s: interface=%s(%d) entity=%s(%d) control=%s(%d) not found", __func__,
-				usbUvcIntefaceName(args.dispatch.c.interface), args.dispatch.c.interface,
-				usbUvcEntityName(args.dispatch.c.interface, args.dispatch.c.entity_id), args.dispatch.c.entity_id,
-				usbUvcControlName(args.dispatch.c.interface, args.dispatch.c.entity_id, args.dispatch.c.control_selector), args.dispatch.c.control_selector);
+			// Hosts probe for controls we don't have all the time, don't spam the log
+			TRACEE(TRACE_EV_UVC_CONTROL_NOT_FOUND, args.dispatch.tag, req->bRequest);
 			uvc->usb.bRequestErrorCode = UVC_REQ_ERROR_INVALID_REQUEST;
 			response.length = -1; // STALL
 			break;
@@ -686,9 +963,9 @@ static int processEventSetup(UvcGadget *uvc, const struct usb_ctrlrequest *req)
 			uvc->usb.bRequestErrorCode = result;
 			if (result != UVC_REQ_ERROR_NO_ERROR) {
 				LOGE("%s: interface=%s(%d) entity=%s(%d) control=%s(%d) processing request error=%02x", __func__,
-					usbUvcIntefaceName(args.dispatch.c.interface), args.dispatch.c.interface,
-					usbUvcEntityName(args.dispatch.c.interface, args.dispatch.c.entity_id), args.dispatch.c.entity_id,
-					usbUvcControlName(args.dispatch.c.interface, args.dispatch.c.entity_id, args.dispatch.c.control_selector), args.dispatch.c.control_selector,
+					uvcInterfaceName(args.dispatch.c.interface), args.dispatch.c.interface,
+					uvcEntityName(args.dispatch.c.interface, args.dispatch.c.entity_id), args.dispatch.c.entity_id,
+					uvcControlName(args.dispatch.c.interface, args.dispatch.c.entity_id, args.dispatch.c.control_selector), args.dispatch.c.control_selector,
 					result);
 				response.length = -1; // STALL
 			}
@@ -697,7 +974,14 @@ static int processEventSetup(UvcGadget *uvc, const struct usb_ctrlrequest *req)
 
 	// Setup packet *always* needs a data out phase
 	// FIXME does it? Even on UVC_SET_CUR?
-	LOGI("%s: sending response length=%d", __func__, response.length);
+	TRACEI(TRACE_EV_UVC_SETUP_RESPONSE, args.dispatch.tag, (uint32_t)response.length, uvc->usb.bRequestErrorCode);
+	if (uvc->metrics) {
+		if (response.length < 0)
+			METRICS_INC(uvc->metrics->stalls);
+		if (uvc->usb.bRequestErrorCode != UVC_REQ_ERROR_NO_ERROR)
+			METRICS_INC(uvc->metrics->request_errors);
+	}
+
 	if (0 != ioctl(uvc->gadget->fd, UVCIOC_SEND_RESPONSE, &response)) {
 		const int err = errno;
 		LOGE("%s: failed to UVCIOIC_SEND_RESPONSE: %d: %s", __func__, err, strerror(err));
@@ -707,23 +991,60 @@ static int processEventSetup(UvcGadget *uvc, const struct usb_ctrlrequest *req)
 	return 0;
 }
 
-static void uvcPrepare(UvcGadget *uvc) {
-	// TODO this is where we'd pick format, set it, recreate buffers, etc etc
-	const DeviceStreamPrepareOpts uvc_output_opts = {
-		.buffers_count = 3,
-		//.buffer_memory = BUFFER_MEMORY_USERPTR,
-		//.buffer_memory = BUFFER_MEMORY_MMAP,
-		.buffer_memory = BUFFER_MEMORY_DMABUF_IMPORT,
+void uvcStreamPrepare(struct Node *uvc_node, const DeviceStream *src) {
+	UvcGadget *const uvc = (UvcGadget*)uvc_node;
+	DeviceStream *const st = &uvc->gadget->output;
+	const UvcStreamFormat *const f = &uvc->format;
 
-		// TODO real format
-		.pixelformat = V4L2_PIX_FMT_MJPEG,
-		.width = 1332,
-		.height = 976,
+	// Format never changes, buffers from the previous session are still good
+	if (st->buffers)
+		return;
+
+	// Encoded frames are passed through as they are
+	if (f->pixelformat == V4L2_PIX_FMT_MJPEG && src) {
+		NegotiatedEdge edge;
+		if (0 != negotiateEdge(&(NegotiateEdgeArgs){
+				.name = "enc_to_uvc",
+				.src = src,
+				.dst = st,
+				.pixelformats = &f->pixelformat,
+				.pixelformats_count = 1,
+			}, &edge)) {
+			LOGE("%s: Unable to take frames of the encoder", __func__);
+			return;
+		}
+
+		const DeviceStreamPrepareOpts uvc_output_opts = {
+			.buffers_count = 3,
+			.buffer_memory = edge.dst_memory,
+
+			.pixelformat = f->pixelformat,
+			.width = f->width,
+			.height = f->height,
+		};
+
+		if (0 != deviceStreamPrepare(st, &uvc_output_opts))
+			LOGE("%s: Unable to prepare uvc-gadget output stream", __func__);
+		return;
+	}
+
+	DeviceStreamPrepareOpts uvc_output_opts = {
+		.buffers_count = 3,
+		.buffer_memory = BUFFER_MEMORY_MMAP,
+		.pixelformat = f->pixelformat,
+		.width = f->width,
+		.height = f->height,
 	};
 
-	if (0 != deviceStreamPrepare(&uvc->gadget->output, &uvc_output_opts)) {
+	if (0 == deviceStreamPrepare(st, &uvc_output_opts))
+		return;
+
+	// Older gadget drivers know only YUYV and MJPEG, but never look at the payload. YUYV buffers are 16 bits
+	// per pixel, enough for any raw format of the same size
+	LOGI("%s: gadget doesn't know %.4s, carrying it as YUYV", __func__, (const char*)&f->pixelformat);
+	uvc_output_opts.pixelformat = V4L2_PIX_FMT_YUYV;
+	if (0 != deviceStreamPrepare(st, &uvc_output_opts))
 		LOGE("%s: Unable to prepare uvc-gadget output stream", __func__);
-	}
 }
 
 static int processEventData(UvcGadget *uvc, const struct uvc_request_data *data) {
@@ -749,33 +1070,42 @@ exit:
 
 static int processEvent(UvcGadget *uvc, const struct v4l2_event *event) {
 	const struct uvc_event *const uvc_event = (void*)&event->u.data;
+	MetricsUvc *const metrics = uvc->metrics;
 
 	switch (event->type) {
 	case UVC_EVENT_CONNECT:
 		LOGI("%s: UVC_EVENT_CONNECT with speed=%s", uvc->node.name, usbSpeedName(uvc_event->speed));
+		if (metrics) METRICS_INC(metrics->connects);
 		break;
 
 	case UVC_EVENT_DISCONNECT:
 		LOGI("%s: UVC_EVENT_DISCONNECT", uvc->node.name);
+		if (metrics) METRICS_INC(metrics->disconnects);
 		break;
 
 	case UVC_EVENT_STREAMON:
 		LOGI("%s: UVC_EVENT_STREAMON", uvc->node.name);
-		uvcPrepare(uvc);
-		uvc->event_streamon(1);
+		if (metrics) METRICS_INC(metrics->streamons);
+		uvc->event_streamon(uvc->event_arg, 1);
 		break;
 
 	case UVC_EVENT_STREAMOFF:
 		LOGI("%s: UVC_EVENT_STREAMOFF", uvc->node.name);
-		uvc->event_streamon(0);
+		if (metrics) METRICS_INC(metrics->streamoffs);
+		uvc->event_streamon(uvc->event_arg, 0);
 		break;
 
 	case UVC_EVENT_SETUP:
-		usbPrintSetupPacket("UVC_EVENT_SETUP: ", &uvc_event->req);
+		if (metrics) METRICS_INC(metrics->setups);
+		TRACEI(TRACE_EV_UVC_SETUP,
+			uvc_event->req.bRequestType, uvc_event->req.bRequest,
+			uvc_event->req.wValue, uvc_event->req.wIndex, uvc_event->req.wLength);
 		return processEventSetup(uvc, &uvc_event->req);
 
 	case UVC_EVENT_DATA:
-		LOGI("%s: UVC_EVENT_DATA length=%d", uvc->node.name, uvc_event->data.length);
+		if (metrics) METRICS_INC(metrics->data);
+		TRACEI(TRACE_EV_UVC_DATA, uvc_event->data.length,
+			uvc->usb.data_phase_control ? uvc->usb.data_phase_control->dispatch.tag : 0);
 		return processEventData(uvc, &uvc_event->data);
 
 		default:
@@ -798,12 +1128,17 @@ int uvcProcessEvents(struct Node *uvc_node) {
 
 		if (result < 0) {
 			LOGE("Error getting events for %s", uvc->node.name);
+			if (uvc->metrics) METRICS_INC(uvc->metrics->event_errors);
 			return result;
 		}
 
 		++events;
+		if (uvc->metrics) METRICS_INC(uvc->metrics->events);
 
-		if (0 != processEvent(uvc, &event))
+		PROBE(uvc_event_begin, event.type);
+		const int event_result = processEvent(uvc, &event);
+		PROBE(uvc_event_end, event.type, event_result);
+		if (0 != event_result)
 			return -1;
 	}
 
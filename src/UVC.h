@@ -5,8 +5,18 @@
 #include <stdint.h>
 
 struct Node;
+struct DeviceStream;
+struct Ptz;
+struct MetricsUvc;
 
-typedef int (uvc_event_streamon_f)(int stream_on);
+// Called on UVC_EVENT_STREAMON/STREAMOFF from whichever thread runs uvcProcessEvents()
+typedef int (uvc_event_streamon_f)(void *arg, int stream_on);
+
+// Called on VS_STILL_IMAGE_TRIGGER_CONTROL from the control thread, call uvcStillComplete() once the still is done.
+// Returns 0 if the still will be taken
+typedef int (uvc_event_still_f)(void *arg);
+
+#define UVC_MAX_CONTROL_SOURCES 4
 
 /*
 typedef int (uvc_event_ctrl_get_f)(void* arg1, uint32_t ctrl_id, int64_t *out_value);
@@ -18,9 +28,22 @@ typedef struct {
 } UvcCtrl;
 */
 
+// Gadget stream format, has to match the only format gadget.sh set up
+typedef struct {
+	// V4L2 fourcc, MJPEG frames come as encoder dmabufs, anything else is written into gadget's own buffers
+	uint32_t pixelformat;
+	uint32_t width, height;
+
+	// dwMaxVideoFrameSize
+	uint32_t frame_size;
+} UvcStreamFormat;
+
 typedef struct {
 	const char *dev_name;
 
+	// Zero for the default 1332x976 MJPEG
+	UvcStreamFormat format;
+
 	// TODO
 	// - list of all supported modes (format, resolution, frametime)
 	// - list of all supported ctrls, with Node reference
@@ -29,12 +52,23 @@ typedef struct {
 	// Moved out
 	//Array *controls;
 
-	// TODO more flexible
-	struct {
-		V4l2Control *brightness;
-	} controls;
+	// Controls to map UVC Processing Unit and Camera Terminal controls onto, searched in order.
+	// Unused trailing entries are NULL
+	V4l2Controls *controls[UVC_MAX_CONTROL_SOURCES];
 
+	// Sensor line time, maps UVC exposure time onto V4L2_CID_EXPOSURE in lines. 0 if unknown
+	uint32_t exposure_line_ns;
+
+	// Serves Camera Terminal zoom and pan/tilt when there are no optical ones. Optional
+	struct Ptz *ptz;
+
+	// Still image capture, optional. Sizes of the still, i.e. the full sensor
+	uvc_event_still_f *event_still;
+	uint32_t still_width, still_height;
+
+	// Passed to event_streamon and event_still
 	uvc_event_streamon_f *event_streamon;
+	void *event_arg;
 
 	//uvc_event_ctrl_get_f *event_ctrl_get;
 	//uvc_event_ctrl_set_f *event_ctrl_set;
@@ -46,3 +80,15 @@ typedef struct {
 struct Node *uvcOpen(UvcOpenArgs args);
 
 int uvcProcessEvents(struct Node *uvc_node);
+
+// Sets up gadget output stream for the negotiated format, call before starting the node. src is the prepared
+// stream encoded frames come from, its buffers are taken the cheapest way it allows. NULL for raw frames
+// Touches buffers, so it belongs to the thread that streams the node
+void uvcStreamPrepare(struct Node *uvc_node, const struct DeviceStream *src);
+
+// Still triggered via uvc_event_still_f is done, the trigger control reads back as normal operation again.
+// Can be called from any thread
+void uvcStillComplete(struct Node *uvc_node);
+
+// Counters of this gadget, NULL if metrics are disabled
+struct MetricsUvc *uvcGetMetrics(struct Node *uvc_node);
@@ -1,97 +1,197 @@
 #include "V4l2Control.h"
 
+#include "snapshot.h"
 #include "v4l2-print.h"
 #include "common.h"
 
 #include <errno.h>
+#include <stdio.h> // snprintf
 #include <string.h> // strerror
+#include <stdlib.h> // calloc
 #include <sys/ioctl.h> // ioctl
 
-V4l2Controls v4l2ControlsCreateFromV4l2Fd(int fd) {
-	V4l2Controls ctrls = {.fd = fd};
-	arrayInit(&ctrls.controls, V4l2Control);
+static uint32_t indexHash(uint32_t id, uint32_t bits) {
+	// Fibonacci hashing, control ids are clustered by class
+	return (id * 0x9E3779B1u) >> (32 - bits);
+}
 
-	struct v4l2_query_ext_ctrl qctrl = {0};
-	for (int i = 0;; i++) {
-		qctrl.id |= V4L2_CTRL_FLAG_NEXT_CTRL | V4L2_CTRL_FLAG_NEXT_COMPOUND;
-		if (0 > ioctl(fd, VIDIOC_QUERY_EXT_CTRL, &qctrl)) {
-			LOGI("Total ext controls: %d", i);
-			break;
-		}
+static void indexBuild(V4l2Controls *ctrls) {
+	const int count = ctrls->controls.size;
 
-		// TODO filter out unsupported controls
+	// Load factor <= 0.5
+	uint32_t bits = 1;
+	while ((1u << bits) < (uint32_t)count * 2)
+		++bits;
 
-		struct v4l2_ext_control ctrl_val = {
-			.id = qctrl.id,
-			.size = 0,
-		};
+	uint16_t *const index = calloc(1u << bits, sizeof(*index));
+	if (!index) {
+		LOGE("Unable to allocate controls index for %d controls", count);
+		return;
+	}
+
+	const uint32_t mask = (1u << bits) - 1;
+	for (int i = 0; i < count; ++i) {
+		const V4l2Control *const c = arrayAt(&ctrls->controls, V4l2Control, i);
+		uint32_t slot = indexHash(c->query.id, bits);
+		while (index[slot])
+			slot = (slot + 1) & mask;
+		index[slot] = i + 1;
+	}
+
+	ctrls->index = index;
+	ctrls->index_bits = bits;
+}
 
-		// Save the default value in case it's not readable, or reading resulted in error
-		int64_t value = qctrl.default_value;
+// Current values of all readable controls with a single VIDIOC_G_EXT_CTRLS, control by control if the driver
+// rejects the batch. Controls that can't be read keep their default value
+static void controlsReadValues(V4l2Controls *ctrls) {
+	const int count = ctrls->controls.size;
+	struct v4l2_ext_control *const vals = calloc(count ? count : 1, sizeof(*vals));
+	V4l2Control **const owners = calloc(count ? count : 1, sizeof(*owners));
+	if (!vals || !owners) {
+		LOGE("Unable to allocate values of %d controls", count);
+		goto exit;
+	}
 
-		if (!(qctrl.flags & V4L2_CTRL_FLAG_WRITE_ONLY) && !(qctrl.flags & V4L2_CTRL_FLAG_HAS_PAYLOAD)) {
-			struct v4l2_ext_controls ctrl_vals = {
+	int readable = 0;
+	for (int i = 0; i < count; ++i) {
+		V4l2Control *const c = arrayAt(&ctrls->controls, V4l2Control, i);
+		c->value = c->query.default_value;
+		if ((c->query.flags & (V4L2_CTRL_FLAG_WRITE_ONLY | V4L2_CTRL_FLAG_HAS_PAYLOAD)) || c->query.type >= V4L2_CTRL_COMPOUND_TYPES)
+			continue;
+
+		vals[readable] = (struct v4l2_ext_control){.id = c->query.id};
+		owners[readable++] = c;
+	}
+
+	struct v4l2_ext_controls batch = {
+		.which = V4L2_CTRL_WHICH_CUR_VAL,
+		.count = readable,
+		.controls = vals,
+	};
+
+	const int batched = readable && 0 == ioctl(ctrls->fd, VIDIOC_G_EXT_CTRLS, &batch);
+	for (int i = 0; i < readable; ++i) {
+		if (!batched) {
+			struct v4l2_ext_controls one = {
 				.which = V4L2_CTRL_WHICH_CUR_VAL,
 				.count = 1,
-				.controls = &ctrl_val,
+				.controls = vals + i,
 			};
 
-			if (0 > ioctl(fd, VIDIOC_G_EXT_CTRLS, &ctrl_vals)) {
-				LOGE("ioctl(VIDIOC_G_EXT_CTRLS[.id=%d]) failed: %s %d",
-					qctrl.id, strerror(errno), errno);
-			} else {
-				if (qctrl.type == V4L2_CTRL_TYPE_INTEGER64) {
-					value = ctrl_val.value64;
-				} else {
-					value = ctrl_val.value;
-				}
+			if (0 > ioctl(ctrls->fd, VIDIOC_G_EXT_CTRLS, &one)) {
+				LOGE("ioctl(VIDIOC_G_EXT_CTRLS[.id=%d]) failed: %s %d", vals[i].id, strerror(errno), errno);
+				continue;
 			}
 		}
 
-		LOGI("[fd=%d] ctrl_ext[%d]: id=(%d)%s type=%s name='%s' range=[%lld.+%llu.%lld] def=%lld cur=%d flags=%08x",
-			fd, i,
-			qctrl.id, v4l2CtrlIdName(qctrl.id),
-			v4l2CtrlTypeName(qctrl.type),
-			qctrl.name,
-			qctrl.minimum, qctrl.step, qctrl.maximum,
-			qctrl.default_value,
-			ctrl_val.value,
-			qctrl.flags
-		);
-
-		v4l2PrintControlFlags(qctrl.flags);
-
-		if (qctrl.type == V4L2_CTRL_TYPE_MENU || qctrl.type == V4L2_CTRL_TYPE_INTEGER_MENU) {
-			for (int j = qctrl.minimum; j <= qctrl.maximum; j++) {
-				struct v4l2_querymenu menu = {
-					.id = qctrl.id,
-					.index = j,
-				};
-
-				if (0 > ioctl(fd, VIDIOC_QUERYMENU, &menu)) {
-					LOGE("ioctl(VIDIOC_QUERYMENU[id=%d index=%d]) failed: %s (%d)",
-						menu.id, menu.index, strerror(errno), errno);
-					break;
-				}
-
-				if (qctrl.type == V4L2_CTRL_TYPE_MENU) {
-					LOGI("  menuitem[%d]: %sname=%s", menu.index,
-						((int)menu.index == ctrl_val.value) ? "-> " : "", menu.name);
-				} else {
-					LOGI("  menuitem[%d]: %svalue=%lld", menu.index,
-						((int)menu.index == ctrl_val.value) ? "-> " : "", menu.value);
-				}
+		owners[i]->value = owners[i]->query.type == V4L2_CTRL_TYPE_INTEGER64 ? vals[i].value64 : vals[i].value;
+	}
+
+exit:
+	free(vals);
+	free(owners);
+}
+
+static void controlLog(int fd, int index, const V4l2Control *c) {
+	const struct v4l2_query_ext_ctrl *const qctrl = &c->query;
+	LOGI("[fd=%d] ctrl_ext[%d]: id=(%d)%s type=%s name='%s' range=[%lld.+%llu.%lld] def=%lld cur=%lld flags=%08x",
+		fd, index,
+		qctrl->id, v4l2CtrlIdName(qctrl->id),
+		v4l2CtrlTypeName(qctrl->type),
+		qctrl->name,
+		qctrl->minimum, qctrl->step, qctrl->maximum,
+		qctrl->default_value,
+		(long long)c->value,
+		qctrl->flags
+	);
+
+#ifdef V4L2_DUMP_CONTROLS
+	v4l2PrintControlFlags(qctrl->flags);
+
+	if (qctrl->type == V4L2_CTRL_TYPE_MENU || qctrl->type == V4L2_CTRL_TYPE_INTEGER_MENU) {
+		for (int j = qctrl->minimum; j <= qctrl->maximum; j++) {
+			struct v4l2_querymenu menu = {
+				.id = qctrl->id,
+				.index = j,
+			};
+
+			if (0 > ioctl(fd, VIDIOC_QUERYMENU, &menu)) {
+				LOGE("ioctl(VIDIOC_QUERYMENU[id=%d index=%d]) failed: %s (%d)",
+					menu.id, menu.index, strerror(errno), errno);
+				break;
+			}
+
+			if (qctrl->type == V4L2_CTRL_TYPE_MENU) {
+				LOGI("  menuitem[%d]: %sname=%s", menu.index,
+					((int64_t)menu.index == c->value) ? "-> " : "", menu.name);
+			} else {
+				LOGI("  menuitem[%d]: %svalue=%lld", menu.index,
+					((int64_t)menu.index == c->value) ? "-> " : "", menu.value);
 			}
 		}
+	}
+#endif
+}
 
-		const V4l2Control control = {
-			.query = qctrl,
-			.value = value,
-		};
+static void controlsEnumerate(V4l2Controls *ctrls) {
+	if (ctrls->enumerated)
+		return;
+	ctrls->enumerated = 1;
+
+	size_t size = 0;
+	const struct v4l2_query_ext_ctrl *const cached = ctrls->snapshot_key[0]
+		? snapshotGet(ctrls->snapshot_key, &size) : NULL;
+
+	if (cached && size % sizeof(*cached) == 0) {
+		for (int i = 0; i < (int)(size / sizeof(*cached)); ++i) {
+			const V4l2Control control = {.query = cached[i], .stale = 1};
+			arrayAppend(&ctrls->controls, &control);
+		}
 
-		arrayAppend(&ctrls.controls, &control);
+		controlsReadValues(ctrls);
+		indexBuild(ctrls);
+		LOGI("[fd=%d] %d ext controls from snapshot", ctrls->fd, ctrls->controls.size);
+		return;
 	}
 
+	struct v4l2_query_ext_ctrl qctrl = {0};
+	for (;;) {
+		qctrl.id |= V4L2_CTRL_FLAG_NEXT_CTRL | V4L2_CTRL_FLAG_NEXT_COMPOUND;
+		if (0 > ioctl(ctrls->fd, VIDIOC_QUERY_EXT_CTRL, &qctrl))
+			break;
+
+		// TODO filter out unsupported controls
+
+		const V4l2Control control = {.query = qctrl};
+		arrayAppend(&ctrls->controls, &control);
+	}
+
+	controlsReadValues(ctrls);
+	indexBuild(ctrls);
+
+	LOGI("Total ext controls: %d", ctrls->controls.size);
+	for (int i = 0; i < ctrls->controls.size; ++i)
+		controlLog(ctrls->fd, i, arrayAt(&ctrls->controls, V4l2Control, i));
+
+	if (!ctrls->snapshot_key[0])
+		return;
+
+	struct v4l2_query_ext_ctrl *const queries = malloc(sizeof(*queries) * (ctrls->controls.size ? ctrls->controls.size : 1));
+	if (!queries)
+		return;
+
+	for (int i = 0; i < ctrls->controls.size; ++i)
+		queries[i] = arrayAt(&ctrls->controls, V4l2Control, i)->query;
+	snapshotPut(ctrls->snapshot_key, queries, sizeof(*queries) * ctrls->controls.size);
+	free(queries);
+}
+
+V4l2Controls v4l2ControlsCreateFromV4l2Fd(int fd, const char *snapshot_key) {
+	V4l2Controls ctrls = {.fd = fd};
+	arrayInit(&ctrls.controls, V4l2Control);
+	if (snapshot_key)
+		snprintf(ctrls.snapshot_key, sizeof(ctrls.snapshot_key), "%s:ctrls", snapshot_key);
 	return ctrls;
 }
 
@@ -100,42 +200,147 @@ void v4l2ControlsDestroy(V4l2Controls *controls) {
 		return;
 
 	arrayDestroy(&controls->controls);
+	free(controls->index);
+	controls->index = NULL;
+}
+
+// Range, default and flags as they are now, the rest of the descriptor doesn't change
+static void controlRefresh(V4l2Controls *ctrls, V4l2Control *c) {
+	c->stale = 0;
+
+	struct v4l2_query_ext_ctrl qctrl = {.id = c->query.id};
+	if (0 > ioctl(ctrls->fd, VIDIOC_QUERY_EXT_CTRL, &qctrl)) {
+		LOGE("ioctl(VIDIOC_QUERY_EXT_CTRL[.id=%d]) failed: %s %d", c->query.id, strerror(errno), errno);
+		return;
+	}
+
+	c->query = qctrl;
 }
 
 V4l2Control *v4l2ControlGet(V4l2Controls *controls, uint32_t ctrl) {
+	controlsEnumerate(controls);
+	if (!controls->index)
+		return NULL;
+
+	const uint32_t mask = (1u << controls->index_bits) - 1;
+	for (uint32_t slot = indexHash(ctrl, controls->index_bits);; slot = (slot + 1) & mask) {
+		const int i = controls->index[slot];
+		if (!i)
+			return NULL;
+
+		V4l2Control *const c = arrayAt(&controls->controls, V4l2Control, i - 1);
+		if (c->query.id != ctrl)
+			continue;
+
+		if (c->stale)
+			controlRefresh(controls, c);
+		return c;
+	}
+}
+
+int v4l2ControlsSubscribe(V4l2Controls *controls) {
+	controlsEnumerate(controls);
+	int subscribed = 0;
 	for (int i = 0; i < controls->controls.size; ++i) {
-		V4l2Control *const c = arrayAt(&controls->controls, V4l2Control, i);
-		if (c->query.id == ctrl)
-			return c;
+		const V4l2Control *const c = arrayAt(&controls->controls, V4l2Control, i);
+		if (c->query.flags & V4L2_CTRL_FLAG_HAS_PAYLOAD)
+			continue;
+
+		struct v4l2_event_subscription subs = {
+			.type = V4L2_EVENT_CTRL,
+			.id = c->query.id,
+		};
+
+		if (0 != ioctl(controls->fd, VIDIOC_SUBSCRIBE_EVENT, &subs)) {
+			const int error = errno;
+			LOGE("ioctl(%d, VIDIOC_SUBSCRIBE_EVENT[.id=%d(%s)]) failed: %s %d",
+				controls->fd, c->query.id, v4l2CtrlIdName(c->query.id), strerror(error), error);
+
+			// Events are not supported on this fd at all
+			if (error == ENOTTY || error == EINVAL)
+				break;
+			continue;
+		}
+
+		++subscribed;
 	}
 
-	return NULL;
+	return subscribed;
 }
 
-int v4l2ControlSet(V4l2Controls *controls, V4l2Control *ctrl, int64_t value) {
-	if (!ctrl)
-		return -EINVAL;
+int v4l2ControlsProcessEvents(V4l2Controls *controls) {
+	int updated = 0;
+	for (;;) {
+		struct v4l2_event event;
+		if (0 != ioctl(controls->fd, VIDIOC_DQEVENT, &event)) {
+			if (errno == ENOENT)
+				break;
+
+			const int error = errno;
+			LOGE("ioctl(%d, VIDIOC_DQEVENT) failed: %s %d", controls->fd, strerror(error), error);
+			return -error;
+		}
+
+		if (event.type != V4L2_EVENT_CTRL)
+			continue;
 
-	struct v4l2_ext_control val = {
+		V4l2Control *const c = v4l2ControlGet(controls, event.id);
+		if (!c)
+			continue;
+
+		const struct v4l2_event_ctrl *const ev = &event.u.ctrl;
+		if (ev->changes & V4L2_EVENT_CTRL_CH_VALUE)
+			c->value = ev->type == V4L2_CTRL_TYPE_INTEGER64 ? ev->value64 : ev->value;
+
+		if (ev->changes & V4L2_EVENT_CTRL_CH_FLAGS)
+			c->query.flags = ev->flags;
+
+		if (ev->changes & V4L2_EVENT_CTRL_CH_RANGE) {
+			c->query.minimum = ev->minimum;
+			c->query.maximum = ev->maximum;
+			c->query.step = ev->step;
+			c->query.default_value = ev->default_value;
+		}
+
+		++updated;
+	}
+
+	return updated;
+}
+
+static int fillExtControl(const V4l2Control *ctrl, int64_t value, struct v4l2_ext_control *out) {
+	*out = (struct v4l2_ext_control){
 		.id = ctrl->query.id,
 	};
 
 	switch (ctrl->query.type) {
 		case V4L2_CTRL_TYPE_INTEGER64:
-			val.value64 = value;
+			out->value64 = value;
 			break;
 
 		case V4L2_CTRL_TYPE_INTEGER:
 		case V4L2_CTRL_TYPE_INTEGER_MENU:
 		case V4L2_CTRL_TYPE_BOOLEAN:
 		case V4L2_CTRL_TYPE_MENU:
-			val.value = value;
+			out->value = value;
 			break;
 
 		default:
 			return -EPERM;
 	}
 
+	return 0;
+}
+
+int v4l2ControlSet(V4l2Controls *controls, V4l2Control *ctrl, int64_t value) {
+	if (!ctrl)
+		return -EINVAL;
+
+	struct v4l2_ext_control val;
+	const int result = fillExtControl(ctrl, value, &val);
+	if (result != 0)
+		return result;
+
 	struct v4l2_ext_controls ctrls = {
 		.which = V4L2_CTRL_WHICH_CUR_VAL,
 		.count = 1,
@@ -162,5 +367,67 @@ int v4l2ControlSetById(V4l2Controls *controls, uint32_t ctrl_id, int64_t value)
 	return v4l2ControlSet(controls, ctrl, value);
 }
 
+int v4l2ControlStage(V4l2Controls *controls, V4l2Control *ctrl, int64_t value) {
+	if (!ctrl)
+		return -ENOENT;
+
+	if (value < ctrl->query.minimum || value > ctrl->query.maximum)
+		return -ERANGE;
+
+	int index = 0;
+	for (; index < controls->pending.count; ++index)
+		if (controls->pending.ctrls[index] == ctrl)
+			break;
+
+	if (index == V4L2_CONTROLS_PENDING_MAX)
+		return -ENOSPC;
+
+	const int result = fillExtControl(ctrl, value, controls->pending.values + index);
+	if (result != 0)
+		return result;
+
+	controls->pending.ctrls[index] = ctrl;
+	if (index == controls->pending.count)
+		controls->pending.count++;
+
+	return 0;
+}
+
+int v4l2ControlStageById(V4l2Controls *controls, uint32_t ctrl_id, int64_t value) {
+	return v4l2ControlStage(controls, v4l2ControlGet(controls, ctrl_id), value);
+}
+
+int v4l2ControlsCommit(V4l2Controls *controls) {
+	const int count = controls->pending.count;
+	if (!count)
+		return 0;
+
+	controls->pending.count = 0;
+
+	struct v4l2_ext_controls ctrls = {
+		.which = V4L2_CTRL_WHICH_CUR_VAL,
+		.count = count,
+		.controls = controls->pending.values,
+	};
+
+	if (0 > ioctl(controls->fd, VIDIOC_S_EXT_CTRLS, &ctrls)) {
+		const int error = errno;
+		// error_idx == count means failure before any control was applied
+		const uint32_t id = ctrls.error_idx < (uint32_t)count ? controls->pending.values[ctrls.error_idx].id : 0;
+		LOGE("ioctl(VIDIOC_S_EXT_CTRLS[count=%d, error_idx=%u .id=%u(%s)]) failed: %s %d)",
+			count, ctrls.error_idx, id, id ? v4l2CtrlIdName(id) : "none", strerror(error), error);
+		return -error;
+	}
+
+	for (int i = 0; i < count; ++i) {
+		V4l2Control *const ctrl = controls->pending.ctrls[i];
+		ctrl->value = ctrl->query.type == V4L2_CTRL_TYPE_INTEGER64
+			? controls->pending.values[i].value64
+			: controls->pending.values[i].value;
+	}
+
+	return count;
+}
+
 V4l2Controls v4l2ControlsCreate(void);
 void v4l2ControlsAppend(V4l2Controls *ctrls, const V4l2Controls *appendage);
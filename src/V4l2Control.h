@@ -1,6 +1,7 @@
 #pragma once
 
 #include "array.h"
+#include "snapshot.h" // SNAPSHOT_KEY_SIZE
 
 #include <linux/videodev2.h>
 #include <stdint.h> // uint32_t et al.
@@ -9,16 +10,42 @@ typedef struct V4l2Control {
 	struct v4l2_query_ext_ctrl query;
 	//struct v4l2_ext_control value;
 	int64_t value;
+
+	// Loaded from the snapshot, range and flags are of whatever mode the device was in when it was taken.
+	// Queried again on the first v4l2ControlGet()
+	int stale;
 } V4l2Control;
 
-typedef struct {
+#define V4L2_CONTROLS_PENDING_MAX 16
+
+typedef struct V4l2Controls {
 	int fd;
+
+	// Enumerated on first use, from the snapshot when it has them
+	int enumerated;
+	char snapshot_key[SNAPSHOT_KEY_SIZE];
 	Array controls;
+
+	// Open addressing hash of control id to controls index + 1, 0 is empty slot
+	uint16_t *index;
+	uint32_t index_bits;
+
+	// Changes staged with v4l2ControlStage(), applied together by v4l2ControlsCommit()
+	struct {
+		int count;
+		V4l2Control *ctrls[V4L2_CONTROLS_PENDING_MAX];
+		struct v4l2_ext_control values[V4L2_CONTROLS_PENDING_MAX];
+	} pending;
 } V4l2Controls;
 
-// Enumerates controls (ext) for a given fd, device or subdevice
-// Returns Array<V4l2Control>
-V4l2Controls v4l2ControlsCreateFromV4l2Fd(int fd);
+// Controls (ext) of a given fd, device or subdevice. Nothing is enumerated until the first v4l2ControlGet() or
+// v4l2ControlsSubscribe(), so that controls nobody touches cost nothing at startup. Then the descriptors come
+// from the snapshot under snapshot_key, or from the driver and get stored there, and current values are read.
+// Ranges and flags of snapshot descriptors may depend on the sensor mode, e.g. exposure and blanking, so each
+// control is queried again the first time v4l2ControlGet() returns it.
+// snapshot_key is from snapshotDeviceKey()/snapshotSubdevKey(), NULL to always enumerate live.
+// Define V4L2_DUMP_CONTROLS to also log flags and menu items on live enumeration
+V4l2Controls v4l2ControlsCreateFromV4l2Fd(int fd, const char *snapshot_key);
 void v4l2ControlsDestroy(V4l2Controls *controls);
 
 // Returns:
@@ -32,3 +59,31 @@ int v4l2ControlSet(V4l2Controls *ctrls, V4l2Control *ctrl, int64_t value);
 
 // NULL if not found
 V4l2Control *v4l2ControlGet(V4l2Controls *ctrls, uint32_t ctrl);
+
+// Subscribes to V4L2_EVENT_CTRL for all controls, so that changes made by the driver (clamping, auto modes)
+// or other processes can be picked up by v4l2ControlsProcessEvents(). Changes made through this V4l2Controls
+// don't generate events, their values are cached on success.
+// Returns number of subscribed controls
+int v4l2ControlsSubscribe(V4l2Controls *ctrls);
+
+// Dequeues all pending events on ctrls->fd, updating cached values, flags and ranges.
+// Expects only V4L2_EVENT_CTRL events to be subscribed on this fd, others are dropped.
+// Returns number of updated controls, or <0 on error
+int v4l2ControlsProcessEvents(V4l2Controls *ctrls);
+
+// Stages a value to be set by the next v4l2ControlsCommit(). Staging the same control again replaces its value.
+// Use it for controls that must change together (e.g. exposure and gain), or many times per frame.
+// Returns:
+// - -ENOENT on no such control
+// - -ERANGE on value outside of range
+// - -EPERM on unsupported ctrl type
+// - -ENOSPC if V4L2_CONTROLS_PENDING_MAX controls are already staged
+// - 0 on success
+int v4l2ControlStage(V4l2Controls *ctrls, V4l2Control *ctrl, int64_t value);
+int v4l2ControlStageById(V4l2Controls *ctrls, uint32_t ctrl_id, int64_t value);
+
+// Applies all staged values with a single VIDIOC_S_EXT_CTRLS. Staged values are dropped on failure.
+// Returns number of applied controls, or -errno on ioctl() error
+int v4l2ControlsCommit(V4l2Controls *ctrls);
+
+static inline int v4l2ControlsPending(const V4l2Controls *ctrls) { return ctrls->pending.count; }
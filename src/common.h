@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <assert.h>
 #include <stdint.h>
+#include <time.h> // clock_gettime
 
 typedef uint8_t u8;
 typedef uint16_t u16;
@@ -17,6 +18,13 @@ typedef int32_t s32;
 
 #define ASSERT(...) assert(__VA_ARGS__)
 
+// Clock of V4L2 buffer timestamps
+static inline uint64_t monotonicUs(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000ull;
+}
+
 #define LOG(prefix, fmt, ...) \
 	fprintf(stderr, prefix fmt "\n", ##__VA_ARGS__)
 
@@ -0,0 +1,283 @@
+#define _GNU_SOURCE // pthread_setname_np
+
+#include "control-thread.h"
+
+#include "Node.h"
+#include "device.h"
+#include "V4l2Control.h"
+#include "UVC.h"
+#include "queue.h"
+#include "common.h"
+
+#include <sys/eventfd.h>
+#include <pthread.h>
+#include <unistd.h> // read, write, close
+#include <stdlib.h> // calloc
+#include <errno.h>
+#include <string.h> // strerror
+
+#define CONTROL_COMMANDS_MAX 16
+
+#define WAKE_BIT (1<<0)
+#define UVC_EVENTS_BIT (1<<1)
+#define CONTROL_EVENTS_BIT (1<<2)
+
+typedef struct ControlThread {
+	struct Node *uvc;
+	struct Node *nodes[CONTROL_THREAD_MAX_NODES];
+
+	pthread_t thread;
+	struct Pollinator *pol;
+	uint32_t fd_bits;
+
+	// Control thread -> frame thread
+	SpscQueue commands;
+	int commands_fd;
+
+	// Frame thread -> control thread
+	int wake_fd;
+	int quit;
+	int streaming;
+
+	// Set by control thread when staged controls wait for a frame boundary
+	int commit_wanted;
+
+	// Set by frame thread on the frame boundary following commit_wanted
+	int frame_arrived;
+
+	// Pause handshake, see controlThreadPause()
+	pthread_mutex_t pause_lock;
+	pthread_cond_t pause_cond;
+	int pause_wanted;
+	int paused;
+} ControlThread;
+
+static void eventFdSignal(int fd) {
+	const uint64_t value = 1;
+	if (sizeof(value) != write(fd, &value, sizeof(value)))
+		LOGE("%s: write(%d) failed: %d, %s", __func__, fd, errno, strerror(errno));
+}
+
+static void eventFdClear(int fd) {
+	uint64_t value;
+	if (read(fd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+		LOGE("%s: read(%d) failed: %d, %s", __func__, fd, errno, strerror(errno));
+}
+
+static int bitSetFunc(int fd, uint32_t flags, uintptr_t arg1, uintptr_t arg2) {
+	UNUSED(fd);
+	UNUSED(flags);
+	*(uint32_t*)arg1 |= arg2;
+	return POLLINATOR_CONTINUE;
+}
+
+static void commitControls(ControlThread *ct) {
+	int pending = 0;
+	for (int i = 0; i < CONTROL_THREAD_MAX_NODES && ct->nodes[i]; ++i)
+		if (ct->nodes[i]->controls && v4l2ControlsPending(ct->nodes[i]->controls))
+			pending = 1;
+
+	if (!pending)
+		return;
+
+	// While streaming, changes are applied right after a camera frame arrives, so that they hit the same frame together
+	if (__atomic_load_n(&ct->streaming, __ATOMIC_ACQUIRE) && !__atomic_exchange_n(&ct->frame_arrived, 0, __ATOMIC_ACQ_REL)) {
+		__atomic_store_n(&ct->commit_wanted, 1, __ATOMIC_RELEASE);
+		return;
+	}
+
+	for (int i = 0; i < CONTROL_THREAD_MAX_NODES && ct->nodes[i]; ++i)
+		nodeCommitControls(ct->nodes[i]);
+}
+
+static void pauseIfWanted(ControlThread *ct) {
+	pthread_mutex_lock(&ct->pause_lock);
+	if (ct->pause_wanted) {
+		ct->paused = 1;
+		pthread_cond_broadcast(&ct->pause_cond);
+		while (ct->pause_wanted)
+			pthread_cond_wait(&ct->pause_cond, &ct->pause_lock);
+		ct->paused = 0;
+	}
+	pthread_mutex_unlock(&ct->pause_lock);
+}
+
+static void *controlThreadMain(void *arg) {
+	ControlThread *const ct = arg;
+
+	while (!__atomic_load_n(&ct->quit, __ATOMIC_ACQUIRE)) {
+		ct->fd_bits = 0;
+		const int result = pollinatorPoll(ct->pol, 5000);
+		if (result < 0) {
+			LOGE("Control thread pollinator returned %d", result);
+			break;
+		}
+
+		if (ct->fd_bits & WAKE_BIT) {
+			eventFdClear(ct->wake_fd);
+			pauseIfWanted(ct);
+		}
+
+		if (ct->fd_bits & UVC_EVENTS_BIT)
+			uvcProcessEvents(ct->uvc);
+
+		// Keep cached control values coherent with the driver, so that UVC GET_* requests are answered from memory
+		if (ct->fd_bits & CONTROL_EVENTS_BIT)
+			for (int i = 0; i < CONTROL_THREAD_MAX_NODES && ct->nodes[i]; ++i)
+				nodeProcessControlEvents(ct->nodes[i]);
+
+		commitControls(ct);
+	}
+
+	return NULL;
+}
+
+static void controlThreadFree(ControlThread *ct) {
+	if (ct->pol)
+		pollinatorDestroy(ct->pol);
+	if (ct->wake_fd >= 0)
+		close(ct->wake_fd);
+	if (ct->commands_fd >= 0)
+		close(ct->commands_fd);
+	spscQueueFinalize(&ct->commands);
+	pthread_cond_destroy(&ct->pause_cond);
+	pthread_mutex_destroy(&ct->pause_lock);
+	free(ct);
+}
+
+struct ControlThread *controlThreadCreate(ControlThreadArgs args) {
+	ControlThread *const ct = calloc(1, sizeof(ControlThread));
+	if (!ct)
+		return NULL;
+
+	ct->uvc = args.uvc;
+	memcpy(ct->nodes, args.nodes, sizeof(ct->nodes));
+	pthread_mutex_init(&ct->pause_lock, NULL);
+	pthread_cond_init(&ct->pause_cond, NULL);
+	ct->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	ct->commands_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (ct->wake_fd < 0 || ct->commands_fd < 0) {
+		LOGE("%s: eventfd() failed: %d, %s", __func__, errno, strerror(errno));
+		goto fail;
+	}
+
+	if (0 != spscQueueInit(&ct->commands, sizeof(ControlCommand), CONTROL_COMMANDS_MAX))
+		goto fail;
+
+	ct->pol = pollinatorCreate(args.backend);
+	if (!ct->pol)
+		goto fail;
+
+	pollinatorMonitorFd(ct->pol, &(PollinatorMonitorFd){
+		.fd = ct->wake_fd,
+		.event_bits = POLLIN_FD_READ,
+		.func = bitSetFunc,
+		.arg1 = (uintptr_t)&ct->fd_bits,
+		.arg2 = WAKE_BIT});
+
+	if (POLLINATOR_HANDLE_NONE == pollinatorMonitorFd(ct->pol, &(PollinatorMonitorFd){
+			.fd = ct->uvc->input->dev_fd,
+			.event_bits = POLLIN_FD_EXCEPT,
+			.func = bitSetFunc,
+			.arg1 = (uintptr_t)&ct->fd_bits,
+			.arg2 = UVC_EVENTS_BIT})) {
+		LOGE("Unable to monitor uvc-gadget events");
+		goto fail;
+	}
+
+	// Control events are pending v4l2 events, i.e. exceptional condition on the controls fd.
+	// For video devices this is the same fd that the frame thread polls for buffers, but without EXCEPT.
+	for (int i = 0; i < CONTROL_THREAD_MAX_NODES && ct->nodes[i]; ++i) {
+		if (!ct->nodes[i]->controls)
+			continue;
+
+		pollinatorMonitorFd(ct->pol, &(PollinatorMonitorFd){
+			.fd = ct->nodes[i]->controls->fd,
+			.event_bits = POLLIN_FD_EXCEPT,
+			.func = bitSetFunc,
+			.arg1 = (uintptr_t)&ct->fd_bits,
+			.arg2 = CONTROL_EVENTS_BIT});
+	}
+
+	const int err = pthread_create(&ct->thread, NULL, controlThreadMain, ct);
+	if (err != 0) {
+		LOGE("%s: pthread_create() failed: %d, %s", __func__, err, strerror(err));
+		goto fail;
+	}
+
+	pthread_setname_np(ct->thread, "malincam-ctl");
+	return ct;
+
+fail:
+	controlThreadFree(ct);
+	return NULL;
+}
+
+void controlThreadDestroy(ControlThread *ct) {
+	if (!ct)
+		return;
+
+	__atomic_store_n(&ct->quit, 1, __ATOMIC_RELEASE);
+	eventFdSignal(ct->wake_fd);
+	pthread_join(ct->thread, NULL);
+
+	controlThreadFree(ct);
+}
+
+int controlThreadPushCommand(ControlThread *ct, const ControlCommand *cmd) {
+	const int result = spscQueuePush(&ct->commands, cmd);
+	if (result != 0) {
+		LOGE("%s: command queue is full, dropping command %d", __func__, cmd->type);
+		return result;
+	}
+
+	eventFdSignal(ct->commands_fd);
+	return 0;
+}
+
+int controlThreadCommandFd(const ControlThread *ct) {
+	return ct->commands_fd;
+}
+
+int controlThreadPopCommand(ControlThread *ct, ControlCommand *out) {
+	if (0 == spscQueuePop(&ct->commands, out))
+		return 0;
+
+	// Empty: clear the wakeup, then look again for commands pushed right before it was cleared
+	eventFdClear(ct->commands_fd);
+	return spscQueuePop(&ct->commands, out);
+}
+
+void controlThreadFrameBoundary(ControlThread *ct) {
+	if (!__atomic_load_n(&ct->commit_wanted, __ATOMIC_ACQUIRE))
+		return;
+
+	if (__atomic_exchange_n(&ct->commit_wanted, 0, __ATOMIC_ACQ_REL)) {
+		__atomic_store_n(&ct->frame_arrived, 1, __ATOMIC_RELEASE);
+		eventFdSignal(ct->wake_fd);
+	}
+}
+
+void controlThreadSetStreaming(ControlThread *ct, int streaming) {
+	__atomic_store_n(&ct->streaming, streaming, __ATOMIC_RELEASE);
+
+	// No more frames to wait for
+	if (!streaming && __atomic_exchange_n(&ct->commit_wanted, 0, __ATOMIC_ACQ_REL))
+		eventFdSignal(ct->wake_fd);
+}
+
+void controlThreadPause(ControlThread *ct) {
+	pthread_mutex_lock(&ct->pause_lock);
+	ct->pause_wanted = 1;
+	eventFdSignal(ct->wake_fd);
+	while (!ct->paused)
+		pthread_cond_wait(&ct->pause_cond, &ct->pause_lock);
+	pthread_mutex_unlock(&ct->pause_lock);
+}
+
+void controlThreadResume(ControlThread *ct) {
+	pthread_mutex_lock(&ct->pause_lock);
+	ct->pause_wanted = 0;
+	pthread_cond_broadcast(&ct->pause_cond);
+	pthread_mutex_unlock(&ct->pause_lock);
+}
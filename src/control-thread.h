@@ -0,0 +1,70 @@
+#pragma once
+
+#include "pollinator.h"
+
+#include <stdint.h>
+
+// Dedicated thread for UVC gadget events and image control handling, so that slow setup/data phases
+// or blocking control ioctls never delay the frame loop.
+//
+// The control thread owns the UVC gadget event fd and all V4l2Controls of the given nodes:
+// it answers UVC requests, stages and commits control changes, and processes V4L2_EVENT_CTRL.
+// Anything that touches streams is forwarded to the frame thread through a lock-free command queue.
+// The frame thread only reports camera frame boundaries and streaming state back, which costs
+// an atomic load per frame unless a control commit is waiting for it. The exception is sensor mode switches,
+// which read sensor controls: the frame thread pauses the control thread around them.
+
+struct Node;
+struct ControlThread;
+
+#define CONTROL_THREAD_MAX_NODES 4
+
+typedef enum {
+	CONTROL_COMMAND_STREAMON,
+	CONTROL_COMMAND_STREAMOFF,
+	// Host triggered still image capture, see uvc_event_still_f
+	CONTROL_COMMAND_STILL,
+} ControlCommandType;
+
+typedef struct {
+	ControlCommandType type;
+} ControlCommand;
+
+typedef struct {
+	PollinatorBackend backend;
+
+	// UVC gadget node, its events are processed on the control thread
+	struct Node *uvc;
+
+	// Nodes whose controls are owned by the control thread. Unused trailing entries are NULL
+	struct Node *nodes[CONTROL_THREAD_MAX_NODES];
+} ControlThreadArgs;
+
+// Starts the thread, UVC events are handled from this point on
+// Returns NULL on failure
+struct ControlThread *controlThreadCreate(ControlThreadArgs args);
+
+// Stops and joins the thread
+void controlThreadDestroy(struct ControlThread *ct);
+
+// Control thread side: queues a command for the frame thread
+// Returns 0 on success, -ENOSPC if the frame thread is not keeping up
+int controlThreadPushCommand(struct ControlThread *ct, const ControlCommand *cmd);
+
+// Frame thread side: fd that becomes readable when commands are queued
+int controlThreadCommandFd(const struct ControlThread *ct);
+
+// Frame thread side: pops next command
+// Returns 0 on success, -EAGAIN if there are no more commands
+int controlThreadPopCommand(struct ControlThread *ct, ControlCommand *out);
+
+// Frame thread side: a new camera frame has arrived, staged controls can be committed now
+void controlThreadFrameBoundary(struct ControlThread *ct);
+
+// Frame thread side: while not streaming staged controls are committed right away
+void controlThreadSetStreaming(struct ControlThread *ct, int streaming);
+
+// Frame thread side: returns once the control thread is parked between events, its controls can be used
+// until controlThreadResume(). Events that arrive meanwhile are handled after resuming
+void controlThreadPause(struct ControlThread *ct);
+void controlThreadResume(struct ControlThread *ct);
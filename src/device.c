@@ -1,6 +1,10 @@
 #include "device.h"
 
 #include "v4l2-print.h"
+#include "trace.h"
+#include "metrics.h"
+#include "probes.h"
+#include "snapshot.h"
 #include "common.h"
 
 #include <stdio.h>
@@ -9,6 +13,8 @@
 
 #include <sys/mman.h> // mmap
 
+#include <linux/dma-buf.h> // DMA_BUF_IOCTL_SYNC
+
 // open
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -44,9 +50,10 @@ static uint32_t v4l2ReadBufferTypeCapabilities(int fd, uint32_t buffer_type) {
 	return req.capabilities;
 }
 
-static int streamInit(DeviceStream *st, int fd, uint32_t buffer_type) {
+static int streamInit(DeviceStream *st, int fd, uint32_t buffer_type, const char *snapshot_key) {
 	DeviceStream stream = {0};
 	stream.dev_fd = fd;
+	snprintf(stream.snapshot_key, sizeof(stream.snapshot_key), "%s", snapshot_key);
 	stream.type = buffer_type;
 	stream.state = STREAM_STATE_IDLE;
 
@@ -78,32 +85,33 @@ fail:
 	return -1;
 }
 
-static int v4l2QueryCapability(Device *dev) {
+static int v4l2QueryCapability(Device *dev, char *snapshot_key, size_t snapshot_key_size) {
 	if (0 != ioctl(dev->fd, VIDIOC_QUERYCAP, &dev->caps)) {
 		LOGE("Failed to ioctl(%d, VIDIOC_QUERYCAP): %d, %s", dev->fd, errno, strerror(errno));
 		return errno;
 	}
 
 	v4l2PrintCapability(&dev->caps);
+	snapshotDeviceKey(&dev->caps, snapshot_key, snapshot_key_size);
 
 	dev->this_device_caps = dev->caps.capabilities & V4L2_CAP_DEVICE_CAPS
 		? dev->caps.device_caps : dev->caps.capabilities;
 
 	if ((V4L2_CAP_VIDEO_CAPTURE | V4L2_CAP_VIDEO_M2M) & dev->this_device_caps) {
-		if (0 != streamInit(&dev->capture, dev-> fd, V4L2_BUF_TYPE_VIDEO_CAPTURE))
+		if (0 != streamInit(&dev->capture, dev->fd, V4L2_BUF_TYPE_VIDEO_CAPTURE, snapshot_key))
 			goto fail;
 	} else if ((V4L2_CAP_VIDEO_CAPTURE_MPLANE | V4L2_CAP_VIDEO_M2M_MPLANE) & dev->this_device_caps) {
-		if (0 != streamInit(&dev->capture, dev-> fd, V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE))
+		if (0 != streamInit(&dev->capture, dev->fd, V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE, snapshot_key))
 			goto fail;
 	} else {
 		dev->capture.type = 0;
 	}
 
 	if ((V4L2_CAP_VIDEO_OUTPUT | V4L2_CAP_VIDEO_M2M) & dev->this_device_caps) {
-		if (0 != streamInit(&dev->output, dev-> fd, V4L2_BUF_TYPE_VIDEO_OUTPUT))
+		if (0 != streamInit(&dev->output, dev->fd, V4L2_BUF_TYPE_VIDEO_OUTPUT, snapshot_key))
 			goto fail;
 	} else if ((V4L2_CAP_VIDEO_OUTPUT_MPLANE | V4L2_CAP_VIDEO_M2M_MPLANE) & dev->this_device_caps) {
-		if (0 != streamInit(&dev->output, dev-> fd, V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE))
+		if (0 != streamInit(&dev->output, dev->fd, V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE, snapshot_key))
 			goto fail;
 	} else {
 		dev->output.type = 0;
@@ -198,7 +206,54 @@ static int v4l2Selection(int fd, enum v4l2_buf_type type, uint32_t cmd, uint32_t
 	return 0;
 }
 
-static int setCrop(DeviceStream *st, int w, int h) {
+// Fits rect into bounds, bounds of zero size are unknown and don't limit anything
+static struct v4l2_rect rectClamp(struct v4l2_rect rect, const struct v4l2_rect *bounds) {
+	if (!bounds->width || !bounds->height)
+		return rect;
+
+	if (rect.width > bounds->width)
+		rect.width = bounds->width;
+	if (rect.height > bounds->height)
+		rect.height = bounds->height;
+	if (rect.left < bounds->left)
+		rect.left = bounds->left;
+	if (rect.top < bounds->top)
+		rect.top = bounds->top;
+	if (rect.left + rect.width > bounds->left + bounds->width)
+		rect.left = bounds->left + bounds->width - rect.width;
+	if (rect.top + rect.height > bounds->top + bounds->height)
+		rect.top = bounds->top + bounds->height - rect.height;
+	return rect;
+}
+
+static int rectEqual(const struct v4l2_rect *a, const struct v4l2_rect *b) {
+	return a->left == b->left && a->top == b->top && a->width == b->width && a->height == b->height;
+}
+
+// Sets target to rect within bounds. Drivers round rectangles silently, which then
+// doesn't match what the next stage was prepared for
+static int setSelection(DeviceStream *st, uint32_t target, const struct v4l2_rect *bounds, const struct v4l2_rect *rect, struct v4l2_rect *out) {
+	struct v4l2_rect r = rectClamp(*rect, bounds);
+	if (!rectEqual(&r, rect))
+		LOGE("%s: (%d,%d) + (%ux%u) is out of bounds (%d,%d) + (%ux%u)", v4l2SelTgtName(target),
+			rect->left, rect->top, rect->width, rect->height,
+			bounds->left, bounds->top, bounds->width, bounds->height);
+
+	if (0 != v4l2Selection(st->dev_fd, st->type, VIDIOC_S_SELECTION, target, &r))
+		return -EINVAL;
+	v4l2Selection(st->dev_fd, st->type, VIDIOC_G_SELECTION, target, out);
+
+	if (!rectEqual(out, rect)) {
+		LOGE("%s: driver adjusted (%d,%d) + (%ux%u) to (%d,%d) + (%ux%u)", v4l2SelTgtName(target),
+			rect->left, rect->top, rect->width, rect->height,
+			out->left, out->top, out->width, out->height);
+		return -ERANGE;
+	}
+
+	return 0;
+}
+
+static int setCrop(DeviceStream *st, const struct v4l2_rect *rect) {
 	struct v4l2_rect crop_bounds = {0};
 	struct v4l2_rect crop_default = {0};
 	struct v4l2_rect native = {0};
@@ -207,38 +262,67 @@ static int setCrop(DeviceStream *st, int w, int h) {
 	v4l2Selection(st->dev_fd, st->type, VIDIOC_G_SELECTION, V4L2_SEL_TGT_CROP_DEFAULT, &crop_default);
 	v4l2Selection(st->dev_fd, st->type, VIDIOC_G_SELECTION, V4L2_SEL_TGT_CROP, &st->crop);
 
-	// TODO do math, validate, etc
-	if (w != 0 && h != 0) {
-		struct v4l2_rect rect = crop_default;
-		rect.width = w;
-		rect.height = h;
-		v4l2Selection(st->dev_fd, st->type, VIDIOC_S_SELECTION, V4L2_SEL_TGT_CROP, &rect);
-		v4l2Selection(st->dev_fd, st->type, VIDIOC_G_SELECTION, V4L2_SEL_TGT_CROP, &st->crop);
-	}
+	if (!rect->width || !rect->height)
+		return 0;
 
-	return 0;
+	return setSelection(st, V4L2_SEL_TGT_CROP, &crop_bounds, rect, &st->crop);
 }
 
-static int setCompose(DeviceStream *st, int w, int h) {
+static int setCompose(DeviceStream *st, uint32_t w, uint32_t h) {
 	struct v4l2_rect compose_bounds = {0};
 	struct v4l2_rect compose_default = {0};
 	v4l2Selection(st->dev_fd, st->type, VIDIOC_G_SELECTION, V4L2_SEL_TGT_COMPOSE_BOUNDS, &compose_bounds);
 	v4l2Selection(st->dev_fd, st->type, VIDIOC_G_SELECTION, V4L2_SEL_TGT_COMPOSE_DEFAULT, &compose_default);
 	v4l2Selection(st->dev_fd, st->type, VIDIOC_G_SELECTION, V4L2_SEL_TGT_COMPOSE, &st->compose);
 
-	// TODO do math, validate, etc
-	if (w != 0 && h != 0) {
-		struct v4l2_rect rect = compose_default;
-		rect.width = w;
-		rect.height = h;
-		v4l2Selection(st->dev_fd, st->type, VIDIOC_S_SELECTION, V4L2_SEL_TGT_COMPOSE, &rect);
-		v4l2Selection(st->dev_fd, st->type, VIDIOC_G_SELECTION, V4L2_SEL_TGT_COMPOSE, &st->compose);
+	if (w == 0 || h == 0)
+		return 0;
+
+	struct v4l2_rect rect = compose_default;
+	rect.width = w;
+	rect.height = h;
+	return setSelection(st, V4L2_SEL_TGT_COMPOSE, &compose_bounds, &rect, &st->compose);
+}
+
+int deviceStreamSetCrop(DeviceStream *st, const struct v4l2_rect *rect) {
+	struct v4l2_selection sel = {
+		.type = st->type,
+		.target = V4L2_SEL_TGT_CROP,
+		.r = *rect,
+	};
+
+	// No logging on success, this is called per frame during digital pan/zoom
+	if (0 != ioctl(st->dev_fd, VIDIOC_S_SELECTION, &sel)) {
+		const int err = errno;
+		LOGE("Failed to ioctl(%d, VIDIOC_S_SELECTION, [target=%s]): %d, %s",
+			st->dev_fd, v4l2SelTgtName(V4L2_SEL_TGT_CROP), err, strerror(err));
+		return -err;
 	}
 
+	st->crop = sel.r;
 	return 0;
 }
 
-static void setPixelFormat(struct v4l2_format *fmt, uint32_t pixelformat, int w, int h) {
+// Formats with a buffer per plane, the rest have all planes in one
+static int pixelFormatPlanes(uint32_t pixelformat) {
+	switch (pixelformat) {
+		case V4L2_PIX_FMT_NV12M:
+		case V4L2_PIX_FMT_NV21M:
+		case V4L2_PIX_FMT_NV16M:
+		case V4L2_PIX_FMT_NV61M:
+			return 2;
+		case V4L2_PIX_FMT_YUV420M:
+		case V4L2_PIX_FMT_YVU420M:
+		case V4L2_PIX_FMT_YUV422M:
+		case V4L2_PIX_FMT_YVU422M:
+		case V4L2_PIX_FMT_YUV444M:
+		case V4L2_PIX_FMT_YVU444M:
+			return 3;
+	}
+	return 1;
+}
+
+static void setPixelFormat(struct v4l2_format *fmt, uint32_t pixelformat, int w, int h, uint32_t bytesperline) {
 	if (!IS_TYPE_MPLANE(fmt->type)) {
 		struct v4l2_pix_format *const pix = &fmt->fmt.pix;
 		pix->pixelformat = pixelformat;
@@ -246,21 +330,23 @@ static void setPixelFormat(struct v4l2_format *fmt, uint32_t pixelformat, int w,
 		pix->height = h;
 
 		pix->sizeimage = 0;
-		pix->bytesperline = 0;
+		pix->bytesperline = bytesperline;
 	} else {
 		struct v4l2_pix_format_mplane *const pix_mp = &fmt->fmt.pix_mp;
 		pix_mp->pixelformat = pixelformat;
 		pix_mp->width = w;
 		pix_mp->height = h;
 
-		// TODO proper multiplanar formats
-		pix_mp->num_planes = 1;
-		pix_mp->plane_fmt[0].sizeimage = 0;
-		pix_mp->plane_fmt[0].bytesperline = 0;
+		// Chroma plane strides follow the luma one, drivers fill them in
+		pix_mp->num_planes = pixelFormatPlanes(pixelformat);
+		for (int i = 0; i < pix_mp->num_planes; ++i) {
+			pix_mp->plane_fmt[i].sizeimage = 0;
+			pix_mp->plane_fmt[i].bytesperline = i == 0 ? bytesperline : 0;
+		}
 	}
 }
 
-static int streamSetFormat(DeviceStream *st, uint32_t pixelformat, int w, int h) {
+static int streamSetFormat(DeviceStream *st, uint32_t pixelformat, int w, int h, uint32_t bytesperline) {
 	LOGI("Setting format %s(%x) %dx%d for Devicestream=%s(%d)",
 		v4l2PixFmtName(pixelformat), pixelformat, w, h,
 		v4l2BufTypeName(st->type), st->type);
@@ -271,7 +357,7 @@ static int streamSetFormat(DeviceStream *st, uint32_t pixelformat, int w, int h)
 
 	struct v4l2_format fmt = st->format;
 	ASSERT(fmt.type == st->type);
-	setPixelFormat(&fmt, pixelformat, w, h);
+	setPixelFormat(&fmt, pixelformat, w, h, bytesperline);
 
 	if (0 != ioctl(st->dev_fd, VIDIOC_S_FMT, &fmt)) {
 		LOGE("Failed to ioctl(%d, VIDIOC_S_FMT, %s): %d, %s",
@@ -284,6 +370,12 @@ static int streamSetFormat(DeviceStream *st, uint32_t pixelformat, int w, int h)
 	LOGI("Set format:");
 	v4l2PrintFormat(&st->format);
 
+	// Buffers shared with another device are laid out for the stride both were given
+	const uint32_t set_bytesperline = IS_TYPE_MPLANE(fmt.type) ? fmt.fmt.pix_mp.plane_fmt[0].bytesperline : fmt.fmt.pix.bytesperline;
+	if (bytesperline && set_bytesperline != bytesperline)
+		LOGE("Driver adjusted bytesperline %u to %u for Devicestream=%s(%d)",
+			bytesperline, set_bytesperline, v4l2BufTypeName(st->type), st->type);
+
 	return 0;
 }
 
@@ -307,10 +399,10 @@ static int bufferExportDmabufFd(int fd, uint32_t buf_type, uint32_t index, uint3
 
 static int bufferDmabufExport(DeviceStream *st, Buffer *const buf) {
 	const int planes_num = IS_STREAM_MPLANE(st) ? st->format.fmt.pix_mp.num_planes : 1;
-	ASSERT(planes_num < VIDEO_MAX_PLANES);
+	ASSERT(planes_num <= VIDEO_MAX_PLANES);
 
 	for (int i = 0; i < planes_num; ++i) {
-		const int fd = bufferExportDmabufFd(st->dev_fd, st->type, buf->buffer.index, 0);
+		const int fd = bufferExportDmabufFd(st->dev_fd, st->type, buf->buffer.index, i);
 		if (fd <= 0) {
 			// FIXME leaks 0..i fds
 			// TODO clean here, or?
@@ -318,15 +410,66 @@ static int bufferDmabufExport(DeviceStream *st, Buffer *const buf) {
 		}
 
 		buf->dmabuf_fd[i] = fd;
+
+		// Sinks read encoded frames and samples through this one mapping, instead of each mapping fds on its own
+		const uint32_t length = IS_STREAM_MPLANE(st) ? buf->buffer.m.planes[i].length : buf->buffer.length;
+		void *const ptr = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+		if (ptr == MAP_FAILED) {
+			LOGE("Failed to mmap(dmabuf fd=%d, buffer[%d] plane=%d): %d, %s, CPU readers will skip it",
+				fd, buf->buffer.index, i, errno, strerror(errno));
+			continue;
+		}
+
+		buf->read_mapped[i] = ptr;
+		buf->read_size[i] = length;
 	}
 
 	return 0;
 }
 
+static void bufferDmabufRelease(DeviceStream *st, Buffer *const buf) {
+	for (int i = 0; i < STREAM_PLANES_COUNT(st); ++i) {
+		if (buf->read_mapped[i])
+			munmap((void*)buf->read_mapped[i], buf->read_size[i]);
+		buf->read_mapped[i] = NULL;
+
+		if (buf->dmabuf_fd[i] > 0)
+			close(buf->dmabuf_fd[i]);
+		buf->dmabuf_fd[i] = 0;
+	}
+}
+
+static void bufferSyncRead(const Buffer *buf, int plane, uint64_t flags) {
+	// Errors only mean there's nothing to sync, e.g. with coherent memory
+	struct dma_buf_sync sync = {.flags = flags | DMA_BUF_SYNC_READ};
+	ioctl(buf->dmabuf_fd[plane], DMA_BUF_IOCTL_SYNC, &sync);
+}
+
+const uint8_t *bufferReadBegin(const Buffer *buf, int plane) {
+	if (!buf->read_mapped[plane])
+		return NULL;
+
+	bufferSyncRead(buf, plane, DMA_BUF_SYNC_START);
+	return buf->read_mapped[plane];
+}
+
+void bufferReadEnd(const Buffer *buf, int plane) {
+	if (buf->read_mapped[plane])
+		bufferSyncRead(buf, plane, DMA_BUF_SYNC_END);
+}
+
+static void bufferMunmap(Buffer *const buf) {
+	for (int i = 0; i < VIDEO_MAX_PLANES; ++i) {
+		if (buf->mapped[i] && 0 != munmap(buf->mapped[i], buf->mapped_size[i]))
+			LOGE("munmap(%p) => %s (%d)", buf->mapped[i], strerror(errno), errno);
+		buf->mapped[i] = NULL;
+	}
+}
+
 static int bufferMmap(DeviceStream *st, Buffer *const buf) {
 	if (IS_STREAM_MPLANE(st)) {
 		const int planes_num = st->format.fmt.pix_mp.num_planes;
-		ASSERT(planes_num < VIDEO_MAX_PLANES);
+		ASSERT(planes_num <= VIDEO_MAX_PLANES);
 
 		for (int i = 0; i < planes_num; ++i) {
 			const uint32_t offset = buf->buffer.m.planes[i].m.mem_offset;
@@ -334,10 +477,12 @@ static int bufferMmap(DeviceStream *st, Buffer *const buf) {
 			buf->mapped[i] = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, st->dev_fd, offset);
 			const int err = errno;
 			if (buf->mapped[i] == MAP_FAILED) {
-				// FIXME munmap already mmapped
+				buf->mapped[i] = NULL;
 				LOGE("Failed to mmap(%d, buffer[%d]): %d, %s", st->dev_fd, buf->buffer.index, errno, strerror(errno));
+				bufferMunmap(buf);
 				return err;
 			}
+			buf->mapped_size[i] = length;
 
 			LOGI("buf.index=%d plane=%d mmap=%p", buf->buffer.index, i, buf->mapped[i]);
 		} // for planes
@@ -345,9 +490,11 @@ static int bufferMmap(DeviceStream *st, Buffer *const buf) {
 		buf->mapped[0] = mmap(NULL, buf->buffer.length, PROT_READ | PROT_WRITE, MAP_SHARED, st->dev_fd, buf->buffer.m.offset);
 		const int err = errno;
 		if (buf->mapped[0] == MAP_FAILED) {
+			buf->mapped[0] = NULL;
 			LOGE("Failed to mmap(%d, buffer[%d]): %d, %s", st->dev_fd, buf->buffer.index, errno, strerror(errno));
 			return err;
 		}
+		buf->mapped_size[0] = buf->buffer.length;
 		LOGI("buf.index=%d mmap=%p", buf->buffer.index, buf->mapped[0]);
 	}
 
@@ -427,7 +574,6 @@ static int streamRequestBuffers(DeviceStream *st) {
 
 	st->buffers = calloc(req.count, sizeof(*st->buffers));
 
-	struct v4l2_plane bmplanes[VIDEO_MAX_PLANES];
 	for (int i = 0; i < st->buffers_count; ++i) {
 		Buffer *const buf = st->buffers + i;
 		buf->buffer = (struct v4l2_buffer){
@@ -436,8 +582,9 @@ static int streamRequestBuffers(DeviceStream *st) {
 			.index = i,
 		};
 
+		// Planes stay with the buffer, pass functions fill them in for queueing
 		if (IS_STREAM_MPLANE(st)) {
-			buf->buffer.m.planes = bmplanes;
+			buf->buffer.m.planes = buf->planes;
 			buf->buffer.length = st->format.fmt.pix_mp.num_planes;
 		}
 
@@ -461,6 +608,10 @@ static int streamRequestBuffers(DeviceStream *st) {
 
 fail:
 	// FIXME remove ones we've already queried?
+	if (st->buffer_memory == BUFFER_MEMORY_MMAP) {
+		for (int i = 0; i < st->buffers_count; ++i)
+			bufferMunmap(st->buffers + i);
+	}
 	free(st->buffers);
 	st->buffers = NULL;
 	return 1;
@@ -479,24 +630,14 @@ static int streamEnqueueBuffers(DeviceStream *st) {
 }
 
 static void streamDestroy(DeviceStream *st) {
-	for (int i = 0; i < st->buffers_count; ++i) {
-		//Buffer *const buf = st->buffers + i;
+	// Released streams have no buffers left
+	for (int i = 0; st->buffers && i < st->buffers_count; ++i) {
 		switch (st->buffer_memory) {
 			case BUFFER_MEMORY_MMAP:
-				/* FIXME
-				if (buf->mapped && 0 != munmap(buf->mapped, buf->buffer.length)) {
-					LOGE("munmap(%p) => %s (%d)", buf->mapped, strerror(errno), errno);
-				}
-				*/
+				bufferMunmap(st->buffers + i);
 				break;
 			case BUFFER_MEMORY_DMABUF_EXPORT:
-				/* FIXME
-				{
-					const int planes_num = streamPlanesNum(st);
-					for (int i = 0; i < planes_num; ++i) {
-						close(buf->dmabuf_fd[i]);
-					}
-				}*/
+				bufferDmabufRelease(st, st->buffers + i);
 				break;
 
 			case BUFFER_MEMORY_NONE:
@@ -524,7 +665,8 @@ struct Device* deviceOpen(const char *devname) {
 
 	LOGI("Opened \"%s\" => %d", devname, dev.fd);
 
-	if (0 != v4l2QueryCapability(&dev)) {
+	char snapshot_key[SNAPSHOT_KEY_SIZE];
+	if (0 != v4l2QueryCapability(&dev, snapshot_key, sizeof(snapshot_key))) {
 		goto fail;
 	}
 
@@ -537,7 +679,7 @@ struct Device* deviceOpen(const char *devname) {
 
 	Device* const ret = (Device*)malloc(sizeof(Device));
 	*ret = dev;
-	ret->controls = v4l2ControlsCreateFromV4l2Fd(ret->fd);
+	ret->controls = v4l2ControlsCreateFromV4l2Fd(ret->fd, snapshot_key);
 	return ret;
 
 fail:
@@ -592,13 +734,52 @@ int deviceEventGet(Device *dev, struct v4l2_event *out) {
 	return 1;
 }
 
+#ifdef V4L2_DUMP_FORMATS
+static void formatDumpSizes(const DeviceStream *st, const struct v4l2_fmtdesc *fmt) {
+	v4l2PrintFormatFlags(fmt->flags);
+
+	for (int i = 0;; ++i) {
+		struct v4l2_frmsizeenum fse = { .index = i, .pixel_format = fmt->pixelformat };
+		if (0 != ioctl(st->dev_fd, VIDIOC_ENUM_FRAMESIZES, &fse)) {
+			LOGI("  Format has %d framesizes", i);
+			break;
+		}
+
+		v4l2PrintFrmSizeEnum(&fse);
+
+		// Only discrete supports index > 0
+		if (fse.type != V4L2_FRMSIZE_TYPE_DISCRETE)
+			break;
+	}
+}
+#endif
+
+static int formatsFromSnapshot(DeviceStream *st, const char *key, int mbus_code) {
+	size_t size = 0;
+	const struct v4l2_fmtdesc *const cached = st->snapshot_key[0] ? snapshotGet(key, &size) : NULL;
+	if (!cached || size % sizeof(*cached))
+		return -ENOENT;
+
+	for (int i = 0; i < (int)(size / sizeof(*cached)); ++i)
+		arrayAppend(&st->formats, cached + i);
+
+	LOGI("%d formats for type=%s mbus_code=%s from snapshot", arraySize(&st->formats),
+		v4l2BufTypeName(st->type), v4l2MbusFmtName(mbus_code));
+	return 0;
+}
+
 int deviceStreamQueryFormats(DeviceStream *st, int mbus_code) {
+	arrayResize(&st->formats);
+
+	char key[SNAPSHOT_KEY_SIZE + 24];
+	snprintf(key, sizeof(key), "%s:fmt:%x:%x", st->snapshot_key, st->type, mbus_code);
+	if (0 == formatsFromSnapshot(st, key, mbus_code))
+		return 0;
+
 	LOGI("Enumerating formats for type=%s(%x) mbus_code=%s(%x)",
 		v4l2BufTypeName(st->type), st->type,
 		v4l2MbusFmtName(mbus_code), mbus_code);
 
-	arrayResize(&st->formats);
-
 	for (int i = 0;; ++i) {
 		struct v4l2_fmtdesc fmt;
 		fmt.index = i;
@@ -607,46 +788,33 @@ int deviceStreamQueryFormats(DeviceStream *st, int mbus_code) {
 		if (0 != ioctl(st->dev_fd, VIDIOC_ENUM_FMT, &fmt)) {
 			if (EINVAL == errno) {
 				LOGI("Enumerated %d formats", i);
-				return 0;
+				break;
 			}
 
 			if (ENOTTY == errno) {
 				LOGI("DeviceStream has no formats");
-				return 0;
+				break;
 			}
 
 			LOGE("Failed to ioctl(%d, VIDIOC_ENUM_FMT): %d, %s", st->dev_fd, errno, strerror(errno));
 			return errno;
 		}
 
-#define V4L2_DUMP_FORMATS
-#ifdef V4L2_DUMP_FORMATS
 		//v4l2PrintFormatDesc(&fmt);
 		LOGI("  fmt[%d] = {%s, %s}", i, v4l2PixFmtName(fmt.pixelformat), fmt.description);
-		v4l2PrintFormatFlags(fmt.flags);
-#endif
-
-		// Enumerate possible sizes
-		for (int i = 0;; ++i) {
-			struct v4l2_frmsizeenum fse = { .index = i, .pixel_format = fmt.pixelformat };
-			if (0 != ioctl(st->dev_fd, VIDIOC_ENUM_FRAMESIZES, &fse)) {
-				if (EINVAL == errno) {
-					LOGI("  Format has %d framesizes", i);
-					break;
-				}
-			}
 
+		// Sizes are picked by setting the format and reading back what the driver took, enumerating them is
+		// only for the log
 #ifdef V4L2_DUMP_FORMATS
-			v4l2PrintFrmSizeEnum(&fse);
+		formatDumpSizes(st, &fmt);
 #endif
 
-			// Only discrete supports index > 0
-			if (fse.type != V4L2_FRMSIZE_TYPE_DISCRETE)
-				break;
-		}
-
 		arrayAppend(&st->formats, &fmt);
 	}
+
+	if (st->snapshot_key[0])
+		snapshotPut(key, st->formats.data, sizeof(struct v4l2_fmtdesc) * arraySize(&st->formats));
+	return 0;
 }
 
 int deviceStreamPrepare(DeviceStream *st, const DeviceStreamPrepareOpts *opts) {
@@ -655,20 +823,21 @@ int deviceStreamPrepare(DeviceStream *st, const DeviceStreamPrepareOpts *opts) {
 		return -EBUSY;
 	}
 
-	if (0 != streamSetFormat(st, opts->pixelformat, opts->width, opts->height)) {
+	if (0 != streamSetFormat(st, opts->pixelformat, opts->width, opts->height, opts->bytesperline)) {
 		return -1;
 	}
 
+	// Adjusted rectangles are logged, crop and compose keep what the driver has set
 	st->crop = (struct v4l2_rect){
 		.left = 0,
 		.top = 0,
 		.width = opts->width,
 		.height = opts->height,
 	};
-	setCrop(st, opts->crop_width, opts->crop_height);
+	setCrop(st, &opts->crop);
 
 	st->compose = st->crop;
-	setCompose(st, opts->crop_width, opts->crop_height);
+	setCompose(st, opts->crop.width, opts->crop.height);
 
 	st->buffer_memory = opts->buffer_memory;
 	st->buffers_count = opts->buffers_count;
@@ -681,6 +850,41 @@ int deviceStreamPrepare(DeviceStream *st, const DeviceStreamPrepareOpts *opts) {
 	return 0;
 }
 
+int deviceStreamRelease(DeviceStream *st) {
+	if (st->state == STREAM_STATE_STREAMING) {
+		LOGE("%s: stream=%p(fd=%d) is streaming", __func__, (void*)st, st->dev_fd);
+		return -EBUSY;
+	}
+
+	if (!st->buffers)
+		return 0;
+
+	for (int i = 0; i < st->buffers_count; ++i) {
+		if (st->buffer_memory == BUFFER_MEMORY_MMAP)
+			bufferMunmap(st->buffers + i);
+		else if (st->buffer_memory == BUFFER_MEMORY_DMABUF_EXPORT)
+			bufferDmabufRelease(st, st->buffers + i);
+	}
+
+	free(st->buffers);
+	st->buffers = NULL;
+
+	struct v4l2_requestbuffers req = {
+		.type = st->type,
+		.count = 0,
+		.memory = st->buffer_memory == BUFFER_MEMORY_DMABUF_IMPORT ? V4L2_MEMORY_DMABUF
+			: st->buffer_memory == BUFFER_MEMORY_USERPTR ? V4L2_MEMORY_USERPTR : V4L2_MEMORY_MMAP,
+	};
+	st->state = STREAM_STATE_IDLE;
+	if (0 != ioctl(st->dev_fd, VIDIOC_REQBUFS, &req)) {
+		const int err = errno;
+		LOGE("Failed to ioctl(%d, VIDIOC_REQBUFS, 0): %d, %s", st->dev_fd, err, strerror(err));
+		return -err;
+	}
+
+	return 0;
+}
+
 int deviceStreamStart(DeviceStream *st) {
 	LOGI("%s: stream=%p(fd=%d)", __func__, (void*)st, st->dev_fd);
 	switch (st->state) {
@@ -751,6 +955,7 @@ const Buffer *deviceStreamPullBuffer(DeviceStream *st) {
 
 	if (0 != ioctl(st->dev_fd, VIDIOC_DQBUF, &buf)) {
 		if (errno != EAGAIN /* FIXME: */ && errno != EPIPE) {
+			if (st->metrics) METRICS_INC(st->metrics->errors);
 			LOGE("Failed to ioctl(%d, VIDIOC_DQBUF): %d, %s",
 				st->dev_fd, errno, strerror(errno));
 			LOGE("Buffer was:");
@@ -772,7 +977,26 @@ const Buffer *deviceStreamPullBuffer(DeviceStream *st) {
 		}
 	}
 
-	//LOGI("%s: %d %p:", __func__, ret->buffer.index, (void*)ret);
+	uint32_t bytesused = buf.bytesused;
+	if (IS_STREAM_MPLANE(st)) {
+		bytesused = 0;
+		for (int i = 0; i < (int)ret->buffer.length; ++i)
+			bytesused += planes[i].bytesused;
+	}
+	TRACEV(TRACE_EV_DQBUF, st->dev_fd, st->type, buf.index, buf.sequence, bytesused);
+	PROBE(dqbuf, st->dev_fd, st->type, buf.index, buf.sequence, bytesused);
+
+	MetricsStream *const metrics = st->metrics;
+	if (metrics) {
+		// Sequence restarts from 0 on streamon, backwards jumps are not drops
+		const uint32_t gap = buf.sequence - (uint32_t)metrics->last_sequence - 1;
+		if (metrics->dequeued && gap > 0 && gap < 0x80000000u)
+			METRICS_ADD(metrics->dropped, gap);
+		METRICS_SET(metrics->last_sequence, buf.sequence);
+		METRICS_INC(metrics->dequeued);
+		METRICS_ADD(metrics->bytes, bytesused);
+	}
+
 	return ret;
 }
 
@@ -782,14 +1006,19 @@ int deviceStreamPushBuffer(DeviceStream *st, const Buffer *buf) {
 		return -EIO;
 	}
 
-	//LOGI("%s: %d %p:", __func__, buf->buffer.index, (void*)buf);
+	const uint32_t bytesused = IS_STREAM_MPLANE(st) ? buf->buffer.m.planes[0].bytesused : buf->buffer.bytesused;
+	TRACEV(TRACE_EV_QBUF, st->dev_fd, st->type, buf->buffer.index, bytesused);
+	PROBE(qbuf, st->dev_fd, st->type, buf->buffer.index, bytesused);
 	if (0 != ioctl(st->dev_fd, VIDIOC_QBUF, &buf->buffer)) {
+		const int err = errno;
 		LOGE("Failed to ioctl(%d, VIDIOC_QBUF): %d, %s",
-			st->dev_fd, errno, strerror(errno));
+			st->dev_fd, err, strerror(err));
 		LOGE("Buffer was:");
 		v4l2PrintBuffer(&buf->buffer);
-		return errno;
+		if (st->metrics) METRICS_INC(st->metrics->errors);
+		return -err;
 	}
 
+	if (st->metrics) METRICS_INC(st->metrics->queued);
 	return 0;
 }
@@ -6,11 +6,19 @@
 #include <linux/videodev2.h>
 #include <stdint.h> // uint32_t et al.
 
+struct MetricsStream;
+
 typedef struct Buffer {
 	struct v4l2_buffer buffer;
 	struct v4l2_plane planes[VIDEO_MAX_PLANES];
 	void *mapped[VIDEO_MAX_PLANES];
+	// Lengths mapped, buffer.length and plane lengths are overwritten by pass functions
+	uint32_t mapped_size[VIDEO_MAX_PLANES];
 	int dmabuf_fd[VIDEO_MAX_PLANES];
+
+	// Exported planes mapped read only, for as long as the buffer exists. See bufferReadBegin()
+	const uint8_t *read_mapped[VIDEO_MAX_PLANES];
+	uint32_t read_size[VIDEO_MAX_PLANES];
 } Buffer;
 
 typedef enum {
@@ -40,10 +48,16 @@ typedef struct DeviceStream {
 
 	Array /*T(struct v4l2_fmtdesc)*/ formats;
 
+	// Of the device, formats are cached under it. See snapshot.h
+	char snapshot_key[SNAPSHOT_KEY_SIZE];
+
 	buffer_memory_e buffer_memory;
 	int buffers_count;
 
 	struct Buffer *buffers;
+
+	// Optional, set by the owner. See metrics.h
+	struct MetricsStream *metrics;
 } DeviceStream;
 
 #define IS_TYPE_MPLANE(type) \
@@ -88,15 +102,34 @@ typedef struct {
 	uint32_t pixelformat;
 	uint32_t width, height;
 
-	uint32_t crop_width, crop_height;
+	// Bytes per line of the first plane, 0 for the driver's choice
+	uint32_t bytesperline;
+
+	// Zero size for no crop
+	struct v4l2_rect crop;
 } DeviceStreamPrepareOpts;
 
 // @mbus_code is optional, set to 0 if not known
 int deviceStreamQueryFormats(DeviceStream *st, int mbus_code);
 
 int deviceStreamPrepare(DeviceStream *st, const DeviceStreamPrepareOpts *opts);
+// Changes crop rectangle, also while streaming. Compose is left as is, so the device scales the crop to it.
+// st->crop is updated to the rectangle that driver has adjusted.
+// Returns 0 on success, -errno on failure
+int deviceStreamSetCrop(DeviceStream *st, const struct v4l2_rect *rect);
+
+// Frees buffers, so that the stream can be prepared again with a different format. Stream must not be streaming
+// Returns 0 on success, -errno on failure
+int deviceStreamRelease(DeviceStream *st);
+
 int deviceStreamStart(DeviceStream *st);
 int deviceStreamStop(DeviceStream *st);
 
 const Buffer *deviceStreamPullBuffer(DeviceStream *st);
+// Returns 0 on success, -errno on failure
 int deviceStreamPushBuffer(DeviceStream *st, const Buffer *buf);
+
+// CPU reads of an exported buffer plane go between these two, so that caches agree with what the device wrote.
+// Returns the plane mapping, or NULL if the plane could not be mapped on export
+const uint8_t *bufferReadBegin(const Buffer *buf, int plane);
+void bufferReadEnd(const Buffer *buf, int plane);
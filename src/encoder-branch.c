@@ -0,0 +1,188 @@
+#include "encoder-branch.h"
+
+#include "Node.h"
+#include "pump.h"
+#include "metrics.h"
+#include "probes.h"
+#include "common.h"
+
+#include <stdlib.h>
+
+enum {
+	// Not used by the branch
+	LENT_NONE = 0,
+
+	// Encoder reads it, the pool still has it too
+	LENT_SHARED,
+
+	// Encoder reads it, the pool is done with it
+	LENT_RETURNED,
+};
+
+typedef struct EncoderBranch {
+	EncoderBranchArgs args;
+
+	buffer_pass_func *pass_in;
+
+	// Map of encoder input buffer index to source buffer index, -1 if free
+	int *acquired_to_source;
+	Queue available;
+
+	// LENT_* per source buffer
+	uint8_t *lent;
+
+	struct MetricsPump *metrics;
+} EncoderBranch;
+
+struct EncoderBranch *encoderBranchCreate(EncoderBranchArgs args) {
+	EncoderBranch *const branch = calloc(1, sizeof(EncoderBranch));
+	if (!branch)
+		return NULL;
+
+	branch->args = args;
+
+	DeviceStream *const input = args.encoder->input;
+	branch->pass_in = pumpBufferPassFunc(args.src, input);
+	if (!branch->pass_in) {
+		LOGE("%s: unable to pass buffers to %s", __func__, args.encoder->name);
+		goto fail;
+	}
+
+	branch->acquired_to_source = malloc(sizeof(int) * input->buffers_count);
+	branch->lent = calloc(args.src->buffers_count, sizeof(uint8_t));
+	if (!branch->acquired_to_source || !branch->lent)
+		goto fail;
+
+	queueInit(&branch->available, sizeof(int), input->buffers_count);
+	for (int i = 0; i < input->buffers_count; ++i) {
+		branch->acquired_to_source[i] = -1;
+		queuePush(&branch->available, &i);
+	}
+
+	return branch;
+
+fail:
+	encoderBranchDestroy(branch);
+	return NULL;
+}
+
+void encoderBranchDestroy(EncoderBranch *branch) {
+	if (!branch)
+		return;
+
+	queueFinalize(&branch->available);
+	free(branch->lent);
+	free(branch->acquired_to_source);
+	free(branch);
+}
+
+void encoderBranchSetMetrics(EncoderBranch *branch, struct MetricsPump *metrics) {
+	branch->metrics = metrics;
+}
+
+void encoderBranchOffer(EncoderBranch *branch, const Buffer *buf) {
+	const int index = buf->buffer.index;
+	if (queueGetSize(&branch->available) <= 0 || branch->lent[index] != LENT_NONE) {
+		if (branch->metrics) METRICS_INC(branch->metrics->skipped);
+		return;
+	}
+
+	DeviceStream *const input = branch->args.encoder->input;
+	const int enc_index = *(const int*)queuePeek(&branch->available);
+	Buffer *const dbuf = input->buffers + enc_index;
+	PROBE(pass_begin, branch->args.src->dev_fd, index, input->dev_fd, enc_index);
+	int result = branch->pass_in(buf, dbuf, STREAM_PLANES_COUNT(branch->args.src));
+	PROBE(pass_end, branch->args.src->dev_fd, index, input->dev_fd, enc_index, result);
+	if (result == 0)
+		result = deviceStreamPushBuffer(input, dbuf);
+	if (result != 0) {
+		LOGE("Unable to pass source to %s", branch->args.encoder->name);
+		if (branch->metrics) METRICS_INC(branch->metrics->errors);
+		return;
+	}
+
+	queuePop(&branch->available);
+	branch->acquired_to_source[enc_index] = index;
+	branch->lent[index] = LENT_SHARED;
+	if (branch->metrics) METRICS_INC(branch->metrics->passed);
+}
+
+static int passOn(EncoderBranch *branch, int index) {
+	DeviceStream *const src = branch->args.src;
+	if (branch->args.next_keep && branch->args.next_keep(branch->args.next_keep_arg, src, index))
+		return 0;
+
+	const int result = deviceStreamPushBuffer(src, src->buffers + index);
+	if (result != 0)
+		LOGE("Unable to return source buffer[%d] back", index);
+	return result;
+}
+
+int encoderBranchKeep(EncoderBranch *branch, DeviceStream *st, int index) {
+	if (st == branch->args.src && branch->lent[index] == LENT_SHARED) {
+		branch->lent[index] = LENT_RETURNED;
+		return 1;
+	}
+
+	return branch->args.next_keep && branch->args.next_keep(branch->args.next_keep_arg, st, index);
+}
+
+static int encoderBranchPumpImpl(EncoderBranch *branch) {
+	Node *const enc = branch->args.encoder;
+
+	// 1. Source buffers the encoder has consumed
+	for (;;) {
+		const Buffer *const buf = deviceStreamPullBuffer(enc->input);
+		if (!buf)
+			break;
+
+		const int enc_index = buf->buffer.index;
+		const int source_index = branch->acquired_to_source[enc_index];
+		ASSERT(source_index >= 0);
+		branch->acquired_to_source[enc_index] = -1;
+		queuePush(&branch->available, &enc_index);
+
+		const int returned = branch->lent[source_index] == LENT_RETURNED;
+		branch->lent[source_index] = LENT_NONE;
+		if (returned) {
+			const int result = passOn(branch, source_index);
+			if (result != 0)
+				return result;
+		}
+	}
+
+	// 2. Encoded frames, all of them
+	for (;;) {
+		const Buffer *const buf = deviceStreamPullBuffer(enc->output);
+		if (!buf)
+			break;
+
+		if (buf->buffer.flags & V4L2_BUF_FLAG_ERROR) {
+			LOGE("%s: frame failed to encode", enc->name);
+			if (branch->metrics) METRICS_INC(branch->metrics->errors);
+		} else if (branch->args.tap) {
+			branch->args.tap(branch->args.tap_arg, enc->output, buf);
+		}
+
+		const int result = deviceStreamPushBuffer(enc->output, buf);
+		if (result != 0) {
+			LOGE("Unable to return %s buffer[%d] back", enc->name, buf->buffer.index);
+			return result;
+		}
+	}
+
+	return 0;
+}
+
+int encoderBranchPump(EncoderBranch *branch) {
+	const int result = encoderBranchPumpImpl(branch);
+
+	struct MetricsPump *const metrics = branch->metrics;
+	if (metrics) {
+		if (result != 0)
+			METRICS_INC(metrics->errors);
+		METRICS_SET(metrics->dst_available, queueGetSize(&branch->available));
+	}
+
+	return result;
+}
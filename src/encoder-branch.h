@@ -0,0 +1,45 @@
+#pragma once
+
+#include "device.h"
+#include "encoder-pool.h"
+#include "queue.h"
+
+struct Node;
+struct MetricsPump;
+
+// Second encoder fed from the same source frames as an encoder pool, e.g. H.264 for the network next to MJPEG
+// for UVC. Source frames are lent to it from the pool's source tap and given back through the pool's keep hook,
+// so the source stream isn't pumped twice. The pool comes first: a frame that arrives while the encoder has
+// no free input buffer is skipped by the branch only.
+
+typedef struct {
+	// Source stream of the pool, buffers exported as dmabuf
+	DeviceStream *src;
+	struct Node *encoder;
+
+	// Source buffers the branch is done with go there after the pool gave them back, to be queued back to src
+	// if it returns 0. Optional
+	encoder_pool_keep_func *next_keep;
+	void *next_keep_arg;
+
+	// Sees every encoded frame, buf is queued back to the encoder right after
+	encoder_pool_tap_func *tap;
+	void *tap_arg;
+} EncoderBranchArgs;
+
+// Streams are expected to be prepared. Returns NULL on failure
+struct EncoderBranch *encoderBranchCreate(EncoderBranchArgs args);
+void encoderBranchDestroy(struct EncoderBranch *branch);
+
+// Optional, passed: frames submitted to the encoder, skipped: frames the encoder had no room for
+void encoderBranchSetMetrics(struct EncoderBranch *branch, struct MetricsPump *metrics);
+
+// Source tap of the pool: submits buf to the encoder if it has a free input buffer
+void encoderBranchOffer(struct EncoderBranch *branch, const Buffer *buf);
+
+// Keep hook of the pool, see encoder_pool_keep_func. Passes buffers the branch doesn't use on to next_keep
+int encoderBranchKeep(struct EncoderBranch *branch, DeviceStream *st, int index);
+
+// Returns consumed source buffers and passes encoded frames to the tap
+// Returns 0 on success, <0 on error
+int encoderBranchPump(struct EncoderBranch *branch);
@@ -0,0 +1,396 @@
+#include "encoder-pool.h"
+
+#include "Node.h"
+#include "trace.h"
+#include "metrics.h"
+#include "probes.h"
+#include "common.h"
+
+#include <stdlib.h>
+#include <errno.h>
+
+static void encoderFinalize(EncoderPoolEncoder *enc) {
+	queueFinalize(&enc->pending);
+	queueFinalize(&enc->available);
+	free(enc->acquired_to_source);
+}
+
+void encoderPoolDestroy(EncoderPool *pool) {
+	if (!pool)
+		return;
+
+	for (int i = 0; i < pool->encoders_count; ++i)
+		encoderFinalize(pool->encoders + i);
+
+	queueFinalize(&pool->available);
+	free(pool->acquired_to_frame);
+	free(pool);
+}
+
+EncoderPool *encoderPoolCreate(EncoderPoolArgs args) {
+	EncoderPool *const pool = calloc(1, sizeof(EncoderPool));
+	if (!pool)
+		return NULL;
+
+	pool->src = args.src;
+	pool->next_in_queue = -1;
+	pool->dst = args.dst;
+	pool->tap = args.tap;
+	pool->tap_arg = args.tap_arg;
+	pool->source_tap = args.source_tap;
+	pool->source_tap_arg = args.source_tap_arg;
+	pool->filter = args.filter;
+	pool->filter_arg = args.filter_arg;
+	pool->keep = args.keep;
+	pool->keep_arg = args.keep_arg;
+
+	for (int i = 0; i < ENCODER_POOL_MAX && args.encoders[i]; ++i) {
+		Node *const node = args.encoders[i];
+		EncoderPoolEncoder *const enc = pool->encoders + pool->encoders_count;
+
+		enc->pass_in = pumpBufferPassFunc(pool->src, node->input);
+		buffer_pass_func *const pass_out = pumpBufferPassFunc(node->output, pool->dst);
+		if (!enc->pass_in || !pass_out) {
+			LOGE("%s: unable to pass buffers through %s", __func__, node->name);
+			goto fail;
+		}
+
+		// All encoders must hand over the same way
+		if (pool->pass_out && pool->pass_out != pass_out) {
+			LOGE("%s: %s output differs from other encoders", __func__, node->name);
+			goto fail;
+		}
+		pool->pass_out = pass_out;
+
+		enc->node = node;
+		enc->acquired_to_source = malloc(sizeof(int) * node->input->buffers_count);
+		queueInit(&enc->available, sizeof(int), node->input->buffers_count);
+		queueInit(&enc->pending, sizeof(uint32_t), node->input->buffers_count + node->output->buffers_count);
+		pool->encoders_count++;
+
+		for (int j = 0; j < node->input->buffers_count; ++j) {
+			enc->acquired_to_source[j] = -1;
+			queuePush(&enc->available, &j);
+		}
+	}
+
+	if (!pool->encoders_count) {
+		LOGE("%s: no encoders", __func__);
+		goto fail;
+	}
+
+	pool->acquired_to_frame = malloc(sizeof(EncoderPoolFrame) * pool->dst->buffers_count);
+	queueInit(&pool->available, sizeof(int), pool->dst->buffers_count);
+	for (int i = 0; i < pool->dst->buffers_count; ++i) {
+		pool->acquired_to_frame[i] = (EncoderPoolFrame){.encoder = -1};
+		queuePush(&pool->available, &i);
+	}
+
+	LOGI("%s: %d encoders", __func__, pool->encoders_count);
+	return pool;
+
+fail:
+	encoderPoolDestroy(pool);
+	return NULL;
+}
+
+static int returnSource(EncoderPool *pool, int index) {
+	if (pool->keep && pool->keep(pool->keep_arg, pool->src, index))
+		return 0;
+
+	const int result = deviceStreamPushBuffer(pool->src, pool->src->buffers + index);
+	if (result != 0)
+		LOGE("Unable to return source buffer[%d] back", index);
+	return result;
+}
+
+// Round-robin, but an encoder that is still busy with all its buffers is passed over
+static EncoderPoolEncoder *nextFreeEncoder(EncoderPool *pool) {
+	for (int i = 0; i < pool->encoders_count; ++i) {
+		const int e = (pool->next_encoder + i) % pool->encoders_count;
+		if (queueGetSize(&pool->encoders[e].available) > 0) {
+			pool->next_encoder = (e + 1) % pool->encoders_count;
+			return pool->encoders + e;
+		}
+	}
+
+	return NULL;
+}
+
+static int encoderPoolPumpInputImpl(EncoderPool *pool) {
+	// 1. Return source buffers that encoders have consumed
+	for (int i = 0; i < pool->encoders_count; ++i) {
+		EncoderPoolEncoder *const enc = pool->encoders + i;
+		for (;;) {
+			const Buffer *const buf = deviceStreamPullBuffer(enc->node->input);
+			if (!buf)
+				break;
+
+			const int enc_index = buf->buffer.index;
+			const int source_index = enc->acquired_to_source[enc_index];
+			ASSERT(source_index >= 0);
+			enc->acquired_to_source[enc_index] = -1;
+			queuePush(&enc->available, &enc_index);
+
+			const int result = returnSource(pool, source_index);
+			if (result != 0)
+				return result;
+		}
+	}
+
+	// 2. Keep only the newest source frame
+	for (;;) {
+		const Buffer *const buf = deviceStreamPullBuffer(pool->src);
+		if (!buf)
+			break;
+
+		if (pool->source_tap)
+			pool->source_tap(pool->source_tap_arg, pool->src, buf);
+
+		if (pool->next_in_queue >= 0) {
+			TRACEI(TRACE_EV_PUMP_SKIP, pool->src->dev_fd, pool->src->type, pool->next_in_queue, buf->buffer.index);
+			if (pool->metrics_in) METRICS_INC(pool->metrics_in->skipped);
+			const int result = returnSource(pool, pool->next_in_queue);
+			if (result != 0)
+				return result;
+		}
+
+		pool->next_in_queue = buf->buffer.index;
+	}
+
+	// 3. Submit it to the next encoder
+	if (pool->next_in_queue < 0)
+		return 0;
+
+	EncoderPoolEncoder *const enc = nextFreeEncoder(pool);
+	if (!enc)
+		return 0;
+
+	const Buffer *const sbuf = pool->src->buffers + pool->next_in_queue;
+	if (pool->filter && !pool->filter(pool->filter_arg, pool->src, sbuf)) {
+		if (pool->metrics_in) METRICS_INC(pool->metrics_in->filtered);
+		const int result = returnSource(pool, pool->next_in_queue);
+		pool->next_in_queue = -1;
+		return result;
+	}
+
+	const int enc_index = *(const int*)queuePeek(&enc->available);
+	Buffer *const dbuf = enc->node->input->buffers + enc_index;
+	PROBE(pass_begin, pool->src->dev_fd, sbuf->buffer.index, enc->node->input->dev_fd, enc_index);
+	int result = enc->pass_in(sbuf, dbuf, STREAM_PLANES_COUNT(pool->src));
+	PROBE(pass_end, pool->src->dev_fd, sbuf->buffer.index, enc->node->input->dev_fd, enc_index, result);
+	if (result != 0) {
+		// Rejected source buffer goes back, the next one might be fine
+		LOGE("Unable to pass source to %s buffer", enc->node->name);
+		returnSource(pool, pool->next_in_queue);
+		pool->next_in_queue = -1;
+		return result;
+	}
+
+	result = deviceStreamPushBuffer(enc->node->input, dbuf);
+	if (result != 0) {
+		LOGE("Unable to pass buffer to %s", enc->node->name);
+		return result;
+	}
+
+	queuePop(&enc->available);
+	enc->acquired_to_source[enc_index] = pool->next_in_queue;
+	pool->next_in_queue = -1;
+
+	const uint32_t seq = pool->next_seq++;
+	ASSERT(queueGetFree(&enc->pending) > 0);
+	queuePush(&enc->pending, &seq);
+
+	if (pool->metrics_in) METRICS_INC(pool->metrics_in->passed);
+	return 0;
+}
+
+int encoderPoolPumpInput(EncoderPool *pool) {
+	const int result = encoderPoolPumpInputImpl(pool);
+
+	MetricsPump *const metrics = pool->metrics_in;
+	if (metrics) {
+		if (result != 0)
+			METRICS_INC(metrics->errors);
+
+		int available = 0;
+		for (int i = 0; i < pool->encoders_count; ++i)
+			available += queueGetSize(&pool->encoders[i].available);
+		METRICS_SET(metrics->dst_available, available);
+	}
+
+	return result;
+}
+
+static int returnEncoded(EncoderPool *pool, const EncoderPoolFrame *frame) {
+	DeviceStream *const st = pool->encoders[frame->encoder].node->output;
+	if (pool->keep && pool->keep(pool->keep_arg, st, frame->index))
+		return 0;
+
+	const int result = deviceStreamPushBuffer(st, st->buffers + frame->index);
+	if (result != 0)
+		LOGE("Unable to return %s buffer[%d] back", pool->encoders[frame->encoder].node->name, frame->index);
+	return result;
+}
+
+static void tapFrame(EncoderPool *pool, const EncoderPoolFrame *frame) {
+	if (!pool->tap)
+		return;
+
+	DeviceStream *const st = pool->encoders[frame->encoder].node->output;
+	pool->tap(pool->tap_arg, st, st->buffers + frame->index);
+}
+
+static EncoderPoolFrame *findReady(EncoderPool *pool, uint32_t seq) {
+	for (int i = 0; i < pool->ready_count; ++i)
+		if (pool->ready[i].seq == seq)
+			return pool->ready + i;
+	return NULL;
+}
+
+static void removeReady(EncoderPool *pool, EncoderPoolFrame *frame) {
+	*frame = pool->ready[--pool->ready_count];
+}
+
+// Frames that failed to encode never show up, move past them to the oldest frame still around
+static void skipLostFrames(EncoderPool *pool) {
+	uint32_t oldest = pool->next_seq;
+	for (int i = 0; i < pool->ready_count; ++i)
+		if ((int32_t)(pool->ready[i].seq - oldest) < 0)
+			oldest = pool->ready[i].seq;
+
+	for (int i = 0; i < pool->encoders_count; ++i) {
+		const uint32_t *const head = queuePeek(&pool->encoders[i].pending);
+		if (head && (int32_t)(*head - oldest) < 0)
+			oldest = *head;
+	}
+
+	if ((int32_t)(oldest - pool->next_out_seq) > 0)
+		pool->next_out_seq = oldest;
+}
+
+static int encoderPoolPumpOutputImpl(EncoderPool *pool) {
+	// 1. Return encoded buffers that destination is done with
+	for (;;) {
+		const Buffer *const buf = deviceStreamPullBuffer(pool->dst);
+		if (!buf)
+			break;
+
+		const int dst_index = buf->buffer.index;
+		const EncoderPoolFrame frame = pool->acquired_to_frame[dst_index];
+		ASSERT(frame.encoder >= 0);
+		pool->acquired_to_frame[dst_index].encoder = -1;
+		queuePush(&pool->available, &dst_index);
+
+		const int result = returnEncoded(pool, &frame);
+		if (result != 0)
+			return result;
+	}
+
+	// 2. Collect encoded frames, encoders finish them in submission order
+	for (int i = 0; i < pool->encoders_count; ++i) {
+		EncoderPoolEncoder *const enc = pool->encoders + i;
+		for (;;) {
+			const Buffer *const buf = deviceStreamPullBuffer(enc->node->output);
+			if (!buf)
+				break;
+
+			const uint32_t *const seq = queuePop(&enc->pending);
+			ASSERT(seq);
+			const EncoderPoolFrame frame = {
+				.encoder = i,
+				.index = buf->buffer.index,
+				.seq = *seq,
+			};
+
+			if (buf->buffer.flags & V4L2_BUF_FLAG_ERROR) {
+				LOGE("%s: frame %u failed to encode", enc->node->name, frame.seq);
+				if (pool->metrics_out) METRICS_INC(pool->metrics_out->errors);
+				const int result = returnEncoded(pool, &frame);
+				if (result != 0)
+					return result;
+				continue;
+			}
+
+			ASSERT(pool->ready_count < ENCODER_POOL_FRAMES_MAX);
+			pool->ready[pool->ready_count++] = frame;
+		}
+	}
+
+	skipLostFrames(pool);
+
+	// 3. Keep only the newest in-order frame
+	EncoderPoolFrame *next = findReady(pool, pool->next_out_seq);
+	if (!next)
+		return 0;
+
+	for (;;) {
+		EncoderPoolFrame *const newer = findReady(pool, next->seq + 1);
+		if (!newer)
+			break;
+
+		TRACEI(TRACE_EV_PUMP_SKIP, pool->dst->dev_fd, pool->dst->type, next->index, newer->index);
+		if (pool->metrics_out) METRICS_INC(pool->metrics_out->skipped);
+		const EncoderPoolFrame skipped = *next;
+		tapFrame(pool, &skipped);
+		pool->next_out_seq = newer->seq;
+		removeReady(pool, next);
+		const int result = returnEncoded(pool, &skipped);
+		if (result != 0)
+			return result;
+
+		// removeReady() moves the last frame, which might have been the newer one
+		next = findReady(pool, pool->next_out_seq);
+	}
+
+	// 4. Pass it to destination
+	if (queueGetSize(&pool->available) <= 0)
+		return 0;
+
+	const EncoderPoolFrame frame = *next;
+	const Buffer *const sbuf = pool->encoders[frame.encoder].node->output->buffers + frame.index;
+	const int dst_index = *(const int*)queuePeek(&pool->available);
+	Buffer *const dbuf = pool->dst->buffers + dst_index;
+	const DeviceStream *const enc_out = pool->encoders[frame.encoder].node->output;
+	PROBE(pass_begin, enc_out->dev_fd, sbuf->buffer.index, pool->dst->dev_fd, dst_index);
+	int result = pool->pass_out(sbuf, dbuf, STREAM_PLANES_COUNT(enc_out));
+	PROBE(pass_end, enc_out->dev_fd, sbuf->buffer.index, pool->dst->dev_fd, dst_index, result);
+	if (result != 0) {
+		// Rejected frame goes back to its encoder, the next one might be fine
+		LOGE("Unable to pass encoded to destination buffer");
+		removeReady(pool, next);
+		pool->next_out_seq = frame.seq + 1;
+		returnEncoded(pool, &frame);
+		return result;
+	}
+
+	result = deviceStreamPushBuffer(pool->dst, dbuf);
+	if (result != 0) {
+		LOGE("Unable to pass buffer to dst");
+		return result;
+	}
+
+	tapFrame(pool, &frame);
+
+	queuePop(&pool->available);
+	ASSERT(pool->acquired_to_frame[dst_index].encoder == -1);
+	pool->acquired_to_frame[dst_index] = frame;
+	removeReady(pool, next);
+	pool->next_out_seq = frame.seq + 1;
+
+	if (pool->metrics_out) METRICS_INC(pool->metrics_out->passed);
+	return 0;
+}
+
+int encoderPoolPumpOutput(EncoderPool *pool) {
+	const int result = encoderPoolPumpOutputImpl(pool);
+
+	MetricsPump *const metrics = pool->metrics_out;
+	if (metrics) {
+		if (result != 0)
+			METRICS_INC(metrics->errors);
+		METRICS_SET(metrics->dst_available, queueGetSize(&pool->available));
+	}
+
+	return result;
+}
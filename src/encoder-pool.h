@@ -0,0 +1,134 @@
+#pragma once
+
+#include "device.h"
+#include "queue.h"
+#include "pump.h"
+
+#include <stdint.h>
+
+struct Node;
+struct MetricsPump;
+
+// Spreads source frames across several hardware encoders round-robin and passes their output on in source order,
+// so that the frame rate is bound by the sum of encoder throughputs instead of a single one.
+// Replaces the source->encoder and encoder->destination pumps. Like a pump, a newer source frame
+// supersedes one that is still waiting for a free encoder, and a newer encoded frame supersedes one
+// still waiting for the destination.
+
+#define ENCODER_POOL_MAX 2
+
+// Encoded frames waiting for their turn: at most every capture buffer of every encoder
+#define ENCODER_POOL_FRAMES_MAX (ENCODER_POOL_MAX * VIDEO_MAX_FRAME)
+
+// Sees every encoded frame in order, including those superseded before reaching destination.
+// buf belongs to st, an encoder output stream, and is only valid for the duration of the call, unless kept, see below.
+// Also used for source frames as they arrive, before any of them is submitted or superseded
+typedef void (encoder_pool_tap_func)(void *arg, DeviceStream *st, const Buffer *buf);
+
+// Sees the source frame about to be submitted to a free encoder. Returns 0 to drop it instead.
+// buf belongs to st, the source stream
+typedef int (encoder_pool_filter_func)(void *arg, const DeviceStream *st, const Buffer *buf);
+
+// Called instead of queueing a source or encoded buffer back to st once the pool is done with it.
+// Returns 1 if the callee still uses it and queues it back itself later, 0 to have it queued back now
+typedef int (encoder_pool_keep_func)(void *arg, DeviceStream *st, int index);
+
+typedef struct {
+	// Encoded frame
+	int encoder;
+	int index;
+
+	// Order of submission to encoders
+	uint32_t seq;
+} EncoderPoolFrame;
+
+typedef struct EncoderPoolEncoder {
+	struct Node *node;
+
+	buffer_pass_func *pass_in;
+
+	// Map of encoder input buffer index to source buffer index, -1 if free
+	int *acquired_to_source;
+	Queue available;
+
+	// Sequence numbers of submitted frames not yet encoded, in submission order
+	Queue pending;
+} EncoderPoolEncoder;
+
+typedef struct EncoderPool {
+	DeviceStream *src;
+	int next_in_queue;
+
+	EncoderPoolEncoder encoders[ENCODER_POOL_MAX];
+	int encoders_count;
+
+	// Encoder that gets the next frame if it has a free buffer
+	int next_encoder;
+	uint32_t next_seq;
+
+	EncoderPoolFrame ready[ENCODER_POOL_FRAMES_MAX];
+	int ready_count;
+
+	// Sequence number of the next frame to pass to destination
+	uint32_t next_out_seq;
+
+	DeviceStream *dst;
+	buffer_pass_func *pass_out;
+
+	// Map of dst buffer index to encoded frame held by it, encoder -1 if free
+	EncoderPoolFrame *acquired_to_frame;
+	Queue available;
+
+	encoder_pool_tap_func *tap;
+	void *tap_arg;
+
+	encoder_pool_tap_func *source_tap;
+	void *source_tap_arg;
+
+	encoder_pool_filter_func *filter;
+	void *filter_arg;
+
+	encoder_pool_keep_func *keep;
+	void *keep_arg;
+
+	// Optional, set by the owner. See metrics.h
+	struct MetricsPump *metrics_in;
+	struct MetricsPump *metrics_out;
+} EncoderPool;
+
+typedef struct {
+	DeviceStream *src;
+
+	// Unused trailing entries are NULL
+	struct Node *encoders[ENCODER_POOL_MAX];
+
+	DeviceStream *dst;
+
+	// Optional
+	encoder_pool_tap_func *tap;
+	void *tap_arg;
+
+	// Optional
+	encoder_pool_tap_func *source_tap;
+	void *source_tap_arg;
+
+	// Optional
+	encoder_pool_filter_func *filter;
+	void *filter_arg;
+
+	// Optional
+	encoder_pool_keep_func *keep;
+	void *keep_arg;
+} EncoderPoolArgs;
+
+// Streams are expected to be prepared. Returns NULL on failure
+EncoderPool *encoderPoolCreate(EncoderPoolArgs args);
+void encoderPoolDestroy(EncoderPool *pool);
+
+// Returns source buffers that encoders are done with and submits the newest source frame
+// Returns 0 on success, <0 on error
+int encoderPoolPumpInput(EncoderPool *pool);
+
+// Collects encoded frames and passes them to destination in submission order
+// Returns 0 on success, <0 on error
+int encoderPoolPumpOutput(EncoderPool *pool);
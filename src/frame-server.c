@@ -0,0 +1,469 @@
+#define _GNU_SOURCE // accept4
+
+#include "frame-server.h"
+
+#include "pollinator.h"
+#include "metrics.h"
+#include "common.h"
+
+#include <sys/socket.h>
+#include <sys/un.h> // sockaddr_un
+#include <stdlib.h> // calloc, free
+#include <string.h> // memcpy, strerror
+#include <unistd.h> // close, unlink
+#include <errno.h>
+
+// Every stream lends out a few buffers at most, see FRAME_SERVER_RESERVED_BUFFERS
+#define FRAME_SERVER_MAX_HOLDS 32
+
+// Subscription bits are per camera and source
+#define FRAME_SERVER_MAX_CAMERAS (32 / FRAME_SOURCE_COUNT)
+
+typedef struct {
+	// -1 if free
+	int fd;
+	PollinatorHandle h;
+
+	// Bit (camera * FRAME_SOURCE_COUNT + source) for every subscription
+	uint32_t subscriptions;
+
+	uint64_t sent;
+	uint64_t skipped;
+} FrameServerClient;
+
+// Buffer sent to clients, not queued back to its stream until all of them released it
+typedef struct {
+	// NULL if free
+	DeviceStream *st;
+	int index;
+
+	uint64_t id;
+	FrameSource source;
+	int camera;
+
+	// Bit per client that hasn't released it yet
+	uint32_t clients;
+
+	// Owner is done with it, it's ours to queue back
+	int returned;
+
+	uint64_t sent_us;
+} FrameServerHold;
+
+typedef struct FrameServer {
+	struct Pollinator *pol;
+
+	int fd;
+	PollinatorHandle h;
+	char path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+
+	FrameServerClient clients[FRAME_SERVER_MAX_CLIENTS];
+	FrameServerHold holds[FRAME_SERVER_MAX_HOLDS];
+
+	uint64_t next_id;
+
+	struct MetricsPump *metrics;
+} FrameServer;
+
+static void updateMetrics(FrameServer *fs) {
+	if (!fs->metrics)
+		return;
+
+	int available = 0;
+	for (int i = 0; i < FRAME_SERVER_MAX_HOLDS; ++i)
+		if (!fs->holds[i].st)
+			available++;
+	METRICS_SET(fs->metrics->dst_available, available);
+}
+
+// Last client is done with it. Queued back if the owner is too, otherwise the owner does it
+static void releaseHold(FrameServer *fs, FrameServerHold *hold, uint32_t client_bit) {
+	hold->clients &= ~client_bit;
+	if (hold->clients)
+		return;
+
+	if (hold->returned) {
+		const int result = deviceStreamPushBuffer(hold->st, hold->st->buffers + hold->index);
+		if (result != 0) {
+			LOGE("%s: unable to return buffer[%d] back: %d", __func__, hold->index, result);
+			if (fs->metrics) METRICS_INC(fs->metrics->errors);
+		}
+	}
+
+	*hold = (FrameServerHold){0};
+}
+
+static void disconnectClient(FrameServer *fs, int client) {
+	FrameServerClient *const c = fs->clients + client;
+	LOGI("Frame client %d disconnected, %llu frames sent, %llu skipped", client,
+		(unsigned long long)c->sent, (unsigned long long)c->skipped);
+
+	for (int i = 0; i < FRAME_SERVER_MAX_HOLDS; ++i)
+		if (fs->holds[i].clients & (1u << client))
+			releaseHold(fs, fs->holds + i, 1u << client);
+
+	pollinatorRelease(fs->pol, c->h);
+	close(c->fd);
+	*c = (FrameServerClient){.fd = -1};
+	updateMetrics(fs);
+}
+
+static void handleMessage(FrameServer *fs, int client, const FrameServerMsg *msg) {
+	FrameServerClient *const c = fs->clients + client;
+	switch (msg->type) {
+		case FRAME_MSG_SUBSCRIBE:
+			if (msg->source >= FRAME_SOURCE_COUNT || msg->camera >= FRAME_SERVER_MAX_CAMERAS) {
+				LOGE("Frame client %d: invalid subscription source=%u camera=%u", client, msg->source, msg->camera);
+				break;
+			}
+			c->subscriptions |= 1u << (msg->camera * FRAME_SOURCE_COUNT + msg->source);
+			LOGI("Frame client %d subscribed to camera %u %s", client, msg->camera,
+				msg->source == FRAME_SOURCE_ISP ? "ISP output" : "encoded");
+			break;
+
+		case FRAME_MSG_RELEASE:
+			// Stale ids of stopped streams are fine
+			for (int i = 0; i < FRAME_SERVER_MAX_HOLDS; ++i) {
+				FrameServerHold *const hold = fs->holds + i;
+				if (hold->st && hold->id == msg->id && hold->clients & (1u << client)) {
+					releaseHold(fs, hold, 1u << client);
+					updateMetrics(fs);
+					break;
+				}
+			}
+			break;
+
+		default:
+			LOGE("Frame client %d: unknown message type %u", client, msg->type);
+	}
+}
+
+static int clientEvent(int fd, uint32_t flags, uintptr_t arg1, uintptr_t arg2) {
+	FrameServer *const fs = (FrameServer*)arg1;
+	const int client = (int)arg2;
+
+	for (;;) {
+		FrameServerMsg msg;
+		const ssize_t length = recv(fd, &msg, sizeof(msg), MSG_DONTWAIT);
+		if (length < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			// Reset when it goes away with frames unread
+			if (errno != ECONNRESET)
+				LOGE("Frame client %d: recv() failed: %d, %s", client, errno, strerror(errno));
+			disconnectClient(fs, client);
+			return POLLINATOR_CONTINUE;
+		}
+
+		// Orderly shutdown
+		if (length == 0) {
+			disconnectClient(fs, client);
+			return POLLINATOR_CONTINUE;
+		}
+
+		if (length != sizeof(msg)) {
+			LOGE("Frame client %d: unexpected %d byte message", client, (int)length);
+			continue;
+		}
+
+		handleMessage(fs, client, &msg);
+	}
+
+	if (flags & POLLIN_FD_ERR)
+		disconnectClient(fs, client);
+
+	return POLLINATOR_CONTINUE;
+}
+
+static int acceptClients(int fd, uint32_t flags, uintptr_t arg1, uintptr_t arg2) {
+	UNUSED(flags);
+	UNUSED(arg2);
+	FrameServer *const fs = (FrameServer*)arg1;
+
+	for (;;) {
+		const int client_fd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (client_fd < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				LOGE("%s: accept() failed: %d, %s", __func__, errno, strerror(errno));
+			break;
+		}
+
+		int client = -1;
+		for (int i = 0; i < FRAME_SERVER_MAX_CLIENTS && client < 0; ++i)
+			if (fs->clients[i].fd < 0)
+				client = i;
+
+		if (client < 0) {
+			LOGE("%s: too many frame clients", __func__);
+			close(client_fd);
+			continue;
+		}
+
+		FrameServerClient *const c = fs->clients + client;
+		c->h = pollinatorMonitorFd(fs->pol, &(PollinatorMonitorFd){
+			.fd = client_fd,
+			.event_bits = POLLIN_FD_READ,
+			.func = clientEvent,
+			.arg1 = (uintptr_t)fs,
+			.arg2 = client,
+		});
+		if (c->h == POLLINATOR_HANDLE_NONE) {
+			LOGE("%s: unable to monitor frame client", __func__);
+			close(client_fd);
+			continue;
+		}
+
+		c->fd = client_fd;
+		LOGI("Frame client %d connected", client);
+	}
+
+	// Keep listening
+	return POLLINATOR_CONTINUE;
+}
+
+struct FrameServer *frameServerOpen(const char *path, struct Pollinator *pol) {
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		LOGE("%s: socket path %s is too long", __func__, path);
+		return NULL;
+	}
+	strcpy(addr.sun_path, path);
+
+	FrameServer *const fs = calloc(1, sizeof(FrameServer));
+	if (!fs)
+		return NULL;
+
+	fs->pol = pol;
+	for (int i = 0; i < FRAME_SERVER_MAX_CLIENTS; ++i)
+		fs->clients[i].fd = -1;
+
+	// Message boundaries, and fds stay attached to the message they were sent with
+	fs->fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fs->fd < 0) {
+		LOGE("%s: socket() failed: %d, %s", __func__, errno, strerror(errno));
+		goto fail;
+	}
+
+	// Stale socket from a previous run
+	unlink(path);
+
+	if (0 != bind(fs->fd, (const struct sockaddr*)&addr, sizeof(addr)) || 0 != listen(fs->fd, FRAME_SERVER_MAX_CLIENTS)) {
+		LOGE("%s: unable to listen on %s: %d, %s", __func__, path, errno, strerror(errno));
+		goto fail;
+	}
+	strcpy(fs->path, path);
+
+	fs->h = pollinatorMonitorFd(pol, &(PollinatorMonitorFd){
+		.fd = fs->fd,
+		.event_bits = POLLIN_FD_READ,
+		.func = acceptClients,
+		.arg1 = (uintptr_t)fs,
+	});
+	if (fs->h == POLLINATOR_HANDLE_NONE)
+		goto fail;
+
+	LOGI("Serving frames on %s", path);
+	return fs;
+
+fail:
+	frameServerClose(fs);
+	return NULL;
+}
+
+void frameServerClose(FrameServer *fs) {
+	if (!fs)
+		return;
+
+	for (int i = 0; i < FRAME_SERVER_MAX_CLIENTS; ++i)
+		if (fs->clients[i].fd >= 0)
+			disconnectClient(fs, i);
+
+	pollinatorRelease(fs->pol, fs->h);
+	if (fs->fd >= 0)
+		close(fs->fd);
+	if (fs->path[0])
+		unlink(fs->path);
+	free(fs);
+}
+
+void frameServerSetMetrics(FrameServer *fs, struct MetricsPump *metrics) {
+	fs->metrics = metrics;
+	updateMetrics(fs);
+}
+
+static void frameMessage(const DeviceStream *st, const Buffer *buf, FrameServerMsg *msg) {
+	const uint64_t timestamp_us = buf->buffer.timestamp.tv_sec * 1000000ull + buf->buffer.timestamp.tv_usec;
+	msg->timestamp_us = timestamp_us;
+	msg->sequence = buf->buffer.sequence;
+
+	if (IS_STREAM_MPLANE(st)) {
+		msg->pixelformat = st->format.fmt.pix_mp.pixelformat;
+		msg->width = st->format.fmt.pix_mp.width;
+		msg->height = st->format.fmt.pix_mp.height;
+		msg->bytesperline = st->format.fmt.pix_mp.plane_fmt[0].bytesperline;
+		msg->offset = buf->buffer.m.planes[0].data_offset;
+		msg->bytesused = buf->buffer.m.planes[0].bytesused;
+		msg->length = buf->buffer.m.planes[0].length;
+	} else {
+		msg->pixelformat = st->format.fmt.pix.pixelformat;
+		msg->width = st->format.fmt.pix.width;
+		msg->height = st->format.fmt.pix.height;
+		msg->bytesperline = st->format.fmt.pix.bytesperline;
+		msg->offset = 0;
+		msg->bytesused = buf->buffer.bytesused;
+		msg->length = buf->buffer.length;
+	}
+}
+
+// Returns 0 on success, -errno on failure
+static int sendFrame(int fd, const FrameServerMsg *msg, int dmabuf_fd) {
+	struct iovec iov = {.iov_base = (void*)msg, .iov_len = sizeof(*msg)};
+	union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} control;
+
+	struct msghdr hdr = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buf,
+		.msg_controllen = sizeof(control.buf),
+	};
+
+	struct cmsghdr *const cmsg = CMSG_FIRSTHDR(&hdr);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &dmabuf_fd, sizeof(int));
+
+	if (sendmsg(fd, &hdr, MSG_NOSIGNAL | MSG_DONTWAIT) < 0)
+		return -errno;
+	return 0;
+}
+
+// Stuck clients would keep buffers from the pipeline for good
+static void dropStuckClients(FrameServer *fs, uint64_t now_us) {
+	for (int i = 0; i < FRAME_SERVER_MAX_HOLDS; ++i) {
+		const FrameServerHold *const hold = fs->holds + i;
+		if (!hold->st || now_us - hold->sent_us < FRAME_SERVER_HOLD_TIMEOUT_MS * 1000ull)
+			continue;
+
+		for (int j = 0; j < FRAME_SERVER_MAX_CLIENTS; ++j) {
+			if (hold->clients & (1u << j)) {
+				LOGE("Frame client %d held frame %llu for too long", j, (unsigned long long)hold->id);
+				disconnectClient(fs, j);
+			}
+		}
+	}
+}
+
+static FrameServerHold *freeHold(FrameServer *fs, const DeviceStream *st) {
+	FrameServerHold *free_hold = NULL;
+	int lent = 0;
+	for (int i = 0; i < FRAME_SERVER_MAX_HOLDS; ++i) {
+		if (fs->holds[i].st == st)
+			lent++;
+		else if (!fs->holds[i].st && !free_hold)
+			free_hold = fs->holds + i;
+	}
+
+	return lent < st->buffers_count - FRAME_SERVER_RESERVED_BUFFERS ? free_hold : NULL;
+}
+
+void frameServerPublish(FrameServer *fs, FrameSource source, int camera, DeviceStream *st, const Buffer *buf) {
+	if (camera >= FRAME_SERVER_MAX_CAMERAS)
+		return;
+
+	const uint64_t now_us = monotonicUs();
+	dropStuckClients(fs, now_us);
+
+	const uint32_t subscription = 1u << (camera * FRAME_SOURCE_COUNT + source);
+	uint32_t subscribers = 0;
+	for (int i = 0; i < FRAME_SERVER_MAX_CLIENTS; ++i)
+		if (fs->clients[i].fd >= 0 && fs->clients[i].subscriptions & subscription)
+			subscribers |= 1u << i;
+	if (!subscribers)
+		return;
+
+	// Clients still busy with the previous frame of this subscription
+	uint32_t busy = 0;
+	for (int i = 0; i < FRAME_SERVER_MAX_HOLDS; ++i)
+		if (fs->holds[i].st && fs->holds[i].source == source && fs->holds[i].camera == camera)
+			busy |= fs->holds[i].clients;
+
+	FrameServerHold *const hold = (subscribers & ~busy) ? freeHold(fs, st) : NULL;
+
+	FrameServerMsg msg = {
+		.type = FRAME_MSG_FRAME,
+		.source = source,
+		.camera = camera,
+		.id = ++fs->next_id,
+	};
+	frameMessage(st, buf, &msg);
+
+	uint32_t holders = 0;
+	for (int i = 0; i < FRAME_SERVER_MAX_CLIENTS; ++i) {
+		if (!(subscribers & (1u << i)))
+			continue;
+
+		FrameServerClient *const c = fs->clients + i;
+		if (!hold || busy & (1u << i)) {
+			c->skipped++;
+			if (fs->metrics) METRICS_INC(fs->metrics->skipped);
+			continue;
+		}
+
+		const int result = sendFrame(c->fd, &msg, buf->dmabuf_fd[0]);
+		if (result == -EAGAIN || result == -EWOULDBLOCK || result == -ENOBUFS) {
+			c->skipped++;
+			if (fs->metrics) METRICS_INC(fs->metrics->skipped);
+			continue;
+		}
+
+		if (result != 0) {
+			LOGE("Frame client %d: sendmsg() failed: %d, %s", i, -result, strerror(-result));
+			if (fs->metrics) METRICS_INC(fs->metrics->errors);
+			disconnectClient(fs, i);
+			continue;
+		}
+
+		c->sent++;
+		if (fs->metrics) METRICS_INC(fs->metrics->passed);
+		holders |= 1u << i;
+	}
+
+	if (holders) {
+		*hold = (FrameServerHold){
+			.st = st,
+			.index = buf->buffer.index,
+			.id = msg.id,
+			.source = source,
+			.camera = camera,
+			.clients = holders,
+			.sent_us = now_us,
+		};
+	}
+
+	updateMetrics(fs);
+}
+
+int frameServerKeep(FrameServer *fs, DeviceStream *st, int index) {
+	for (int i = 0; i < FRAME_SERVER_MAX_HOLDS; ++i) {
+		FrameServerHold *const hold = fs->holds + i;
+		if (hold->st == st && hold->index == index) {
+			hold->returned = 1;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+void frameServerForget(FrameServer *fs, DeviceStream *st) {
+	for (int i = 0; i < FRAME_SERVER_MAX_HOLDS; ++i)
+		if (fs->holds[i].st == st)
+			fs->holds[i] = (FrameServerHold){0};
+	updateMetrics(fs);
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include "device.h"
+
+#include <stdint.h>
+
+struct Pollinator;
+struct MetricsPump;
+struct FrameServer;
+
+// Frames for other processes on the device, without them opening the camera. ISP output and encoded frames
+// are passed as the pipeline's own dmabuf fds over a SOCK_SEQPACKET unix socket (SCM_RIGHTS), so the only
+// copy a consumer makes is the one it chooses to.
+//
+// Protocol, one FrameServerMsg per packet:
+//   client: FRAME_MSG_SUBSCRIBE {source, camera}, any number of them
+//   server: FRAME_MSG_FRAME {...} with the dmabuf fd attached, for every subscribed frame it got
+//   client: FRAME_MSG_RELEASE {id} once done reading the frame. Received fd is the client's to close
+//
+// The pipeline comes first. A frame is not queued back to its device until every client has released it,
+// so a client holds at most one frame per subscription and a stream lends out at most all but
+// FRAME_SERVER_RESERVED_BUFFERS of its buffers. Frames that don't fit, or don't fit the client's socket
+// buffer, are skipped for that client. Clients holding a frame for longer than FRAME_SERVER_HOLD_TIMEOUT_MS
+// are disconnected.
+
+#define FRAME_SERVER_DEFAULT_SOCKET_PATH "/run/malincam.frames.sock"
+
+#define FRAME_SERVER_MAX_CLIENTS 8
+#define FRAME_SERVER_RESERVED_BUFFERS 2
+#define FRAME_SERVER_HOLD_TIMEOUT_MS 1000
+
+typedef enum {
+	// NV12/YUV420 as the encoders get it
+	FRAME_SOURCE_ISP = 0,
+
+	// MJPEG/H264 as the gadget gets it, including frames superseded before reaching it
+	FRAME_SOURCE_ENCODED,
+
+	FRAME_SOURCE_COUNT,
+} FrameSource;
+
+enum {
+	FRAME_MSG_SUBSCRIBE = 1,
+	FRAME_MSG_FRAME,
+	FRAME_MSG_RELEASE,
+};
+
+typedef struct {
+	uint32_t type;
+
+	// FRAME_MSG_SUBSCRIBE, FRAME_MSG_FRAME
+	uint32_t source;
+	uint32_t camera;
+
+	uint32_t reserved;
+
+	// FRAME_MSG_FRAME, FRAME_MSG_RELEASE
+	uint64_t id;
+
+	// FRAME_MSG_FRAME: buffer timestamp, and format of the attached dmabuf
+	uint64_t timestamp_us;
+	uint32_t sequence;
+	uint32_t pixelformat;
+	uint32_t width, height;
+	uint32_t bytesperline;
+
+	// Frame data is at offset, bytesused long, in a dmabuf of length bytes
+	uint32_t offset;
+	uint32_t bytesused;
+	uint32_t length;
+} FrameServerMsg;
+
+// Returns NULL on failure
+struct FrameServer *frameServerOpen(const char *path, struct Pollinator *pol);
+
+// Streams are expected to be forgotten already
+void frameServerClose(struct FrameServer *fs);
+
+void frameServerSetMetrics(struct FrameServer *fs, struct MetricsPump *metrics);
+
+// Sends buf to the clients subscribed to it. buf is a filled capture buffer of st, exported as dmabuf
+void frameServerPublish(struct FrameServer *fs, FrameSource source, int camera, DeviceStream *st, const Buffer *buf);
+
+// Called instead of queueing buffer index back to st. Returns 1 if clients still hold it, in which case
+// it is queued back once they release it, 0 if the caller should queue it back now
+int frameServerKeep(struct FrameServer *fs, DeviceStream *st, int index);
+
+// Drops holds of st without queueing them back, before st is stopped
+void frameServerForget(struct FrameServer *fs, DeviceStream *st);
@@ -0,0 +1,106 @@
+#include "geometry.h"
+
+#include "common.h"
+
+#include <errno.h>
+
+static uint32_t gcd(uint32_t a, uint32_t b) {
+	while (b) {
+		const uint32_t t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+static uint32_t lcm(uint32_t a, uint32_t b) {
+	a = a ? a : 1;
+	b = b ? b : 1;
+	return a / gcd(a, b) * b;
+}
+
+static uint32_t alignDown(uint32_t value, uint32_t align) {
+	return value / align * align;
+}
+
+static uint32_t alignUp(uint32_t value, uint32_t align) {
+	return (value + align - 1) / align * align;
+}
+
+int geometrySolve(const GeometryRequest *req, Geometry *out) {
+	const uint32_t sw = req->sensor_width, sh = req->sensor_height;
+	if (!sw || !sh || req->stages_count > GEOMETRY_MAX_STAGES) {
+		LOGE("%s: invalid request for %ux%u sensor", __func__, sw, sh);
+		return -EINVAL;
+	}
+
+	// Chroma planes are half size each way, in every stage
+	uint32_t width_align = 2, height_align = 2, stride_align = 2;
+	for (int i = 0; i < req->stages_count; ++i) {
+		width_align = lcm(width_align, req->stages[i].width);
+		height_align = lcm(height_align, req->stages[i].height);
+		stride_align = lcm(stride_align, req->stages[i].stride);
+	}
+	const uint32_t crop_align = req->crop_align ? req->crop_align : 1;
+
+	uint64_t w = req->width ? req->width : sw;
+	uint64_t h = req->height ? req->height : sh;
+
+	// Downscale only, keeping the aspect
+	if (w > sw || h > sh) {
+		if (w * sh > h * sw) {
+			h = h * sw / w;
+			w = sw;
+		} else {
+			w = w * sh / h;
+			h = sh;
+		}
+	}
+
+	w = alignDown(w, width_align);
+	h = alignDown(h, height_align);
+	if (!w || !h) {
+		LOGE("%s: %ux%u doesn't fit %ux%u aligned to %ux%u", __func__,
+			req->width, req->height, sw, sh, width_align, height_align);
+		return -EINVAL;
+	}
+
+	// Largest crop of the output aspect, so that the ISP scales both ways by the same factor
+	uint32_t cw, ch;
+	if ((uint64_t)sw * h > (uint64_t)sh * w) {
+		ch = sh;
+		cw = sh * w / h;
+	} else {
+		cw = sw;
+		ch = sw * h / w;
+	}
+	cw = alignDown(cw, crop_align);
+	ch = alignDown(ch, crop_align);
+
+	// Rounding may leave the crop a few pixels short, which would be a tiny upscale
+	if (w > cw)
+		w = alignDown(cw, width_align);
+	if (h > ch)
+		h = alignDown(ch, height_align);
+	if (!w || !h) {
+		LOGE("%s: no aligned output within %ux%u crop", __func__, cw, ch);
+		return -EINVAL;
+	}
+
+	*out = (Geometry){
+		.crop = {
+			.left = alignDown((sw - cw) / 2, crop_align),
+			.top = alignDown((sh - ch) / 2, crop_align),
+			.width = cw,
+			.height = ch,
+		},
+		.width = w,
+		.height = h,
+		.stride = alignUp(w, stride_align),
+	};
+	out->sizeimage = out->stride * out->height * 3 / 2;
+
+	LOGI("%s: %ux%u sensor, crop (%d,%d) + (%ux%u), output %ux%u stride %u", __func__,
+		sw, sh, out->crop.left, out->crop.top, cw, ch, out->width, out->height, out->stride);
+	return 0;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <linux/videodev2.h> // v4l2_rect
+#include <stdint.h>
+
+// Frame geometry along sensor -> ISP -> encoders, solved once so that every stage takes the previous one's
+// buffers as they are: ISP input crop is centered on the sensor frame with the output aspect, ISP output is
+// the size and line stride the encoders accept, so no stage rounds the format on its own and nothing gets
+// scaled twice.
+
+// Alignment rules of one stage for a YUV420 frame, 0 or 1 for none
+typedef struct {
+	// Frame size
+	uint32_t width, height;
+
+	// Bytes per line of the luma plane, chroma strides follow from it
+	uint32_t stride;
+} GeometryAlign;
+
+#define GEOMETRY_MAX_STAGES 4
+
+typedef struct {
+	// Camera frame the ISP crops from
+	uint32_t sensor_width, sensor_height;
+
+	// Crop position and size alignment on the camera frame, 2 keeps the bayer pattern phase
+	uint32_t crop_align;
+
+	// Output size wanted, 0 for the sensor size. Never scaled up past the sensor
+	uint32_t width, height;
+
+	// ISP output and everything it feeds
+	GeometryAlign stages[GEOMETRY_MAX_STAGES];
+	int stages_count;
+} GeometryRequest;
+
+typedef struct {
+	// On the camera frame
+	struct v4l2_rect crop;
+
+	// ISP output and encoders input
+	uint32_t width, height;
+	uint32_t stride;
+	uint32_t sizeimage;
+} Geometry;
+
+// Output size is rounded down to the alignment of all stages, the crop is the largest one of the same aspect.
+// Returns 0 on success, -EINVAL if the request can't be satisfied
+int geometrySolve(const GeometryRequest *req, Geometry *out);
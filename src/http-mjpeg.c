@@ -0,0 +1,572 @@
+#define _GNU_SOURCE // accept4
+
+#include "http-mjpeg.h"
+
+#include "pollinator.h"
+#include "queue.h"
+#include "metrics.h"
+#include "common.h"
+
+#include <linux/errqueue.h> // sock_extended_err
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <stdio.h> // snprintf
+#include <stdlib.h> // calloc, free, strtoul
+#include <string.h> // memcpy, strerror, strstr
+#include <unistd.h> // close
+#include <errno.h>
+
+// Older libc headers
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+
+#define HTTP_MJPEG_BOUNDARY "malincamframe"
+#define HTTP_MJPEG_REQUEST_MAX 1024
+
+// Zerocopy sends of a client waiting for completion. A frame takes a few sends at most
+#define HTTP_MJPEG_PENDING_MAX 64
+
+static const char http_response[] =
+	"HTTP/1.0 200 OK\r\n"
+	"Content-Type: multipart/x-mixed-replace; boundary=" HTTP_MJPEG_BOUNDARY "\r\n"
+	"Cache-Control: no-cache, no-store\r\n"
+	"Pragma: no-cache\r\n"
+	"Connection: close\r\n"
+	"\r\n";
+
+static const char http_not_found[] =
+	"HTTP/1.0 404 Not Found\r\n"
+	"Connection: close\r\n"
+	"\r\n";
+
+static const char http_part_end[] = "\r\n";
+
+typedef struct {
+	// Part header, JPEG and http_part_end are sent as one
+	char header[128];
+	uint32_t header_size;
+
+	uint8_t *data;
+	uint32_t size;
+	uint32_t capacity;
+
+	uint64_t id;
+
+	// Clients sending it or waiting for their zerocopy sends of it to complete, plus one while newest of its camera
+	int refs;
+} HttpMjpegSlot;
+
+typedef struct {
+	// -1 if free
+	int fd;
+	PollinatorHandle h;
+	uint32_t event_bits;
+
+	// Until the request is read
+	char request[HTTP_MJPEG_REQUEST_MAX];
+	int request_size;
+
+	int streaming;
+	int camera;
+
+	// Slot being sent and bytes of it sent so far, -1 if none
+	int slot;
+	uint32_t offset;
+
+	// Last frame started, newer ones are sent next
+	uint64_t last_id;
+
+	int zerocopy;
+
+	// Slot of every zerocopy send not completed yet, in order
+	Queue pending;
+
+	uint64_t frames;
+	uint64_t bytes;
+} HttpMjpegClient;
+
+typedef struct HttpMjpeg {
+	struct Pollinator *pol;
+
+	int fd;
+	PollinatorHandle h;
+
+	HttpMjpegClient clients[HTTP_MJPEG_MAX_CLIENTS];
+	HttpMjpegSlot slots[HTTP_MJPEG_SLOTS];
+
+	// Newest frame slot per camera, -1 if none
+	int latest[HTTP_MJPEG_MAX_CAMERAS];
+	uint64_t next_id;
+
+	struct MetricsPump *metrics;
+} HttpMjpeg;
+
+static void updateMetrics(HttpMjpeg *http) {
+	if (!http->metrics)
+		return;
+
+	int available = 0;
+	for (int i = 0; i < HTTP_MJPEG_SLOTS; ++i)
+		if (!http->slots[i].refs)
+			available++;
+	METRICS_SET(http->metrics->dst_available, available);
+}
+
+static void slotUnref(HttpMjpeg *http, int slot) {
+	ASSERT(http->slots[slot].refs > 0);
+	http->slots[slot].refs--;
+}
+
+static void disconnectClient(HttpMjpeg *http, int client) {
+	HttpMjpegClient *const c = http->clients + client;
+	if (c->streaming)
+		LOGI("HTTP client %d disconnected, %llu frames, %llu bytes sent", client,
+			(unsigned long long)c->frames, (unsigned long long)c->bytes);
+
+	if (c->slot >= 0)
+		slotUnref(http, c->slot);
+
+	// Pages stay pinned by the kernel for as long as it needs them, the frame in them may change from here on
+	for (;;) {
+		const int *const slot = queuePop(&c->pending);
+		if (!slot)
+			break;
+		slotUnref(http, *slot);
+	}
+	queueFinalize(&c->pending);
+
+	pollinatorRelease(http->pol, c->h);
+	close(c->fd);
+	*c = (HttpMjpegClient){.fd = -1, .slot = -1};
+	updateMetrics(http);
+}
+
+static void clientSetEvents(HttpMjpeg *http, HttpMjpegClient *c, uint32_t event_bits) {
+	if (c->event_bits == event_bits)
+		return;
+
+	pollinatorSetEvents(http->pol, c->h, event_bits);
+	c->event_bits = event_bits;
+}
+
+// Returns 0 on success, -errno if the client is to be disconnected
+static int clientSend(HttpMjpeg *http, HttpMjpegClient *c) {
+	int blocked = 0;
+	for (;;) {
+		if (c->slot < 0) {
+			// Previous frame stays pinned until its zerocopy sends complete, a client holds one slot at most
+			if (queueGetSize(&c->pending) > 0)
+				break;
+
+			const int latest = http->latest[c->camera];
+			if (latest < 0 || http->slots[latest].id == c->last_id)
+				break;
+
+			c->slot = latest;
+			c->offset = 0;
+			c->last_id = http->slots[latest].id;
+			http->slots[latest].refs++;
+		}
+
+		// Wait for completions, they come with POLLERR
+		if (c->zerocopy && queueGetFree(&c->pending) <= 0)
+			break;
+
+		const HttpMjpegSlot *const slot = http->slots + c->slot;
+		struct iovec iov[3] = {
+			{.iov_base = (void*)slot->header, .iov_len = slot->header_size},
+			{.iov_base = slot->data, .iov_len = slot->size},
+			{.iov_base = (void*)http_part_end, .iov_len = sizeof(http_part_end) - 1},
+		};
+
+		// Skip what's been sent already
+		struct msghdr hdr = {.msg_iov = iov, .msg_iovlen = COUNTOF(iov)};
+		uint32_t skip = c->offset;
+		while (hdr.msg_iovlen && skip >= hdr.msg_iov->iov_len) {
+			skip -= hdr.msg_iov->iov_len;
+			hdr.msg_iov++;
+			hdr.msg_iovlen--;
+		}
+		hdr.msg_iov->iov_base = (uint8_t*)hdr.msg_iov->iov_base + skip;
+		hdr.msg_iov->iov_len -= skip;
+
+		const ssize_t sent = sendmsg(c->fd, &hdr, MSG_NOSIGNAL | MSG_DONTWAIT | (c->zerocopy ? MSG_ZEROCOPY : 0));
+		if (sent < 0) {
+			if (errno == EINTR)
+				continue;
+
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				blocked = 1;
+				break;
+			}
+
+			// Pinned memory over the socket's limit, wait for completions or copy if there are none to wait for
+			if (errno == ENOBUFS && c->zerocopy) {
+				if (queueGetSize(&c->pending) > 0)
+					break;
+				c->zerocopy = 0;
+				continue;
+			}
+
+			if (errno != EPIPE && errno != ECONNRESET)
+				LOGE("%s: sendmsg() failed: %d, %s", __func__, errno, strerror(errno));
+			return -errno;
+		}
+
+		if (c->zerocopy) {
+			queuePush(&c->pending, &c->slot);
+			http->slots[c->slot].refs++;
+		}
+
+		c->offset += sent;
+		c->bytes += sent;
+		if (c->offset == slot->header_size + slot->size + sizeof(http_part_end) - 1) {
+			slotUnref(http, c->slot);
+			c->slot = -1;
+			c->frames++;
+		}
+	}
+
+	clientSetEvents(http, c, POLLIN_FD_READ | (blocked ? POLLIN_FD_WRITE : 0));
+	return 0;
+}
+
+// Returns number of zerocopy sends completed
+static int reapCompletions(HttpMjpeg *http, HttpMjpegClient *c) {
+	int completed = 0;
+	for (;;) {
+		char control[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in))];
+		struct msghdr hdr = {.msg_control = control, .msg_controllen = sizeof(control)};
+		if (recvmsg(c->fd, &hdr, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+			break;
+
+		for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr); cmsg; cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+			if (cmsg->cmsg_level != SOL_IP || cmsg->cmsg_type != IP_RECVERR)
+				continue;
+
+			struct sock_extended_err err;
+			memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+			if (err.ee_errno != 0 || err.ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				continue;
+
+			// Range of send calls, completions of a TCP socket come in order
+			const uint32_t count = err.ee_data - err.ee_info + 1;
+			for (uint32_t i = 0; i < count; ++i) {
+				const int *const slot = queuePop(&c->pending);
+				if (!slot)
+					break;
+				slotUnref(http, *slot);
+				completed++;
+			}
+
+			// Kernel had to copy anyway, pinning only costs
+			if (c->zerocopy && err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+				LOGI("HTTP client %d is local, not using zerocopy", (int)(c - http->clients));
+				c->zerocopy = 0;
+			}
+		}
+	}
+
+	return completed;
+}
+
+// Returns 0 while reading, 1 once the whole request is in, -errno on failure
+static int readRequest(HttpMjpegClient *c) {
+	for (;;) {
+		const int space = HTTP_MJPEG_REQUEST_MAX - 1 - c->request_size;
+		if (space <= 0)
+			return -E2BIG;
+
+		const ssize_t length = recv(c->fd, c->request + c->request_size, space, MSG_DONTWAIT);
+		if (length < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			return -errno;
+		}
+
+		if (length == 0)
+			return -ECONNRESET;
+
+		c->request_size += length;
+		c->request[c->request_size] = '\0';
+		if (strstr(c->request, "\r\n\r\n"))
+			return 1;
+	}
+}
+
+// "GET /<camera> HTTP/1.x", returns camera or -1
+static int parseRequest(const char *request) {
+	if (0 != strncmp(request, "GET /", 5))
+		return -1;
+
+	const char *const path = request + 5;
+	if (path[0] == ' ')
+		return 0;
+
+	char *end;
+	const unsigned long camera = strtoul(path, &end, 10);
+	if (end == path || *end != ' ' || camera >= HTTP_MJPEG_MAX_CAMERAS)
+		return -1;
+	return camera;
+}
+
+static int startStreaming(HttpMjpeg *http, int client) {
+	HttpMjpegClient *const c = http->clients + client;
+	const int camera = parseRequest(c->request);
+	if (camera < 0) {
+		send(c->fd, http_not_found, sizeof(http_not_found) - 1, MSG_NOSIGNAL | MSG_DONTWAIT);
+		return -ENOENT;
+	}
+
+	// Fits into an empty socket buffer
+	if ((ssize_t)sizeof(http_response) - 1 != send(c->fd, http_response, sizeof(http_response) - 1, MSG_NOSIGNAL | MSG_DONTWAIT))
+		return -EIO;
+
+	const int one = 1;
+	c->zerocopy = 0 == setsockopt(c->fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one));
+
+	c->camera = camera;
+	c->streaming = 1;
+	LOGI("HTTP client %d streaming camera %d%s", client, camera, c->zerocopy ? ", zerocopy" : "");
+	return clientSend(http, c);
+}
+
+static int clientEvent(int fd, uint32_t flags, uintptr_t arg1, uintptr_t arg2) {
+	HttpMjpeg *const http = (HttpMjpeg*)arg1;
+	const int client = (int)arg2;
+	HttpMjpegClient *const c = http->clients + client;
+
+	int result = 0;
+	if (!c->streaming) {
+		result = readRequest(c);
+		if (result > 0)
+			result = startStreaming(http, client);
+	} else {
+		// Completions are reported as POLLERR, real errors show up on send
+		if (flags & POLLIN_FD_ERR)
+			reapCompletions(http, c);
+
+		// Anything the client sends from here on is ignored, until it closes the connection
+		if (flags & POLLIN_FD_READ) {
+			char discard[256];
+			const ssize_t length = recv(fd, discard, sizeof(discard), MSG_DONTWAIT);
+			if (length == 0)
+				result = -ECONNRESET;
+			else if (length < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				result = -errno;
+		}
+
+		if (result == 0)
+			result = clientSend(http, c);
+	}
+
+	if (result < 0)
+		disconnectClient(http, client);
+
+	updateMetrics(http);
+	return POLLINATOR_CONTINUE;
+}
+
+static int acceptClients(int fd, uint32_t flags, uintptr_t arg1, uintptr_t arg2) {
+	UNUSED(flags);
+	UNUSED(arg2);
+	HttpMjpeg *const http = (HttpMjpeg*)arg1;
+
+	for (;;) {
+		const int client_fd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (client_fd < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				LOGE("%s: accept() failed: %d, %s", __func__, errno, strerror(errno));
+			break;
+		}
+
+		int client = -1;
+		for (int i = 0; i < HTTP_MJPEG_MAX_CLIENTS && client < 0; ++i)
+			if (http->clients[i].fd < 0)
+				client = i;
+
+		if (client < 0) {
+			LOGE("%s: too many HTTP clients", __func__);
+			close(client_fd);
+			continue;
+		}
+
+		HttpMjpegClient *const c = http->clients + client;
+		c->h = pollinatorMonitorFd(http->pol, &(PollinatorMonitorFd){
+			.fd = client_fd,
+			.event_bits = POLLIN_FD_READ,
+			.func = clientEvent,
+			.arg1 = (uintptr_t)http,
+			.arg2 = client,
+		});
+		if (c->h == POLLINATOR_HANDLE_NONE) {
+			LOGE("%s: unable to monitor HTTP client", __func__);
+			close(client_fd);
+			continue;
+		}
+
+		c->fd = client_fd;
+		c->event_bits = POLLIN_FD_READ;
+		queueInit(&c->pending, sizeof(int), HTTP_MJPEG_PENDING_MAX);
+	}
+
+	// Keep listening
+	return POLLINATOR_CONTINUE;
+}
+
+struct HttpMjpeg *httpMjpegOpen(uint16_t port, struct Pollinator *pol) {
+	HttpMjpeg *const http = calloc(1, sizeof(HttpMjpeg));
+	if (!http)
+		return NULL;
+
+	http->pol = pol;
+	for (int i = 0; i < HTTP_MJPEG_MAX_CLIENTS; ++i)
+		http->clients[i] = (HttpMjpegClient){.fd = -1, .slot = -1};
+	for (int i = 0; i < HTTP_MJPEG_MAX_CAMERAS; ++i)
+		http->latest[i] = -1;
+
+	http->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (http->fd < 0) {
+		LOGE("%s: socket() failed: %d, %s", __func__, errno, strerror(errno));
+		goto fail;
+	}
+
+	// Restarts shouldn't wait for connections of the previous run to time out
+	const int one = 1;
+	setsockopt(http->fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	const struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_port = htons(port),
+		.sin_addr.s_addr = htonl(INADDR_ANY),
+	};
+	if (0 != bind(http->fd, (const struct sockaddr*)&addr, sizeof(addr)) || 0 != listen(http->fd, HTTP_MJPEG_MAX_CLIENTS)) {
+		LOGE("%s: unable to listen on port %u: %d, %s", __func__, port, errno, strerror(errno));
+		goto fail;
+	}
+
+	http->h = pollinatorMonitorFd(pol, &(PollinatorMonitorFd){
+		.fd = http->fd,
+		.event_bits = POLLIN_FD_READ,
+		.func = acceptClients,
+		.arg1 = (uintptr_t)http,
+	});
+	if (http->h == POLLINATOR_HANDLE_NONE)
+		goto fail;
+
+	LOGI("Serving MJPEG over HTTP on port %u", port);
+	return http;
+
+fail:
+	httpMjpegClose(http);
+	return NULL;
+}
+
+void httpMjpegClose(HttpMjpeg *http) {
+	if (!http)
+		return;
+
+	for (int i = 0; i < HTTP_MJPEG_MAX_CLIENTS; ++i)
+		if (http->clients[i].fd >= 0)
+			disconnectClient(http, i);
+
+	pollinatorRelease(http->pol, http->h);
+	if (http->fd >= 0)
+		close(http->fd);
+
+	for (int i = 0; i < HTTP_MJPEG_SLOTS; ++i)
+		free(http->slots[i].data);
+	free(http);
+}
+
+void httpMjpegSetMetrics(HttpMjpeg *http, struct MetricsPump *metrics) {
+	http->metrics = metrics;
+	updateMetrics(http);
+}
+
+static int freeSlot(HttpMjpeg *http) {
+	for (int i = 0; i < HTTP_MJPEG_SLOTS; ++i)
+		if (!http->slots[i].refs)
+			return i;
+	return -1;
+}
+
+void httpMjpegPublish(HttpMjpeg *http, int camera, const DeviceStream *st, const Buffer *buf) {
+	if (camera >= HTTP_MJPEG_MAX_CAMERAS)
+		return;
+
+	int watched = 0;
+	for (int i = 0; i < HTTP_MJPEG_MAX_CLIENTS; ++i)
+		if (http->clients[i].streaming && http->clients[i].camera == camera)
+			watched = 1;
+	if (!watched)
+		return;
+
+	const int mp = IS_STREAM_MPLANE(st);
+	const uint32_t pixelformat = mp ? st->format.fmt.pix_mp.pixelformat : st->format.fmt.pix.pixelformat;
+	if (pixelformat != V4L2_PIX_FMT_MJPEG && pixelformat != V4L2_PIX_FMT_JPEG)
+		return;
+
+	const uint32_t offset = mp ? buf->buffer.m.planes[0].data_offset : 0;
+	const uint32_t bytesused = mp ? buf->buffer.m.planes[0].bytesused : buf->buffer.bytesused;
+	if (bytesused <= offset)
+		return;
+
+	const int index = freeSlot(http);
+	if (index < 0) {
+		if (http->metrics) METRICS_INC(http->metrics->skipped);
+		return;
+	}
+
+	HttpMjpegSlot *const slot = http->slots + index;
+	const uint32_t size = bytesused - offset;
+	if (slot->capacity < size) {
+		free(slot->data);
+		slot->capacity = 0;
+		slot->data = malloc(size);
+		if (!slot->data) {
+			if (http->metrics) METRICS_INC(http->metrics->errors);
+			return;
+		}
+		slot->capacity = size;
+	}
+
+	const uint8_t *const data = bufferReadBegin(buf, 0);
+	if (!data) {
+		if (http->metrics) METRICS_INC(http->metrics->errors);
+		return;
+	}
+
+	memcpy(slot->data, data + offset, size);
+	bufferReadEnd(buf, 0);
+
+	slot->size = size;
+	slot->id = ++http->next_id;
+	slot->header_size = snprintf(slot->header, sizeof(slot->header),
+		"--" HTTP_MJPEG_BOUNDARY "\r\nContent-Type: image/jpeg\r\nContent-Length: %u\r\n\r\n", size);
+
+	if (http->latest[camera] >= 0)
+		slotUnref(http, http->latest[camera]);
+	http->latest[camera] = index;
+	slot->refs++;
+
+	if (http->metrics) METRICS_INC(http->metrics->passed);
+
+	// Clients that are done with their previous frame start on this one
+	for (int i = 0; i < HTTP_MJPEG_MAX_CLIENTS; ++i) {
+		HttpMjpegClient *const c = http->clients + i;
+		if (!c->streaming || c->camera != camera || c->slot >= 0)
+			continue;
+
+		if (0 != clientSend(http, c))
+			disconnectClient(http, i);
+	}
+
+	updateMetrics(http);
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include "device.h"
+
+#include <stdint.h>
+
+struct Pollinator;
+struct MetricsPump;
+struct HttpMjpeg;
+
+// Encoded JPEG frames over HTTP as multipart/x-mixed-replace, the MJPEG stream browsers and most players
+// understand, for viewing over Ethernet or USB networking instead of UVC:
+//   curl http://<device>:<port>/0 > stream.mjpeg
+// Path is the camera index, / is camera 0.
+//
+// Like the recorder, each frame is copied once from the mapped encoder buffer, so the encoder buffer goes back
+// to the pipeline right away. Only frames some client waits for are copied. From there it is sent to all
+// clients of the camera with MSG_ZEROCOPY, the frame memory stays pinned until the kernel reports
+// completion. Local peers, e.g. over loopback, always get a copy made by the kernel, zerocopy is turned off for
+// those after the first completion says so.
+//
+// Every client gets the newest frame once it's done with the previous one, including its zerocopy completions,
+// so slow clients get fewer frames without holding up anyone else.
+
+#define HTTP_MJPEG_MAX_CLIENTS 16
+#define HTTP_MJPEG_MAX_CAMERAS 4
+
+// Newest frame of every camera, one frame per client being sent or waiting for its zerocopy completions,
+// and the one being published, so publishing never runs out of slots
+#define HTTP_MJPEG_SLOTS (HTTP_MJPEG_MAX_CAMERAS + HTTP_MJPEG_MAX_CLIENTS + 1)
+
+// Returns NULL on failure
+struct HttpMjpeg *httpMjpegOpen(uint16_t port, struct Pollinator *pol);
+void httpMjpegClose(struct HttpMjpeg *http);
+
+// Optional, passed: frames copied for sending, skipped: frames dropped for lack of a free slot,
+// dst_available: free slots
+void httpMjpegSetMetrics(struct HttpMjpeg *http, struct MetricsPump *metrics);
+
+// Makes buf the newest frame of camera. buf is a dequeued JPEG encoder buffer of st, exported as dmabuf,
+// and can be queued back as soon as this returns
+void httpMjpegPublish(struct HttpMjpeg *http, int camera, const DeviceStream *st, const Buffer *buf);
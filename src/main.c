@@ -2,15 +2,30 @@
 #include "array.h"
 
 #include "common.h"
+#include "control-thread.h"
+#include "encoder-branch.h"
+#include "encoder-pool.h"
+#include "frame-server.h"
+#include "http-mjpeg.h"
 #include "Led.h"
+#include "metrics.h"
 #include "Node.h"
 #include "Pilatform.h"
 #include "pollinator.h"
+#include "ptz.h"
 #include "pump.h"
+#include "raw.h"
+#include "recorder.h"
+#include "rtp.h"
+#include "scene.h"
+#include "snapshot.h"
+#include "still.h"
+#include "trace.h"
 #include "UVC.h"
 
 #include <errno.h>
 #include <string.h> // strerror
+#include <stdlib.h> // getenv
 
 //#define TEST_UVC_ONLY
 #ifdef TEST_UVC_ONLY
@@ -18,14 +33,20 @@
 #include <fcntl.h> // open
 #endif
 
-#include <time.h> // clock_gettime
+#include <time.h> // time, localtime_r
 
 uint64_t g_begin_us = 0;
 
+// MALINCAM_POLLINATOR=uring selects io_uring event loop backend, epoll otherwise
+static PollinatorBackend pollinatorBackendFromEnv(void) {
+	const char *const value = getenv("MALINCAM_POLLINATOR");
+	if (value && 0 == strcmp(value, "uring"))
+		return POLLINATOR_BACKEND_URING;
+	return POLLINATOR_BACKEND_EPOLL;
+}
+
 uint64_t nowUs(void) {
-	struct timespec ts;
-	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
-	return (ts.tv_sec * 1000000ul + ts.tv_nsec / 1000ul) - g_begin_us;
+	return monotonicUs() - g_begin_us;
 }
 
 #ifndef TEST_UVC_ONLY
@@ -94,7 +115,7 @@ static int testUvc(void) {
 
 	//int fd2 = open("/dev/video2", O_RDWR | O_NONBLOCK);
 
-	struct Pollinator *const pol = pollinatorCreate();
+	struct Pollinator *const pol = pollinatorCreate(pollinatorBackendFromEnv());
 
 	uint32_t bits = 0;
 	//pollinatorMonitorFd(&pol, uvc->input->dev_fd, bitSetFunc, (uintptr_t)&bits, 1);
@@ -135,101 +156,655 @@ static int testUvc(void) {
 #define CAM_TO_ISP_BIT (1<<0)
 #define ISP_TO_ENC_BIT (1<<1)
 #define ENC_TO_UVC_BIT (1<<2)
-#define UVC_EVENTS_BIT (1<<3)
-
+#define COMMANDS_BIT (1<<3)
+#define RECORD_BIT (1<<4)
+#define RAW_BIT (1<<5)
+#define H264_BIT (1<<6)
+#define RECORD_FINISH_BIT (1<<7)
+#define STILL_BIT (1<<8)
+
+// One camera streaming to its own UVC function
 typedef struct {
+	int index;
+
 	Node *cam;
+	// NULL in raw mode, as are the encoders
 	Node *isp;
-	Node *enc;
+	// Frames are spread across all of them, see encoder-pool.h
+	Node *enc[ENCODER_POOL_MAX];
+	int enc_count;
 	Node *uvc;
 
-	struct Pollinator *pol;
-
 	Pump *cam_to_isp;
-	Pump *isp_to_enc;
-	Pump *enc_to_uvc;
+	EncoderPool *encode;
+
+	// Camera straight to gadget in raw mode, see raw.h
+	struct RawPump *raw;
+
+	// Encoded frames tapped to disk while streaming, NULL if not recording
+	struct Recorder *recorder;
+
+	// Previous session's recording, finishing its writes in the background. See recorderStop()
+	struct Recorder *recorder_finishing;
+
+	// Drops unchanged frames before encoding, NULL if disabled
+	struct Scene *scene;
+
+	// H.264 of the same ISP frames for the network, NULL if RTP is disabled. See rtp.h
+	Node *h264;
+	struct EncoderBranch *h264_branch;
+	struct RtpSink *rtp;
+
+	// Digital pan/tilt/zoom on ISP input crop, NULL if unavailable
+	Ptz *ptz;
+
+	// Full resolution still encoder, opened on the first still. See still.h
+	Node *still_enc;
+
+	// Still in progress, NULL otherwise. Video streams stay stopped until it's done
+	struct StillCapture *still;
+	uint64_t still_begin_us;
+	uint32_t still_width, still_height;
+	char still_path[256];
+
+	// Video stopped for a still at this time and hasn't reached the gadget again yet, 0 otherwise
+	uint64_t still_gap_begin_us;
+
+	// Registered once, parked while not streaming
+	PollinatorHandle cam_output_h;
+	PollinatorHandle isp_input_h;
+	PollinatorHandle isp_output_h;
+	PollinatorHandle enc_h[ENCODER_POOL_MAX];
+	PollinatorHandle uvc_h;
+	PollinatorHandle record_h;
+	PollinatorHandle record_finish_h;
+	PollinatorHandle h264_h;
+	PollinatorHandle still_enc_h;
+
+	// UVC events and image controls are handled there, see control-thread.h
+	struct ControlThread *control;
 
+	int streaming;
 	uint32_t fd_bits;
 } Pipeline;
 
-static Pipeline g_pipeline = {0};
+// All pipelines share the frame thread and its event loop
+static struct {
+	// Device nodes, UVC keeps pointers to gadget names
+	PiTopology topo;
 
-static int uvcEventStreamon(int streamon);
+	Pipeline pipelines[PI_MAX_CAMERAS];
+	int pipelines_count;
 
-static int pipelineCreate(void) {
-	Pipeline *const p = &g_pipeline;
+	// Pipeline that is served first after the next poll. Rotates, so that with both cameras
+	// producing at once neither gets to queue to the shared ISP and encoder first every time
+	int first;
 
-	Node *const cam = piOpenCamera();
-	if (!cam) {
-		LOGE("Unable to open Rpi camera");
-		return 1;
+	int streaming_count;
+
+	struct Pollinator *pol;
+
+	// Listening socket for metrics scrapes, <0 if disabled
+	int metrics_fd;
+
+	// Frames for local processes, NULL if disabled
+	struct FrameServer *frames;
+
+	// MJPEG over the network, NULL if disabled
+	struct HttpMjpeg *http;
+
+	// H.264 over RTP to this receiver, NULL if disabled. Camera N sends to port + 2N
+	const char *rtp_host;
+	uint16_t rtp_port;
+	int rtp_inline_params;
+
+	// Directory for recordings, NULL if disabled
+	const char *record_dir;
+
+	// Directory for stills, NULL if they are disabled
+	const char *still_dir;
+
+	// Sensor data to the host without ISP and encoders, for all cameras
+	RawMode raw_mode;
+
+	// Static scene frame dropping, max_interval_ms 0 if disabled
+	SceneArgs scene;
+} g_malincam = {0};
+
+// Video mode
+static const PiCameraArgs pipeline_camera_args = {
+	.fps = 30,
+};
+
+static int uvcEventStreamon(void *arg, int streamon);
+static int uvcEventStill(void *arg);
+
+// Metric names get pipeline index only with more than one camera, so a single camera keeps its names
+static void pipelineMetricsName(const Pipeline *p, const char *name, char *out, size_t size) {
+	if (g_malincam.pipelines_count > 1)
+		snprintf(out, size, "%s.%d", name, p->index);
+	else
+		snprintf(out, size, "%s", name);
+}
+
+static void nodeAttachMetrics(const Pipeline *p, Node *node) {
+	char name[METRICS_NAME_SIZE];
+	pipelineMetricsName(p, node->name, name, sizeof(name));
+
+	if (node->input)
+		node->input->metrics = metricsStream(name, "input");
+	if (node->output)
+		node->output->metrics = metricsStream(name, "output");
+}
+
+static Pump *pipelinePumpCreate(const Pipeline *p, DeviceStream *src, DeviceStream *dst, const char *name) {
+	Pump *const pump = pumpCreate(src, dst);
+	if (pump) {
+		char metrics_name[METRICS_NAME_SIZE];
+		pipelineMetricsName(p, name, metrics_name, sizeof(metrics_name));
+		pump->metrics = metricsPump(metrics_name);
 	}
+	return pump;
+}
 
-	Node *const isp = piOpenISP();
-	if (!isp) {
-		LOGE("Unable to open Rpi ISP");
-		return 1;
+static void pipelineEncodedTap(void *arg, DeviceStream *st, const Buffer *buf) {
+	Pipeline *const p = arg;
+	// Full ring only drops the frame from the recording
+	if (p->recorder)
+		recorderWrite(p->recorder, st, buf);
+	if (g_malincam.frames)
+		frameServerPublish(g_malincam.frames, FRAME_SOURCE_ENCODED, p->index, st, buf);
+	if (g_malincam.http)
+		httpMjpegPublish(g_malincam.http, p->index, st, buf);
+}
+
+static void pipelineSourceTap(void *arg, DeviceStream *st, const Buffer *buf) {
+	Pipeline *const p = arg;
+	if (g_malincam.frames)
+		frameServerPublish(g_malincam.frames, FRAME_SOURCE_ISP, p->index, st, buf);
+	if (p->h264_branch)
+		encoderBranchOffer(p->h264_branch, buf);
+}
+
+static int pipelineFramesKeep(void *arg, DeviceStream *st, int index) {
+	UNUSED(arg);
+	return g_malincam.frames && frameServerKeep(g_malincam.frames, st, index);
+}
+
+// Source frames go back through the H.264 branch, then the frame server
+static int pipelineKeep(void *arg, DeviceStream *st, int index) {
+	Pipeline *const p = arg;
+	if (p->h264_branch)
+		return encoderBranchKeep(p->h264_branch, st, index);
+	return pipelineFramesKeep(arg, st, index);
+}
+
+static void pipelineH264Tap(void *arg, DeviceStream *st, const Buffer *buf) {
+	Pipeline *const p = arg;
+	// Packets that don't fit the socket are lost, the next frame doesn't wait
+	if (p->rtp)
+		rtpSinkSend(p->rtp, st, buf);
+}
+
+// Frames held by local clients are not queued back to streams about to stop
+static void pipelineFramesForget(Pipeline *p) {
+	if (!g_malincam.frames)
+		return;
+
+	if (p->isp)
+		frameServerForget(g_malincam.frames, p->isp->output);
+	for (int i = 0; i < p->enc_count; ++i)
+		frameServerForget(g_malincam.frames, p->enc[i]->output);
+}
+
+static int pipelineSceneFilter(void *arg, const DeviceStream *st, const Buffer *buf) {
+	Pipeline *const p = arg;
+	return sceneChanged(p->scene, st, buf);
+}
+
+// <dir>/cam<N>-<YYYYmmdd-HHMMSS>.<ext>
+static void pipelineFileName(const Pipeline *p, const char *dir, const char *ext, char *out, size_t size) {
+	char stamp[32];
+	const time_t now = time(NULL);
+	struct tm tm;
+	strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", localtime_r(&now, &tm));
+	snprintf(out, size, "%s/cam%d-%s.%s", dir, p->index, stamp, ext);
+}
+
+// New file per streaming session, of the MJPEG the gadget gets. H.264 only goes to RTP
+static void pipelineRecordStart(Pipeline *p) {
+	char path[256];
+	pipelineFileName(p, g_malincam.record_dir, "mjpeg", path, sizeof(path));
+
+	p->recorder = recorderOpen(path);
+	if (!p->recorder) {
+		LOGE("Unable to record camera %d", p->index);
+		return;
+	}
+
+	char name[METRICS_NAME_SIZE];
+	pipelineMetricsName(p, "record", name, sizeof(name));
+	recorderSetMetrics(p->recorder, metricsPump(name));
+
+	p->record_h = pollinatorMonitorFd(g_malincam.pol, &(PollinatorMonitorFd){
+		.fd = recorderFd(p->recorder),
+		.event_bits = POLLIN_FD_READ,
+		.func = bitSetFunc,
+		.arg1 = (uintptr_t)&p->fd_bits,
+		.arg2 = RECORD_BIT});
+}
+
+static void pipelineRtpStart(Pipeline *p) {
+	p->rtp = rtpSinkOpen((RtpSinkArgs){
+		.host = g_malincam.rtp_host,
+		.port = g_malincam.rtp_port + 2 * p->index,
+		.inline_params = g_malincam.rtp_inline_params,
+	});
+	if (!p->rtp) {
+		LOGE("Unable to stream camera %d over RTP", p->index);
+		return;
 	}
 
-	Node *const enc = piOpenEncoder(PiEncoderJPEG);
-	if (!enc) {
-		LOGE("Unable to open Rpi encoder");
+	char name[METRICS_NAME_SIZE];
+	pipelineMetricsName(p, "rtp", name, sizeof(name));
+	rtpSinkSetMetrics(p->rtp, metricsPump(name));
+}
+
+// Waits for the previous session's recording if it hasn't finished yet
+static void pipelineRecordClose(Pipeline *p) {
+	if (!p->recorder_finishing)
+		return;
+
+	pollinatorRelease(g_malincam.pol, p->record_finish_h);
+	p->record_finish_h = POLLINATOR_HANDLE_NONE;
+	recorderClose(p->recorder_finishing);
+	p->recorder_finishing = NULL;
+}
+
+// Detaches the recorder, its file is finished from the event loop without blocking the frame thread
+static void pipelineRecordStop(Pipeline *p) {
+	if (!p->recorder)
+		return;
+
+	// Ring fd is closed with the recorder, next session gets a new one
+	pollinatorRelease(g_malincam.pol, p->record_h);
+	p->record_h = POLLINATOR_HANDLE_NONE;
+
+	// Only ever one finishing, sessions are longer than a sync
+	pipelineRecordClose(p);
+
+	recorderStop(p->recorder);
+	p->recorder_finishing = p->recorder;
+	p->recorder = NULL;
+	p->record_finish_h = pollinatorMonitorFd(g_malincam.pol, &(PollinatorMonitorFd){
+		.fd = recorderFd(p->recorder_finishing),
+		.event_bits = POLLIN_FD_READ,
+		.func = bitSetFunc,
+		.arg1 = (uintptr_t)&p->fd_bits,
+		.arg2 = RECORD_FINISH_BIT});
+
+	// Failed to queue anything, nothing will complete
+	if (recorderFinished(p->recorder_finishing))
+		pipelineRecordClose(p);
+}
+
+// Control thread for the opened nodes
+static int pipelineCreateControl(Pipeline *p) {
+	p->control = controlThreadCreate((ControlThreadArgs){
+		.backend = pollinatorBackendFromEnv(),
+		.uvc = p->uvc,
+		.nodes = {p->cam, p->isp},
+	});
+	if (!p->control) {
+		LOGE("Unable to start control thread");
 		return 1;
 	}
 
+	pollinatorMonitorFd(g_malincam.pol, &(PollinatorMonitorFd){
+		.fd = controlThreadCommandFd(p->control),
+		.event_bits = POLLIN_FD_READ,
+		.func = bitSetFunc,
+		.arg1 = (uintptr_t)&p->fd_bits,
+		.arg2 = COMMANDS_BIT});
+
+	return 0;
+}
+
+// Camera and gadget only. Image controls are the sensor's, no zoom and no stills, as those need the ISP
+static int pipelineCreateRaw(Pipeline *p) {
+	const PiTopology *const topo = &g_malincam.topo;
+	Node *const cam = p->cam;
+
+	RawFormat raw;
+	if (0 != rawFormat(g_malincam.raw_mode, cam->output, &raw))
+		return 1;
+
+	LOGI("Camera %d raw %.4s %ux%u, %u bytes per frame. Gadget needs RAW_FOURCC=\"%.4s\" RAW_BITS=%d RAW_WIDTH=%u RAW_HEIGHT=%u",
+		p->index, raw.guid, raw.width, raw.height, raw.frame_size, raw.guid, raw.bits, raw.width, raw.height);
+
 	Node *const uvc = uvcOpen((UvcOpenArgs){
-		.dev_name = "/dev/video2",
+		.dev_name = topo->uvc_gadgets[p->index],
+		.format = {
+			.pixelformat = raw.pixelformat,
+			.width = raw.width,
+			.height = raw.height,
+			.frame_size = raw.frame_size,
+		},
 		.event_streamon = uvcEventStreamon,
-		// TODO .controls.brightness = 
+		.event_arg = p,
+		.controls = {cam->controls},
+		.exposure_line_ns = piCameraLineTimeNs(cam),
 	});
 	if (!uvc) {
-		LOGE("Unable to open uvc-gadget device");
+		LOGE("Unable to open uvc-gadget device %s", topo->uvc_gadgets[p->index]);
 		return 1;
 	}
+	p->uvc = uvc;
+
+	nodeAttachMetrics(p, cam);
+	nodeAttachMetrics(p, uvc);
+
+	return pipelineCreateControl(p);
+}
+
+static int pipelineCreate(Pipeline *p, int index) {
+	const PiTopology *const topo = &g_malincam.topo;
+	p->index = index;
 
+	Node *const cam = piOpenCamera(topo->cameras + index, pipeline_camera_args);
+	if (!cam) {
+		LOGE("Unable to open Rpi camera %d", index);
+		return 1;
+	}
 	p->cam = cam;
+
+	if (g_malincam.raw_mode)
+		return pipelineCreateRaw(p);
+
+	Node *const isp = piOpenISP(topo->isps + index, cam);
+	if (!isp) {
+		LOGE("Unable to open Rpi ISP %d", index);
+		return 1;
+	}
 	p->isp = isp;
-	p->enc = enc;
+
+	// JPEG encoder and codec MJPEG encoder are separate hardware blocks, a single one tops out below 120 fps.
+	// MALINCAM_ENCODERS=1 uses only the JPEG encoder.
+	// Every open is a separate m2m context, so with several cameras each gets its own.
+	static const enum PiEncoderType encoder_types[ENCODER_POOL_MAX] = {PiEncoderJPEG, PiEncoderMJPEG};
+	const char *const encoders = getenv("MALINCAM_ENCODERS");
+	const int enc_count = encoders && 0 == strcmp(encoders, "1") ? 1 : ENCODER_POOL_MAX;
+	for (int i = 0; i < enc_count; ++i) {
+		Node *const enc = piOpenEncoder(topo, encoder_types[i], isp);
+		if (!enc) {
+			LOGE("Unable to open Rpi encoder %d", i);
+			if (i == 0)
+				return 1;
+			break;
+		}
+		p->enc[p->enc_count++] = enc;
+	}
+
+	// Shares the codec block with the MJPEG encoder, in its own context
+	if (g_malincam.rtp_host) {
+		p->h264 = piOpenEncoder(topo, PiEncoderH264, isp);
+		if (p->h264)
+			nodeAttachMetrics(p, p->h264);
+		else
+			LOGE("Unable to open Rpi H.264 encoder, camera %d won't stream over RTP", index);
+	}
+
+	p->ptz = ptzCreate(isp->input);
+
+	uint32_t still_width, still_height;
+	piCameraMaxSize(cam, &still_width, &still_height);
+
+	Node *const uvc = uvcOpen((UvcOpenArgs){
+		.dev_name = topo->uvc_gadgets[index],
+		.event_streamon = uvcEventStreamon,
+		.event_still = g_malincam.still_dir ? uvcEventStill : NULL,
+		.still_width = still_width,
+		.still_height = still_height,
+		.event_arg = p,
+		.controls = {cam->controls, isp->controls},
+		.exposure_line_ns = piCameraLineTimeNs(cam),
+		.ptz = p->ptz,
+	});
+	if (!uvc) {
+		LOGE("Unable to open uvc-gadget device %s", topo->uvc_gadgets[index]);
+		return 1;
+	}
 	p->uvc = uvc;
 
-	p->pol = pollinatorCreate();
+	nodeAttachMetrics(p, cam);
+	nodeAttachMetrics(p, isp);
+	for (int i = 0; i < p->enc_count; ++i)
+		nodeAttachMetrics(p, p->enc[i]);
+	nodeAttachMetrics(p, uvc);
 
-	pollinatorMonitorFd(p->pol, &(PollinatorMonitorFd){
-		.fd = uvc->input->dev_fd,
-		.event_bits = POLLIN_FD_EXCEPT,
-		.func = bitSetFunc,
-		.arg1 = (uintptr_t)&p->fd_bits,
-		.arg2 = UVC_EVENTS_BIT});
+	return pipelineCreateControl(p);
+}
+
+static void pipelineDestroy(Pipeline *p) {
+	stillCaptureStop(p->still);
+	controlThreadDestroy(p->control);
+	pipelineFramesForget(p);
+
+	encoderPoolDestroy(p->encode);
+	encoderBranchDestroy(p->h264_branch);
+	pumpDestroy(p->cam_to_isp);
+	rawPumpDestroy(p->raw);
+	sceneDestroy(p->scene);
+	pipelineRecordStop(p);
+	pipelineRecordClose(p);
+	rtpSinkClose(p->rtp);
+
+	ptzDestroy(p->ptz);
+
+	nodeDestroy(p->uvc);
+	if (p->still_enc)
+		nodeDestroy(p->still_enc);
+	for (int i = 0; i < p->enc_count; ++i)
+		nodeDestroy(p->enc[i]);
+	if (p->h264)
+		nodeDestroy(p->h264);
+	if (p->isp)
+		nodeDestroy(p->isp);
+	nodeDestroy(p->cam);
+
+	*p = (Pipeline){0};
+}
+
+static int malincamCreate(void) {
+	const uint64_t create_us = nowUs();
 
+	// MALINCAM_SNAPSHOT overrides device snapshot location, empty value disables it. See snapshot.h
+	const char *const snapshot = getenv("MALINCAM_SNAPSHOT");
+	snapshotOpen(!snapshot ? SNAPSHOT_DEFAULT_PATH : snapshot[0] ? snapshot : NULL);
+
+	// MALINCAM_TOPOLOGY_CACHE overrides cache location, empty value disables it
+	const char *const topology_cache = getenv("MALINCAM_TOPOLOGY_CACHE");
+	piDiscover(&g_malincam.topo, !topology_cache ? PI_TOPOLOGY_DEFAULT_CACHE_PATH : topology_cache[0] ? topology_cache : NULL);
+	const uint64_t discover_us = nowUs();
+
+	const PiTopology *const topo = &g_malincam.topo;
+	int count = topo->cameras_count;
+	if (count > topo->isps_count) {
+		LOGE("%d cameras, but only %d ISP instances, not using the rest", count, topo->isps_count);
+		count = topo->isps_count;
+	}
+	if (count > topo->uvc_gadgets_count) {
+		LOGE("%d cameras, but only %d UVC functions, not using the rest", count, topo->uvc_gadgets_count);
+		count = topo->uvc_gadgets_count;
+	}
+
+	g_malincam.pol = pollinatorCreate(pollinatorBackendFromEnv());
+
+	// MALINCAM_RECORD=<dir> records the MJPEG of every streaming session there
+	const char *const record_dir = getenv("MALINCAM_RECORD");
+	g_malincam.record_dir = record_dir && record_dir[0] ? record_dir : NULL;
+
+	// MALINCAM_RAW=packed|unpacked streams sensor data instead of MJPEG, see raw.h
+	const char *const raw = getenv("MALINCAM_RAW");
+	if (raw && 0 == strcmp(raw, "packed"))
+		g_malincam.raw_mode = RAW_MODE_PACKED;
+	else if (raw && 0 == strcmp(raw, "unpacked"))
+		g_malincam.raw_mode = RAW_MODE_UNPACKED;
+	else if (raw && raw[0])
+		LOGE("Unknown MALINCAM_RAW=%s, expected packed or unpacked", raw);
+
+	// MALINCAM_STATIC=<ms> drops frames of static scenes, sending one at least every <ms>.
+	// MALINCAM_STATIC_THRESHOLD overrides what counts as a change, see scene.h
+	const char *const static_ms = getenv("MALINCAM_STATIC");
+	const char *const static_threshold = getenv("MALINCAM_STATIC_THRESHOLD");
+	g_malincam.scene = (SceneArgs){
+		.max_interval_ms = static_ms ? strtoul(static_ms, NULL, 10) : 0,
+		.threshold = static_threshold ? atoi(static_threshold) : SCENE_DEFAULT_THRESHOLD,
+	};
+
+	// MALINCAM_STILLS=<dir> advertises still image controls and saves host triggered stills there, see still.h
+	const char *const still_dir = getenv("MALINCAM_STILLS");
+	g_malincam.still_dir = still_dir && still_dir[0] ? still_dir : NULL;
+
+	// MALINCAM_METRICS_SOCKET overrides socket location, empty value disables it
+	const char *const metrics_socket = getenv("MALINCAM_METRICS_SOCKET");
+	g_malincam.metrics_fd = -1;
+	if (!metrics_socket || metrics_socket[0])
+		g_malincam.metrics_fd = metricsServerOpen(metrics_socket ? metrics_socket : METRICS_DEFAULT_SOCKET_PATH);
+	if (g_malincam.metrics_fd >= 0) {
+		pollinatorMonitorFd(g_malincam.pol, &(PollinatorMonitorFd){
+			.fd = g_malincam.metrics_fd,
+			.event_bits = POLLIN_FD_READ,
+			.func = metricsServeClients,
+		});
+	}
+
+	// MALINCAM_FRAME_SOCKET overrides frame server location, empty value disables it. See frame-server.h
+	const char *const frame_socket = getenv("MALINCAM_FRAME_SOCKET");
+	if (!frame_socket || frame_socket[0])
+		g_malincam.frames = frameServerOpen(frame_socket ? frame_socket : FRAME_SERVER_DEFAULT_SOCKET_PATH, g_malincam.pol);
+	if (g_malincam.frames)
+		frameServerSetMetrics(g_malincam.frames, metricsPump("frame_server"));
+
+	// MALINCAM_RTP=<host>[:<port>] streams H.264 there, see rtp.h. MALINCAM_RTP_INLINE=0 leaves out
+	// SPS/PPS the encoder doesn't repeat before IDR frames
+	static char rtp_host[64];
+	const char *const rtp = getenv("MALINCAM_RTP");
+	if (rtp && rtp[0] && !g_malincam.raw_mode) {
+		snprintf(rtp_host, sizeof(rtp_host), "%s", rtp);
+		char *const port = strchr(rtp_host, ':');
+		if (port)
+			*port = '\0';
+		g_malincam.rtp_host = rtp_host;
+		g_malincam.rtp_port = port ? strtoul(port + 1, NULL, 10) : RTP_DEFAULT_PORT;
+		const char *const rtp_inline = getenv("MALINCAM_RTP_INLINE");
+		g_malincam.rtp_inline_params = !rtp_inline || 0 != strcmp(rtp_inline, "0");
+	}
+
+	// MALINCAM_HTTP=<port> serves MJPEG over HTTP there, see http-mjpeg.h
+	const char *const http_port = getenv("MALINCAM_HTTP");
+	if (http_port && http_port[0])
+		g_malincam.http = httpMjpegOpen(strtoul(http_port, NULL, 10), g_malincam.pol);
+	if (g_malincam.http)
+		httpMjpegSetMetrics(g_malincam.http, metricsPump("http"));
+
+	// Per pipeline, from previous stage end
+	uint64_t pipeline_us[PI_MAX_CAMERAS] = {0};
+	uint64_t stage_us = nowUs();
+	const uint64_t services_us = stage_us - discover_us;
+
+	g_malincam.pipelines_count = count;
+	for (int i = 0; i < count; ++i) {
+		if (0 != pipelineCreate(g_malincam.pipelines + i, i))
+			return 1;
+		pipeline_us[i] = nowUs() - stage_us;
+		stage_us += pipeline_us[i];
+	}
+
+	// UVC functions answer the host from here on
+	const uint64_t ready_us = nowUs();
+	snapshotSave();
+
+	int hits, misses;
+	snapshotStats(&hits, &misses);
+	LOGI("Startup: ready %.1fms after start: discovery %.1fms, services %.1fms, pipelines %.1fms + %.1fms, "
+		"device snapshot %d hits %d misses",
+		ready_us / 1000., (discover_us - create_us) / 1000., services_us / 1000.,
+		pipeline_us[0] / 1000., count > 1 ? pipeline_us[1] / 1000. : 0., hits, misses);
+
+	LOGI("Running %d camera pipeline(s)", count);
 	return 0;
 }
 
-static void pipelineDestroy(void) {
-	Pipeline *const p = &g_pipeline;
+static void malincamDestroy(void) {
+	for (int i = 0; i < g_malincam.pipelines_count; ++i)
+		pipelineDestroy(g_malincam.pipelines + i);
 
-	pumpDestroy(p->isp_to_enc);
-	pumpDestroy(p->cam_to_isp);
+	frameServerClose(g_malincam.frames);
+	httpMjpegClose(g_malincam.http);
+	pollinatorDestroy(g_malincam.pol);
+	metricsServerClose(g_malincam.metrics_fd);
+	snapshotClose();
+}
 
-	nodeDestroy(p->enc);
-	nodeDestroy(p->isp);
-	nodeDestroy(p->cam);
+static int pipelineStreamsStartRaw(Pipeline *p) {
+	struct Pollinator *const pol = g_malincam.pol;
 
-	pollinatorDestroy(p->pol);
+	if (0 != nodeStart(p->cam)) {
+		LOGE("Unable to start camera");
+		return 1;
+	}
+
+	p->raw = rawPumpCreate(g_malincam.raw_mode, p->cam->output, p->uvc->input);
+	if (!p->raw)
+		return 1;
+
+	char name[METRICS_NAME_SIZE];
+	pipelineMetricsName(p, "cam_to_uvc", name, sizeof(name));
+	rawPumpSetMetrics(p->raw, metricsPump(name));
+
+	p->cam_output_h = pollinatorMonitorFd(pol, &(PollinatorMonitorFd){
+		.fd = p->cam->output->dev_fd,
+		.event_bits = POLLIN_FD_READ,
+		.func = bitSetFunc,
+		.arg1 = (uintptr_t)&p->fd_bits,
+		.arg2 = RAW_BIT});
+
+	p->uvc_h = pollinatorMonitorFd(pol, &(PollinatorMonitorFd){
+		.fd = p->uvc->input->dev_fd,
+		.event_bits = POLLIN_FD_WRITE,
+		.func = bitSetFunc,
+		.arg1 = (uintptr_t)&p->fd_bits,
+		.arg2 = RAW_BIT});
+
+	return 0;
 }
 
-int pipelineStart(void) {
-	Pipeline *const p = &g_pipeline;
+// Nodes, pumps and their fds, without the session state of pipelineStart(). Stills restart these
+static int pipelineStreamsStart(Pipeline *p) {
+	struct Pollinator *const pol = g_malincam.pol;
 
+	uvcStreamPrepare(p->uvc, g_malincam.raw_mode ? NULL : p->enc[0]->output);
 	if (0 != nodeStart(p->uvc)) {
 		LOGE("Unable to start uvc-gadget");
 		return 1;
 	}
 
-	if (0 != nodeStart(p->enc)) {
-		LOGE("Unable to start encoder");
-		return 1;
+	if (g_malincam.raw_mode)
+		return pipelineStreamsStartRaw(p);
+
+	for (int i = 0; i < p->enc_count; ++i) {
+		if (0 != nodeStart(p->enc[i])) {
+			LOGE("Unable to start encoder %s", p->enc[i]->name);
+			return 1;
+		}
 	}
 
+	// Video for UVC goes on without it
+	const int h264 = p->rtp && 0 == nodeStart(p->h264);
+	if (p->rtp && !h264)
+		LOGE("Unable to start %s", p->h264->name);
+
 	if (0 != nodeStart(p->isp)) {
 		LOGE("Unable to start ISP");
 		return 1;
@@ -240,18 +815,61 @@ int pipelineStart(void) {
 		return 1;
 	}
 
-	p->cam_to_isp = pumpCreate(p->cam->output, p->isp->input);
-	p->isp_to_enc = pumpCreate(p->isp->output, p->enc->input);
-	p->enc_to_uvc = pumpCreate(p->enc->output, p->uvc->input);
+	// Fresh reference, the first frame always goes through
+	if (g_malincam.scene.max_interval_ms)
+		p->scene = sceneCreate(g_malincam.scene);
+
+	p->cam_to_isp = pipelinePumpCreate(p, p->cam->output, p->isp->input, "cam_to_isp");
+	if (h264) {
+		p->h264_branch = encoderBranchCreate((EncoderBranchArgs){
+			.src = p->isp->output,
+			.encoder = p->h264,
+			.next_keep = pipelineFramesKeep,
+			.next_keep_arg = p,
+			.tap = pipelineH264Tap,
+			.tap_arg = p,
+		});
+		if (p->h264_branch) {
+			char name[METRICS_NAME_SIZE];
+			pipelineMetricsName(p, "isp_to_h264", name, sizeof(name));
+			encoderBranchSetMetrics(p->h264_branch, metricsPump(name));
+		}
+	}
+
+	const int lending = g_malincam.frames || p->h264_branch;
+	EncoderPoolArgs encode_args = {
+		.src = p->isp->output,
+		.dst = p->uvc->input,
+		.tap = p->recorder || g_malincam.frames || g_malincam.http ? pipelineEncodedTap : NULL,
+		.tap_arg = p,
+		.source_tap = lending ? pipelineSourceTap : NULL,
+		.source_tap_arg = p,
+		.filter = p->scene ? pipelineSceneFilter : NULL,
+		.filter_arg = p,
+		.keep = lending ? pipelineKeep : NULL,
+		.keep_arg = p,
+	};
+	for (int i = 0; i < p->enc_count; ++i)
+		encode_args.encoders[i] = p->enc[i];
+	p->encode = encoderPoolCreate(encode_args);
+	if (p->encode) {
+		char name[METRICS_NAME_SIZE];
+		pipelineMetricsName(p, "isp_to_enc", name, sizeof(name));
+		p->encode->metrics_in = metricsPump(name);
+		pipelineMetricsName(p, "enc_to_uvc", name, sizeof(name));
+		p->encode->metrics_out = metricsPump(name);
+	}
 
-	pollinatorMonitorFd(p->pol, &(PollinatorMonitorFd){
+	// Re-registering a known fd reuses its slot and handle
+	p->cam_output_h = pollinatorMonitorFd(pol, &(PollinatorMonitorFd){
 		.fd = p->cam->output->dev_fd,
 		.event_bits = POLLIN_FD_READ | POLLIN_FD_WRITE,
 		.func = bitSetFunc,
 		.arg1 = (uintptr_t)&p->fd_bits,
 		.arg2 = CAM_TO_ISP_BIT});
 
-	pollinatorMonitorFd(p->pol, &(PollinatorMonitorFd){
+	// Also carries ISP control events, but those are left to the control thread
+	p->isp_input_h = pollinatorMonitorFd(pol, &(PollinatorMonitorFd){
 		.fd = p->isp->input->dev_fd,
 		.event_bits = POLLIN_FD_READ | POLLIN_FD_WRITE,
 		.func = bitSetFunc,
@@ -259,134 +877,413 @@ int pipelineStart(void) {
 		.arg2 = CAM_TO_ISP_BIT});
 
 	// FIXME if using single-device isp /dev/video12, then this fd will be the same as input
-	pollinatorMonitorFd(p->pol, &(PollinatorMonitorFd){
+	p->isp_output_h = pollinatorMonitorFd(pol, &(PollinatorMonitorFd){
 		.fd = p->isp->output->dev_fd,
 		.event_bits = POLLIN_FD_READ | POLLIN_FD_WRITE,
 		.func = bitSetFunc,
 		.arg1 = (uintptr_t)&p->fd_bits,
 		.arg2 = ISP_TO_ENC_BIT});
 
-	pollinatorMonitorFd(p->pol, &(PollinatorMonitorFd){
-		.fd = p->enc->input->dev_fd,
-		.event_bits = POLLIN_FD_READ | POLLIN_FD_WRITE,
-		.func = bitSetFunc,
-		.arg1 = (uintptr_t)&p->fd_bits,
-		.arg2 = ISP_TO_ENC_BIT | ENC_TO_UVC_BIT});
+	for (int i = 0; i < p->enc_count; ++i) {
+		p->enc_h[i] = pollinatorMonitorFd(pol, &(PollinatorMonitorFd){
+			.fd = p->enc[i]->input->dev_fd,
+			.event_bits = POLLIN_FD_READ | POLLIN_FD_WRITE,
+			.func = bitSetFunc,
+			.arg1 = (uintptr_t)&p->fd_bits,
+			.arg2 = ISP_TO_ENC_BIT | ENC_TO_UVC_BIT});
+	}
 
-	pollinatorMonitorFd(p->pol, &(PollinatorMonitorFd){
+	if (p->h264_branch) {
+		p->h264_h = pollinatorMonitorFd(pol, &(PollinatorMonitorFd){
+			.fd = p->h264->input->dev_fd,
+			.event_bits = POLLIN_FD_READ | POLLIN_FD_WRITE,
+			.func = bitSetFunc,
+			.arg1 = (uintptr_t)&p->fd_bits,
+			.arg2 = H264_BIT});
+	}
+
+	// Gadget events are left to the control thread
+	p->uvc_h = pollinatorMonitorFd(pol, &(PollinatorMonitorFd){
 		.fd = p->uvc->input->dev_fd,
-		.event_bits = POLLIN_FD_EXCEPT | POLLIN_FD_WRITE | POLLIN_FD_READ,
+		.event_bits = POLLIN_FD_WRITE | POLLIN_FD_READ,
 		.func = bitSetFunc,
 		.arg1 = (uintptr_t)&p->fd_bits,
-		.arg2 = ENC_TO_UVC_BIT | UVC_EVENTS_BIT});
+		.arg2 = ENC_TO_UVC_BIT});
 
-	ledBlinkEnable(1);
 	return 0;
 }
 
-int pipelineStop(void) {
-	Pipeline *const p = &g_pipeline;
+static void pipelineStreamsStop(Pipeline *p) {
+	struct Pollinator *const pol = g_malincam.pol;
 
-	ledBlinkEnable(0);
+	pipelineFramesForget(p);
 
-	nodeStop(g_pipeline.uvc);
-	nodeStop(g_pipeline.enc);
-	nodeStop(g_pipeline.isp);
-	nodeStop(g_pipeline.cam);
+	nodeStop(p->uvc);
+	for (int i = 0; i < p->enc_count; ++i)
+		nodeStop(p->enc[i]);
+	if (p->h264_branch)
+		nodeStop(p->h264);
+	if (p->isp)
+		nodeStop(p->isp);
+	nodeStop(p->cam);
 
-	pumpDestroy(p->enc_to_uvc); p->enc_to_uvc = NULL;
-	pumpDestroy(p->isp_to_enc); p->isp_to_enc = NULL;
+	encoderPoolDestroy(p->encode); p->encode = NULL;
+	encoderBranchDestroy(p->h264_branch); p->h264_branch = NULL;
 	pumpDestroy(p->cam_to_isp); p->cam_to_isp = NULL;
+	rawPumpDestroy(p->raw); p->raw = NULL;
+	sceneDestroy(p->scene); p->scene = NULL;
+
+	// Park, handles remain valid for the next start
+	pollinatorSetEvents(pol, p->cam_output_h, 0);
+	pollinatorSetEvents(pol, p->isp_input_h, 0);
+	pollinatorSetEvents(pol, p->isp_output_h, 0);
+	for (int i = 0; i < p->enc_count; ++i)
+		pollinatorSetEvents(pol, p->enc_h[i], 0);
+	pollinatorSetEvents(pol, p->h264_h, 0);
+	pollinatorSetEvents(pol, p->uvc_h, 0);
+}
 
-	pollinatorMonitorFd(p->pol, &(PollinatorMonitorFd){
-		.fd = p->cam->output->dev_fd,
-		.event_bits = 0,
-	});
+static int pipelineStart(Pipeline *p) {
+	if (p->streaming)
+		return 0;
 
-	pollinatorMonitorFd(p->pol, &(PollinatorMonitorFd){
-		.fd = p->isp->input->dev_fd,
-		.event_bits = 0});
+	// Recordings are of encoded frames
+	if (g_malincam.record_dir && p->enc_count)
+		pipelineRecordStart(p);
+	if (p->h264)
+		pipelineRtpStart(p);
 
-	pollinatorMonitorFd(p->pol, &(PollinatorMonitorFd){
-		.fd = p->isp->output->dev_fd,
-		.event_bits = 0});
+	// A still in progress starts them when it's done, see pipelineStillEnd()
+	if (!p->still && 0 != pipelineStreamsStart(p)) {
+		pipelineRecordStop(p);
+		rtpSinkClose(p->rtp); p->rtp = NULL;
+		return 1;
+	}
 
-	pollinatorMonitorFd(p->pol, &(PollinatorMonitorFd){
-		.fd = p->enc->input->dev_fd,
-		.event_bits = 0});
+	controlThreadSetStreaming(p->control, 1);
+	p->streaming = 1;
 
-	// Continue monitoring uvc events
-	pollinatorMonitorFd(p->pol, &(PollinatorMonitorFd){
-		.fd = p->uvc->input->dev_fd,
-		.event_bits = POLLIN_FD_EXCEPT,
-		.func = bitSetFunc,
-		.arg1 = (uintptr_t)&p->fd_bits,
-		.arg2 = UVC_EVENTS_BIT});
+	// Blinks while any camera streams
+	if (g_malincam.streaming_count++ == 0)
+		ledBlinkEnable(1);
+	return 0;
+}
+
+static int pipelineStop(Pipeline *p) {
+	struct Pollinator *const pol = g_malincam.pol;
+
+	if (!p->streaming)
+		return 0;
+
+	p->streaming = 0;
+	p->still_gap_begin_us = 0;
+	if (--g_malincam.streaming_count == 0)
+		ledBlinkEnable(0);
+	controlThreadSetStreaming(p->control, 0);
+
+	// Already stopped for a still in progress
+	if (!p->still)
+		pipelineStreamsStop(p);
+	pipelineRecordStop(p);
+	rtpSinkClose(p->rtp); p->rtp = NULL;
+
+	PollinatorStats stats;
+	pollinatorGetStats(pol, &stats);
+	LOGI("Pollinator %s: polls=%llu syscalls=%llu events=%llu syscalls/poll=%.2f",
+		pollinatorBackendName(pollinatorGetBackend(pol)),
+		(unsigned long long)stats.polls, (unsigned long long)stats.syscalls, (unsigned long long)stats.events,
+		stats.polls ? (double)stats.syscalls / stats.polls : 0.);
+	LOGI("Pollinator events of camera %d: cam=%llu isp_in=%llu isp_out=%llu uvc=%llu", p->index,
+		(unsigned long long)pollinatorEventsCount(pol, p->cam_output_h),
+		(unsigned long long)pollinatorEventsCount(pol, p->isp_input_h),
+		(unsigned long long)pollinatorEventsCount(pol, p->isp_output_h),
+		(unsigned long long)pollinatorEventsCount(pol, p->uvc_h));
+	for (int i = 0; i < p->enc_count; ++i)
+		LOGI("Pollinator events of camera %d: %s=%llu", p->index, p->enc[i]->name,
+			(unsigned long long)pollinatorEventsCount(pol, p->enc_h[i]));
 
 	return 0;
 }
 
-static int pipelineProcess(void) {
-	Pipeline *const p = &g_pipeline;
+// Sensor controls belong to the control thread, and the mode switch reads and refreshes them
+static int pipelineCameraSetMode(Pipeline *p, PiCameraArgs args) {
+	controlThreadPause(p->control);
+	const int result = piCameraSetMode(p->cam, args);
+	controlThreadResume(p->control);
+	return result;
+}
 
-	g_pipeline.fd_bits = 0;
+// Streams stay stopped until the still is done, everything else goes on in the meantime
+static void pipelineStillEnd(Pipeline *p, int result) {
+	struct Pollinator *const pol = g_malincam.pol;
+	MetricsUvc *const metrics = uvcGetMetrics(p->uvc);
+
+	if (p->still) {
+		stillCaptureStop(p->still);
+		p->still = NULL;
+		pollinatorSetEvents(pol, p->cam_output_h, 0);
+		pollinatorSetEvents(pol, p->isp_input_h, 0);
+		pollinatorSetEvents(pol, p->isp_output_h, 0);
+		pollinatorSetEvents(pol, p->still_enc_h, 0);
+	}
 
-	const uint64_t poll_pre = nowUs();
-	const int result = pollinatorPoll(g_pipeline.pol, 5000);
-	const uint64_t now_us = nowUs();
-	if (!g_pipeline.fd_bits) {
-		LOGI("Slept for %.3fms", (now_us - poll_pre) / 1000.);
-		//g_pipeline.fd_bits = 0xff;
+	const uint64_t capture_us = nowUs() - p->still_begin_us;
+
+	// Back to video whatever happened above
+	if (0 != pipelineCameraSetMode(p, pipeline_camera_args) || 0 != piIspSetMode(p->isp, p->cam, PiIspVideo)) {
+		LOGE("Camera %d is unable to switch back to video mode", p->index);
+		result = -EIO;
 	}
 
-	ledBlinkUpdate(now_us / 1000);
+	// Re-preparing reset the ISP crop
+	if (p->ptz)
+		ptzReset(p->ptz);
 
-	if (result < 0) {
-		LOGE("Pollinator returned %d", result);
-		exit(1);
+	if (p->streaming) {
+		if (0 != pipelineStreamsStart(p)) {
+			LOGE("Camera %d is unable to resume video after still", p->index);
+			pipelineStop(p);
+		} else {
+			p->still_gap_begin_us = p->still_begin_us;
+		}
+	}
+
+	uvcStillComplete(p->uvc);
+
+	if (result < 0)
+		LOGE("Camera %d still failed: %d", p->index, result);
+	LOGI("Camera %d still took %llums", p->index, (unsigned long long)capture_us / 1000);
+	if (metrics) {
+		if (result < 0)
+			METRICS_INC(metrics->still_errors);
+		else
+			METRICS_INC(metrics->stills);
+		METRICS_SET(metrics->still_capture_us, capture_us);
+	}
+}
+
+static void pipelineStillProcess(Pipeline *p) {
+	const int result = stillCaptureProcess(p->still);
+	if (result == 0)
+		return;
+
+	if (result > 0)
+		LOGI("Camera %d still %ux%u, %d bytes: %s", p->index, p->still_width, p->still_height, result, p->still_path);
+	pipelineStillEnd(p, result);
+}
+
+// Its fds are the ones video uses, registered again for the still
+static void pipelineStillMonitor(Pipeline *p) {
+	struct Pollinator *const pol = g_malincam.pol;
+	const int fds[] = {p->cam->output->dev_fd, p->isp->input->dev_fd, p->isp->output->dev_fd, p->still_enc->input->dev_fd};
+	PollinatorHandle *const handles[] = {&p->cam_output_h, &p->isp_input_h, &p->isp_output_h, &p->still_enc_h};
+	for (int i = 0; i < (int)COUNTOF(fds); ++i) {
+		*handles[i] = pollinatorMonitorFd(pol, &(PollinatorMonitorFd){
+			.fd = fds[i],
+			.event_bits = POLLIN_FD_READ | POLLIN_FD_WRITE,
+			.func = bitSetFunc,
+			.arg1 = (uintptr_t)&p->fd_bits,
+			.arg2 = STILL_BIT});
+	}
+}
+
+// Switches the camera to its full resolution mode for one frame. Video, if streaming, stops until the still
+// is done. The capture itself runs from the event loop, see pipelineStillProcess()
+static void pipelineStill(Pipeline *p) {
+	if (p->still) {
+		LOGI("Camera %d still is already in progress", p->index);
+		return;
+	}
+
+	p->still_begin_us = nowUs();
+
+	if (p->streaming)
+		pipelineStreamsStop(p);
+
+	uint32_t width, height;
+	piCameraMaxSize(p->cam, &width, &height);
+	int result = pipelineCameraSetMode(p, (PiCameraArgs){.width = width, .height = height});
+	if (result == 0)
+		result = piIspSetMode(p->isp, p->cam, PiIspStill);
+
+	// ISP output size, which may differ from the sensor size by alignment
+	const DeviceStream *const still = p->isp->output;
+	p->still_width = IS_STREAM_MPLANE(still) ? still->format.fmt.pix_mp.width : still->format.fmt.pix.width;
+	p->still_height = IS_STREAM_MPLANE(still) ? still->format.fmt.pix_mp.height : still->format.fmt.pix.height;
+	if (result == 0 && !p->still_enc) {
+		p->still_enc = piOpenStillEncoder(&g_malincam.topo, p->isp);
+		if (p->still_enc)
+			nodeAttachMetrics(p, p->still_enc);
+		else
+			result = -ENODEV;
+	}
+
+	if (result == 0) {
+		pipelineFileName(p, g_malincam.still_dir, "jpg", p->still_path, sizeof(p->still_path));
+		p->still = stillCaptureStart((StillCaptureArgs){
+			.cam = p->cam,
+			.isp = p->isp,
+			.enc = p->still_enc,
+			.skip_frames = STILL_SKIP_FRAMES,
+			.timeout_ms = STILL_TIMEOUT_MS,
+			.path = p->still_path,
+		});
+		if (!p->still)
+			result = -EIO;
+	}
+
+	if (result != 0) {
+		pipelineStillEnd(p, result);
+		return;
+	}
+
+	pipelineStillMonitor(p);
+}
+
+static void pipelineProcess(Pipeline *p) {
+	if (p->fd_bits & COMMANDS_BIT) {
+		ControlCommand cmd;
+		while (0 == controlThreadPopCommand(p->control, &cmd)) {
+			switch (cmd.type) {
+				case CONTROL_COMMAND_STREAMON: pipelineStart(p); break;
+				case CONTROL_COMMAND_STREAMOFF: pipelineStop(p); break;
+				case CONTROL_COMMAND_STILL: pipelineStill(p); break;
+			}
+		}
 	}
 
-	if (g_pipeline.fd_bits & UVC_EVENTS_BIT) {
-		uvcProcessEvents(g_pipeline.uvc);
+	// Staged control changes are committed by the control thread right after a camera frame arrives
+	if (p->cam_to_isp && p->fd_bits & CAM_TO_ISP_BIT) {
+		controlThreadFrameBoundary(p->control);
+
+		// Before the new frame is queued to the ISP, so that it gets the new crop
+		if (p->ptz)
+			ptzUpdate(p->ptz);
 	}
 
 	// After this point stream might have stopped already, but we'd still have lingering bits singaling transfer...
 
-	if (g_pipeline.cam_to_isp && g_pipeline.fd_bits & CAM_TO_ISP_BIT) {
-		const int result = pumpPump(g_pipeline.cam_to_isp);
+	if (p->cam_to_isp && p->fd_bits & CAM_TO_ISP_BIT) {
+		const int result = pumpPump(p->cam_to_isp);
 		if (0 != result) {
 			LOGE("cam-to-isp pump error: %d", result);
 			//return 1;
 		}
 	}
 
-	if (g_pipeline.isp_to_enc && g_pipeline.fd_bits & ISP_TO_ENC_BIT) {
-		const int result = pumpPump(g_pipeline.isp_to_enc);
+	if (p->encode && p->fd_bits & ISP_TO_ENC_BIT) {
+		const int result = encoderPoolPumpInput(p->encode);
 		if (0 != result) {
 			LOGE("isp-to-enc pump error: %d", result);
 			//return 1;
 		}
 	}
 
-	if (g_pipeline.enc_to_uvc && g_pipeline.fd_bits & ENC_TO_UVC_BIT) {
-		const int result = pumpPump(p->enc_to_uvc);
+	if (p->encode && p->fd_bits & ENC_TO_UVC_BIT) {
+		const int result = encoderPoolPumpOutput(p->encode);
 		if (0 != result) {
 			LOGE("enc-to-uvc pump error: %d", result);
 			//return 1;
 		}
+
+		// Gadget holds a frame again
+		if (p->still_gap_begin_us && queueGetSize(&p->encode->available) < p->encode->dst->buffers_count) {
+			const uint64_t gap_us = nowUs() - p->still_gap_begin_us;
+			p->still_gap_begin_us = 0;
+			LOGI("Camera %d video resumed %llums after still", p->index, (unsigned long long)gap_us / 1000);
+			MetricsUvc *const metrics = uvcGetMetrics(p->uvc);
+			if (metrics) METRICS_SET(metrics->still_gap_us, gap_us);
+		}
+	}
+
+	if (p->h264_branch && p->fd_bits & H264_BIT) {
+		const int result = encoderBranchPump(p->h264_branch);
+		if (0 != result)
+			LOGE("isp-to-h264 pump error: %d", result);
+	}
+
+	if (p->raw && p->fd_bits & RAW_BIT) {
+		controlThreadFrameBoundary(p->control);
+
+		const int result = rawPumpPump(p->raw);
+		if (0 != result)
+			LOGE("cam-to-uvc pump error: %d", result);
+	}
+
+	if (p->recorder && p->fd_bits & RECORD_BIT) {
+		const int result = recorderProcess(p->recorder);
+		if (0 != result) {
+			// Keeps streaming, only recording stops
+			LOGE("Camera %d recording failed: %d", p->index, result);
+			pipelineRecordStop(p);
+		}
+	}
+
+	// Also on timeouts, without any bits
+	if (p->still)
+		pipelineStillProcess(p);
+
+	if (p->recorder_finishing && p->fd_bits & RECORD_FINISH_BIT) {
+		recorderProcess(p->recorder_finishing);
+		if (recorderFinished(p->recorder_finishing))
+			pipelineRecordClose(p);
+	}
+}
+
+static int malincamProcess(void) {
+	for (int i = 0; i < g_malincam.pipelines_count; ++i)
+		g_malincam.pipelines[i].fd_bits = 0;
+
+	const uint64_t poll_pre = nowUs();
+	int timeout_ms = 5000;
+	for (int i = 0; i < g_malincam.pipelines_count; ++i) {
+		const struct StillCapture *const still = g_malincam.pipelines[i].still;
+		if (still && stillCaptureTimeoutMs(still) < timeout_ms)
+			timeout_ms = stillCaptureTimeoutMs(still);
 	}
 
+	const int result = pollinatorPoll(g_malincam.pol, timeout_ms);
+	const uint64_t now_us = nowUs();
+
+	uint32_t any_bits = 0;
+	for (int i = 0; i < g_malincam.pipelines_count; ++i)
+		any_bits |= g_malincam.pipelines[i].fd_bits;
+	if (!any_bits)
+		TRACEI(TRACE_EV_POLL_IDLE, (uint32_t)(now_us - poll_pre));
+
+	ledBlinkUpdate(now_us / 1000);
+
+	if (result < 0) {
+		LOGE("Pollinator returned %d", result);
+		exit(1);
+	}
+
+	const int count = g_malincam.pipelines_count;
+	for (int i = 0; i < count; ++i)
+		pipelineProcess(g_malincam.pipelines + (g_malincam.first + i) % count);
+
+	if (count)
+		g_malincam.first = (g_malincam.first + 1) % count;
+
 	return 0;
 }
 
-static int uvcEventStreamon(int streamon) {
+// Runs on the pipeline's control thread, streams are started and stopped on the frame thread
+static int uvcEventStreamon(void *arg, int streamon) {
+	Pipeline *const p = arg;
 	switch (streamon) {
-		case 1: return pipelineStart();
-		case 0: return pipelineStop();
+		case 1: return controlThreadPushCommand(p->control, &(ControlCommand){.type = CONTROL_COMMAND_STREAMON});
+		case 0: return controlThreadPushCommand(p->control, &(ControlCommand){.type = CONTROL_COMMAND_STREAMOFF});
 	}
 	return -EINVAL;
 }
 
+// Runs on the pipeline's control thread, like uvcEventStreamon()
+static int uvcEventStill(void *arg) {
+	Pipeline *const p = arg;
+	return controlThreadPushCommand(p->control, &(ControlCommand){.type = CONTROL_COMMAND_STILL});
+}
+
 int main(int argc, const char *argv[]) {
 	UNUSED(argc);
 	UNUSED(argv);
@@ -398,14 +1295,24 @@ int main(int argc, const char *argv[]) {
 
 	prev_frame_us = nowUs();
 
-	if (pipelineCreate() != 0) {
-		LOGE("Failed to create pipeline");
+	// MALINCAM_TRACE overrides trace ring location, read it with malincam-trace
+	const char *const trace_path = getenv("MALINCAM_TRACE");
+	traceOpen(trace_path ? trace_path : TRACE_DEFAULT_PATH, 4096);
+
+	// MALINCAM_METRICS overrides metrics page location
+	const char *const metrics_path = getenv("MALINCAM_METRICS");
+	metricsOpen(metrics_path ? metrics_path : METRICS_DEFAULT_PATH);
+
+	if (malincamCreate() != 0) {
+		LOGE("Failed to create pipelines");
 		return 1;
 	}
 
-	while (pipelineProcess() == 0);
+	while (malincamProcess() == 0);
 
-	pipelineDestroy();
+	malincamDestroy();
+	metricsClose();
+	traceClose();
 
 	return 0;
 #endif // else ifdef TEST_UVC_ONLY
@@ -0,0 +1,201 @@
+#include "media.h"
+
+#include "common.h"
+
+#include <sys/ioctl.h>
+#include <fcntl.h> // open
+#include <unistd.h> // close
+#include <stdlib.h> // calloc, free
+#include <errno.h>
+#include <string.h> // strerror
+
+int mediaDevnodePath(uint32_t major, uint32_t minor, char *out, size_t size) {
+	char path[64];
+	snprintf(path, sizeof(path), "/sys/dev/char/%u:%u/uevent", major, minor);
+
+	FILE *const f = fopen(path, "r");
+	if (!f)
+		return -errno;
+
+	int result = -ENOENT;
+	char line[128];
+	while (fgets(line, sizeof(line), f)) {
+		if (0 != strncmp(line, "DEVNAME=", 8))
+			continue;
+
+		line[strcspn(line, "\n")] = '\0';
+		if ((size_t)snprintf(out, size, "/dev/%s", line + 8) < size)
+			result = 0;
+		else
+			result = -ENAMETOOLONG;
+		break;
+	}
+
+	fclose(f);
+	return result;
+}
+
+static MediaEntity *graphEntityById(const MediaGraph *graph, uint32_t id) {
+	for (int i = 0; i < graph->entities_count; ++i)
+		if (graph->entities[i].entity.id == id)
+			return graph->entities + i;
+	return NULL;
+}
+
+static const struct media_v2_pad *graphPadById(const MediaGraph *graph, uint32_t id) {
+	for (int i = 0; i < graph->pads_count; ++i)
+		if (graph->pads[i].id == id)
+			return graph->pads + i;
+	return NULL;
+}
+
+int mediaGraphLoad(const char *path, MediaGraph *out) {
+	*out = (MediaGraph){0};
+	struct media_v2_interface *interfaces = NULL;
+	struct media_v2_entity *entities = NULL;
+	int result = 0;
+
+	const int fd = open(path, O_RDWR | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	if (0 != ioctl(fd, MEDIA_IOC_DEVICE_INFO, &out->info)) {
+		result = -errno;
+		LOGE("Failed to ioctl(%s, MEDIA_IOC_DEVICE_INFO): %d, %s", path, errno, strerror(errno));
+		goto exit;
+	}
+
+	// First pass gets counts, second fills the arrays.
+	// Topology could change in between, topology_version would tell, but Pi devices are static
+	struct media_v2_topology topo = {0};
+	if (0 != ioctl(fd, MEDIA_IOC_G_TOPOLOGY, &topo)) {
+		result = -errno;
+		LOGE("Failed to ioctl(%s, MEDIA_IOC_G_TOPOLOGY): %d, %s", path, errno, strerror(errno));
+		goto exit;
+	}
+
+	entities = calloc(topo.num_entities + 1, sizeof(*entities));
+	interfaces = calloc(topo.num_interfaces + 1, sizeof(*interfaces));
+	out->pads = calloc(topo.num_pads + 1, sizeof(*out->pads));
+	out->links = calloc(topo.num_links + 1, sizeof(*out->links));
+	out->entities = calloc(topo.num_entities + 1, sizeof(*out->entities));
+	if (!entities || !interfaces || !out->pads || !out->links || !out->entities) {
+		result = -ENOMEM;
+		goto exit;
+	}
+
+	topo.ptr_entities = (uintptr_t)entities;
+	topo.ptr_interfaces = (uintptr_t)interfaces;
+	topo.ptr_pads = (uintptr_t)out->pads;
+	topo.ptr_links = (uintptr_t)out->links;
+	if (0 != ioctl(fd, MEDIA_IOC_G_TOPOLOGY, &topo)) {
+		result = -errno;
+		LOGE("Failed to ioctl(%s, MEDIA_IOC_G_TOPOLOGY): %d, %s", path, errno, strerror(errno));
+		goto exit;
+	}
+
+	out->entities_count = topo.num_entities;
+	out->pads_count = topo.num_pads;
+	out->links_count = topo.num_links;
+
+	for (int i = 0; i < out->entities_count; ++i)
+		out->entities[i].entity = entities[i];
+
+	for (int i = 0; i < out->pads_count; ++i) {
+		MediaEntity *const entity = graphEntityById(out, out->pads[i].entity_id);
+		if (entity)
+			entity->pads_count++;
+	}
+
+	// Interface links connect interface (source) to entity (sink)
+	for (int i = 0; i < out->links_count; ++i) {
+		const struct media_v2_link *const link = out->links + i;
+		if ((link->flags & MEDIA_LNK_FL_LINK_TYPE) != MEDIA_LNK_FL_INTERFACE_LINK)
+			continue;
+
+		MediaEntity *const entity = graphEntityById(out, link->sink_id);
+		if (!entity || entity->devnode[0])
+			continue;
+
+		for (int j = 0; j < (int)topo.num_interfaces; ++j) {
+			const struct media_v2_interface *const intf = interfaces + j;
+			if (intf->id != link->source_id)
+				continue;
+
+			entity->dev_major = intf->devnode.major;
+			entity->dev_minor = intf->devnode.minor;
+			if (0 != mediaDevnodePath(intf->devnode.major, intf->devnode.minor, entity->devnode, sizeof(entity->devnode)))
+				entity->devnode[0] = '\0';
+			break;
+		}
+	}
+
+exit:
+	free(entities);
+	free(interfaces);
+	close(fd);
+	if (result != 0)
+		mediaGraphDestroy(out);
+	return result;
+}
+
+void mediaGraphDestroy(MediaGraph *graph) {
+	free(graph->entities);
+	free(graph->pads);
+	free(graph->links);
+	*graph = (MediaGraph){0};
+}
+
+const MediaEntity *mediaGraphFindByFunction(const MediaGraph *graph, uint32_t function, int n) {
+	for (int i = 0; i < graph->entities_count; ++i)
+		if (graph->entities[i].entity.function == function && n-- == 0)
+			return graph->entities + i;
+	return NULL;
+}
+
+const MediaEntity *mediaGraphLinkedSink(const MediaGraph *graph, const MediaEntity *source, int source_pad_index, uint32_t function) {
+	const MediaEntity *ret = NULL;
+	uint32_t ret_pad_index = UINT32_MAX;
+
+	for (int i = 0; i < graph->links_count; ++i) {
+		const struct media_v2_link *const link = graph->links + i;
+		if ((link->flags & MEDIA_LNK_FL_LINK_TYPE) != MEDIA_LNK_FL_DATA_LINK)
+			continue;
+
+		const struct media_v2_pad *const src = graphPadById(graph, link->source_id);
+		const struct media_v2_pad *const sink = graphPadById(graph, link->sink_id);
+		if (!src || !sink || src->entity_id != source->entity.id)
+			continue;
+
+		if (source_pad_index >= 0 ? src->index != (uint32_t)source_pad_index : src->index >= ret_pad_index)
+			continue;
+
+		const MediaEntity *const entity = graphEntityById(graph, sink->entity_id);
+		if (!entity || entity->entity.function != function)
+			continue;
+
+		ret = entity;
+		ret_pad_index = src->index;
+	}
+
+	return ret;
+}
+
+const MediaEntity *mediaGraphLinkedSource(const MediaGraph *graph, const MediaEntity *sink, uint32_t function) {
+	for (int i = 0; i < graph->links_count; ++i) {
+		const struct media_v2_link *const link = graph->links + i;
+		if ((link->flags & MEDIA_LNK_FL_LINK_TYPE) != MEDIA_LNK_FL_DATA_LINK)
+			continue;
+
+		const struct media_v2_pad *const src = graphPadById(graph, link->source_id);
+		const struct media_v2_pad *const dst = graphPadById(graph, link->sink_id);
+		if (!src || !dst || dst->entity_id != sink->entity.id)
+			continue;
+
+		const MediaEntity *const entity = graphEntityById(graph, src->entity_id);
+		if (entity && entity->entity.function == function)
+			return entity;
+	}
+
+	return NULL;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <linux/media.h>
+#include <stddef.h> // size_t
+#include <stdint.h>
+
+// Media controller topology, as returned by MEDIA_IOC_G_TOPOLOGY, with entities resolved to their device nodes
+
+#define MEDIA_DEVNODE_SIZE 32
+
+typedef struct MediaEntity {
+	struct media_v2_entity entity;
+
+	// "/dev/..." of the entity's interface, empty if it has none
+	char devnode[MEDIA_DEVNODE_SIZE];
+	uint32_t dev_major, dev_minor;
+
+	int pads_count;
+} MediaEntity;
+
+typedef struct MediaGraph {
+	struct media_device_info info;
+
+	MediaEntity *entities;
+	int entities_count;
+
+	struct media_v2_pad *pads;
+	int pads_count;
+
+	struct media_v2_link *links;
+	int links_count;
+} MediaGraph;
+
+// Returns 0 on success, -errno on failure
+int mediaGraphLoad(const char *path, MediaGraph *out);
+void mediaGraphDestroy(MediaGraph *graph);
+
+// n-th entity with given function, NULL if there are fewer
+const MediaEntity *mediaGraphFindByFunction(const MediaGraph *graph, uint32_t function, int n);
+
+// Entity connected by a data link to source pad source_pad_index of source, that has the function.
+// source_pad_index < 0 means the lowest numbered source pad that has such link. NULL if none
+const MediaEntity *mediaGraphLinkedSink(const MediaGraph *graph, const MediaEntity *source, int source_pad_index, uint32_t function);
+
+// Entity with the function connected by a data link to any sink pad of sink. NULL if none
+const MediaEntity *mediaGraphLinkedSource(const MediaGraph *graph, const MediaEntity *sink, uint32_t function);
+
+// Resolves char device numbers to "/dev/..." using sysfs uevent
+// Returns 0 on success, -errno on failure
+int mediaDevnodePath(uint32_t major, uint32_t minor, char *out, size_t size);
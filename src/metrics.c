@@ -0,0 +1,301 @@
+#define _GNU_SOURCE // accept4
+
+#include "metrics.h"
+
+#include "common.h"
+
+#include <sys/mman.h> // mmap
+#include <sys/socket.h>
+#include <sys/un.h> // sockaddr_un
+#include <fcntl.h> // open
+#include <unistd.h> // ftruncate, close, unlink
+#include <stdlib.h> // calloc
+#include <errno.h>
+#include <string.h> // strerror, strncpy
+
+static struct {
+	MetricsPage *page;
+	int mapped;
+	char socket_path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+
+	// Prometheus text served to socket clients. A full page with the longest names and values takes about 21k
+	char text[32768];
+} g_metrics = {0};
+
+int metricsOpen(const char *path) {
+	metricsClose();
+
+	const size_t size = sizeof(MetricsPage);
+	void *mem = NULL;
+
+	const int fd = path ? open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644) : -1;
+	if (fd >= 0) {
+		if (0 == ftruncate(fd, size)) {
+			mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			if (mem == MAP_FAILED)
+				mem = NULL;
+		}
+
+		if (!mem)
+			LOGE("Unable to map metrics page %s: %d, %s", path, errno, strerror(errno));
+
+		close(fd);
+	} else if (path) {
+		LOGE("Unable to open metrics page %s: %d, %s", path, errno, strerror(errno));
+	}
+
+	g_metrics.mapped = !!mem;
+	if (!mem) {
+		// Still useful for the metrics socket
+		mem = calloc(1, size);
+		if (!mem)
+			return -ENOMEM;
+	}
+
+	g_metrics.page = mem;
+	g_metrics.page->magic = METRICS_MAGIC;
+	g_metrics.page->version = METRICS_VERSION;
+
+	return g_metrics.mapped ? 0 : -EIO;
+}
+
+void metricsClose(void) {
+	if (!g_metrics.page)
+		return;
+
+	if (g_metrics.mapped)
+		munmap(g_metrics.page, sizeof(MetricsPage));
+	else
+		free(g_metrics.page);
+
+	g_metrics.page = NULL;
+}
+
+MetricsStream *metricsStream(const char *node, const char *stream) {
+	MetricsPage *const page = g_metrics.page;
+	if (!page)
+		return NULL;
+
+	char name[METRICS_NAME_SIZE];
+	snprintf(name, sizeof(name), "%s:%s", node, stream);
+
+	for (uint32_t i = 0; i < page->streams_count; ++i)
+		if (0 == strcmp(page->streams[i].name, name))
+			return page->streams + i;
+
+	if (page->streams_count == METRICS_MAX_STREAMS) {
+		LOGE("%s: no free metrics slot for %s", __func__, name);
+		return NULL;
+	}
+
+	MetricsStream *const ret = page->streams + page->streams_count;
+	memcpy(ret->name, name, sizeof(name));
+	__atomic_store_n(&page->streams_count, page->streams_count + 1, __ATOMIC_RELEASE);
+	return ret;
+}
+
+MetricsPump *metricsPump(const char *name) {
+	MetricsPage *const page = g_metrics.page;
+	if (!page)
+		return NULL;
+
+	for (uint32_t i = 0; i < page->pumps_count; ++i)
+		if (0 == strncmp(page->pumps[i].name, name, METRICS_NAME_SIZE - 1))
+			return page->pumps + i;
+
+	if (page->pumps_count == METRICS_MAX_PUMPS) {
+		LOGE("%s: no free metrics slot for %s", __func__, name);
+		return NULL;
+	}
+
+	MetricsPump *const ret = page->pumps + page->pumps_count;
+	strncpy(ret->name, name, METRICS_NAME_SIZE - 1);
+	__atomic_store_n(&page->pumps_count, page->pumps_count + 1, __ATOMIC_RELEASE);
+	return ret;
+}
+
+MetricsUvc *metricsUvc(const char *name) {
+	MetricsPage *const page = g_metrics.page;
+	if (!page)
+		return NULL;
+
+	for (uint32_t i = 0; i < page->uvcs_count; ++i)
+		if (0 == strncmp(page->uvcs[i].name, name, METRICS_NAME_SIZE - 1))
+			return page->uvcs + i;
+
+	if (page->uvcs_count == METRICS_MAX_UVCS) {
+		LOGE("%s: no free metrics slot for %s", __func__, name);
+		return NULL;
+	}
+
+	MetricsUvc *const ret = page->uvcs + page->uvcs_count;
+	strncpy(ret->name, name, METRICS_NAME_SIZE - 1);
+	__atomic_store_n(&page->uvcs_count, page->uvcs_count + 1, __ATOMIC_RELEASE);
+	return ret;
+}
+
+typedef struct {
+	const char *name;
+	const char *type;
+	const char *help;
+	size_t offset;
+} MetricsField;
+
+#define METRICS_FIELD(struct_, field, name_, type_, help_) \
+	{ .name = name_, .type = type_, .help = help_, .offset = offsetof(struct_, field) }
+
+static const MetricsField stream_fields[] = {
+	METRICS_FIELD(MetricsStream, dequeued, "malincam_stream_dequeued_total", "counter", "Buffers dequeued"),
+	METRICS_FIELD(MetricsStream, queued, "malincam_stream_queued_total", "counter", "Buffers queued"),
+	METRICS_FIELD(MetricsStream, bytes, "malincam_stream_bytes_total", "counter", "Payload bytes of dequeued buffers"),
+	METRICS_FIELD(MetricsStream, dropped, "malincam_stream_dropped_total", "counter", "Frames missing from dequeued sequence numbers"),
+	METRICS_FIELD(MetricsStream, errors, "malincam_stream_errors_total", "counter", "Failed buffer ioctls"),
+};
+
+static const MetricsField pump_fields[] = {
+	METRICS_FIELD(MetricsPump, passed, "malincam_pump_passed_total", "counter", "Buffers passed to destination"),
+	METRICS_FIELD(MetricsPump, skipped, "malincam_pump_skipped_total", "counter", "Source buffers superseded by a newer one"),
+	METRICS_FIELD(MetricsPump, filtered, "malincam_pump_filtered_total", "counter", "Source buffers dropped as unchanged"),
+	METRICS_FIELD(MetricsPump, errors, "malincam_pump_errors_total", "counter", "Pump failures"),
+	METRICS_FIELD(MetricsPump, dst_available, "malincam_pump_dst_available", "gauge", "Destination buffers available for queueing"),
+};
+
+static const MetricsField uvc_fields[] = {
+	METRICS_FIELD(MetricsUvc, events, "malincam_uvc_events_total", "counter", "UVC gadget events"),
+	METRICS_FIELD(MetricsUvc, event_errors, "malincam_uvc_event_errors_total", "counter", "Failures to get UVC gadget events"),
+	METRICS_FIELD(MetricsUvc, setups, "malincam_uvc_setups_total", "counter", "USB setup requests"),
+	METRICS_FIELD(MetricsUvc, data, "malincam_uvc_data_total", "counter", "USB data phase events"),
+	METRICS_FIELD(MetricsUvc, stalls, "malincam_uvc_stalls_total", "counter", "USB setup requests answered with STALL"),
+	METRICS_FIELD(MetricsUvc, request_errors, "malincam_uvc_request_errors_total", "counter", "USB setup requests with UVC request error code"),
+	METRICS_FIELD(MetricsUvc, connects, "malincam_uvc_connects_total", "counter", "USB host connects"),
+	METRICS_FIELD(MetricsUvc, disconnects, "malincam_uvc_disconnects_total", "counter", "USB host disconnects"),
+	METRICS_FIELD(MetricsUvc, streamons, "malincam_uvc_streamons_total", "counter", "Host stream starts"),
+	METRICS_FIELD(MetricsUvc, streamoffs, "malincam_uvc_streamoffs_total", "counter", "Host stream stops"),
+	METRICS_FIELD(MetricsUvc, stills, "malincam_uvc_stills_total", "counter", "Still images taken"),
+	METRICS_FIELD(MetricsUvc, still_errors, "malincam_uvc_still_errors_total", "counter", "Still images that failed"),
+	METRICS_FIELD(MetricsUvc, still_capture_us, "malincam_uvc_still_capture_us", "gauge", "Duration of the last still capture"),
+	METRICS_FIELD(MetricsUvc, still_gap_us, "malincam_uvc_still_gap_us", "gauge", "Video interruption by the last still"),
+};
+
+static uint64_t loadField(const void *base, const MetricsField *field) {
+	return __atomic_load_n((const uint64_t*)((const char*)base + field->offset), __ATOMIC_RELAXED);
+}
+
+// snprintf-like appending, keeps counting past the end
+#define APPEND(...) \
+	do { \
+		const int n_ = snprintf(buf + (written < (int)size ? written : (int)size), \
+			written < (int)size ? size - written : 0, __VA_ARGS__); \
+		if (n_ > 0) written += n_; \
+	} while(0)
+
+int metricsFormatPrometheus(const MetricsPage *page, char *buf, size_t size) {
+	int written = 0;
+	if (size)
+		buf[0] = '\0';
+
+	const uint32_t streams_count = __atomic_load_n(&page->streams_count, __ATOMIC_ACQUIRE);
+	for (int f = 0; f < (int)COUNTOF(stream_fields); ++f) {
+		const MetricsField *const field = stream_fields + f;
+		APPEND("# HELP %s %s\n# TYPE %s %s\n", field->name, field->help, field->name, field->type);
+		for (uint32_t i = 0; i < streams_count; ++i)
+			APPEND("%s{stream=\"%s\"} %llu\n", field->name, page->streams[i].name,
+				(unsigned long long)loadField(page->streams + i, field));
+	}
+
+	const uint32_t pumps_count = __atomic_load_n(&page->pumps_count, __ATOMIC_ACQUIRE);
+	for (int f = 0; f < (int)COUNTOF(pump_fields); ++f) {
+		const MetricsField *const field = pump_fields + f;
+		APPEND("# HELP %s %s\n# TYPE %s %s\n", field->name, field->help, field->name, field->type);
+		for (uint32_t i = 0; i < pumps_count; ++i)
+			APPEND("%s{pump=\"%s\"} %llu\n", field->name, page->pumps[i].name,
+				(unsigned long long)loadField(page->pumps + i, field));
+	}
+
+	const uint32_t uvcs_count = __atomic_load_n(&page->uvcs_count, __ATOMIC_ACQUIRE);
+	for (int f = 0; f < (int)COUNTOF(uvc_fields); ++f) {
+		const MetricsField *const field = uvc_fields + f;
+		APPEND("# HELP %s %s\n# TYPE %s %s\n", field->name, field->help, field->name, field->type);
+		for (uint32_t i = 0; i < uvcs_count; ++i)
+			APPEND("%s{gadget=\"%s\"} %llu\n", field->name, page->uvcs[i].name,
+				(unsigned long long)loadField(page->uvcs + i, field));
+	}
+
+	return written;
+}
+
+int metricsServerOpen(const char *path) {
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		LOGE("%s: socket path %s is too long", __func__, path);
+		return -ENAMETOOLONG;
+	}
+	strcpy(addr.sun_path, path);
+
+	const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		const int err = errno;
+		LOGE("%s: socket() failed: %d, %s", __func__, err, strerror(err));
+		return -err;
+	}
+
+	// Stale socket from a previous run
+	unlink(path);
+
+	if (0 != bind(fd, (const struct sockaddr*)&addr, sizeof(addr)) || 0 != listen(fd, 4)) {
+		const int err = errno;
+		LOGE("%s: unable to listen on %s: %d, %s", __func__, path, err, strerror(err));
+		close(fd);
+		return -err;
+	}
+
+	strcpy(g_metrics.socket_path, path);
+	LOGI("Serving metrics on %s", path);
+	return fd;
+}
+
+void metricsServerClose(int fd) {
+	if (fd < 0)
+		return;
+
+	close(fd);
+	if (g_metrics.socket_path[0]) {
+		unlink(g_metrics.socket_path);
+		g_metrics.socket_path[0] = '\0';
+	}
+}
+
+int metricsServeClients(int fd, uint32_t flags, uintptr_t arg1, uintptr_t arg2) {
+	UNUSED(flags);
+	UNUSED(arg1);
+	UNUSED(arg2);
+
+	char *const buf = g_metrics.text;
+	const int buf_size = sizeof(g_metrics.text);
+
+	for (;;) {
+		const int client = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (client < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				LOGE("%s: accept() failed: %d, %s", __func__, errno, strerror(errno));
+			break;
+		}
+
+		int length = g_metrics.page ? metricsFormatPrometheus(g_metrics.page, buf, buf_size) : 0;
+		if (length >= buf_size) {
+			LOGE("%s: metrics truncated, %d bytes needed", __func__, length);
+			length = buf_size - 1;
+		}
+
+		// Fits into an empty socket buffer, a client that is not reading is not our problem
+		if (length > 0 && length != send(client, buf, length, MSG_NOSIGNAL | MSG_DONTWAIT))
+			LOGE("%s: short metrics write", __func__);
+
+		close(client);
+	}
+
+	// Keep listening
+	return 0;
+}
@@ -0,0 +1,115 @@
+#pragma once
+
+#include "Pilatform.h" // PI_MAX_CAMERAS
+
+#include <stddef.h> // size_t
+#include <stdint.h>
+
+// Runtime counters living in a shared memory page, so they can be read by other processes at any time.
+// Also served as Prometheus text format over a unix socket, e.g.:
+//   socat - UNIX-CONNECT:/run/malincam.metrics.sock
+//
+// Every counter has a single writer thread (stream and pump counters: frame loop, UVC counters: control thread,
+// except still image ones: frame loop),
+// so counters are bumped with plain relaxed atomic stores, no locked read-modify-write on the frame path.
+// Readers use relaxed atomic loads.
+
+#define METRICS_DEFAULT_PATH "/dev/shm/malincam.metrics"
+#define METRICS_DEFAULT_SOCKET_PATH "/run/malincam.metrics.sock"
+
+// Streams of one camera pipeline: sensor 1, ISP 2, pool encoders 2 * ENCODER_POOL_MAX, gadget 1,
+// H.264 encoder 2, still encoder 2
+#define METRICS_PIPELINE_STREAMS 12
+// Pumps of one camera pipeline: cam_to_isp, encoder pool in and out, H.264 branch, raw, recorder, RTP
+#define METRICS_PIPELINE_PUMPS 7
+// Shared by all cameras: frame server, HTTP MJPEG
+#define METRICS_SHARED_PUMPS 2
+
+#define METRICS_MAX_STREAMS (PI_MAX_CAMERAS * METRICS_PIPELINE_STREAMS)
+#define METRICS_MAX_PUMPS (PI_MAX_CAMERAS * METRICS_PIPELINE_PUMPS + METRICS_SHARED_PUMPS)
+#define METRICS_MAX_UVCS PI_MAX_CAMERAS
+#define METRICS_NAME_SIZE 24
+
+#define METRICS_MAGIC 0x5254454du // "METR"
+#define METRICS_VERSION 7
+
+typedef struct MetricsStream {
+	char name[METRICS_NAME_SIZE]; // "<node>:<input|output>"
+
+	uint64_t dequeued; // DQBUF
+	uint64_t queued; // QBUF
+	uint64_t bytes; // bytesused of dequeued buffers (first plane)
+	uint64_t dropped; // gaps in dequeued buffer sequence numbers
+	uint64_t errors; // failed DQBUF/QBUF, EAGAIN excluded
+	uint64_t last_sequence;
+} MetricsStream;
+
+typedef struct MetricsPump {
+	char name[METRICS_NAME_SIZE];
+
+	uint64_t passed; // buffers passed from source to destination
+	uint64_t skipped; // source buffers returned unused because a newer one arrived
+	uint64_t filtered; // source buffers returned unused because they add nothing, see scene.h
+	uint64_t errors;
+	uint64_t dst_available; // gauge: destination buffers not currently holding a source buffer
+} MetricsPump;
+
+typedef struct MetricsUvc {
+	char name[METRICS_NAME_SIZE]; // gadget video device
+
+	uint64_t events;
+	uint64_t event_errors;
+	uint64_t setups;
+	uint64_t data;
+	uint64_t stalls; // setup responses with negative length
+	uint64_t request_errors; // setup responses with bRequestErrorCode != 0
+	uint64_t connects;
+	uint64_t disconnects;
+	uint64_t streamons;
+	uint64_t streamoffs;
+	uint64_t stills;
+	uint64_t still_errors;
+	uint64_t still_capture_us; // gauge: mode switch and capture of the last still
+	uint64_t still_gap_us; // gauge: video interruption by the last still, until the next frame reached the gadget
+} MetricsUvc;
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t streams_count;
+	uint32_t pumps_count;
+	uint32_t uvcs_count;
+
+	MetricsStream streams[METRICS_MAX_STREAMS];
+	MetricsPump pumps[METRICS_MAX_PUMPS];
+	MetricsUvc uvcs[METRICS_MAX_UVCS];
+} MetricsPage;
+
+// Single writer: read-modify-write without a locked instruction
+#define METRICS_ADD(counter, value) \
+	__atomic_store_n(&(counter), (counter) + (value), __ATOMIC_RELAXED)
+#define METRICS_INC(counter) METRICS_ADD(counter, 1)
+#define METRICS_SET(counter, value) \
+	__atomic_store_n(&(counter), (value), __ATOMIC_RELAXED)
+
+// Creates or truncates the page file at path
+// Falls back to process-private memory if the file cannot be mapped
+// Returns 0 on success
+int metricsOpen(const char *path);
+void metricsClose(void);
+
+// Find existing or allocate a new named slot. Returns NULL if metrics are not open or slots are exhausted.
+MetricsStream *metricsStream(const char *node, const char *stream);
+MetricsPump *metricsPump(const char *name);
+MetricsUvc *metricsUvc(const char *name);
+
+// Returns number of characters written, like snprintf; output is truncated to size
+int metricsFormatPrometheus(const MetricsPage *page, char *buf, size_t size);
+
+// Returns listening socket fd or -errno. Monitor it for reading and call metricsServeClients()
+int metricsServerOpen(const char *path);
+void metricsServerClose(int fd);
+
+// Accepts all pending connections, writes current metrics to each and closes them.
+// Matches pollin_fd_f signature, so can be registered with pollinator directly
+int metricsServeClients(int fd, uint32_t flags, uintptr_t arg1, uintptr_t arg2);
@@ -0,0 +1,128 @@
+#include "negotiate.h"
+
+#include "pump.h"
+#include "v4l2-print.h"
+#include "common.h"
+
+#include <errno.h>
+
+// Cheapest first
+static const struct {
+	buffer_memory_e src, dst;
+	const char *cost;
+} memory_pairs[] = {
+	{BUFFER_MEMORY_DMABUF_EXPORT, BUFFER_MEMORY_DMABUF_IMPORT, "zero copy"},
+	{BUFFER_MEMORY_MMAP, BUFFER_MEMORY_USERPTR, "user pointer"},
+	{BUFFER_MEMORY_MMAP, BUFFER_MEMORY_MMAP, "copy"},
+};
+
+static const char *memoryName(buffer_memory_e memory) {
+	switch (memory) {
+		case BUFFER_MEMORY_MMAP: return "mmap";
+		case BUFFER_MEMORY_USERPTR: return "userptr";
+		case BUFFER_MEMORY_DMABUF_EXPORT: return "dmabuf export";
+		case BUFFER_MEMORY_DMABUF_IMPORT: return "dmabuf import";
+		case BUFFER_MEMORY_NONE: break;
+	}
+	return "none";
+}
+
+static int isPrepared(const DeviceStream *st) {
+	return st->state != STREAM_STATE_IDLE;
+}
+
+static uint32_t streamPixelFormat(const DeviceStream *st) {
+	return IS_STREAM_MPLANE(st) ? st->format.fmt.pix_mp.pixelformat : st->format.fmt.pix.pixelformat;
+}
+
+// Same bitstream under two names: the JPEG encoder produces JPEG, UVC carries MJPEG
+static int formatsCompatible(uint32_t a, uint32_t b) {
+	const int a_jpeg = a == V4L2_PIX_FMT_JPEG || a == V4L2_PIX_FMT_MJPEG;
+	const int b_jpeg = b == V4L2_PIX_FMT_JPEG || b == V4L2_PIX_FMT_MJPEG;
+	return a == b || (a_jpeg && b_jpeg);
+}
+
+// Streams that don't enumerate formats take anything
+static int streamTakesFormat(const DeviceStream *st, uint32_t pixelformat) {
+	if (arraySize(&st->formats) == 0)
+		return 1;
+
+	for (int i = 0; i < arraySize(&st->formats); ++i)
+		if (arrayAtConst(&st->formats, struct v4l2_fmtdesc, i)->pixelformat == pixelformat)
+			return 1;
+	return 0;
+}
+
+// Exported dmabufs are of MMAP buffers
+static int streamTakesMemory(const DeviceStream *st, buffer_memory_e memory) {
+	if (isPrepared(st))
+		return st->buffer_memory == memory;
+
+	switch (memory) {
+		case BUFFER_MEMORY_MMAP:
+		case BUFFER_MEMORY_DMABUF_EXPORT:
+			return !!(st->buffer_capabilities & V4L2_BUF_CAP_SUPPORTS_MMAP);
+		case BUFFER_MEMORY_USERPTR:
+			return !!(st->buffer_capabilities & V4L2_BUF_CAP_SUPPORTS_USERPTR);
+		case BUFFER_MEMORY_DMABUF_IMPORT:
+			return !!(st->buffer_capabilities & V4L2_BUF_CAP_SUPPORTS_DMABUF);
+		case BUFFER_MEMORY_NONE:
+			break;
+	}
+	return 0;
+}
+
+static uint32_t pickFormat(const NegotiateEdgeArgs *args) {
+	const DeviceStream *const src = args->src;
+	const DeviceStream *const dst = args->dst;
+	for (int i = 0; i < args->pixelformats_count; ++i) {
+		const uint32_t pixelformat = args->pixelformats[i];
+		const int src_ok = isPrepared(src)
+			? formatsCompatible(streamPixelFormat(src), pixelformat)
+			: streamTakesFormat(src, pixelformat);
+		if (src_ok && (!dst || streamTakesFormat(dst, pixelformat)))
+			return pixelformat;
+	}
+
+	return 0;
+}
+
+int negotiateEdge(const NegotiateEdgeArgs *args, NegotiatedEdge *out) {
+	const DeviceStream *const src = args->src;
+	const DeviceStream *const dst = args->dst;
+
+	const uint32_t pixelformat = pickFormat(args);
+	if (!pixelformat) {
+		LOGE("%s: %s: no pixel format both ends take, src has %s", __func__, args->name,
+			isPrepared(src) ? v4l2PixFmtName(streamPixelFormat(src)) : "none yet");
+		return -ENOTSUP;
+	}
+
+	for (int i = 0; i < (int)COUNTOF(memory_pairs); ++i) {
+		if (!streamTakesMemory(src, memory_pairs[i].src))
+			continue;
+
+		if (!dst) {
+			*out = (NegotiatedEdge){.pixelformat = pixelformat, .src_memory = memory_pairs[i].src};
+			LOGI("Plan %s: %s, %s", args->name, v4l2PixFmtName(pixelformat), memoryName(out->src_memory));
+			return 0;
+		}
+
+		if (!streamTakesMemory(dst, memory_pairs[i].dst))
+			continue;
+		if (!pumpPassFuncFor(memory_pairs[i].src, IS_STREAM_MPLANE(src), memory_pairs[i].dst, IS_STREAM_MPLANE(dst)))
+			continue;
+
+		*out = (NegotiatedEdge){
+			.pixelformat = pixelformat,
+			.src_memory = memory_pairs[i].src,
+			.dst_memory = memory_pairs[i].dst,
+		};
+		LOGI("Plan %s: %s, %s -> %s, %s", args->name, v4l2PixFmtName(pixelformat),
+			memoryName(out->src_memory), memoryName(out->dst_memory), memory_pairs[i].cost);
+		return 0;
+	}
+
+	LOGE("%s: %s: no memory types to pass %s buffers with", __func__, args->name, v4l2PixFmtName(pixelformat));
+	return -ENOTSUP;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include "device.h"
+
+#include <stdint.h>
+
+// Picks what goes over one edge of the pipeline, from the enumerated formats and buffer capabilities of the
+// streams on both ends:
+// - pixel format: the first preferred one both ends take, so that nothing converts. Over an edge from an
+//   already prepared stream, it's the one that stream produces
+// - memory types: the cheapest pair pump.c has a pass function for. Shared dmabufs, then pointers into mapped
+//   buffers, then copying
+
+typedef struct {
+	// Edge name in the plan, e.g. "isp_to_enc"
+	const char *name;
+
+	// Producer. If prepared already, its format and memory type are kept
+	const DeviceStream *src;
+
+	// Consumer, NULL while it's not known. Picks memory for src alone then
+	const DeviceStream *dst;
+
+	// In order of preference
+	const uint32_t *pixelformats;
+	int pixelformats_count;
+} NegotiateEdgeArgs;
+
+typedef struct {
+	uint32_t pixelformat;
+	buffer_memory_e src_memory, dst_memory;
+} NegotiatedEdge;
+
+// Logs the chosen plan for the edge
+// Returns 0 on success, -ENOTSUP if the streams have nothing in common
+int negotiateEdge(const NegotiateEdgeArgs *args, NegotiatedEdge *out);
@@ -0,0 +1,230 @@
+// malincam-pollinator-bench: epoll and io_uring pollinator backends side by side, see pollinator.h
+// Usage: malincam-pollinator-bench [fds [events]]
+// Every fd is an eventfd or a pipe, signalled from the same thread right before the poll, so latency is the
+// cost of waiting and dispatching, not scheduling. Syscalls are the ones pollinator makes, reads and writes
+// of the fds themselves are left out. Loads:
+// - single: one fd ready per poll, like a pipeline waiting on its next buffer
+// - burst: all fds ready at once, like both cameras and their encoders completing together
+// - rearm: single, and every callback changes the fd's event bits, like pumps toggling write interest
+#define ARRAY_H_IMPLEMENT
+#include "array.h"
+#include "pollinator.h"
+#include "common.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h> // atoi, qsort
+#include <string.h> // strerror
+#include <time.h> // clock_gettime
+#include <unistd.h> // pipe, read, write
+#include <sys/eventfd.h>
+
+#define BENCH_MAX_FDS 256
+
+typedef enum {
+	BENCH_FD_EVENTFD,
+	BENCH_FD_PIPE,
+} BenchFdKind;
+
+typedef enum {
+	BENCH_LOAD_SINGLE,
+	BENCH_LOAD_BURST,
+	BENCH_LOAD_REARM,
+	BENCH_LOAD_COUNT,
+} BenchLoad;
+
+static const char *const bench_load_names[BENCH_LOAD_COUNT] = {"single", "burst", "rearm"};
+
+typedef struct {
+	BenchFdKind kind;
+	BenchLoad load;
+	struct Pollinator *p;
+	PollinatorHandle handles[BENCH_MAX_FDS];
+	uint32_t event_bits[BENCH_MAX_FDS];
+	int fds_count;
+	int events;
+
+	// Read and write ends, the same fd for eventfds
+	int rfd[BENCH_MAX_FDS], wfd[BENCH_MAX_FDS];
+	uint64_t signalled_ns[BENCH_MAX_FDS];
+
+	// Signal to dispatch, one per event
+	uint64_t *latency_ns;
+	int latency_count;
+} Bench;
+
+static uint64_t monotonicNs(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int benchOpenFds(Bench *b) {
+	for (int i = 0; i < b->fds_count; ++i) {
+		if (b->kind == BENCH_FD_EVENTFD) {
+			b->rfd[i] = b->wfd[i] = eventfd(0, EFD_NONBLOCK);
+			if (b->rfd[i] < 0)
+				goto fail;
+		} else {
+			int fds[2];
+			if (0 != pipe(fds))
+				goto fail;
+			b->rfd[i] = fds[0];
+			b->wfd[i] = fds[1];
+		}
+	}
+	return 0;
+
+fail:
+	LOGE("Unable to open %d fds: %d, %s", b->fds_count, errno, strerror(errno));
+	return -1;
+}
+
+static void benchCloseFds(Bench *b) {
+	for (int i = 0; i < b->fds_count; ++i) {
+		close(b->rfd[i]);
+		if (b->wfd[i] != b->rfd[i])
+			close(b->wfd[i]);
+	}
+}
+
+static void benchSignal(Bench *b, int index) {
+	const uint64_t one = 1;
+	b->signalled_ns[index] = monotonicNs();
+	if (sizeof(one) != write(b->wfd[index], &one, sizeof(one)))
+		LOGE("Unable to signal fd %d: %d, %s", b->wfd[index], errno, strerror(errno));
+}
+
+static int benchReadable(int fd, uint32_t flags, uintptr_t arg1, uintptr_t arg2) {
+	UNUSED(flags);
+	Bench *const b = (Bench*)arg1;
+	const uint64_t now_ns = monotonicNs();
+
+	uint64_t value;
+	if (sizeof(value) != read(fd, &value, sizeof(value)))
+		LOGE("Unable to read fd %d: %d, %s", fd, errno, strerror(errno));
+
+	if (b->latency_count < b->events)
+		b->latency_ns[b->latency_count++] = now_ns - b->signalled_ns[arg2];
+
+	if (b->load == BENCH_LOAD_REARM) {
+		b->event_bits[arg2] ^= POLLIN_FD_EXCEPT;
+		pollinatorSetEvents(b->p, b->handles[arg2], b->event_bits[arg2]);
+	}
+	return POLLINATOR_CONTINUE;
+}
+
+static int compareU64(const void *a, const void *b) {
+	const uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+	return x < y ? -1 : x > y;
+}
+
+// Returns 0 on success, 1 if events went missing
+static int benchRun(Bench *b, PollinatorBackend backend, BenchLoad load) {
+	struct Pollinator *const p = pollinatorCreate(backend);
+	if (!p)
+		return 1;
+
+	if (pollinatorGetBackend(p) != backend) {
+		printf("%-8s unavailable\n", pollinatorBackendName(backend));
+		pollinatorDestroy(p);
+		return 0;
+	}
+
+	b->p = p;
+	b->load = load;
+	for (int i = 0; i < b->fds_count; ++i) {
+		b->event_bits[i] = POLLIN_FD_READ;
+		b->handles[i] = pollinatorMonitorFd(p, &(PollinatorMonitorFd){
+			.fd = b->rfd[i],
+			.event_bits = POLLIN_FD_READ,
+			.func = benchReadable,
+			.arg1 = (uintptr_t)b,
+			.arg2 = i,
+		});
+	}
+
+	// Registration is not what's measured, neither is the first arming of multishot polls
+	pollinatorPoll(p, 0);
+	PollinatorStats before;
+	pollinatorGetStats(p, &before);
+
+	b->latency_count = 0;
+	const uint64_t begin_ns = monotonicNs();
+	const int burst = load == BENCH_LOAD_BURST;
+	for (int sent = 0; sent < b->events;) {
+		const int count = burst ? b->fds_count : 1;
+		for (int i = 0; i < count && sent < b->events; ++i, ++sent)
+			benchSignal(b, burst ? i : sent % b->fds_count);
+
+		while (b->latency_count < sent)
+			if (0 > pollinatorPoll(p, 1000))
+				break;
+	}
+	const uint64_t elapsed_ns = monotonicNs() - begin_ns;
+
+	PollinatorStats after;
+	pollinatorGetStats(p, &after);
+	pollinatorDestroy(p);
+
+	const int events = b->latency_count;
+	if (!events) {
+		LOGE("%s: no events dispatched", pollinatorBackendName(backend));
+		return 1;
+	}
+
+	qsort(b->latency_ns, events, sizeof(*b->latency_ns), compareU64);
+	uint64_t total_ns = 0;
+	for (int i = 0; i < events; ++i)
+		total_ns += b->latency_ns[i];
+
+	const uint64_t polls = after.polls - before.polls;
+	const uint64_t syscalls = after.syscalls - before.syscalls;
+	printf("%-8s %-6s: %6.3f syscalls/event %6.2f events/poll latency avg %6.2f us p50 %6.2f us p99 %7.2f us, "
+		"%7.0f events/s%s\n",
+		pollinatorBackendName(backend), bench_load_names[load],
+		(double)syscalls / events, (double)events / (polls ? polls : 1),
+		total_ns / 1000. / events, b->latency_ns[events / 2] / 1000., b->latency_ns[events * 99 / 100] / 1000.,
+		events * 1e9 / elapsed_ns, events == b->events ? "" : " MISSING EVENTS");
+	return events != b->events;
+}
+
+int main(int argc, const char *argv[]) {
+	int fds_count = 16, events = 100000;
+	if (argc >= 2)
+		fds_count = atoi(argv[1]);
+	if (argc >= 3)
+		events = atoi(argv[2]);
+	if (fds_count <= 0 || fds_count > BENCH_MAX_FDS || events <= 0) {
+		LOGE("Usage: %s [fds(1..%d) [events]]", argv[0], BENCH_MAX_FDS);
+		return 1;
+	}
+
+	static Bench b;
+	b.fds_count = fds_count;
+	b.events = events;
+	b.latency_ns = malloc(sizeof(*b.latency_ns) * events);
+	if (!b.latency_ns) {
+		LOGE("Unable to allocate %d latency samples", events);
+		return 1;
+	}
+
+	static const BenchFdKind kinds[] = {BENCH_FD_EVENTFD, BENCH_FD_PIPE};
+	static const PollinatorBackend backends[] = {POLLINATOR_BACKEND_EPOLL, POLLINATOR_BACKEND_URING};
+	int result = 0;
+	for (int k = 0; k < (int)COUNTOF(kinds); ++k) {
+		b.kind = kinds[k];
+		if (0 != benchOpenFds(&b))
+			return 1;
+
+		printf("%d %s fds, %d events\n", fds_count, b.kind == BENCH_FD_EVENTFD ? "eventfd" : "pipe", events);
+		for (int load = 0; load < BENCH_LOAD_COUNT; ++load)
+			for (int i = 0; i < (int)COUNTOF(backends); ++i)
+				result |= benchRun(&b, backends[i], load);
+
+		benchCloseFds(&b);
+	}
+
+	free(b.latency_ns);
+	return result;
+}
@@ -1,29 +1,94 @@
 #include "pollinator.h"
+#include "uring.h"
+#include "probes.h"
 #include "common.h"
 
 #include <sys/epoll.h>
+#include <poll.h> // POLLIN et al. for io_uring
 #include <errno.h>
 #include <string.h> // strerror
 #include <unistd.h> // close
 #include <stdlib.h> // calloc
 
-typedef struct Pollinator {
-	Array fds;
-	int epoll_fd;
-} Pollinator;
-
 typedef struct {
-	int fd;
+	int fd; // -1 if slot is free
+	uint32_t generation;
+	uint32_t event_bits; // zero if parked
 	pollin_fd_f *func;
 	uintptr_t arg1, arg2;
+
+	uint64_t events_count;
+
+	// io_uring: sequence of the currently armed multishot poll, completions from older arms are stale
+	uint8_t arm;
+
+	// Next free slot index, valid only for free slots
+	int next_free;
 } PollinatorFd;
 
-struct Pollinator *pollinatorCreate(void) {
+typedef struct Pollinator {
+	Array /*T(PollinatorFd)*/ fds;
+
+	// Map of fd to slot index, -1 if fd is not registered
+	Array /*T(int)*/ fd_to_slot;
+
+	int free_head;
+
+	PollinatorBackend backend;
+	int epoll_fd;
+	Uring uring;
+
+	PollinatorStats stats;
+} Pollinator;
+
+#define HANDLE_MAKE(index, generation) ((((uint64_t)(generation)) << 32) | (uint32_t)(index))
+#define HANDLE_INDEX(handle) ((int)((handle) & 0xffffffffu))
+#define HANDLE_GENERATION(handle) ((uint32_t)((handle) >> 32))
+
+// io_uring user_data is the handle with arm sequence in bits 24..31 of the index part.
+// Zero generation is never valid, so zero user_data marks internal requests, e.g. POLL_REMOVE.
+#define URING_MAX_SLOTS (1 << 24)
+#define URING_USER_DATA(index, generation, arm) (HANDLE_MAKE((index) | ((uint32_t)(arm) << 24), generation))
+#define URING_USER_DATA_HANDLE(ud) ((ud) & ~(0xffull << 24))
+#define URING_USER_DATA_ARM(ud) ((uint8_t)((ud) >> 24))
+#define URING_USER_DATA_INTERNAL 0
+
+#define URING_ENTRIES 64
+
+const char *pollinatorBackendName(PollinatorBackend backend) {
+	switch (backend) {
+		case POLLINATOR_BACKEND_EPOLL: return "epoll";
+		case POLLINATOR_BACKEND_URING: return "io_uring";
+	}
+	return "UNKNOWN";
+}
+
+struct Pollinator *pollinatorCreate(PollinatorBackend backend) {
 	Pollinator *p = calloc(sizeof(Pollinator), 1);
 	arrayInit(&p->fds, PollinatorFd);
+	arrayInit(&p->fd_to_slot, int);
+	p->free_head = -1;
+	p->epoll_fd = -1;
+	p->uring.fd = -1;
 
+	if (backend == POLLINATOR_BACKEND_URING) {
+		const int result = uringInit(&p->uring, URING_ENTRIES);
+		if (result == 0 && !(p->uring.features & IORING_FEAT_EXT_ARG)) {
+			LOGE("io_uring doesn't support IORING_FEAT_EXT_ARG, needed for wait timeouts");
+			uringDestroy(&p->uring);
+		} else if (result == 0) {
+			p->backend = POLLINATOR_BACKEND_URING;
+			LOGI("Pollinator backend: %s", pollinatorBackendName(p->backend));
+			return p;
+		}
+
+		LOGE("Unable to use io_uring pollinator backend, falling back to epoll");
+	}
+
+	p->backend = POLLINATOR_BACKEND_EPOLL;
 	p->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
 	ASSERT(p->epoll_fd > 0);
+	LOGI("Pollinator backend: %s", pollinatorBackendName(p->backend));
 	return p;
 }
 
@@ -31,81 +96,296 @@ void pollinatorDestroy(Pollinator *p) {
 	if (!p)
 		return;
 
+	arrayDestroy(&p->fd_to_slot);
 	arrayDestroy(&p->fds);
-	close(p->epoll_fd);
+
+	if (p->epoll_fd >= 0)
+		close(p->epoll_fd);
+
+	if (p->uring.fd >= 0)
+		uringDestroy(&p->uring);
+
 	free(p);
 }
 
-static int findPfd(Pollinator *const p, int fd) {
-	const int n = arraySize(&p->fds);
-	for (int i = 0; i < n; ++i) {
-		const PollinatorFd *const pfd = arrayAtConst(&p->fds, PollinatorFd, i);
-		if (pfd->fd == fd)
-			return i;
+PollinatorBackend pollinatorGetBackend(const Pollinator *p) {
+	return p->backend;
+}
+
+void pollinatorGetStats(const Pollinator *p, PollinatorStats *out) {
+	*out = p->stats;
+	if (p->backend == POLLINATOR_BACKEND_URING)
+		out->syscalls = p->uring.enters;
+}
+
+static int findPfd(const Pollinator *const p, int fd) {
+	if (fd < 0 || fd >= arraySize(&p->fd_to_slot))
+		return -1;
+
+	return *arrayAtConst(&p->fd_to_slot, int, fd);
+}
+
+static void mapFd(Pollinator *const p, int fd, int index) {
+	while (arraySize(&p->fd_to_slot) <= fd) {
+		const int unmapped = -1;
+		arrayAppend(&p->fd_to_slot, &unmapped);
 	}
 
-	return -1;
+	*arrayAt(&p->fd_to_slot, int, fd) = index;
 }
 
 static int allocPfd(Pollinator *const p) {
-	const int n = arraySize(&p->fds);
-	for (int i = 0; i < n; ++i) {
-		const PollinatorFd *const pfd = arrayAtConst(&p->fds, PollinatorFd, i);
-		if (pfd->fd < 0)
-			return i;
+	if (p->free_head >= 0) {
+		const int index = p->free_head;
+		p->free_head = arrayAt(&p->fds, PollinatorFd, index)->next_free;
+		return index;
 	}
 
-	return arrayAppend(&p->fds, NULL);
+	// Generation starts at 1, so that no valid handle equals POLLINATOR_HANDLE_NONE
+	const PollinatorFd pfd = {
+		.fd = -1,
+		.generation = 1,
+		.next_free = -1,
+	};
+	return arrayAppend(&p->fds, &pfd);
 }
 
-int pollinatorMonitorFd(Pollinator *p, const PollinatorMonitorFd *reg) {
-	int index = findPfd(p, reg->fd);
-	int epoll_op = reg->event_bits == 0 ? EPOLL_CTL_DEL : EPOLL_CTL_MOD;
+static void freePfd(Pollinator *const p, int index) {
+	PollinatorFd *const pfd = arrayAt(&p->fds, PollinatorFd, index);
+	mapFd(p, pfd->fd, -1);
 
-	if (epoll_op == EPOLL_CTL_DEL) {
-		if (index < 0)
+	// Bumping generation invalidates both the handle and any in-flight epoll events for this slot
+	*pfd = (PollinatorFd){
+		.fd = -1,
+		.generation = pfd->generation + 1,
+		.next_free = p->free_head,
+	};
+	p->free_head = index;
+}
+
+// Returns slot index, or -1 if handle is stale
+static int handleToIndex(const Pollinator *const p, PollinatorHandle handle) {
+	const int index = HANDLE_INDEX(handle);
+	if (handle == POLLINATOR_HANDLE_NONE || index >= arraySize(&p->fds))
+		return -1;
+
+	const PollinatorFd *const pfd = arrayAtConst(&p->fds, PollinatorFd, index);
+	if (pfd->fd < 0 || pfd->generation != HANDLE_GENERATION(handle))
+		return -1;
+
+	return index;
+}
+
+static uint32_t epollEvents(uint32_t event_bits) {
+	return EPOLLET
+		| ((event_bits & POLLIN_FD_READ) ? EPOLLIN : 0)
+		| ((event_bits & POLLIN_FD_WRITE) ? EPOLLOUT : 0)
+		| ((event_bits & POLLIN_FD_EXCEPT) ? EPOLLPRI : 0)
+		| ((event_bits & POLLIN_FD_ERR) ? EPOLLERR : 0);
+}
+
+// Applies new event bits to the slot, choosing ADD/MOD/DEL based on whether it was parked
+static int pfdSetEventsEpoll(Pollinator *const p, int index, uint32_t event_bits) {
+	PollinatorFd *const pfd = arrayAt(&p->fds, PollinatorFd, index);
+
+	int epoll_op;
+	if (event_bits == 0) {
+		if (pfd->event_bits == 0)
 			return 0;
+		epoll_op = EPOLL_CTL_DEL;
+	} else {
+		epoll_op = pfd->event_bits == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+	}
 
-		PollinatorFd *const pfd = arrayAt(&p->fds, PollinatorFd, index);
-		pfd->fd = -1;
+	struct epoll_event event = {
+		.data.u64 = HANDLE_MAKE(index, pfd->generation),
+		.events = epollEvents(event_bits),
+	};
+
+	p->stats.syscalls++;
+	if (0 != epoll_ctl(p->epoll_fd, epoll_op, pfd->fd, &event)) {
+		const int err = errno;
+		LOGE("epoll_ctl(%d, fd=%d) failed: %d, %s", epoll_op, pfd->fd, err, strerror(err));
+		return -err;
+	}
+
+	pfd->event_bits = event_bits;
+	return 0;
+}
+
+static uint32_t uringPollMask(uint32_t event_bits) {
+	return 0
+		| ((event_bits & POLLIN_FD_READ) ? POLLIN : 0)
+		| ((event_bits & POLLIN_FD_WRITE) ? POLLOUT : 0)
+		| ((event_bits & POLLIN_FD_EXCEPT) ? POLLPRI : 0)
+		| ((event_bits & POLLIN_FD_ERR) ? POLLERR : 0);
+}
+
+static int uringArm(Pollinator *const p, int index) {
+	PollinatorFd *const pfd = arrayAt(&p->fds, PollinatorFd, index);
+	struct io_uring_sqe *const sqe = uringGetSqe(&p->uring);
+	if (!sqe)
+		return -EBUSY;
+
+	pfd->arm++;
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = pfd->fd;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->poll32_events = uringPollMask(pfd->event_bits);
+	sqe->user_data = URING_USER_DATA(index, pfd->generation, pfd->arm);
+	return 0;
+}
+
+static int uringDisarm(Pollinator *const p, int index) {
+	const PollinatorFd *const pfd = arrayAtConst(&p->fds, PollinatorFd, index);
+	struct io_uring_sqe *const sqe = uringGetSqe(&p->uring);
+	if (!sqe)
+		return -EBUSY;
+
+	sqe->opcode = IORING_OP_POLL_REMOVE;
+	sqe->fd = -1;
+	sqe->addr = URING_USER_DATA(index, pfd->generation, pfd->arm);
+	sqe->user_data = URING_USER_DATA_INTERNAL;
+	return 0;
+}
+
+// Changes are only queued here, they get submitted with the next io_uring_enter() in pollinatorPoll()
+static int pfdSetEventsUring(Pollinator *const p, int index, uint32_t event_bits) {
+	if (index >= URING_MAX_SLOTS)
+		return -ENOSPC;
 
-		const int result = epoll_ctl(p->epoll_fd, EPOLL_CTL_DEL, reg->fd, NULL);
-		ASSERT(result == 0);
+	PollinatorFd *const pfd = arrayAt(&p->fds, PollinatorFd, index);
+	const uint32_t old_bits = pfd->event_bits;
+	if (old_bits == event_bits)
 		return 0;
+
+	if (old_bits != 0) {
+		const int result = uringDisarm(p, index);
+		if (result != 0)
+			return result;
 	}
 
-	if (index < 0) {
+	pfd->event_bits = event_bits;
+	if (event_bits == 0)
+		return 0;
+
+	return uringArm(p, index);
+}
+
+static int pfdSetEvents(Pollinator *const p, int index, uint32_t event_bits) {
+	switch (p->backend) {
+		case POLLINATOR_BACKEND_EPOLL: return pfdSetEventsEpoll(p, index, event_bits);
+		case POLLINATOR_BACKEND_URING: return pfdSetEventsUring(p, index, event_bits);
+	}
+	return -EINVAL;
+}
+
+PollinatorHandle pollinatorMonitorFd(Pollinator *p, const PollinatorMonitorFd *reg) {
+	int index = findPfd(p, reg->fd);
+
+	if (reg->event_bits == 0) {
+		if (index >= 0) {
+			pfdSetEvents(p, index, 0);
+			freePfd(p, index);
+		}
+		return POLLINATOR_HANDLE_NONE;
+	}
+
+	const int is_new = index < 0;
+	if (is_new) {
 		index = allocPfd(p);
-		epoll_op = EPOLL_CTL_ADD;
+		PollinatorFd *const pfd = arrayAt(&p->fds, PollinatorFd, index);
+		pfd->fd = reg->fd;
+		pfd->event_bits = 0;
+		pfd->events_count = 0;
+		mapFd(p, reg->fd, index);
 	}
 
-	*arrayAt(&p->fds, PollinatorFd, index) = (PollinatorFd){
-		.fd = reg->fd,
-		.func = reg->func,
-		.arg1 = reg->arg1,
-		.arg2 = reg->arg2,
-	};
+	PollinatorFd *const pfd = arrayAt(&p->fds, PollinatorFd, index);
+	pfd->func = reg->func;
+	pfd->arg1 = reg->arg1;
+	pfd->arg2 = reg->arg2;
 
-	struct epoll_event event = {
-		.data.u32 = index,
-		.events = EPOLLET
-			| ((reg->event_bits & POLLIN_FD_READ) ? EPOLLIN : 0)
-			| ((reg->event_bits & POLLIN_FD_WRITE) ? EPOLLOUT : 0)
-			| ((reg->event_bits & POLLIN_FD_EXCEPT) ? EPOLLPRI : 0)
-			| ((reg->event_bits & POLLIN_FD_ERR) ? EPOLLERR : 0),
-	};
+	if (0 != pfdSetEvents(p, index, reg->event_bits)) {
+		if (is_new)
+			freePfd(p, index);
+		return POLLINATOR_HANDLE_NONE;
+	}
 
-	const int result = epoll_ctl(p->epoll_fd, epoll_op, reg->fd, &event);
-	ASSERT(result == 0);
-	return 0;
+	return HANDLE_MAKE(index, pfd->generation);
+}
+
+int pollinatorSetEvents(Pollinator *p, PollinatorHandle handle, uint32_t event_bits) {
+	const int index = handleToIndex(p, handle);
+	if (index < 0)
+		return -ENOENT;
+
+	return pfdSetEvents(p, index, event_bits);
+}
+
+void pollinatorRelease(Pollinator *p, PollinatorHandle handle) {
+	const int index = handleToIndex(p, handle);
+	if (index < 0)
+		return;
+
+	pfdSetEvents(p, index, 0);
+	freePfd(p, index);
+}
+
+uint64_t pollinatorEventsCount(const Pollinator *p, PollinatorHandle handle) {
+	const int index = handleToIndex(p, handle);
+	if (index < 0)
+		return 0;
+
+	return arrayAtConst(&p->fds, PollinatorFd, index)->events_count;
+}
+
+static uint32_t flagsFromPollMask(uint32_t mask) {
+	// EPOLL* and POLL* have the same values for these
+	return 0
+		| ((mask & POLLIN) ? POLLIN_FD_READ : 0)
+		| ((mask & POLLOUT) ? POLLIN_FD_WRITE : 0)
+		| ((mask & POLLPRI) ? POLLIN_FD_EXCEPT : 0)
+		| ((mask & (POLLERR | POLLHUP)) ? POLLIN_FD_ERR : 0);
+}
+
+// Returns callback result to be propagated from pollinatorPoll()
+static int dispatch(Pollinator *const p, PollinatorHandle handle, uint32_t flags) {
+	// Callbacks may have released or parked this slot, or the fds array might have been reallocated
+	const int index = handleToIndex(p, handle);
+	if (index < 0)
+		return POLLINATOR_CONTINUE;
+
+	PollinatorFd *const pfd = arrayAt(&p->fds, PollinatorFd, index);
+	if (pfd->event_bits == 0 || flags == 0)
+		return POLLINATOR_CONTINUE;
+
+	pfd->events_count++;
+	p->stats.events++;
+
+	// Copy out, pfd pointer is not valid after the callback
+	const int fd = pfd->fd;
+	pollin_fd_f *const func = pfd->func;
+	const uintptr_t arg1 = pfd->arg1, arg2 = pfd->arg2;
+
+	const int func_result = func(fd, flags, arg1, arg2);
+	switch (func_result) {
+		case POLLINATOR_STOP:
+			pollinatorRelease(p, handle);
+			return POLLINATOR_CONTINUE;
+		default:
+			return func_result;
+	}
 }
 
-int pollinatorPoll(Pollinator *p, int timeout_ms) {
 #define MAX_EVENTS 16
+
+static int pollEpoll(Pollinator *p, int timeout_ms) {
 	struct epoll_event events[MAX_EVENTS];
 	int count;
 
 	for (;;) {
+		p->stats.syscalls++;
 		count = epoll_wait(p->epoll_fd, events, MAX_EVENTS, timeout_ms);
 		if (count < 0) {
 			LOGE("epoll_wait returned %d: %s", errno, strerror(errno));
@@ -120,11 +400,9 @@ int pollinatorPoll(Pollinator *p, int timeout_ms) {
 	int result = POLLINATOR_CONTINUE;
 	for (int i = 0; i < count; ++i) {
 		const struct epoll_event *const e = events + i;
-		const int index = e->data.u32;
-		const PollinatorFd *const fd = arrayAtConst(&p->fds, PollinatorFd, index);
 
 		/*
-		LOGI("[e=%d/%d] fd=%d revents=%s%s%s%s", i, count, fd->fd,
+		LOGI("[e=%d/%d] handle=%llx revents=%s%s%s%s", i, count, (unsigned long long)e->data.u64,
 			(e->events & EPOLLIN) ? "EPOLLIN " : "",
 			(e->events & EPOLLOUT) ? "EPOLLOUT " : "",
 			(e->events & EPOLLPRI) ? "EPOLLPRI " : "",
@@ -132,26 +410,81 @@ int pollinatorPoll(Pollinator *p, int timeout_ms) {
 		);
 		*/
 
-		const uint32_t flags = 0
-			| ((e->events & EPOLLIN) ? POLLIN_FD_READ : 0)
-			| ((e->events & EPOLLOUT) ? POLLIN_FD_WRITE : 0)
-			| ((e->events & EPOLLPRI) ? POLLIN_FD_EXCEPT : 0)
-			| ((e->events & (EPOLLERR | EPOLLHUP)) ? POLLIN_FD_ERR : 0);
+		const int func_result = dispatch(p, e->data.u64, flagsFromPollMask(e->events));
+		if (func_result != POLLINATOR_CONTINUE)
+			result = func_result;
+	}
 
-		if (0 == flags)
+	return result;
+}
+
+static int pollUring(Pollinator *p, int timeout_ms) {
+	// Submits all queued registration changes and waits in a single syscall
+	const int submitted = uringSubmitAndWait(&p->uring, 1, timeout_ms);
+	if (submitted < 0 && submitted != -ETIME) {
+		LOGE("io_uring_enter returned %d: %s", -submitted, strerror(-submitted));
+		return submitted;
+	}
+
+	int result = POLLINATOR_CONTINUE;
+	struct io_uring_cqe cqe;
+	for (int i = 0; i < MAX_EVENTS && uringPopCqe(&p->uring, &cqe); ++i) {
+		if (cqe.user_data == URING_USER_DATA_INTERNAL)
+			continue;
+
+		const PollinatorHandle handle = URING_USER_DATA_HANDLE(cqe.user_data);
+		const int index = handleToIndex(p, handle);
+		if (index < 0)
 			continue;
 
-		const int func_result = fd->func(fd->fd, flags, fd->arg1, fd->arg2);
-		switch (func_result) {
-			case POLLINATOR_CONTINUE:
-				break;
-			case POLLINATOR_STOP:
-				LOGE("POLLINATOR_STOP is not implemented");
-				break;
-			default:
+		PollinatorFd *const pfd = arrayAt(&p->fds, PollinatorFd, index);
+		if (pfd->arm != URING_USER_DATA_ARM(cqe.user_data))
+			continue;
+
+		// Disarmed by POLL_REMOVE
+		if (cqe.res == -ECANCELED)
+			continue;
+
+		// The poll is gone. The owner gets POLLIN_FD_ERR like from epoll, and the fd is parked unless the callback
+		// armed it again with other events
+		if (cqe.res < 0) {
+			LOGE("io_uring poll for fd=%d failed: %d, %s", pfd->fd, -cqe.res, strerror(-cqe.res));
+			const uint8_t arm = pfd->arm;
+			const int func_result = dispatch(p, handle, POLLIN_FD_ERR);
+			if (func_result != POLLINATOR_CONTINUE)
 				result = func_result;
+
+			const int after = handleToIndex(p, handle);
+			PollinatorFd *const apfd = after >= 0 ? arrayAt(&p->fds, PollinatorFd, after) : NULL;
+			if (apfd && apfd->arm == arm)
+				apfd->event_bits = 0;
+			continue;
 		}
+
+		// Multishot poll may be terminated by the kernel at any time, e.g. on CQ overflow
+		if (!(cqe.flags & IORING_CQE_F_MORE) && pfd->event_bits != 0)
+			uringArm(p, index);
+
+		const int func_result = dispatch(p, handle, flagsFromPollMask(cqe.res));
+		if (func_result != POLLINATOR_CONTINUE)
+			result = func_result;
+	}
+
+	return result;
+}
+
+int pollinatorPoll(Pollinator *p, int timeout_ms) {
+	p->stats.polls++;
+	const uint64_t events_before = p->stats.events;
+	PROBE(poll_sleep, timeout_ms);
+
+	int result = -EINVAL;
+	switch (p->backend) {
+		case POLLINATOR_BACKEND_EPOLL: result = pollEpoll(p, timeout_ms); break;
+		case POLLINATOR_BACKEND_URING: result = pollUring(p, timeout_ms); break;
 	}
 
+	PROBE(poll_wake, result, p->stats.events - events_before);
+	UNUSED(events_before);
 	return result;
 }
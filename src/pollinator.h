@@ -5,7 +5,10 @@
 #include <stdint.h>
 
 typedef enum {
+	// Keep monitoring the fd
 	POLLINATOR_CONTINUE = 0,
+
+	// Unregister the fd and release its handle
 	POLLINATOR_STOP,
 } PollinatorAction;
 
@@ -14,14 +17,41 @@ typedef enum {
 #define POLLIN_FD_EXCEPT (1<<2)
 #define POLLIN_FD_ERR (1<<3)
 
-// No pollinator functions are safe to call from within the callback
+// All pollinator functions except pollinatorDestroy() and pollinatorPoll() are safe to call from within the callback.
+// Events for registrations that were released or parked during the same poll are dropped, registrations whose
+// events were changed to other non-zero bits still get theirs.
 typedef int (pollin_fd_f)(int fd, uint32_t flags, uintptr_t arg1, uintptr_t arg2);
 
+// Stable registration handle: slot index in lower 32 bits, slot generation in upper 32 bits.
+// Stays valid until the fd is unregistered, including across pollinatorSetEvents(.., 0) parking.
+typedef uint64_t PollinatorHandle;
+#define POLLINATOR_HANDLE_NONE 0
+
 struct Pollinator;
 
-struct Pollinator *pollinatorCreate(void);
+typedef enum {
+	POLLINATOR_BACKEND_EPOLL,
+
+	// Multishot IORING_OP_POLL_ADD, needs linux >= 5.13.
+	// Registration changes are batched into the next wait, saving a syscall per change.
+	POLLINATOR_BACKEND_URING,
+} PollinatorBackend;
+
+// Falls back to epoll if requested backend is not available
+struct Pollinator *pollinatorCreate(PollinatorBackend backend);
 void pollinatorDestroy(struct Pollinator *p);
 
+PollinatorBackend pollinatorGetBackend(const struct Pollinator *p);
+const char *pollinatorBackendName(PollinatorBackend backend);
+
+typedef struct {
+	uint64_t polls; // pollinatorPoll() calls
+	uint64_t syscalls; // epoll_wait/epoll_ctl/io_uring_enter made on behalf of pollinator
+	uint64_t events; // dispatched callbacks
+} PollinatorStats;
+
+void pollinatorGetStats(const struct Pollinator *p, PollinatorStats *out);
+
 typedef struct {
 	int fd;
 	uint32_t event_bits; // POLLIN_FD_*, zero means unregister
@@ -29,7 +59,19 @@ typedef struct {
 	uintptr_t arg1, arg2;
 } PollinatorMonitorFd;
 
-// Returns < 0 on failure
-int pollinatorMonitorFd(struct Pollinator *p, const PollinatorMonitorFd *reg);
+// Registers a new fd, or updates the existing registration for the same fd.
+// Returns handle, or POLLINATOR_HANDLE_NONE on failure or unregistration
+PollinatorHandle pollinatorMonitorFd(struct Pollinator *p, const PollinatorMonitorFd *reg);
+
+// Changes event bits for an existing registration.
+// Zero event bits park the fd: it's removed from the wait set, but the handle stays valid.
+// Returns 0 on success, -ENOENT on stale handle, -errno on epoll failure
+int pollinatorSetEvents(struct Pollinator *p, PollinatorHandle handle, uint32_t event_bits);
+
+// Unregisters the fd, handle becomes stale
+void pollinatorRelease(struct Pollinator *p, PollinatorHandle handle);
+
+// Number of callback invocations for this registration, 0 for stale handles
+uint64_t pollinatorEventsCount(const struct Pollinator *p, PollinatorHandle handle);
 
 int pollinatorPoll(struct Pollinator *p, int timeout_ms);
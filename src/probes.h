@@ -0,0 +1,22 @@
+#pragma once
+
+// USDT probes for perf/bpftrace, provider "malincam". See malincam-latency.bt for an example.
+// A probe is a single nop when not attached, arguments are only materialized in registers/stack slots.
+// Built only if <sys/sdt.h> (systemtap-sdt-dev) is available, see HAVE_SDT in Makefile.
+//
+// Probes and arguments:
+//   dqbuf(fd, buf_type, index, sequence, bytesused)
+//   qbuf(fd, buf_type, index, bytesused)
+//   pass_begin(src_fd, src_index, dst_fd, dst_index)
+//   pass_end(src_fd, src_index, dst_fd, dst_index, result)
+//   poll_sleep(timeout_ms)
+//   poll_wake(result, events_dispatched)
+//   uvc_event_begin(event_type)
+//   uvc_event_end(event_type, result)
+
+#ifdef HAVE_SDT
+#include <sys/sdt.h>
+#define PROBE(name, ...) STAP_PROBEV(malincam, name, ##__VA_ARGS__)
+#else
+#define PROBE(name, ...) ((void)0)
+#endif
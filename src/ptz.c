@@ -0,0 +1,111 @@
+#include "ptz.h"
+
+#include "device.h"
+#include "common.h"
+
+#include <stdlib.h> // calloc, free
+
+// Fraction of the remaining distance covered per frame, eases into the target
+#define PTZ_STEP_SHIFT 2
+
+Ptz *ptzCreate(DeviceStream *stream) {
+	if (!stream->crop.width || !stream->crop.height) {
+		LOGE("%s: stream has no crop rectangle", __func__);
+		return NULL;
+	}
+
+	Ptz *const ptz = calloc(1, sizeof(Ptz));
+	if (!ptz)
+		return NULL;
+
+	ptz->stream = stream;
+	ptz->full = stream->crop;
+	ptz->zoom = ptz->target_zoom = PTZ_ZOOM_DEFAULT;
+
+	LOGI("%s: full view (%d,%d) + (%dx%d)", __func__,
+		ptz->full.left, ptz->full.top, ptz->full.width, ptz->full.height);
+	return ptz;
+}
+
+void ptzDestroy(Ptz *ptz) {
+	free(ptz);
+}
+
+static int32_t clamp(int32_t value, int32_t min, int32_t max) {
+	return value < min ? min : value > max ? max : value;
+}
+
+void ptzSetZoom(Ptz *ptz, int32_t zoom) {
+	__atomic_store_n(&ptz->target_zoom, clamp(zoom, PTZ_ZOOM_MIN, PTZ_ZOOM_MAX), __ATOMIC_RELAXED);
+}
+
+void ptzSetPanTilt(Ptz *ptz, int32_t pan, int32_t tilt) {
+	__atomic_store_n(&ptz->target_pan, clamp(pan, -PTZ_PAN_TILT_MAX, PTZ_PAN_TILT_MAX), __ATOMIC_RELAXED);
+	__atomic_store_n(&ptz->target_tilt, clamp(tilt, -PTZ_PAN_TILT_MAX, PTZ_PAN_TILT_MAX), __ATOMIC_RELAXED);
+}
+
+int32_t ptzGetZoom(const Ptz *ptz) {
+	return __atomic_load_n(&ptz->target_zoom, __ATOMIC_RELAXED);
+}
+
+void ptzGetPanTilt(const Ptz *ptz, int32_t *pan, int32_t *tilt) {
+	*pan = __atomic_load_n(&ptz->target_pan, __ATOMIC_RELAXED);
+	*tilt = __atomic_load_n(&ptz->target_tilt, __ATOMIC_RELAXED);
+}
+
+static int32_t stepTowards(int32_t value, int32_t target) {
+	const int32_t delta = target - value;
+	int32_t step = delta / (1 << PTZ_STEP_SHIFT);
+	if (!step)
+		step = delta > 0 ? 1 : delta < 0 ? -1 : 0;
+	return value + step;
+}
+
+// Even coordinates keep bayer and chroma subsampling phase
+static struct v4l2_rect ptzRect(const Ptz *ptz, int32_t zoom, int32_t pan, int32_t tilt) {
+	const struct v4l2_rect full = ptz->full;
+	struct v4l2_rect r = {
+		.width = (full.width * PTZ_ZOOM_MIN / zoom) & ~1u,
+		.height = (full.height * PTZ_ZOOM_MIN / zoom) & ~1u,
+	};
+
+	const int32_t free_x = full.width - r.width;
+	const int32_t free_y = full.height - r.height;
+	r.left = (full.left + free_x / 2 + (int64_t)pan * free_x / (2 * PTZ_PAN_TILT_MAX)) & ~1;
+	r.top = (full.top + free_y / 2 - (int64_t)tilt * free_y / (2 * PTZ_PAN_TILT_MAX)) & ~1;
+	return r;
+}
+
+static int rectEqual(const struct v4l2_rect *a, const struct v4l2_rect *b) {
+	return a->left == b->left && a->top == b->top && a->width == b->width && a->height == b->height;
+}
+
+void ptzReset(Ptz *ptz) {
+	ptz->zoom = PTZ_ZOOM_DEFAULT;
+	ptz->pan = ptz->tilt = 0;
+}
+
+int ptzUpdate(Ptz *ptz) {
+	const int32_t target_zoom = __atomic_load_n(&ptz->target_zoom, __ATOMIC_RELAXED);
+	const int32_t target_pan = __atomic_load_n(&ptz->target_pan, __ATOMIC_RELAXED);
+	const int32_t target_tilt = __atomic_load_n(&ptz->target_tilt, __ATOMIC_RELAXED);
+	if (target_zoom == ptz->zoom && target_pan == ptz->pan && target_tilt == ptz->tilt)
+		return 0;
+
+	// Skip steps that would round to the same rectangle
+	const struct v4l2_rect current = ptzRect(ptz, ptz->zoom, ptz->pan, ptz->tilt);
+	struct v4l2_rect rect;
+	do {
+		ptz->zoom = stepTowards(ptz->zoom, target_zoom);
+		ptz->pan = stepTowards(ptz->pan, target_pan);
+		ptz->tilt = stepTowards(ptz->tilt, target_tilt);
+		rect = ptzRect(ptz, ptz->zoom, ptz->pan, ptz->tilt);
+	} while (rectEqual(&rect, &current)
+		&& (target_zoom != ptz->zoom || target_pan != ptz->pan || target_tilt != ptz->tilt));
+
+	if (rectEqual(&rect, &current))
+		return 0;
+
+	const int result = deviceStreamSetCrop(ptz->stream, &rect);
+	return result < 0 ? result : 1;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <linux/videodev2.h> // v4l2_rect
+#include <stdint.h>
+
+struct DeviceStream;
+
+// Digital pan/tilt/zoom: moves crop rectangle of a stream while streaming, the device scales it to its
+// unchanged compose size. No buffer reallocation and no extra CPU work per frame.
+// Target is set by the control thread, the crop walks towards it on the frame thread, one step per frame.
+
+// Zoom in 1/100ths of magnification
+#define PTZ_ZOOM_MIN 100
+#define PTZ_ZOOM_MAX 400
+#define PTZ_ZOOM_DEFAULT PTZ_ZOOM_MIN
+
+// Pan and tilt in arc-seconds, like UVC. The limits move the crop window right to the edge of the full frame
+#define PTZ_PAN_TILT_MAX (10 * 3600)
+#define PTZ_PAN_TILT_STEP 3600
+
+typedef struct Ptz {
+	struct DeviceStream *stream;
+
+	// Crop at zoom 1x
+	struct v4l2_rect full;
+
+	// Written by the control thread
+	int32_t target_zoom, target_pan, target_tilt;
+
+	// Frame thread state
+	int32_t zoom, pan, tilt;
+} Ptz;
+
+// Current crop of stream is the full (1x) view
+// Returns NULL on failure
+Ptz *ptzCreate(struct DeviceStream *stream);
+void ptzDestroy(Ptz *ptz);
+
+// Control thread side. Values are clamped to the limits above
+void ptzSetZoom(Ptz *ptz, int32_t zoom);
+void ptzSetPanTilt(Ptz *ptz, int32_t pan, int32_t tilt);
+int32_t ptzGetZoom(const Ptz *ptz);
+void ptzGetPanTilt(const Ptz *ptz, int32_t *pan, int32_t *tilt);
+
+// Frame thread side, call once per frame before the frame is queued to the cropping device.
+// Costs three relaxed loads unless the crop is moving.
+// Returns 1 if crop has changed, 0 if not, <0 on error
+int ptzUpdate(Ptz *ptz);
+
+// Frame thread side, after the stream was prepared again and its crop is back at the full view.
+// Crop walks back to the target from there
+void ptzReset(Ptz *ptz);
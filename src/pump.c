@@ -1,11 +1,16 @@
 #include "pump.h"
 
 #include "v4l2-print.h"
+#include "trace.h"
+#include "metrics.h"
+#include "probes.h"
 #include "common.h"
 
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 
+// Plane by plane, each with its own fd. Planes of contiguous formats share one and tell apart by data_offset
 static int passDmabufMP(const Buffer *src, Buffer *dst, int planes_count) {
 	for (int i = 0; i < planes_count; ++i) {
 		dst->buffer.m.planes[i].length = src->buffer.m.planes[i].length;
@@ -17,6 +22,7 @@ static int passDmabufMP(const Buffer *src, Buffer *dst, int planes_count) {
 	return 0;
 }
 
+// Single-planar streams have one buffer, so the multi-planar end has a single plane too, see pumpBufferPassFunc()
 static int passDmabufSPtoMP(const Buffer *src, Buffer *dst, int planes_count) {
 	ASSERT(planes_count == 1);
 
@@ -31,9 +37,14 @@ static int passDmabufSPtoMP(const Buffer *src, Buffer *dst, int planes_count) {
 static int passDmabufMPtoSP(const Buffer *src, Buffer *dst, int planes_count) {
 	ASSERT(planes_count == 1);
 
+	// Single-planar buffers start at the beginning of the dmabuf, there's no offset to pass on
+	if (src->buffer.m.planes[0].data_offset) {
+		LOGE("%s: buffer[%d] data starts at offset %u", __func__,
+			src->buffer.index, src->buffer.m.planes[0].data_offset);
+		return -EINVAL;
+	}
+
 	dst->buffer.length = src->buffer.m.planes[0].length;
-	// FIXME this is impossible dst->buffer.data_offset = src->buffer.m.planes[0].data_offset;
-	// FIXME detect and complain
 	dst->buffer.bytesused = src->buffer.m.planes[0].bytesused;
 	dst->buffer.m.fd = src->dmabuf_fd[0];
 
@@ -60,14 +71,27 @@ static int passMmapToUserptrSP(const Buffer *src, Buffer *dst, int planes_count)
 	return 0;
 }
 
+// Plane bytesused counts data_offset in, a driver reporting less would make the payload size wrap around
+static int planeOffsetValid(const Buffer *src) {
+	const struct v4l2_plane *const plane = src->buffer.m.planes;
+	if (plane->data_offset <= plane->bytesused && plane->data_offset <= plane->length)
+		return 1;
+
+	LOGE("Buffer[%d] data_offset=%u is past bytesused=%u or length=%u", src->buffer.index, plane->data_offset,
+		plane->bytesused, plane->length);
+	return 0;
+}
+
 static int passMmapMPToUserptrSP(const Buffer *src, Buffer *dst, int planes_count) {
 	ASSERT(planes_count == 1);
 
-	dst->buffer.length = src->buffer.m.planes[0].length;
-	// FIXME this is impossible dst->buffer.data_offset = src->buffer.m.planes[0].data_offset;
-	// FIXME detect and complain
-	dst->buffer.bytesused = src->buffer.m.planes[0].bytesused;
-	dst->buffer.m.userptr = (unsigned long)src->mapped[0];
+	// Pointer goes past the offset, the rest of the plane is what's left of it
+	const uint32_t offset = src->buffer.m.planes[0].data_offset;
+	if (!planeOffsetValid(src))
+		return -EINVAL;
+	dst->buffer.length = src->buffer.m.planes[0].length - offset;
+	dst->buffer.bytesused = src->buffer.m.planes[0].bytesused - offset;
+	dst->buffer.m.userptr = (unsigned long)((const uint8_t*)src->mapped[0] + offset);
 
 	return 0;
 }
@@ -75,9 +99,11 @@ static int passMmapMPToUserptrSP(const Buffer *src, Buffer *dst, int planes_coun
 static int passMmapMPToMmapSP(const Buffer *src, Buffer *dst, int planes_count) {
 	ASSERT(planes_count == 1);
 
-	// FIXME this is impossible dst->buffer.data_offset = src->buffer.m.planes[0].data_offset;
-	// FIXME detect and complain
-	dst->buffer.bytesused = src->buffer.m.planes[0].bytesused;
+	// Plane bytesused counts the offset in
+	const uint32_t offset = src->buffer.m.planes[0].data_offset;
+	if (!planeOffsetValid(src))
+		return -EINVAL;
+	dst->buffer.bytesused = src->buffer.m.planes[0].bytesused - offset;
 
 	if (dst->buffer.length < dst->buffer.bytesused) {
 		LOGE("%s: buffer size mismatch, src:", __func__);
@@ -87,7 +113,7 @@ static int passMmapMPToMmapSP(const Buffer *src, Buffer *dst, int planes_count)
 	}
 	ASSERT(dst->buffer.length >= dst->buffer.bytesused);
 
-	memcpy(dst->mapped[0], src->mapped[0], dst->buffer.bytesused);
+	memcpy(dst->mapped[0], (const uint8_t*)src->mapped[0] + offset, dst->buffer.bytesused);
 
 	return 0;
 }
@@ -150,32 +176,54 @@ static const PumpBufferPassTableEntry pass_func_table[] = {
 	},
 };
 
-static buffer_pass_func *getPassFunc(const DeviceStream *src, const DeviceStream *dst) {
-	// FIXME verify plane compatibility
-	const int src_planes = STREAM_PLANES_COUNT(src);
-	const int dst_planes = STREAM_PLANES_COUNT(src);
-	if (src_planes != dst_planes) {
-		LOGE("%s: incompatible number of planes: src=%d dst=%d", __func__, src_planes, dst_planes);
-		return NULL;
-	}
-
-	const int src_mp = !!IS_STREAM_MPLANE(src);
-	const int dst_mp = !!IS_STREAM_MPLANE(dst);
-
+buffer_pass_func *pumpPassFuncFor(buffer_memory_e src_mem, int src_mp, buffer_memory_e dst_mem, int dst_mp) {
 	for (int i = 0; i < (int)COUNTOF(pass_func_table); ++i) {
 		const PumpBufferPassTableEntry *const te = pass_func_table + i;
-		if (src->buffer_memory != te->src_mem)
+		if (src_mem != te->src_mem)
 			continue;
-		if (dst->buffer_memory != te->dst_mem)
+		if (dst_mem != te->dst_mem)
 			continue;
-		if (src_mp != te->src_mp)
+		if (!!src_mp != te->src_mp)
 			continue;
-		if (dst_mp != te->dst_mp)
+		if (!!dst_mp != te->dst_mp)
 			continue;
 
 		return te->func;
 	}
 
+	return NULL;
+}
+
+static uint32_t planeStride(const DeviceStream *st, int plane) {
+	return IS_STREAM_MPLANE(st) ? st->format.fmt.pix_mp.plane_fmt[plane].bytesperline : st->format.fmt.pix.bytesperline;
+}
+
+buffer_pass_func *pumpBufferPassFunc(const DeviceStream *src, const DeviceStream *dst) {
+	// Buffers are passed plane for plane, and single-planar streams have all planes in one
+	const int src_planes = STREAM_PLANES_COUNT(src);
+	const int dst_planes = STREAM_PLANES_COUNT(dst);
+	if (src_planes != dst_planes) {
+		LOGE("%s: incompatible number of planes: src=%d dst=%d", __func__, src_planes, dst_planes);
+		return NULL;
+	}
+
+	// Different strides would have dst read lines at the wrong offsets. Compressed formats have none
+	for (int i = 0; i < src_planes; ++i) {
+		const uint32_t src_stride = planeStride(src, i);
+		const uint32_t dst_stride = planeStride(dst, i);
+		if (src_stride && dst_stride && src_stride != dst_stride) {
+			LOGE("%s: plane %d stride mismatch: src=%u dst=%u", __func__, i, src_stride, dst_stride);
+			return NULL;
+		}
+	}
+
+	const int src_mp = !!IS_STREAM_MPLANE(src);
+	const int dst_mp = !!IS_STREAM_MPLANE(dst);
+
+	buffer_pass_func *const func = pumpPassFuncFor(src->buffer_memory, src_mp, dst->buffer_memory, dst_mp);
+	if (func)
+		return func;
+
 	LOGE("Pump doesn't support passing mem=%d:%s to mem=%d:%s",
 		src->buffer_memory,
 		src_mp ? "MP" : "SP",
@@ -186,7 +234,7 @@ static buffer_pass_func *getPassFunc(const DeviceStream *src, const DeviceStream
 }
 
 Pump *pumpCreate(DeviceStream *src, DeviceStream *dst) {
-	buffer_pass_func *const pass_func = getPassFunc(src, dst);
+	buffer_pass_func *const pass_func = pumpBufferPassFunc(src, dst);
 	if (!pass_func) {
 		LOGE("Unable to find a suitable buffer passing func for given src and dst streams");
 		return NULL;
@@ -207,6 +255,7 @@ Pump *pumpCreate(DeviceStream *src, DeviceStream *dst) {
 
 	pump->buffer_pass_func = pass_func;
 	pump->planes_count = STREAM_PLANES_COUNT(src);
+	pump->metrics = NULL;
 	return pump;
 }
 
@@ -221,7 +270,22 @@ void pumpDestroy(Pump *pump) {
 	free(pump);
 }
 
+static int pumpPumpImpl(Pump *pump);
+
 int pumpPump(Pump *pump /* TODO, uint32_t hint*/) {
+	const int result = pumpPumpImpl(pump);
+
+	MetricsPump *const metrics = pump->metrics;
+	if (metrics) {
+		if (result != 0)
+			METRICS_INC(metrics->errors);
+		METRICS_SET(metrics->dst_available, queueGetSize(&pump->dst.available));
+	}
+
+	return result;
+}
+
+static int pumpPumpImpl(Pump *pump) {
 	// 1. Pull any encoded frames from the destination
 	for (;;) {
 		const Buffer *const buf = deviceStreamPullBuffer(pump->dst.st);
@@ -229,10 +293,12 @@ int pumpPump(Pump *pump /* TODO, uint32_t hint*/) {
 			break;
 
 		// Mark the corresponding source buffer as complete
-		const int source_index = pump->dst.acquired_to_source[buf->buffer.index];
+		const int dst_index = buf->buffer.index;
+		const int source_index = pump->dst.acquired_to_source[dst_index];
 		ASSERT(source_index >= 0);
 		const int result = deviceStreamPushBuffer(pump->src.st, pump->src.st->buffers + source_index);
-		pump->dst.acquired_to_source[buf->buffer.index] = -1;
+		pump->dst.acquired_to_source[dst_index] = -1;
+		queuePush(&pump->dst.available, &dst_index);
 
 		if (result != 0) {
 			LOGE("Unable to return source buffer[%d] back", source_index);
@@ -252,7 +318,8 @@ int pumpPump(Pump *pump /* TODO, uint32_t hint*/) {
 		*/
 
 		if (pump->src.next_in_queue >= 0) {
-			LOGI("Skipping buffer[%d]", pump->src.next_in_queue);
+			TRACEI(TRACE_EV_PUMP_SKIP, pump->src.st->dev_fd, pump->src.st->type, pump->src.next_in_queue, buf->buffer.index);
+			if (pump->metrics) METRICS_INC(pump->metrics->skipped);
 			//v4l2PrintBuffer(&buf->buffer);
 			const int result = deviceStreamPushBuffer(pump->src.st, pump->src.st->buffers + pump->src.next_in_queue);
 			//v4l2PrintBuffer(&buf->buffer);
@@ -283,9 +350,14 @@ int pumpPump(Pump *pump /* TODO, uint32_t hint*/) {
 	const Buffer *const sbuf = pump->src.st->buffers + pump->src.next_in_queue;
 	const int dst_index = *(int*)queuePeek(&pump->dst.available);
 	Buffer *const dbuf = pump->dst.st->buffers + dst_index;
+	PROBE(pass_begin, pump->src.st->dev_fd, sbuf->buffer.index, pump->dst.st->dev_fd, dst_index);
 	int result = pump->buffer_pass_func(sbuf, dbuf, pump->planes_count);
+	PROBE(pass_end, pump->src.st->dev_fd, sbuf->buffer.index, pump->dst.st->dev_fd, dst_index, result);
 	if (result != 0) {
+		// Rejected source buffer goes back, the next one might be fine
 		LOGE("Unable to pass source to destination buffer");
+		deviceStreamPushBuffer(pump->src.st, sbuf);
+		pump->src.next_in_queue = -1;
 		return result;
 	}
 
@@ -306,5 +378,6 @@ int pumpPump(Pump *pump /* TODO, uint32_t hint*/) {
 	pump->dst.acquired_to_source[dst_index] = pump->src.next_in_queue;
 	pump->src.next_in_queue = -1;
 	queuePop(&pump->dst.available);
+	if (pump->metrics) METRICS_INC(pump->metrics->passed);
 	return 0;
 }
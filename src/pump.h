@@ -3,6 +3,8 @@
 #include "device.h"
 #include "queue.h"
 
+struct MetricsPump;
+
 typedef int (buffer_pass_func)(const Buffer *src, Buffer *dst, int planes_count);
 
 typedef struct Pump {
@@ -25,8 +27,18 @@ typedef struct Pump {
 
 	buffer_pass_func *buffer_pass_func;
 	int planes_count;
+
+	// Optional, set by the owner. See metrics.h
+	struct MetricsPump *metrics;
 } Pump;
 
+// Function that hands src buffers over to dst, see pass_func_table in pump.c
+// Returns NULL if the memory types of the streams are not supported
+buffer_pass_func *pumpBufferPassFunc(const DeviceStream *src, const DeviceStream *dst);
+
+// Same for streams yet to be prepared with these memory types and planarity, see negotiate.h
+buffer_pass_func *pumpPassFuncFor(buffer_memory_e src_mem, int src_mp, buffer_memory_e dst_mem, int dst_mp);
+
 #define HINT_SOURCE (1<<0)
 #define HINT_DEST (1<<1)
 
@@ -3,6 +3,7 @@
 #include <memory.h> // memcpy
 #include <errno.h>
 #include <stddef.h> // NULL
+#include <stdlib.h> // malloc, free
 
 #define QUEUE_AT(q, i) \
 	(void*)(((char*)(q)->data.data) + (q)->data.item_size * (i))
@@ -46,6 +47,7 @@ const void *queuePop(Queue *queue) {
 
 	const void *const item = QUEUE_AT_CONST(queue, queue->front);
 	queue->front = (queue->front + 1) % queue->data.capacity;
+	queue->data.size--;
 	return item;
 }
 
@@ -55,3 +57,48 @@ const void *queuePeek(const Queue *queue) {
 
 	return QUEUE_AT_CONST(queue, queue->front);
 }
+
+int spscQueueInit(SpscQueue *queue, int item_size, int max_count) {
+	uint32_t capacity = 1;
+	while (capacity < (uint32_t)max_count)
+		capacity <<= 1;
+
+	*queue = (SpscQueue){
+		.data = malloc((size_t)item_size * capacity),
+		.item_size = item_size,
+		.mask = capacity - 1,
+	};
+
+	return queue->data ? 0 : -ENOMEM;
+}
+
+void spscQueueFinalize(SpscQueue *queue) {
+	free(queue->data);
+	queue->data = NULL;
+}
+
+int spscQueuePush(SpscQueue *queue, const void *item) {
+	const uint32_t tail = queue->tail;
+	const uint32_t head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+	if (tail - head > queue->mask)
+		return -ENOSPC;
+
+	memcpy(queue->data + (size_t)(tail & queue->mask) * queue->item_size, item, queue->item_size);
+
+	// Publish the item
+	__atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+int spscQueuePop(SpscQueue *queue, void *out) {
+	const uint32_t head = queue->head;
+	const uint32_t tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+	if (head == tail)
+		return -EAGAIN;
+
+	memcpy(out, queue->data + (size_t)(head & queue->mask) * queue->item_size, queue->item_size);
+
+	// Release the slot back to the producer
+	__atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+	return 0;
+}
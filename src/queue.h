@@ -2,6 +2,8 @@
 
 #include "array.h"
 
+#include <stdint.h>
+
 // FIFO queue, implemented as a ring buffer
 typedef struct Queue {
 	Array data;
@@ -27,3 +29,28 @@ int queuePush(Queue *queue, const void *item);
 // Pointer is valid until next queuePush() or queueFinalize()
 const void *queuePop(Queue *queue);
 const void *queuePeek(const Queue *queue);
+
+// Lock-free FIFO for exactly one producer thread and one consumer thread.
+// Items are copied in and out, capacity is rounded up to power of two
+typedef struct SpscQueue {
+	char *data;
+	uint32_t item_size;
+	uint32_t mask;
+
+	// Consumer position, written only by the consumer
+	uint32_t head __attribute__((aligned(64)));
+
+	// Producer position, written only by the producer
+	uint32_t tail __attribute__((aligned(64)));
+} SpscQueue;
+
+// Returns 0 on success, -ENOMEM on allocation failure
+int spscQueueInit(SpscQueue *queue, int item_size, int max_count);
+void spscQueueFinalize(SpscQueue *queue);
+
+// Producer side. Returns 0 on success, -ENOSPC if the queue is full
+int spscQueuePush(SpscQueue *queue, const void *item);
+
+// Consumer side. Copies next item to out
+// Returns 0 on success, -EAGAIN if the queue is empty
+int spscQueuePop(SpscQueue *queue, void *out);
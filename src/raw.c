@@ -0,0 +1,256 @@
+#include "raw.h"
+
+#include "unpack.h"
+#include "queue.h"
+#include "metrics.h"
+#include "trace.h"
+#include "common.h"
+
+#include <stdlib.h> // calloc, free
+#include <string.h> // memcpy
+#include <errno.h>
+
+// Unicam formats, see Pilatform.c. GUIDs are the ones uvcvideo maps onto the unpacked format,
+// packed formats have none there, so they get the V4L2 fourcc
+static const struct {
+	uint32_t camera;
+	int bits;
+
+	uint32_t unpacked;
+	char unpacked_guid[5];
+	char packed_guid[5];
+} raw_formats[] = {
+	{V4L2_PIX_FMT_SBGGR8, 8, V4L2_PIX_FMT_SBGGR8, "BA81", "BA81"},
+	{V4L2_PIX_FMT_SGBRG8, 8, V4L2_PIX_FMT_SGBRG8, "GBRG", "GBRG"},
+	{V4L2_PIX_FMT_SGRBG8, 8, V4L2_PIX_FMT_SGRBG8, "GRBG", "GRBG"},
+	{V4L2_PIX_FMT_SRGGB8, 8, V4L2_PIX_FMT_SRGGB8, "RGGB", "RGGB"},
+	{V4L2_PIX_FMT_GREY, 8, V4L2_PIX_FMT_GREY, "Y800", "Y800"},
+	{V4L2_PIX_FMT_SBGGR10P, 10, V4L2_PIX_FMT_SBGGR16, "BG16", "pBAA"},
+	{V4L2_PIX_FMT_SGBRG10P, 10, V4L2_PIX_FMT_SGBRG16, "GB16", "pGAA"},
+	{V4L2_PIX_FMT_SGRBG10P, 10, V4L2_PIX_FMT_SGRBG16, "GR16", "pgAA"},
+	{V4L2_PIX_FMT_SRGGB10P, 10, V4L2_PIX_FMT_SRGGB16, "RG16", "pRAA"},
+	{V4L2_PIX_FMT_Y10P, 10, V4L2_PIX_FMT_Y16, "Y16 ", "Y10P"},
+	{V4L2_PIX_FMT_SBGGR12P, 12, V4L2_PIX_FMT_SBGGR16, "BG16", "pBCC"},
+	{V4L2_PIX_FMT_SGBRG12P, 12, V4L2_PIX_FMT_SGBRG16, "GB16", "pGCC"},
+	{V4L2_PIX_FMT_SGRBG12P, 12, V4L2_PIX_FMT_SGRBG16, "GR16", "pgCC"},
+	{V4L2_PIX_FMT_SRGGB12P, 12, V4L2_PIX_FMT_SRGGB16, "RG16", "pRCC"},
+};
+
+int rawFormat(RawMode mode, const DeviceStream *camera, RawFormat *out) {
+	const uint32_t pixelformat = IS_STREAM_MPLANE(camera) ? camera->format.fmt.pix_mp.pixelformat : camera->format.fmt.pix.pixelformat;
+	const uint32_t width = IS_STREAM_MPLANE(camera) ? camera->format.fmt.pix_mp.width : camera->format.fmt.pix.width;
+	const uint32_t height = IS_STREAM_MPLANE(camera) ? camera->format.fmt.pix_mp.height : camera->format.fmt.pix.height;
+
+	for (int i = 0; i < (int)COUNTOF(raw_formats); ++i) {
+		if (raw_formats[i].camera != pixelformat)
+			continue;
+
+		const int unpack = mode == RAW_MODE_UNPACKED && raw_formats[i].bits > 8;
+		*out = (RawFormat){
+			.pixelformat = unpack ? raw_formats[i].unpacked : pixelformat,
+			.bits = unpack ? 16 : raw_formats[i].bits,
+			.camera_bits = raw_formats[i].bits,
+			.width = width,
+			.height = height,
+		};
+		memcpy(out->guid, unpack ? raw_formats[i].unpacked_guid : raw_formats[i].packed_guid, sizeof(out->guid));
+		out->bytesperline = (width * out->bits + 7) / 8;
+		out->frame_size = out->bytesperline * height;
+		return 0;
+	}
+
+	LOGE("%s: camera format %.4s is not a raw one", __func__, (const char*)&pixelformat);
+	return -EINVAL;
+}
+
+typedef struct RawPump {
+	DeviceStream *src;
+	DeviceStream *dst;
+
+	RawFormat format;
+	uint32_t src_stride;
+
+	// NULL copies rows as they are
+	unpack_row_f *unpack;
+	const char *unpack_name;
+
+	// Newest camera buffer not copied yet, -1 if none
+	int pending;
+
+	// Gadget buffers not queued
+	Queue available;
+
+	struct MetricsPump *metrics;
+
+	uint64_t frames;
+	uint64_t convert_us;
+} RawPump;
+
+struct RawPump *rawPumpCreate(RawMode mode, DeviceStream *src, DeviceStream *dst) {
+	if (IS_STREAM_MPLANE(src) || IS_STREAM_MPLANE(dst)) {
+		LOGE("%s: only single plane streams are supported", __func__);
+		return NULL;
+	}
+
+	if (src->buffer_memory != BUFFER_MEMORY_DMABUF_EXPORT || dst->buffer_memory != BUFFER_MEMORY_MMAP) {
+		LOGE("%s: expected exported dmabufs to mmap, got mem=%d to mem=%d", __func__, src->buffer_memory, dst->buffer_memory);
+		return NULL;
+	}
+
+	RawPump *const rp = calloc(1, sizeof(RawPump));
+	if (!rp)
+		return NULL;
+
+	rp->src = src;
+	rp->dst = dst;
+	rp->pending = -1;
+
+	queueInit(&rp->available, sizeof(int), dst->buffers_count);
+	for (int i = 0; i < dst->buffers_count; ++i)
+		queuePush(&rp->available, &i);
+
+	if (0 != rawFormat(mode, src, &rp->format))
+		goto fail;
+	rp->src_stride = src->format.fmt.pix.bytesperline;
+
+	if (rp->format.bits != rp->format.camera_bits) {
+		const UnpackKernels *const kernels = unpackKernelsBest();
+		rp->unpack = unpackRowFunc(kernels, rp->format.camera_bits);
+		rp->unpack_name = kernels->name;
+	}
+
+	for (int i = 0; i < dst->buffers_count; ++i) {
+		if (dst->buffers[i].buffer.length < rp->format.frame_size) {
+			LOGE("%s: gadget buffer of %u bytes is too small for %u byte frames", __func__,
+				dst->buffers[i].buffer.length, rp->format.frame_size);
+			goto fail;
+		}
+	}
+
+	// Camera buffers are exported dmabufs, mapped on export
+	for (int i = 0; i < src->buffers_count; ++i) {
+		if (!src->buffers[i].read_mapped[0]) {
+			LOGE("%s: camera buffer %d is not mapped", __func__, i);
+			goto fail;
+		}
+	}
+
+	LOGI("Raw %.4s %ux%u, %d bits, %u bytes per frame, %s",
+		rp->format.guid, rp->format.width, rp->format.height, rp->format.bits, rp->format.frame_size,
+		rp->unpack ? rp->unpack_name : "copied");
+	return rp;
+
+fail:
+	rawPumpDestroy(rp);
+	return NULL;
+}
+
+void rawPumpDestroy(RawPump *rp) {
+	if (!rp)
+		return;
+
+	if (rp->frames)
+		LOGI("Raw pump: %llu frames, %.3fms per frame", (unsigned long long)rp->frames,
+			rp->convert_us / 1000. / rp->frames);
+
+	queueFinalize(&rp->available);
+
+	free(rp);
+}
+
+void rawPumpSetMetrics(RawPump *rp, struct MetricsPump *metrics) {
+	rp->metrics = metrics;
+}
+
+static void convertFrame(RawPump *rp, int src_index, Buffer *dbuf) {
+	const Buffer *const sbuf = rp->src->buffers + src_index;
+	uint8_t *const dst = dbuf->mapped[0];
+	const RawFormat *const f = &rp->format;
+
+	const uint64_t begin_us = monotonicUs();
+	const uint8_t *const src = bufferReadBegin(sbuf, 0);
+
+	if (rp->unpack) {
+		unpackImage(rp->unpack, (uint16_t*)dst, f->bytesperline, src, rp->src_stride, f->width, f->height);
+	} else if (rp->src_stride == f->bytesperline) {
+		memcpy(dst, src, f->frame_size);
+	} else {
+		for (uint32_t y = 0; y < f->height; ++y)
+			memcpy(dst + y * f->bytesperline, src + y * rp->src_stride, f->bytesperline);
+	}
+
+	bufferReadEnd(sbuf, 0);
+
+	rp->convert_us += monotonicUs() - begin_us;
+	rp->frames++;
+	dbuf->buffer.bytesused = f->frame_size;
+}
+
+static int rawPumpImpl(RawPump *rp) {
+	// 1. Gadget is done with these
+	for (;;) {
+		const Buffer *const buf = deviceStreamPullBuffer(rp->dst);
+		if (!buf)
+			break;
+
+		const int index = buf->buffer.index;
+		queuePush(&rp->available, &index);
+	}
+
+	// 2. Only the newest camera frame is worth sending
+	for (;;) {
+		const Buffer *const buf = deviceStreamPullBuffer(rp->src);
+		if (!buf)
+			break;
+
+		if (rp->pending >= 0) {
+			TRACEI(TRACE_EV_PUMP_SKIP, rp->src->dev_fd, rp->src->type, rp->pending, buf->buffer.index);
+			if (rp->metrics) METRICS_INC(rp->metrics->skipped);
+			const int result = deviceStreamPushBuffer(rp->src, rp->src->buffers + rp->pending);
+			if (result != 0) {
+				LOGE("Unable to return camera buffer[%d] back", rp->pending);
+				return result;
+			}
+		}
+
+		rp->pending = buf->buffer.index;
+	}
+
+	if (rp->pending < 0 || queueGetSize(&rp->available) <= 0)
+		return 0;
+
+	// 3. Camera buffer goes back as soon as it's copied
+	const int dst_index = *(const int*)queuePeek(&rp->available);
+	Buffer *const dbuf = rp->dst->buffers + dst_index;
+	convertFrame(rp, rp->pending, dbuf);
+
+	int result = deviceStreamPushBuffer(rp->dst, dbuf);
+	if (result != 0) {
+		LOGE("Unable to pass raw frame to gadget");
+		return result;
+	}
+	queuePop(&rp->available);
+
+	result = deviceStreamPushBuffer(rp->src, rp->src->buffers + rp->pending);
+	rp->pending = -1;
+	if (result != 0) {
+		LOGE("Unable to return camera buffer back");
+		return result;
+	}
+
+	if (rp->metrics) METRICS_INC(rp->metrics->passed);
+	return 0;
+}
+
+int rawPumpPump(RawPump *rp) {
+	const int result = rawPumpImpl(rp);
+
+	struct MetricsPump *const metrics = rp->metrics;
+	if (metrics) {
+		if (result != 0)
+			METRICS_INC(metrics->errors);
+		METRICS_SET(metrics->dst_available, queueGetSize(&rp->available));
+	}
+
+	return result;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include "device.h"
+
+struct MetricsPump;
+struct RawPump;
+
+// Sensor data straight to the host, without ISP and encoders. For hosts that do their own demosaicing.
+// Gadget has to be set up with the matching uncompressed format, see RAW_FOURCC in gadget.sh
+typedef enum {
+	RAW_MODE_OFF = 0,
+
+	// CSI-2 packed, as the sensor sends it. Only unicam's row padding is dropped
+	RAW_MODE_PACKED,
+
+	// 16 bits per sample, see unpack.h. 8 bit formats stay as they are
+	RAW_MODE_UNPACKED,
+} RawMode;
+
+// What the host gets for a camera format
+typedef struct {
+	// V4L2 fourcc, e.g. V4L2_PIX_FMT_SBGGR16
+	uint32_t pixelformat;
+
+	// Fourcc part of the UVC format GUID, the one uvcvideo knows where there is one. Vendor one otherwise
+	char guid[5];
+
+	// Per sample as sent, i.e. bBitsPerPixel, and as the camera stores it
+	int bits;
+	int camera_bits;
+
+	uint32_t width, height;
+
+	// Rows are not padded
+	uint32_t bytesperline;
+	uint32_t frame_size;
+} RawFormat;
+
+// Returns 0 on success, -EINVAL if the camera format is not a raw one
+int rawFormat(RawMode mode, const DeviceStream *camera, RawFormat *out);
+
+// Copies or unpacks newest camera frame into the next free gadget buffer. Camera buffers are returned right away,
+// so the camera never waits for USB. Gadget stream has to be prepared with its own (MMAP) buffers
+struct RawPump *rawPumpCreate(RawMode mode, DeviceStream *src, DeviceStream *dst);
+void rawPumpDestroy(struct RawPump *rp);
+
+void rawPumpSetMetrics(struct RawPump *rp, struct MetricsPump *metrics);
+
+// Returns 0 on success, -errno on failure
+int rawPumpPump(struct RawPump *rp);
@@ -0,0 +1,317 @@
+#define _GNU_SOURCE // O_DIRECT
+
+#include "recorder.h"
+
+#include "device.h"
+#include "uring.h"
+#include "metrics.h"
+#include "common.h"
+
+#include <sys/mman.h> // mmap
+#include <fcntl.h> // open, O_DIRECT
+#include <unistd.h> // close, fdatasync
+#include <stdlib.h> // calloc, free
+#include <string.h> // memcpy, strerror
+#include <errno.h>
+
+#define RECORDER_CHUNKS (RECORDER_RING_SIZE / RECORDER_CHUNK_SIZE)
+
+// user_data of the writes that finish the file, chunk writes have their ring index
+#define RECORDER_TAIL_ID RECORDER_CHUNKS
+#define RECORDER_SYNC_ID (RECORDER_CHUNKS + 1)
+
+typedef struct Recorder {
+	int fd;
+	int direct;
+
+	Uring uring;
+
+	// Page aligned, as O_DIRECT needs
+	uint8_t *ring;
+
+	// Byte positions in the file: appended <= submitted + RECORDER_RING_SIZE, written <= submitted <= appended.
+	// Ring offset is position % RECORDER_RING_SIZE
+	uint64_t appended;
+	uint64_t submitted;
+	uint64_t written;
+
+	// Bytes written by completed chunks, 0 if not completed yet. Chunks complete out of order, written only
+	// advances over contiguous ones and stops for good at a short one
+	uint32_t chunk_written[RECORDER_CHUNKS];
+	int in_flight;
+
+	// Set on write failure, nothing is recorded after that
+	int error;
+
+	// Set by recorderStop(), the tail and sync are queued once no chunk is in flight
+	int stopping;
+	int finishing;
+	int finished;
+	int synced;
+
+	struct MetricsPump *metrics;
+} Recorder;
+
+struct Recorder *recorderOpen(const char *path) {
+	Recorder *const rec = calloc(1, sizeof(Recorder));
+	if (!rec)
+		return NULL;
+
+	rec->uring.fd = -1;
+	rec->direct = 1;
+	rec->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_DIRECT, 0644);
+	if (rec->fd < 0 && errno == EINVAL) {
+		// e.g. tmpfs
+		LOGI("%s: %s doesn't support O_DIRECT, writing through page cache", __func__, path);
+		rec->direct = 0;
+		rec->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	}
+	if (rec->fd < 0) {
+		LOGE("%s: unable to open %s: %d, %s", __func__, path, errno, strerror(errno));
+		goto fail;
+	}
+
+	rec->ring = mmap(NULL, RECORDER_RING_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	if (rec->ring == MAP_FAILED) {
+		rec->ring = NULL;
+		LOGE("%s: unable to allocate ring: %d, %s", __func__, errno, strerror(errno));
+		goto fail;
+	}
+
+	if (0 != uringInit(&rec->uring, RECORDER_CHUNKS))
+		goto fail;
+
+	LOGI("Recording to %s", path);
+	return rec;
+
+fail:
+	recorderClose(rec);
+	return NULL;
+}
+
+int recorderFd(const Recorder *rec) {
+	return rec->uring.fd;
+}
+
+void recorderSetMetrics(Recorder *rec, struct MetricsPump *metrics) {
+	rec->metrics = metrics;
+}
+
+static void completeChunk(Recorder *rec, const struct io_uring_cqe *cqe) {
+	const int chunk = (int)cqe->user_data;
+	rec->in_flight--;
+
+	if (cqe->res != RECORDER_CHUNK_SIZE) {
+		const int err = cqe->res < 0 ? -cqe->res : EIO;
+		LOGE("Recording write failed: %d, %s", err, strerror(err));
+		if (!rec->error)
+			rec->error = -err;
+		if (rec->metrics) METRICS_INC(rec->metrics->errors);
+	}
+
+	rec->chunk_written[chunk] = cqe->res > 0 ? cqe->res : 0;
+	while (rec->written != rec->submitted) {
+		const int next = (rec->written % RECORDER_RING_SIZE) / RECORDER_CHUNK_SIZE;
+		const uint32_t size = rec->chunk_written[next];
+		if (!size)
+			break;
+		rec->chunk_written[next] = 0;
+		rec->written += size;
+
+		// Anything after a short write is past a hole in the file
+		if (size != RECORDER_CHUNK_SIZE)
+			break;
+	}
+}
+
+static int submitChunks(Recorder *rec) {
+	int submitted = 0;
+	while (!rec->error && rec->appended - rec->submitted >= RECORDER_CHUNK_SIZE) {
+		struct io_uring_sqe *const sqe = uringGetSqe(&rec->uring);
+		if (!sqe)
+			break;
+
+		const uint32_t offset = rec->submitted % RECORDER_RING_SIZE;
+		sqe->opcode = IORING_OP_WRITE;
+		sqe->fd = rec->fd;
+		sqe->addr = (uint64_t)(uintptr_t)(rec->ring + offset);
+		sqe->len = RECORDER_CHUNK_SIZE;
+		sqe->off = rec->submitted;
+		sqe->user_data = offset / RECORDER_CHUNK_SIZE;
+
+		rec->submitted += RECORDER_CHUNK_SIZE;
+		rec->in_flight++;
+		submitted++;
+	}
+
+	if (!submitted)
+		return 0;
+
+	const int result = uringSubmitAndWait(&rec->uring, 0, 0);
+	if (result < 0)
+		LOGE("Recording submit failed: %d, %s", -result, strerror(-result));
+	return result < 0 ? result : 0;
+}
+
+static void completeFinish(Recorder *rec, const struct io_uring_cqe *cqe) {
+	rec->in_flight--;
+
+	if (cqe->user_data == RECORDER_TAIL_ID) {
+		const uint32_t size = rec->submitted - rec->written;
+		if (cqe->res != (int)size) {
+			const int err = cqe->res < 0 ? -cqe->res : EIO;
+			LOGE("Recording tail of %u bytes failed: %d, %s", size, err, strerror(err));
+			if (!rec->error)
+				rec->error = -err;
+			return;
+		}
+		rec->written += size;
+		return;
+	}
+
+	// Canceled too if the tail failed
+	if (cqe->res < 0)
+		LOGE("Recording sync failed: %d, %s", -cqe->res, strerror(-cqe->res));
+	rec->synced = cqe->res == 0;
+	rec->finished = 1;
+}
+
+// Remaining bytes are less than a chunk and likely not block aligned, so they go through the page cache,
+// followed by fdatasync() linked to them
+static void submitFinish(Recorder *rec) {
+	if (!rec->stopping || rec->finishing || rec->in_flight)
+		return;
+	rec->finishing = 1;
+
+	const uint32_t size = rec->error ? 0 : rec->appended - rec->submitted;
+	if (size && rec->direct) {
+		const int flags = fcntl(rec->fd, F_GETFL);
+		if (flags < 0 || 0 != fcntl(rec->fd, F_SETFL, flags & ~O_DIRECT))
+			LOGE("%s: unable to clear O_DIRECT: %d, %s", __func__, errno, strerror(errno));
+	}
+
+	// Nothing is in flight, so the SQ has room for both
+	if (size) {
+		struct io_uring_sqe *const sqe = uringGetSqe(&rec->uring);
+		sqe->opcode = IORING_OP_WRITE;
+		sqe->flags = IOSQE_IO_LINK;
+		sqe->fd = rec->fd;
+		sqe->addr = (uint64_t)(uintptr_t)(rec->ring + rec->submitted % RECORDER_RING_SIZE);
+		sqe->len = size;
+		sqe->off = rec->submitted;
+		sqe->user_data = RECORDER_TAIL_ID;
+		rec->submitted += size;
+		rec->in_flight++;
+	}
+
+	struct io_uring_sqe *const sqe = uringGetSqe(&rec->uring);
+	sqe->opcode = IORING_OP_FSYNC;
+	sqe->fd = rec->fd;
+	sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+	sqe->user_data = RECORDER_SYNC_ID;
+	rec->in_flight++;
+
+	const int result = uringSubmitAndWait(&rec->uring, 0, 0);
+	if (result < 0) {
+		// recorderClose() syncs then
+		LOGE("Recording finish submit failed: %d, %s", -result, strerror(-result));
+		rec->in_flight = 0;
+		rec->finished = 1;
+	}
+}
+
+int recorderProcess(Recorder *rec) {
+	struct io_uring_cqe cqe;
+	while (uringPopCqe(&rec->uring, &cqe)) {
+		if (cqe.user_data < RECORDER_CHUNKS)
+			completeChunk(rec, &cqe);
+		else
+			completeFinish(rec, &cqe);
+	}
+
+	submitFinish(rec);
+
+	if (rec->metrics)
+		METRICS_SET(rec->metrics->dst_available, RECORDER_RING_SIZE - (rec->appended - rec->written));
+
+	return rec->error;
+}
+
+static void appendToRing(Recorder *rec, const uint8_t *data, uint32_t size) {
+	const uint32_t offset = rec->appended % RECORDER_RING_SIZE;
+	const uint32_t first = size < RECORDER_RING_SIZE - offset ? size : RECORDER_RING_SIZE - offset;
+	memcpy(rec->ring + offset, data, first);
+	memcpy(rec->ring, data + first, size - first);
+	rec->appended += size;
+}
+
+int recorderWrite(Recorder *rec, const DeviceStream *st, const Buffer *buf) {
+	if (rec->error)
+		return rec->error;
+
+	const int mp = IS_STREAM_MPLANE(st);
+	const uint32_t offset = mp ? buf->buffer.m.planes[0].data_offset : 0;
+	const uint32_t bytesused = mp ? buf->buffer.m.planes[0].bytesused : buf->buffer.bytesused;
+	if (bytesused <= offset)
+		return 0;
+
+	const uint32_t size = bytesused - offset;
+	if (size > RECORDER_RING_SIZE - (rec->appended - rec->written)) {
+		if (rec->metrics) METRICS_INC(rec->metrics->skipped);
+		return -ENOBUFS;
+	}
+
+	const uint8_t *const data = bufferReadBegin(buf, 0);
+	if (!data) {
+		if (rec->metrics) METRICS_INC(rec->metrics->errors);
+		return -EINVAL;
+	}
+
+	appendToRing(rec, data + offset, size);
+	bufferReadEnd(buf, 0);
+
+	if (rec->metrics) METRICS_INC(rec->metrics->passed);
+	return submitChunks(rec);
+}
+
+void recorderStop(Recorder *rec) {
+	rec->stopping = 1;
+	submitFinish(rec);
+}
+
+int recorderFinished(const Recorder *rec) {
+	return rec->finished;
+}
+
+void recorderClose(Recorder *rec) {
+	if (!rec)
+		return;
+
+	if (rec->uring.fd >= 0) {
+		recorderStop(rec);
+		while (!rec->finished && rec->in_flight > 0) {
+			const int result = uringSubmitAndWait(&rec->uring, 1, -1);
+			if (result == -EINTR)
+				continue;
+			if (result < 0) {
+				LOGE("%s: waiting for writes failed: %d, %s", __func__, -result, strerror(-result));
+				break;
+			}
+			recorderProcess(rec);
+		}
+
+		uringDestroy(&rec->uring);
+	}
+
+	if (rec->fd >= 0) {
+		if (!rec->synced)
+			fdatasync(rec->fd);
+		close(rec->fd);
+	}
+
+	if (rec->ring)
+		munmap(rec->ring, RECORDER_RING_SIZE);
+
+	LOGI("Recorded %llu bytes", (unsigned long long)rec->written);
+	free(rec);
+}
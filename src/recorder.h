@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stdint.h>
+
+struct Buffer;
+struct DeviceStream;
+struct MetricsPump;
+
+// Writes encoded frames to a file as raw elementary stream (concatenated JPEGs, or H.264 Annex B),
+// without ever blocking the caller. The pipeline records the MJPEG of its encoder pool only.
+//
+// Each frame is copied once, from the mapped encoder buffer into a page-aligned ring, and the encoder buffer
+// can be returned right away. Whole chunks of the ring are written with O_DIRECT through io_uring,
+// so slow storage neither stalls the frame loop nor fills the page cache. If storage can't keep up and
+// the ring is full, frames are dropped from the recording only.
+
+#define RECORDER_CHUNK_SIZE (256 << 10)
+#define RECORDER_RING_SIZE (32 * RECORDER_CHUNK_SIZE)
+
+struct Recorder;
+
+// Creates or truncates the file at path
+// Returns NULL on failure
+struct Recorder *recorderOpen(const char *path);
+
+// Stops taking frames and finishes the file without blocking: the unaligned tail and fdatasync() are queued
+// behind outstanding writes, and complete through recorderFd() and recorderProcess() like them
+void recorderStop(struct Recorder *rec);
+
+// Returns 1 once a stopped recorder has nothing left in flight, recorderClose() doesn't block then
+int recorderFinished(const struct Recorder *rec);
+
+// Stops the recorder if it isn't yet and waits for it to finish
+void recorderClose(struct Recorder *rec);
+
+// fd that becomes readable when writes complete, call recorderProcess() then
+int recorderFd(const struct Recorder *rec);
+
+// Reaps completed writes
+// Returns 0 on success, -errno if a write failed, recording stops then
+int recorderProcess(struct Recorder *rec);
+
+// Appends a dequeued encoded buffer of st, buffer can be queued back as soon as this returns.
+// Buffers need to be exported as dmabuf
+// Returns 0 on success, -ENOBUFS if the frame was dropped, -errno on failure
+int recorderWrite(struct Recorder *rec, const struct DeviceStream *st, const struct Buffer *buf);
+
+// Optional, passed: frames recorded, skipped: frames dropped, dst_available: free ring bytes
+void recorderSetMetrics(struct Recorder *rec, struct MetricsPump *metrics);
@@ -0,0 +1,314 @@
+// malincam-rtp-bench: RTP sink over loopback, see rtp.h
+// Usage: malincam-rtp-bench [frames]
+// Synthetic H.264 access units go through rtpSinkSend() to a UDP socket on 127.0.0.1, which reassembles
+// FU-A fragments and checks every frame against what was sent: sequence numbers without gaps, one RTP
+// timestamp per frame taken from the capture time, marker on the last packet only, SPS and PPS inlined
+// ahead of IDR frames that come without them, and NAL units byte for byte.
+// Capture to send is the time rtpSinkSend() takes for a frame captured right before the call, so it's
+// the sink's share of the latency: splitting, packetizing and handing packets to the kernel.
+#define _GNU_SOURCE // recvmmsg
+#define ARRAY_H_IMPLEMENT
+#include "array.h"
+#include "rtp.h"
+#include "common.h"
+
+#include <arpa/inet.h> // htonl
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h> // atoi, malloc, qsort
+#include <string.h> // memcmp, memcpy, strerror
+#include <time.h> // clock_gettime
+#include <unistd.h> // close
+
+#define BENCH_GOP 30
+#define BENCH_IDR_SIZE 60000
+#define BENCH_P_SIZE 15000
+#define BENCH_MAX_NALS 8
+#define BENCH_FRAME_MAX (BENCH_IDR_SIZE + 1024)
+
+// A frame with all of its packets and a few to spare
+#define BENCH_PACKETS_MAX 256
+#define BENCH_PACKET_MAX 2048
+
+enum {
+	NAL_TYPE_SLICE = 1,
+	NAL_TYPE_IDR = 5,
+	NAL_TYPE_SPS = 7,
+	NAL_TYPE_PPS = 8,
+	NAL_TYPE_FU_A = 28,
+};
+
+typedef struct {
+	const uint8_t *data;
+	uint32_t size;
+} BenchNal;
+
+typedef struct {
+	BenchNal nals[BENCH_MAX_NALS];
+	int count;
+} BenchNals;
+
+typedef struct {
+	int fd;
+	int seq_valid;
+	uint16_t seq;
+
+	uint8_t packets[BENCH_PACKETS_MAX][BENCH_PACKET_MAX];
+	int sizes[BENCH_PACKETS_MAX];
+
+	// Reassembled NAL units of the current frame, back to back
+	uint8_t frame[BENCH_FRAME_MAX + 2 * 256];
+	uint32_t frame_size;
+	BenchNals nals;
+} BenchReceiver;
+
+static uint64_t monotonicNs(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static const uint8_t g_sps[] = {0x67, 0x64, 0x00, 0x28, 0xac, 0xd9, 0x40, 0x78, 0x02, 0x27, 0xe5, 0xc0, 0x44};
+static const uint8_t g_pps[] = {0x68, 0xeb, 0xe3, 0xcb, 0x22, 0xc0};
+
+// Slice payload bytes are never zero, so no start codes show up inside NAL units
+static void fillSlice(uint8_t *out, uint32_t size, int type, uint32_t *rng) {
+	out[0] = 0x60 | type;
+	for (uint32_t i = 1; i < size; ++i) {
+		*rng = *rng * 1664525u + 1013904223u;
+		out[i] = 1 + (*rng >> 24) % 255;
+	}
+}
+
+static void appendNal(uint8_t *out, uint32_t *size, BenchNals *nals, const uint8_t *nal, uint32_t nal_size) {
+	static const uint8_t start_code[] = {0, 0, 0, 1};
+	memcpy(out + *size, start_code, sizeof(start_code));
+	*size += sizeof(start_code);
+	memcpy(out + *size, nal, nal_size);
+	nals->nals[nals->count++] = (BenchNal){.data = out + *size, .size = nal_size};
+	*size += nal_size;
+}
+
+// Encoder like GOP: SPS, PPS and IDR first, later IDRs without parameters, P frames in one or two slices
+// of varying sizes, down to ones that fit a single packet
+static uint32_t makeFrame(int index, uint8_t *out, BenchNals *nals, BenchNals *expected, uint32_t *rng) {
+	static uint8_t slice[BENCH_IDR_SIZE];
+	uint32_t size = 0;
+	nals->count = expected->count = 0;
+
+	const int idr = index % BENCH_GOP == 0;
+	if (idr) {
+		if (index == 0) {
+			appendNal(out, &size, nals, g_sps, sizeof(g_sps));
+			appendNal(out, &size, nals, g_pps, sizeof(g_pps));
+		} else {
+			expected->nals[expected->count++] = (BenchNal){.data = g_sps, .size = sizeof(g_sps)};
+			expected->nals[expected->count++] = (BenchNal){.data = g_pps, .size = sizeof(g_pps)};
+		}
+		fillSlice(slice, BENCH_IDR_SIZE, NAL_TYPE_IDR, rng);
+		appendNal(out, &size, nals, slice, BENCH_IDR_SIZE);
+	} else {
+		const uint32_t slice_size = index % 5 == 0 ? 700 : BENCH_P_SIZE / 2 + (*rng >> 8) % BENCH_P_SIZE;
+		const int slices = index % 7 == 0 ? 2 : 1;
+		for (int i = 0; i < slices; ++i) {
+			fillSlice(slice, slice_size / slices, NAL_TYPE_SLICE, rng);
+			appendNal(out, &size, nals, slice, slice_size / slices);
+		}
+	}
+
+	for (int i = 0; i < nals->count; ++i)
+		expected->nals[expected->count++] = nals->nals[i];
+	return size;
+}
+
+static int receiverOpen(BenchReceiver *r, uint16_t *port) {
+	r->fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	struct sockaddr_in addr = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+	socklen_t addr_len = sizeof(addr);
+	if (r->fd < 0 || 0 != bind(r->fd, (const struct sockaddr*)&addr, sizeof(addr))
+		|| 0 != getsockname(r->fd, (struct sockaddr*)&addr, &addr_len)) {
+		LOGE("Unable to open receiver socket: %d, %s", errno, strerror(errno));
+		return -1;
+	}
+
+	// An IDR frame is ~45 packets, all of them are queued before the receiver gets to run
+	const int rcvbuf = 4 << 20;
+	setsockopt(r->fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+	*port = ntohs(addr.sin_port);
+	return 0;
+}
+
+// Returns number of packets received
+static int receiverDrain(BenchReceiver *r) {
+	struct iovec iovs[BENCH_PACKETS_MAX];
+	struct mmsghdr msgs[BENCH_PACKETS_MAX];
+	for (int i = 0; i < BENCH_PACKETS_MAX; ++i) {
+		iovs[i] = (struct iovec){.iov_base = r->packets[i], .iov_len = BENCH_PACKET_MAX};
+		msgs[i] = (struct mmsghdr){.msg_hdr = {.msg_iov = iovs + i, .msg_iovlen = 1}};
+	}
+
+	const int count = recvmmsg(r->fd, msgs, BENCH_PACKETS_MAX, MSG_DONTWAIT, NULL);
+	if (count < 0)
+		return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -errno;
+
+	for (int i = 0; i < count; ++i)
+		r->sizes[i] = msgs[i].msg_len;
+	return count;
+}
+
+// Needs frame in scope
+#define CHECK(cond, fmt, ...) do { \
+		if (!(cond)) { \
+			LOGE("Frame %d: " fmt, frame, __VA_ARGS__); \
+			return -1; \
+		} \
+	} while (0)
+
+static int receiverCheckFrame(BenchReceiver *r, int frame, uint32_t timestamp, const BenchNals *expected) {
+	const int count = receiverDrain(r);
+	CHECK(count > 0, "no packets received: %d", count);
+
+	r->frame_size = 0;
+	r->nals.count = 0;
+	int fragment = 0;
+	for (int i = 0; i < count; ++i) {
+		const uint8_t *const p = r->packets[i];
+		const int size = r->sizes[i];
+		CHECK(size > RTP_HEADER_SIZE, "packet %d is %d bytes", i, size);
+		CHECK(p[0] == 0x80 && (p[1] & 0x7f) == RTP_PAYLOAD_TYPE, "packet %d has header %02x %02x", i, p[0], p[1]);
+
+		const uint16_t seq = p[2] << 8 | p[3];
+		CHECK(!r->seq_valid || seq == (uint16_t)(r->seq + 1), "packet %d has seq %u after %u", i, seq, r->seq);
+		r->seq = seq;
+		r->seq_valid = 1;
+
+		const uint32_t ts = (uint32_t)p[4] << 24 | p[5] << 16 | p[6] << 8 | p[7];
+		CHECK(ts == timestamp, "packet %d has timestamp %u, expected %u", i, ts, timestamp);
+
+		const int marker = p[1] >> 7;
+		CHECK(marker == (i == count - 1), "packet %d of %d has marker %d", i, count, marker);
+
+		const uint8_t *const payload = p + RTP_HEADER_SIZE;
+		const uint32_t payload_size = size - RTP_HEADER_SIZE;
+		CHECK(payload_size <= RTP_MAX_PAYLOAD + 2, "packet %d has %u bytes of payload", i, payload_size);
+		CHECK(r->frame_size + payload_size <= sizeof(r->frame) && r->nals.count < BENCH_MAX_NALS,
+			"too much data at packet %d", i);
+
+		if ((payload[0] & 0x1f) != NAL_TYPE_FU_A) {
+			CHECK(!fragment, "packet %d interrupts a fragmented NAL", i);
+			memcpy(r->frame + r->frame_size, payload, payload_size);
+			r->nals.nals[r->nals.count++] = (BenchNal){.data = r->frame + r->frame_size, .size = payload_size};
+			r->frame_size += payload_size;
+			continue;
+		}
+
+		CHECK(payload_size > 2, "packet %d is an empty fragment", i);
+		const int start = payload[1] >> 7, end = (payload[1] >> 6) & 1;
+		CHECK(start != fragment, "packet %d has start bit %d, %s", i, start, fragment ? "inside a NAL" : "expected one");
+		if (start) {
+			// NAL header is rebuilt from the FU indicator and header
+			r->frame[r->frame_size] = (payload[0] & 0xe0) | (payload[1] & 0x1f);
+			r->nals.nals[r->nals.count++] = (BenchNal){.data = r->frame + r->frame_size, .size = 1};
+			r->frame_size++;
+			fragment = 1;
+		}
+
+		memcpy(r->frame + r->frame_size, payload + 2, payload_size - 2);
+		r->frame_size += payload_size - 2;
+		r->nals.nals[r->nals.count - 1].size += payload_size - 2;
+		fragment = !end;
+	}
+
+	CHECK(!fragment, "NAL %d is not finished", r->nals.count - 1);
+	CHECK(r->nals.count == expected->count, "%d NAL units received, %d expected", r->nals.count, expected->count);
+	for (int i = 0; i < expected->count; ++i) {
+		const BenchNal *const got = r->nals.nals + i, *const want = expected->nals + i;
+		CHECK(got->size == want->size && 0 == memcmp(got->data, want->data, want->size),
+			"NAL %d differs: %u bytes received, %u expected", i, got->size, want->size);
+	}
+
+	return count;
+}
+
+static int compareU64(const void *a, const void *b) {
+	const uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+	return x < y ? -1 : x > y;
+}
+
+int main(int argc, const char *argv[]) {
+	const int frames = argc >= 2 ? atoi(argv[1]) : 3000;
+	if (frames <= 0) {
+		LOGE("Usage: %s [frames]", argv[0]);
+		return 1;
+	}
+
+	static BenchReceiver r;
+	uint16_t port;
+	if (0 != receiverOpen(&r, &port))
+		return 1;
+
+	struct RtpSink *const rtp = rtpSinkOpen((RtpSinkArgs){.host = "127.0.0.1", .port = port, .inline_params = 1});
+	if (!rtp)
+		return 1;
+
+	// Encoder buffer stand-ins: memory that isn't a dmabuf, so syncs fail and are skipped like on coherent memory
+	static uint8_t data[BENCH_FRAME_MAX];
+	const DeviceStream st = {.type = V4L2_BUF_TYPE_VIDEO_CAPTURE};
+	Buffer buf = {.buffer = {.type = V4L2_BUF_TYPE_VIDEO_CAPTURE, .length = sizeof(data)}};
+	buf.dmabuf_fd[0] = -1;
+	buf.read_mapped[0] = data;
+	buf.read_size[0] = sizeof(data);
+
+	uint64_t *const latency_ns = malloc(sizeof(*latency_ns) * frames);
+	if (!latency_ns)
+		return 1;
+
+	uint32_t rng = 1;
+	uint64_t bytes = 0, packets = 0;
+	int result = 0;
+	for (int i = 0; i < frames && !result; ++i) {
+		BenchNals nals, expected;
+		buf.buffer.bytesused = makeFrame(i, data, &nals, &expected, &rng);
+		bytes += buf.buffer.bytesused;
+
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		buf.buffer.timestamp = (struct timeval){.tv_sec = ts.tv_sec, .tv_usec = ts.tv_nsec / 1000};
+		const uint64_t begin_ns = monotonicNs();
+		if (0 != rtpSinkSend(rtp, &st, &buf)) {
+			LOGE("Frame %d: send failed", i);
+			result = 1;
+			break;
+		}
+		latency_ns[i] = monotonicNs() - begin_ns;
+
+		const uint64_t capture_us = ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+		const int received = receiverCheckFrame(&r, i, capture_us * (RTP_CLOCK_HZ / 1000) / 1000, &expected);
+		if (received < 0)
+			result = 1;
+		else
+			packets += received;
+	}
+
+	rtpSinkClose(rtp);
+	close(r.fd);
+
+	if (!result) {
+		qsort(latency_ns, frames, sizeof(*latency_ns), compareU64);
+		uint64_t total_ns = 0;
+		for (int i = 0; i < frames; ++i)
+			total_ns += latency_ns[i];
+
+		printf("%d frames, %llu packets, %.1f KiB per frame, all reassembled and matching\n", frames,
+			(unsigned long long)packets, bytes / 1024. / frames);
+		printf("capture to send: avg %.1f us p50 %.1f us p99 %.1f us max %.1f us, %.0f ns per packet\n",
+			total_ns / 1000. / frames, latency_ns[frames / 2] / 1000., latency_ns[frames * 99 / 100] / 1000.,
+			latency_ns[frames - 1] / 1000., (double)total_ns / packets);
+	}
+
+	free(latency_ns);
+	return result;
+}
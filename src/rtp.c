@@ -0,0 +1,326 @@
+#define _GNU_SOURCE // sendmmsg
+
+#include "rtp.h"
+
+#include "metrics.h"
+#include "common.h"
+
+#include <arpa/inet.h> // inet_ntop
+#include <netdb.h> // getaddrinfo
+#include <sys/socket.h>
+#include <stdio.h> // snprintf
+#include <stdlib.h> // calloc, free
+#include <string.h> // memcpy, memchr, strerror
+#include <unistd.h> // close, getpid
+#include <errno.h>
+
+// Access unit is SPS, PPS, SEI and a slice or a few
+#define RTP_MAX_NALS 64
+
+// SPS and PPS of the encoder are a few dozen bytes
+#define RTP_MAX_PARAM 256
+
+// Room for the frame's packets without waiting on the network
+#define RTP_SNDBUF (1 << 20)
+
+enum {
+	NAL_TYPE_IDR = 5,
+	NAL_TYPE_SPS = 7,
+	NAL_TYPE_PPS = 8,
+	NAL_TYPE_FU_A = 28,
+};
+
+typedef struct {
+	// RTP header, then FU indicator and header for fragments
+	uint8_t header[RTP_HEADER_SIZE + 2];
+	struct iovec iov[2];
+} RtpPacket;
+
+typedef struct {
+	const uint8_t *data;
+	uint32_t size;
+} RtpNal;
+
+typedef struct RtpSink {
+	int fd;
+	int inline_params;
+
+	uint16_t seq;
+	uint32_t ssrc;
+
+	uint8_t sps[RTP_MAX_PARAM];
+	uint32_t sps_size;
+	uint8_t pps[RTP_MAX_PARAM];
+	uint32_t pps_size;
+
+	// Batch being filled
+	RtpPacket packets[RTP_BATCH];
+	struct mmsghdr msgs[RTP_BATCH];
+	int count;
+
+	// Packets of the current frame that didn't make it, failed send otherwise
+	int lost;
+	int error;
+
+	struct MetricsPump *metrics;
+
+	uint64_t frames;
+	uint64_t packets_sent;
+	uint64_t packets_lost;
+	uint64_t latency_us;
+	uint64_t latency_max_us;
+} RtpSink;
+
+struct RtpSink *rtpSinkOpen(RtpSinkArgs args) {
+	RtpSink *const rtp = calloc(1, sizeof(RtpSink));
+	if (!rtp)
+		return NULL;
+
+	rtp->fd = -1;
+	rtp->inline_params = args.inline_params;
+	rtp->ssrc = getpid() ^ (uint32_t)monotonicUs() ^ args.port;
+	rtp->seq = (uint16_t)monotonicUs();
+
+	char port[8];
+	snprintf(port, sizeof(port), "%u", args.port);
+	const struct addrinfo hints = {.ai_family = AF_INET, .ai_socktype = SOCK_DGRAM};
+	struct addrinfo *addr = NULL;
+	const int gai = getaddrinfo(args.host, port, &hints, &addr);
+	if (gai != 0) {
+		LOGE("%s: unable to resolve %s: %s", __func__, args.host, gai_strerror(gai));
+		goto fail;
+	}
+
+	rtp->fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (rtp->fd < 0 || 0 != connect(rtp->fd, addr->ai_addr, addr->ai_addrlen)) {
+		LOGE("%s: unable to connect to %s:%u: %d, %s", __func__, args.host, args.port, errno, strerror(errno));
+		goto fail;
+	}
+
+	const int sndbuf = RTP_SNDBUF;
+	setsockopt(rtp->fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+
+	char ip[INET_ADDRSTRLEN];
+	inet_ntop(AF_INET, &((const struct sockaddr_in*)addr->ai_addr)->sin_addr, ip, sizeof(ip));
+	LOGI("RTP H.264 to %s:%u, SDP:\n"
+		"v=0\no=- 0 0 IN IP4 %s\ns=malincam\nc=IN IP4 %s\nt=0 0\n"
+		"m=video %u RTP/AVP %d\na=rtpmap:%d H264/%d\na=fmtp:%d packetization-mode=1",
+		ip, args.port, ip, ip, args.port, RTP_PAYLOAD_TYPE, RTP_PAYLOAD_TYPE, RTP_CLOCK_HZ, RTP_PAYLOAD_TYPE);
+
+	freeaddrinfo(addr);
+	return rtp;
+
+fail:
+	if (addr)
+		freeaddrinfo(addr);
+	rtpSinkClose(rtp);
+	return NULL;
+}
+
+void rtpSinkClose(RtpSink *rtp) {
+	if (!rtp)
+		return;
+
+	if (rtp->frames)
+		LOGI("RTP: %llu frames, %llu packets, %llu lost, capture to send %.1fms avg %.1fms max",
+			(unsigned long long)rtp->frames, (unsigned long long)rtp->packets_sent, (unsigned long long)rtp->packets_lost,
+			rtp->latency_us / 1000. / rtp->frames, rtp->latency_max_us / 1000.);
+
+	if (rtp->fd >= 0)
+		close(rtp->fd);
+	free(rtp);
+}
+
+void rtpSinkSetMetrics(RtpSink *rtp, struct MetricsPump *metrics) {
+	rtp->metrics = metrics;
+}
+
+static void flush(RtpSink *rtp) {
+	int sent = 0;
+	while (sent < rtp->count) {
+		const int result = sendmmsg(rtp->fd, rtp->msgs + sent, rtp->count - sent, MSG_DONTWAIT);
+		if (result >= 0) {
+			sent += result;
+			continue;
+		}
+
+		if (errno == EINTR)
+			continue;
+
+		// Full socket, or nobody listening yet: port unreachable comes back on the next send
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS && errno != ECONNREFUSED) {
+			LOGE("%s: sendmmsg() failed: %d, %s", __func__, errno, strerror(errno));
+			rtp->error = -errno;
+		}
+		break;
+	}
+
+	rtp->packets_sent += sent;
+	rtp->lost += rtp->count - sent;
+	rtp->packets_lost += rtp->count - sent;
+	rtp->count = 0;
+}
+
+static void addPacket(RtpSink *rtp, const uint8_t *fu, const uint8_t *payload, uint32_t size, int marker, uint32_t timestamp) {
+	if (rtp->count == RTP_BATCH)
+		flush(rtp);
+
+	RtpPacket *const packet = rtp->packets + rtp->count;
+	uint8_t *const h = packet->header;
+	h[0] = 0x80; // version 2
+	h[1] = (marker ? 0x80 : 0) | RTP_PAYLOAD_TYPE;
+	h[2] = rtp->seq >> 8;
+	h[3] = rtp->seq;
+	h[4] = timestamp >> 24;
+	h[5] = timestamp >> 16;
+	h[6] = timestamp >> 8;
+	h[7] = timestamp;
+	h[8] = rtp->ssrc >> 24;
+	h[9] = rtp->ssrc >> 16;
+	h[10] = rtp->ssrc >> 8;
+	h[11] = rtp->ssrc;
+	if (fu)
+		memcpy(h + RTP_HEADER_SIZE, fu, 2);
+
+	packet->iov[0] = (struct iovec){.iov_base = h, .iov_len = RTP_HEADER_SIZE + (fu ? 2 : 0)};
+	packet->iov[1] = (struct iovec){.iov_base = (void*)payload, .iov_len = size};
+	rtp->msgs[rtp->count].msg_hdr = (struct msghdr){.msg_iov = packet->iov, .msg_iovlen = COUNTOF(packet->iov)};
+	rtp->count++;
+	rtp->seq++;
+}
+
+// Single NAL unit packet if it fits, FU-A fragments otherwise
+static void addNal(RtpSink *rtp, const RtpNal *nal, int last, uint32_t timestamp) {
+	if (nal->size <= RTP_MAX_PAYLOAD) {
+		addPacket(rtp, NULL, nal->data, nal->size, last, timestamp);
+		return;
+	}
+
+	// NAL header is spread over FU indicator and header
+	const uint8_t indicator = (nal->data[0] & 0xe0) | NAL_TYPE_FU_A;
+	const uint8_t type = nal->data[0] & 0x1f;
+	for (uint32_t pos = 1; pos < nal->size;) {
+		const uint32_t left = nal->size - pos;
+		const uint32_t size = left < RTP_MAX_PAYLOAD - 2 ? left : RTP_MAX_PAYLOAD - 2;
+		const int end = pos + size == nal->size;
+		const uint8_t fu[2] = {indicator, (pos == 1 ? 0x80 : 0) | (end ? 0x40 : 0) | type};
+		addPacket(rtp, fu, nal->data + pos, size, last && end, timestamp);
+		pos += size;
+	}
+}
+
+// Offset of the next 00 00 01 at or after pos, size if there is none
+static uint32_t findStartCode(const uint8_t *data, uint32_t pos, uint32_t size) {
+	while (pos + 3 <= size) {
+		const uint8_t *const one = memchr(data + pos + 2, 1, size - pos - 2);
+		if (!one)
+			break;
+
+		const uint32_t i = one - data;
+		if (data[i - 1] == 0 && data[i - 2] == 0)
+			return i - 2;
+		pos = i - 1;
+	}
+
+	return size;
+}
+
+// Returns number of NAL units, without start codes and trailing zeros
+static int splitNals(const uint8_t *data, uint32_t size, RtpNal *nals) {
+	int count = 0;
+	uint32_t pos = findStartCode(data, 0, size);
+	while (pos < size && count < RTP_MAX_NALS) {
+		const uint32_t begin = pos + 3;
+		const uint32_t next = findStartCode(data, begin, size);
+		uint32_t end = next;
+		while (end > begin && data[end - 1] == 0)
+			end--;
+		if (end > begin)
+			nals[count++] = (RtpNal){.data = data + begin, .size = end - begin};
+		pos = next;
+	}
+
+	return count;
+}
+
+static void keepParam(uint8_t *out, uint32_t *out_size, const RtpNal *nal) {
+	if (nal->size > RTP_MAX_PARAM)
+		return;
+	memcpy(out, nal->data, nal->size);
+	*out_size = nal->size;
+}
+
+static void sendFrame(RtpSink *rtp, const uint8_t *data, uint32_t size, uint32_t timestamp) {
+	RtpNal nals[RTP_MAX_NALS];
+	const int count = splitNals(data, size, nals);
+	if (!count)
+		return;
+
+	int idr = 0, params = 0;
+	for (int i = 0; i < count; ++i) {
+		const int type = nals[i].data[0] & 0x1f;
+		idr |= type == NAL_TYPE_IDR;
+		params |= type == NAL_TYPE_SPS || type == NAL_TYPE_PPS;
+	}
+
+	if (rtp->inline_params && idr && !params && rtp->sps_size && rtp->pps_size) {
+		addNal(rtp, &(RtpNal){.data = rtp->sps, .size = rtp->sps_size}, 0, timestamp);
+		addNal(rtp, &(RtpNal){.data = rtp->pps, .size = rtp->pps_size}, 0, timestamp);
+	}
+
+	for (int i = 0; i < count; ++i) {
+		const int type = nals[i].data[0] & 0x1f;
+		if (type == NAL_TYPE_SPS)
+			keepParam(rtp->sps, &rtp->sps_size, nals + i);
+		else if (type == NAL_TYPE_PPS)
+			keepParam(rtp->pps, &rtp->pps_size, nals + i);
+
+		addNal(rtp, nals + i, i == count - 1, timestamp);
+	}
+
+	flush(rtp);
+}
+
+int rtpSinkSend(RtpSink *rtp, const DeviceStream *st, const Buffer *buf) {
+	const int mp = IS_STREAM_MPLANE(st);
+	const uint32_t offset = mp ? buf->buffer.m.planes[0].data_offset : 0;
+	const uint32_t bytesused = mp ? buf->buffer.m.planes[0].bytesused : buf->buffer.bytesused;
+	if (bytesused <= offset)
+		return 0;
+
+	// Encoders copy the camera timestamp, which is CLOCK_MONOTONIC
+	const uint64_t capture_us = buf->buffer.timestamp.tv_sec * 1000000ull + buf->buffer.timestamp.tv_usec;
+	const uint32_t timestamp = capture_us * (RTP_CLOCK_HZ / 1000) / 1000;
+
+	rtp->lost = 0;
+	rtp->error = 0;
+	const uint8_t *const data = bufferReadBegin(buf, 0);
+	if (!data) {
+		if (rtp->metrics) METRICS_INC(rtp->metrics->errors);
+		return -EINVAL;
+	}
+
+	sendFrame(rtp, data + offset, bytesused - offset, timestamp);
+	bufferReadEnd(buf, 0);
+
+	const uint64_t now_us = monotonicUs();
+	if (capture_us && capture_us <= now_us) {
+		const uint64_t latency_us = now_us - capture_us;
+		rtp->latency_us += latency_us;
+		if (latency_us > rtp->latency_max_us)
+			rtp->latency_max_us = latency_us;
+	}
+
+	rtp->frames++;
+
+	if (rtp->metrics) {
+		if (rtp->error)
+			METRICS_INC(rtp->metrics->errors);
+		else if (rtp->lost)
+			METRICS_INC(rtp->metrics->skipped);
+		else
+			METRICS_INC(rtp->metrics->passed);
+	}
+
+	return rtp->error;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include "device.h"
+
+#include <stdint.h>
+
+struct MetricsPump;
+struct RtpSink;
+
+// H.264 over RTP (RFC 6184) to a UDP receiver, for low latency viewing over the network, e.g.:
+//   ffplay -protocol_whitelist file,udp,rtp -fflags nobuffer -flags low_delay malincam.sdp
+// with the SDP logged on open.
+//
+// NAL units go straight from the mapped encoder buffer into the socket: every packet is an RTP header (plus FU-A
+// indicator and header for fragments) and a pointer into the frame, sent in sendmmsg() batches as soon as the
+// encoder is done with the frame. Nothing is queued, a frame the socket can't take right away loses
+// packets instead of delaying the next one.
+
+#define RTP_DEFAULT_PORT 5004
+#define RTP_PAYLOAD_TYPE 96
+#define RTP_CLOCK_HZ 90000
+
+#define RTP_HEADER_SIZE 12
+
+// Fits a 1500 byte Ethernet MTU with IPv4, UDP and RTP headers to spare
+#define RTP_MAX_PAYLOAD 1400
+
+// Packets per sendmmsg() call
+#define RTP_BATCH 64
+
+typedef struct {
+	// Receiver, IPv4 address or name
+	const char *host;
+	uint16_t port;
+
+	// Last SPS and PPS ahead of every IDR frame that comes without them, so receivers can join at any IDR
+	int inline_params;
+} RtpSinkArgs;
+
+// Returns NULL on failure
+struct RtpSink *rtpSinkOpen(RtpSinkArgs args);
+
+// Logs frame, packet and latency stats
+void rtpSinkClose(struct RtpSink *rtp);
+
+// Optional, passed: frames sent, skipped: frames that lost packets to a full socket, errors: failed sends
+void rtpSinkSetMetrics(struct RtpSink *rtp, struct MetricsPump *metrics);
+
+// buf is a dequeued H.264 (Annex B) encoder buffer of st, exported as dmabuf, and can be queued back as soon as
+// this returns
+// Returns 0 on success, -errno on failure
+int rtpSinkSend(struct RtpSink *rtp, const DeviceStream *st, const Buffer *buf);
@@ -0,0 +1,119 @@
+#include "scene.h"
+
+#include "common.h"
+
+#include <stdlib.h> // calloc, free, abs
+#include <string.h> // memcpy
+
+#define SCENE_SAMPLES_W (SCENE_GRID_W * SCENE_BLOCK_SAMPLES)
+#define SCENE_SAMPLES_H (SCENE_GRID_H * SCENE_BLOCK_SAMPLES)
+
+typedef struct Scene {
+	SceneArgs args;
+
+	// Sample positions for the frame size they were computed for
+	uint32_t width, height, stride;
+	uint32_t xs[SCENE_SAMPLES_W];
+	uint32_t ys[SCENE_SAMPLES_H];
+
+	// Block sums of the last frame let through, valid if last_passed_us != 0
+	uint32_t reference[SCENE_GRID_H][SCENE_GRID_W];
+	uint64_t last_passed_us;
+
+	uint64_t frames;
+	uint64_t unchanged;
+	uint64_t signature_us;
+} Scene;
+
+struct Scene *sceneCreate(SceneArgs args) {
+	Scene *const scene = calloc(1, sizeof(Scene));
+	if (!scene)
+		return NULL;
+
+	scene->args = args;
+	LOGI("Static scenes send a frame at least every %ums, block threshold %d", args.max_interval_ms, args.threshold);
+	return scene;
+}
+
+void sceneDestroy(Scene *scene) {
+	if (!scene)
+		return;
+
+	if (scene->frames)
+		LOGI("Scene: %llu frames, %llu unchanged, %.1fus per signature",
+			(unsigned long long)scene->frames, (unsigned long long)scene->unchanged,
+			(double)scene->signature_us / scene->frames);
+
+	free(scene);
+}
+
+// Centers of SCENE_SAMPLES_W x SCENE_SAMPLES_H equal cells
+static void setFrameSize(Scene *scene, uint32_t width, uint32_t height, uint32_t stride) {
+	scene->width = width;
+	scene->height = height;
+	scene->stride = stride;
+	for (int i = 0; i < SCENE_SAMPLES_W; ++i)
+		scene->xs[i] = (2 * i + 1) * width / (2 * SCENE_SAMPLES_W);
+	for (int i = 0; i < SCENE_SAMPLES_H; ++i)
+		scene->ys[i] = ((2 * i + 1) * height / (2 * SCENE_SAMPLES_H)) * stride;
+
+	// Different size, nothing to compare with
+	scene->last_passed_us = 0;
+}
+
+static void computeSignature(const Scene *scene, const uint8_t *luma, uint32_t out[SCENE_GRID_H][SCENE_GRID_W]) {
+	memset(out, 0, sizeof(uint32_t) * SCENE_GRID_H * SCENE_GRID_W);
+	for (int j = 0; j < SCENE_SAMPLES_H; ++j) {
+		const uint8_t *const row = luma + scene->ys[j];
+		uint32_t *const sums = out[j / SCENE_BLOCK_SAMPLES];
+		for (int i = 0; i < SCENE_SAMPLES_W; ++i)
+			sums[i / SCENE_BLOCK_SAMPLES] += row[scene->xs[i]];
+	}
+}
+
+static int signatureDiffers(const Scene *scene, uint32_t sig[SCENE_GRID_H][SCENE_GRID_W]) {
+	// Sums, not averages, are compared
+	const int threshold = scene->args.threshold * SCENE_BLOCK_SAMPLES * SCENE_BLOCK_SAMPLES;
+	for (int y = 0; y < SCENE_GRID_H; ++y)
+		for (int x = 0; x < SCENE_GRID_W; ++x)
+			if (abs((int)sig[y][x] - (int)scene->reference[y][x]) > threshold)
+				return 1;
+	return 0;
+}
+
+int sceneChanged(Scene *scene, const DeviceStream *st, const Buffer *buf) {
+	const int mp = IS_STREAM_MPLANE(st);
+	const uint32_t width = mp ? st->format.fmt.pix_mp.width : st->format.fmt.pix.width;
+	const uint32_t height = mp ? st->format.fmt.pix_mp.height : st->format.fmt.pix.height;
+	const uint32_t stride = mp ? st->format.fmt.pix_mp.plane_fmt[0].bytesperline : st->format.fmt.pix.bytesperline;
+	const uint32_t length = mp ? buf->buffer.m.planes[0].length : buf->buffer.length;
+	const uint32_t offset = mp ? buf->buffer.m.planes[0].data_offset : 0;
+	if (width < SCENE_SAMPLES_W || height < SCENE_SAMPLES_H || offset + stride * height > length)
+		return 1;
+
+	if (width != scene->width || height != scene->height || stride != scene->stride)
+		setFrameSize(scene, width, height, stride);
+
+	const uint64_t begin_us = monotonicUs();
+	const uint8_t *const data = bufferReadBegin(buf, 0);
+	if (!data)
+		return 1;
+
+	uint32_t sig[SCENE_GRID_H][SCENE_GRID_W];
+	computeSignature(scene, data + offset, sig);
+	bufferReadEnd(buf, 0);
+
+	const uint64_t now_us = monotonicUs();
+	scene->signature_us += now_us - begin_us;
+	scene->frames++;
+
+	if (scene->last_passed_us && now_us - scene->last_passed_us < scene->args.max_interval_ms * 1000ull
+		&& !signatureDiffers(scene, sig)) {
+		scene->unchanged++;
+		return 0;
+	}
+
+	memcpy(scene->reference, sig, sizeof(sig));
+	scene->last_passed_us = now_us;
+	return 1;
+}
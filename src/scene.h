@@ -0,0 +1,36 @@
+#pragma once
+
+#include "device.h"
+
+#include <stdint.h>
+
+// Static scene detection on ISP output, so that frames which add nothing need not be encoded and sent.
+// Signature of a frame is the average luma of SCENE_GRID_W x SCENE_GRID_H blocks, each sampled on a sparse
+// SCENE_BLOCK_SAMPLES x SCENE_BLOCK_SAMPLES grid straight from the ISP's dmabuf, i.e. about 12k byte loads
+// per frame regardless of its size.
+// A frame is unchanged if no block moved by more than threshold since the last frame that was let through,
+// and that one is less than max_interval_ms old. The first frame that differs goes through right away,
+// so motion isn't delayed, and slow drift adds up until it does.
+
+#define SCENE_GRID_W 16
+#define SCENE_GRID_H 12
+#define SCENE_BLOCK_SAMPLES 8
+
+// Luma levels of a block average, well above sensor noise averaged over a block
+#define SCENE_DEFAULT_THRESHOLD 6
+
+struct Scene;
+
+typedef struct {
+	// Longest a static scene goes without a frame
+	uint32_t max_interval_ms;
+
+	int threshold;
+} SceneArgs;
+
+struct Scene *sceneCreate(SceneArgs args);
+void sceneDestroy(struct Scene *scene);
+
+// buf is a filled capture buffer of st, with 8 bit luma in the first plane
+// Returns 1 if buf should be passed on, 0 if the last one that was is still good
+int sceneChanged(struct Scene *scene, const DeviceStream *st, const Buffer *buf);
@@ -0,0 +1,235 @@
+#include "snapshot.h"
+
+#include "array.h"
+#include "common.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h> // malloc
+#include <string.h> // strerror
+
+#include <linux/videodev2.h> // v4l2_capability
+#include <sys/stat.h> // fstat
+#include <sys/sysmacros.h> // major, minor
+#include <sys/utsname.h> // uname
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t count;
+} SnapshotHeader;
+
+typedef struct {
+	char key[SNAPSHOT_KEY_SIZE];
+	void *data;
+	size_t size;
+} SnapshotEntry;
+
+static struct {
+	char path[256];
+	int enabled;
+	int dirty;
+	int hits, misses;
+	Array /*T(SnapshotEntry)*/ entries;
+} g_snapshot;
+
+static SnapshotEntry *entryFind(const char *key) {
+	for (int i = 0; i < arraySize(&g_snapshot.entries); ++i) {
+		SnapshotEntry *const e = arrayAt(&g_snapshot.entries, SnapshotEntry, i);
+		if (0 == strcmp(e->key, key))
+			return e;
+	}
+
+	return NULL;
+}
+
+static void entriesFree(void) {
+	for (int i = 0; i < arraySize(&g_snapshot.entries); ++i)
+		free(arrayAt(&g_snapshot.entries, SnapshotEntry, i)->data);
+	arrayResize(&g_snapshot.entries);
+}
+
+static int entryRead(FILE *f) {
+	uint32_t key_len, size;
+	if (1 != fread(&key_len, sizeof(key_len), 1, f) || key_len == 0 || key_len >= SNAPSHOT_KEY_SIZE)
+		return -EINVAL;
+
+	SnapshotEntry e = {0};
+	if (1 != fread(e.key, key_len, 1, f) || 1 != fread(&size, sizeof(size), 1, f))
+		return -EINVAL;
+
+	e.size = size;
+	e.data = malloc(size ? size : 1);
+	if (!e.data)
+		return -ENOMEM;
+
+	if (size && 1 != fread(e.data, size, 1, f)) {
+		free(e.data);
+		return -EINVAL;
+	}
+
+	arrayAppend(&g_snapshot.entries, &e);
+	return 0;
+}
+
+static void snapshotLoad(void) {
+	FILE *const f = fopen(g_snapshot.path, "rb");
+	if (!f) {
+		LOGI("No device snapshot at %s: %s, enumerating live", g_snapshot.path, strerror(errno));
+		return;
+	}
+
+	SnapshotHeader header;
+	int valid = 1 == fread(&header, sizeof(header), 1, f)
+		&& header.magic == SNAPSHOT_MAGIC && header.version == SNAPSHOT_VERSION;
+
+	for (uint32_t i = 0; valid && i < header.count; ++i)
+		valid = 0 == entryRead(f);
+
+	fclose(f);
+
+	if (!valid) {
+		LOGI("Device snapshot %s is invalid or of another version, enumerating live", g_snapshot.path);
+		entriesFree();
+		return;
+	}
+
+	LOGI("Loaded %d device snapshot entries from %s", arraySize(&g_snapshot.entries), g_snapshot.path);
+}
+
+void snapshotOpen(const char *path) {
+	arrayInit(&g_snapshot.entries, SnapshotEntry);
+	g_snapshot.enabled = !!path;
+	if (!path)
+		return;
+
+	snprintf(g_snapshot.path, sizeof(g_snapshot.path), "%s", path);
+	snapshotLoad();
+}
+
+void snapshotSave(void) {
+	if (!g_snapshot.enabled || !g_snapshot.dirty)
+		return;
+
+	char tmp_path[sizeof(g_snapshot.path) + 8];
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", g_snapshot.path);
+
+	FILE *const f = fopen(tmp_path, "wb");
+	if (!f) {
+		LOGE("Unable to write device snapshot %s: %d, %s", tmp_path, errno, strerror(errno));
+		return;
+	}
+
+	const SnapshotHeader header = {
+		.magic = SNAPSHOT_MAGIC,
+		.version = SNAPSHOT_VERSION,
+		.count = arraySize(&g_snapshot.entries),
+	};
+	int ok = 1 == fwrite(&header, sizeof(header), 1, f);
+
+	for (int i = 0; ok && i < arraySize(&g_snapshot.entries); ++i) {
+		const SnapshotEntry *const e = arrayAtConst(&g_snapshot.entries, SnapshotEntry, i);
+		const uint32_t key_len = strlen(e->key), size = e->size;
+		ok = 1 == fwrite(&key_len, sizeof(key_len), 1, f)
+			&& 1 == fwrite(e->key, key_len, 1, f)
+			&& 1 == fwrite(&size, sizeof(size), 1, f)
+			&& (!size || 1 == fwrite(e->data, size, 1, f));
+	}
+
+	if (0 != fclose(f))
+		ok = 0;
+
+	if (!ok || 0 != rename(tmp_path, g_snapshot.path)) {
+		LOGE("Unable to write device snapshot %s: %d, %s", g_snapshot.path, errno, strerror(errno));
+		remove(tmp_path);
+		return;
+	}
+
+	g_snapshot.dirty = 0;
+	LOGI("Saved %d device snapshot entries to %s", header.count, g_snapshot.path);
+}
+
+void snapshotClose(void) {
+	snapshotSave();
+	entriesFree();
+	arrayDestroy(&g_snapshot.entries);
+	g_snapshot.enabled = 0;
+}
+
+const void *snapshotGet(const char *key, size_t *size) {
+	const SnapshotEntry *const e = g_snapshot.enabled ? entryFind(key) : NULL;
+	if (!e) {
+		++g_snapshot.misses;
+		return NULL;
+	}
+
+	++g_snapshot.hits;
+	*size = e->size;
+	return e->data;
+}
+
+void snapshotPut(const char *key, const void *data, size_t size) {
+	if (!g_snapshot.enabled)
+		return;
+
+	if (strlen(key) >= SNAPSHOT_KEY_SIZE) {
+		LOGE("%s: key %s is too long", __func__, key);
+		return;
+	}
+
+	void *const copy = malloc(size ? size : 1);
+	if (!copy)
+		return;
+	if (size)
+		memcpy(copy, data, size);
+
+	SnapshotEntry *const e = entryFind(key);
+	if (e) {
+		free(e->data);
+		e->data = copy;
+		e->size = size;
+	} else {
+		SnapshotEntry entry = {.data = copy, .size = size};
+		strcpy(entry.key, key);
+		arrayAppend(&g_snapshot.entries, &entry);
+	}
+
+	g_snapshot.dirty = 1;
+}
+
+void snapshotStats(int *hits, int *misses) {
+	*hits = g_snapshot.hits;
+	*misses = g_snapshot.misses;
+}
+
+void snapshotDeviceKey(const struct v4l2_capability *caps, char *out, size_t size) {
+	snprintf(out, size, "%.32s/%.32s/%.32s/%u.%u.%u", (const char*)caps->driver, (const char*)caps->card,
+		(const char*)caps->bus_info, (caps->version >> 16) & 0xff, (caps->version >> 8) & 0xff, caps->version & 0xff);
+}
+
+int snapshotSubdevKey(int fd, char *out, size_t size) {
+	struct stat st;
+	if (0 != fstat(fd, &st))
+		return -errno;
+
+	char path[64];
+	snprintf(path, sizeof(path), "/sys/dev/char/%u:%u/name", major(st.st_rdev), minor(st.st_rdev));
+	FILE *const f = fopen(path, "r");
+	if (!f)
+		return -errno;
+
+	char name[64] = {0};
+	const int got = !!fgets(name, sizeof(name), f);
+	fclose(f);
+	if (!got)
+		return -EIO;
+	name[strcspn(name, "\n")] = '\0';
+
+	struct utsname uts;
+	if (0 != uname(&uts))
+		return -errno;
+
+	snprintf(out, size, "%s/%.64s", name, uts.release);
+	return 0;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stddef.h> // size_t
+
+// Results of device enumeration (controls, formats, sensor modes) kept in a file between runs, so that startup
+// reads them back instead of issuing hundreds of ioctls. Entries are keyed by what identifies the driver and
+// its version, see snapshotDeviceKey() and snapshotSubdevKey(), so a kernel or driver update misses the cache
+// and enumerates live again. Blobs are raw structs, SNAPSHOT_VERSION must go up when any cached struct changes.
+//
+// Single threaded, used during pipeline creation.
+
+#define SNAPSHOT_DEFAULT_PATH "/var/cache/malincam.snapshot"
+
+#define SNAPSHOT_MAGIC 0x50414e53u // "SNAP"
+#define SNAPSHOT_VERSION 1
+
+#define SNAPSHOT_KEY_SIZE 160
+
+struct v4l2_capability;
+
+// Loads entries from path, if it's there and of this version. NULL disables the snapshot: gets miss, puts are
+// dropped
+void snapshotOpen(const char *path);
+
+// Writes the snapshot back if anything was put since it was opened or last saved. Atomic, readers see either
+// the old or the new file
+void snapshotSave(void);
+
+// Saves, then frees all entries
+void snapshotClose(void);
+
+// Returns the blob stored under key and sets *size, NULL if there's none
+const void *snapshotGet(const char *key, size_t *size);
+
+// Replaces the blob stored under key
+void snapshotPut(const char *key, const void *data, size_t size);
+
+// Counts of gets that hit and missed since open, for the startup report
+void snapshotStats(int *hits, int *misses);
+
+// Driver, card, bus and driver version of a video device
+void snapshotDeviceKey(const struct v4l2_capability *caps, char *out, size_t size);
+
+// Entity name from sysfs, unique per sensor and bus address, and the kernel release
+// Returns 0 on success, -errno if the name couldn't be read
+int snapshotSubdevKey(int fd, char *out, size_t size);
@@ -0,0 +1,148 @@
+#include "still.h"
+
+#include "Node.h"
+#include "device.h"
+#include "pump.h"
+#include "common.h"
+
+#include <fcntl.h> // open
+#include <unistd.h> // write, close
+#include <stdio.h> // snprintf
+#include <stdlib.h> // calloc, free
+#include <string.h> // strerror
+#include <errno.h>
+
+static int writeEncoded(const DeviceStream *st, const Buffer *buf, const char *path) {
+	const int mp = IS_STREAM_MPLANE(st);
+	const uint32_t offset = mp ? buf->buffer.m.planes[0].data_offset : 0;
+	const uint32_t bytesused = mp ? buf->buffer.m.planes[0].bytesused : buf->buffer.bytesused;
+	if (bytesused <= offset) {
+		LOGE("%s: encoder produced an empty frame", __func__);
+		return -EIO;
+	}
+
+	const int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		const int err = errno;
+		LOGE("%s: unable to open %s: %d, %s", __func__, path, err, strerror(err));
+		return -err;
+	}
+
+	const uint8_t *const data = bufferReadBegin(buf, 0);
+	if (!data) {
+		LOGE("%s: encoder buffer %d is not mapped", __func__, buf->buffer.index);
+		close(fd);
+		return -EINVAL;
+	}
+
+	const ssize_t written = write(fd, data + offset, bytesused - offset);
+	const int err = written < 0 ? errno : EIO;
+	bufferReadEnd(buf, 0);
+	close(fd);
+
+	if (written != (ssize_t)(bytesused - offset)) {
+		LOGE("%s: unable to write %s: %d, %s", __func__, path, err, strerror(err));
+		return -err;
+	}
+
+	return (int)written;
+}
+
+typedef struct StillCapture {
+	StillCaptureArgs args;
+	char path[256];
+
+	Pump *cam_to_isp;
+	Pump *isp_to_enc;
+
+	int skip;
+	uint64_t deadline_us;
+} StillCapture;
+
+struct StillCapture *stillCaptureStart(StillCaptureArgs args) {
+	StillCapture *const sc = calloc(1, sizeof(StillCapture));
+	if (!sc)
+		return NULL;
+
+	sc->args = args;
+	snprintf(sc->path, sizeof(sc->path), "%s", args.path);
+	sc->args.path = sc->path;
+	sc->skip = args.skip_frames;
+	sc->deadline_us = monotonicUs() + args.timeout_ms * 1000ull;
+
+	// Same order as video: consumers first
+	if (0 != nodeStart(args.enc))
+		goto fail;
+	if (0 != nodeStart(args.isp))
+		goto stop_enc;
+	if (0 != nodeStart(args.cam))
+		goto stop_isp;
+
+	sc->cam_to_isp = pumpCreate(args.cam->output, args.isp->input);
+	sc->isp_to_enc = pumpCreate(args.isp->output, args.enc->input);
+	if (sc->cam_to_isp && sc->isp_to_enc)
+		return sc;
+
+	pumpDestroy(sc->isp_to_enc);
+	pumpDestroy(sc->cam_to_isp);
+	nodeStop(args.cam);
+stop_isp:
+	nodeStop(args.isp);
+stop_enc:
+	nodeStop(args.enc);
+fail:
+	free(sc);
+	return NULL;
+}
+
+int stillCaptureTimeoutMs(const StillCapture *sc) {
+	// Rounded up, so that the poll doesn't wake right before the deadline
+	const uint64_t now_us = monotonicUs();
+	return sc->deadline_us > now_us ? (int)((sc->deadline_us - now_us + 999) / 1000) : 0;
+}
+
+int stillCaptureProcess(StillCapture *sc) {
+	const StillCaptureArgs *const args = &sc->args;
+
+	// Not through the pump, so that dropped frames never reach the ISP
+	for (; sc->skip > 0; --sc->skip) {
+		const Buffer *const buf = deviceStreamPullBuffer(args->cam->output);
+		if (!buf)
+			break;
+		deviceStreamPushBuffer(args->cam->output, buf);
+	}
+
+	if (sc->skip == 0) {
+		int result = pumpPump(sc->cam_to_isp);
+		if (result == 0)
+			result = pumpPump(sc->isp_to_enc);
+		if (result != 0) {
+			LOGE("%s: pump error %d", __func__, result);
+			return result < 0 ? result : -EIO;
+		}
+
+		const Buffer *const buf = deviceStreamPullBuffer(args->enc->output);
+		if (buf)
+			return writeEncoded(args->enc->output, buf, args->path);
+	}
+
+	if (monotonicUs() >= sc->deadline_us) {
+		LOGE("%s: no frame in %dms", __func__, args->timeout_ms);
+		return -ETIMEDOUT;
+	}
+
+	return 0;
+}
+
+void stillCaptureStop(StillCapture *sc) {
+	if (!sc)
+		return;
+
+	pumpDestroy(sc->isp_to_enc);
+	pumpDestroy(sc->cam_to_isp);
+
+	nodeStop(sc->args.cam);
+	nodeStop(sc->args.isp);
+	nodeStop(sc->args.enc);
+	free(sc);
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+struct Node;
+
+// One-shot capture of a single encoded frame, for stills at a different resolution than video.
+// Runs from the caller's event loop: stillCaptureStart() starts the nodes, and stillCaptureProcess() is called
+// whenever their fds are ready or the timeout has passed. The first skip_frames camera frames are dropped
+// while the sensor settles after a mode change, the next one goes through ISP and encoder, and the encoded
+// result is written to path. stillCaptureStop() stops the nodes.
+//
+// Limitation: the still is only saved to a file, it is not sent to the host. UVC method 2/3 delivers the still
+// in the video stream, marked with the STI payload header bit, but the gadget driver writes payload headers
+// itself. A host that triggers a still gets its video back, but no still frame. Still controls are therefore
+// only advertised when MALINCAM_STILLS names a directory.
+
+// Frames dropped after a sensor mode change
+#define STILL_SKIP_FRAMES 2
+#define STILL_TIMEOUT_MS 2000
+
+typedef struct {
+	// Prepared and stopped
+	struct Node *cam;
+	struct Node *isp;
+	struct Node *enc;
+
+	int skip_frames;
+	int timeout_ms;
+
+	const char *path;
+} StillCaptureArgs;
+
+struct StillCapture;
+
+// Starts the nodes, their fds to wait on are cam->output, isp->input, isp->output and enc->input
+// Returns NULL on failure
+struct StillCapture *stillCaptureStart(StillCaptureArgs args);
+
+// Milliseconds left until stillCaptureProcess() times out
+int stillCaptureTimeoutMs(const struct StillCapture *sc);
+
+// Moves frames along, never blocks
+// Returns 0 while in progress, size of the written image when done, -ETIMEDOUT if no frame made it through
+// in time, -errno on failure
+int stillCaptureProcess(struct StillCapture *sc);
+
+// Stops the nodes and frees sc
+void stillCaptureStop(struct StillCapture *sc);
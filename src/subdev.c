@@ -1,5 +1,6 @@
 #include "subdev.h"
 
+#include "snapshot.h"
 #include "v4l2-print.h"
 #include "common.h"
 
@@ -16,6 +17,7 @@
 #include <string.h> // strerror
 
 #include <stdint.h> // uint32_t and friends
+#include <stdio.h> // snprintf
 
 static int subdevReadCaps(Subdev *sd) {
 	if (0 != ioctl(sd->fd, VIDIOC_SUBDEV_QUERYCAP, &sd->cap)) {
@@ -81,7 +83,8 @@ static int subdevFrameIntervalGet(Subdev *sd, int pad) {
 	return 0;
 }
 
-static int subdevEnumFrameIntervals(Subdev *sd, int pad, uint32_t mbus_code, int w, int h) {
+// Fills *min_interval with the shortest enumerated frame interval, leaves it untouched if there are none
+static int subdevEnumFrameIntervals(Subdev *sd, int pad, uint32_t mbus_code, int w, int h, struct v4l2_fract *min_interval) {
 	//LOGI("Enumerating frame intervals for pad=%d mcode=%s(%08x) size=%dx%d",
 		//pad, v4l2MbusFmtName(mbus_code), mbus_code, w, h);
 
@@ -112,6 +115,12 @@ static int subdevEnumFrameIntervals(Subdev *sd, int pad, uint32_t mbus_code, int
 		}
 
 		v4l2PrintSubdevFrameInterval(&fiv);
+
+		// a/b < c/d <=> a*d < c*b
+		const struct v4l2_fract iv = fiv.interval;
+		if (iv.denominator && (!min_interval->denominator
+				|| (uint64_t)iv.numerator * min_interval->denominator < (uint64_t)min_interval->numerator * iv.denominator))
+			*min_interval = iv;
 	}
 
 	return 0;
@@ -148,9 +157,22 @@ static int subdevEnumFrameSizes(Subdev *sd, int pad, uint32_t mbus_code) {
 		 fsz.min_width, fsz.max_width,
 		 fsz.min_height, fsz.max_height);
 
-		subdevEnumFrameIntervals(sd, fsz.pad, fsz.code, fsz.min_width, fsz.min_height);
+		SubdevMode mode = {
+			.pad = fsz.pad,
+			.mbus_code = fsz.code,
+			.width = fsz.max_width,
+			.height = fsz.max_height,
+		};
+
+		struct v4l2_fract min_size_interval = {0, 0};
+		subdevEnumFrameIntervals(sd, fsz.pad, fsz.code, fsz.min_width, fsz.min_height, &min_size_interval);
 		if (fsz.min_width != fsz.max_width || fsz.min_height != fsz.max_height)
-			subdevEnumFrameIntervals(sd, fsz.pad, fsz.code, fsz.max_width, fsz.max_height);
+			subdevEnumFrameIntervals(sd, fsz.pad, fsz.code, fsz.max_width, fsz.max_height, &mode.min_interval);
+		else
+			mode.min_interval = min_size_interval;
+
+		// Continuous/stepwise sizes are recorded by their maximum only
+		arrayAppend(&sd->modes, &mode);
 	}
 
 	return 0;
@@ -188,8 +210,30 @@ static int subdevEnumMbusCodes(Subdev *sd, int pad) {
 	return 0;
 }
 
+// Sensors report bayer order of the current flips in their mbus codes, so the key has the active code as well
+static void subdevEnumModes(Subdev *sd, int pad, const char *snapshot_key) {
+	char key[SNAPSHOT_KEY_SIZE + 32];
+	snprintf(key, sizeof(key), "%s:modes:%d:%x", snapshot_key, pad, sd->pads[pad].format.format.code);
+
+	size_t size = 0;
+	const SubdevMode *const cached = snapshot_key[0] ? snapshotGet(key, &size) : NULL;
+	if (cached && size % sizeof(*cached) == 0) {
+		for (int i = 0; i < (int)(size / sizeof(*cached)); ++i)
+			arrayAppend(&sd->modes, cached + i);
+		LOGI("Pad %d has %d modes from snapshot", pad, (int)(size / sizeof(*cached)));
+		return;
+	}
+
+	const int first = arraySize(&sd->modes);
+	if (0 != subdevEnumMbusCodes(sd, pad) || !snapshot_key[0])
+		return;
+
+	snapshotPut(key, arrayAt(&sd->modes, SubdevMode, first), sizeof(SubdevMode) * (arraySize(&sd->modes) - first));
+}
+
 Subdev *subdevOpen(const char *name, int pads_count) {
 	Subdev sd = {0};
+	arrayInit(&sd.modes, SubdevMode);
 
 	sd.fd = open(name, O_RDWR | O_NONBLOCK);
 	if (sd.fd < 0) {
@@ -200,6 +244,10 @@ Subdev *subdevOpen(const char *name, int pads_count) {
 	if (0 != subdevReadCaps(&sd))
 		goto fail;
 
+	char snapshot_key[SNAPSHOT_KEY_SIZE] = "";
+	if (0 != snapshotSubdevKey(sd.fd, snapshot_key, sizeof(snapshot_key)))
+		snapshot_key[0] = '\0';
+
 	sd.pads = malloc(sizeof(*sd.pads) * pads_count);
 	sd.pads_count = pads_count;
 
@@ -218,18 +266,20 @@ Subdev *subdevOpen(const char *name, int pads_count) {
 		//subdevSelectionGet(&sd, ipad, V4L2_SEL_TGT_COMPOSE_ACTIVE, NULL);
 		// invalid for subdev subdevSelectionGet(&sd, ipad, V4L2_SEL_TGT_COMPOSE_PADDED);
 		subdevFrameIntervalGet(&sd, ipad);
-		subdevEnumMbusCodes(&sd, ipad);
+		subdevEnumModes(&sd, ipad, snapshot_key);
 	}
 
 	Subdev *out = malloc(sizeof(*out));
 	*out = sd;
-	out->controls = v4l2ControlsCreateFromV4l2Fd(out->fd);
+	out->controls = v4l2ControlsCreateFromV4l2Fd(out->fd, snapshot_key[0] ? snapshot_key : NULL);
 	return out;
 
 fail:
 	if (sd.pads)
 		free(sd.pads);
 
+	arrayDestroy(&sd.modes);
+
 	if (sd.fd > 0)
 		close(sd.fd);
 
@@ -241,6 +291,7 @@ void subdevClose(Subdev *sd) {
 		return;
 
 	v4l2ControlsDestroy(&sd->controls);
+	arrayDestroy(&sd->modes);
 
 	if (sd->fd > 0)
 		close(sd->fd);
@@ -281,6 +332,11 @@ int subdevSet(Subdev *sd, SubdevSet *set) {
 	LOGI("Got format %s(%#x) %dx%d", v4l2MbusFmtName(format.format.code), format.format.code,
 		format.format.width, format.format.height);
 
+	// Sensors adjust bayer order to flips, and size to the nearest mode
+	set->mbus_code = format.format.code;
+	set->width = format.format.width;
+	set->height = format.format.height;
+
 	struct v4l2_subdev_selection crop_bounds = {
 		.pad = set->pad,
 		.which = V4L2_SUBDEV_FORMAT_TRY,
@@ -357,3 +413,98 @@ int subdevSet(Subdev *sd, SubdevSet *set) {
 
 	return 0;
 }
+
+static const struct {
+	uint32_t mbus_code;
+	uint32_t bits;
+} raw_mbus_codes[] = {
+	{MEDIA_BUS_FMT_SBGGR8_1X8, 8},
+	{MEDIA_BUS_FMT_SGBRG8_1X8, 8},
+	{MEDIA_BUS_FMT_SGRBG8_1X8, 8},
+	{MEDIA_BUS_FMT_SRGGB8_1X8, 8},
+	{MEDIA_BUS_FMT_Y8_1X8, 8},
+	{MEDIA_BUS_FMT_SBGGR10_1X10, 10},
+	{MEDIA_BUS_FMT_SGBRG10_1X10, 10},
+	{MEDIA_BUS_FMT_SGRBG10_1X10, 10},
+	{MEDIA_BUS_FMT_SRGGB10_1X10, 10},
+	{MEDIA_BUS_FMT_Y10_1X10, 10},
+	{MEDIA_BUS_FMT_SBGGR12_1X12, 12},
+	{MEDIA_BUS_FMT_SGBRG12_1X12, 12},
+	{MEDIA_BUS_FMT_SGRBG12_1X12, 12},
+	{MEDIA_BUS_FMT_SRGGB12_1X12, 12},
+	{MEDIA_BUS_FMT_Y12_1X12, 12},
+	{MEDIA_BUS_FMT_SBGGR16_1X16, 16},
+	{MEDIA_BUS_FMT_SGBRG16_1X16, 16},
+	{MEDIA_BUS_FMT_SGRBG16_1X16, 16},
+	{MEDIA_BUS_FMT_SRGGB16_1X16, 16},
+};
+
+uint32_t subdevMbusCodeBits(uint32_t mbus_code) {
+	for (int i = 0; i < (int)COUNTOF(raw_mbus_codes); ++i)
+		if (raw_mbus_codes[i].mbus_code == mbus_code)
+			return raw_mbus_codes[i].bits;
+	return 0;
+}
+
+// Max frame rate in millihertz, 0 if unknown
+static uint64_t modeMaxFpsMilli(const SubdevMode *mode, int64_t pixel_rate) {
+	if (mode->min_interval.numerator && mode->min_interval.denominator)
+		return 1000ull * mode->min_interval.denominator / mode->min_interval.numerator;
+
+	// Upper bound, blanking is not known until the mode is set
+	if (pixel_rate > 0)
+		return 1000ull * pixel_rate / ((uint64_t)mode->width * mode->height);
+
+	return 0;
+}
+
+const SubdevMode *subdevSelectMode(const Subdev *sd, const SubdevModeRequest *req) {
+	const SubdevMode *best = NULL;
+	uint64_t best_bits = 0;
+
+	// No mode is good enough: prefer covering the size over the frame rate, then the fastest one
+	const SubdevMode *fallback = NULL;
+	int fallback_covers = 0;
+	uint64_t fallback_fps = 0;
+
+	for (int i = 0; i < arraySize(&sd->modes); ++i) {
+		const SubdevMode *const mode = arrayAtConst(&sd->modes, SubdevMode, i);
+		const uint32_t bits = subdevMbusCodeBits(mode->mbus_code);
+		if (mode->pad != req->pad || !bits)
+			continue;
+
+		const uint64_t fps_milli = modeMaxFpsMilli(mode, req->pixel_rate);
+		const int covers = mode->width >= req->width && mode->height >= req->height;
+		const int fast = !req->fps || !fps_milli || fps_milli >= req->fps * 1000ull;
+
+		// CSI-2 bandwidth at requested frame rate is proportional to bits per frame
+		const uint64_t frame_bits = (uint64_t)mode->width * mode->height * bits;
+		if (covers && fast) {
+			if (!best || frame_bits < best_bits) {
+				best = mode;
+				best_bits = frame_bits;
+			}
+			continue;
+		}
+
+		if (!fallback || covers > fallback_covers || (covers == fallback_covers && fps_milli > fallback_fps)) {
+			fallback = mode;
+			fallback_covers = covers;
+			fallback_fps = fps_milli;
+		}
+	}
+
+	const SubdevMode *const ret = best ? best : fallback;
+	if (ret) {
+		const uint64_t fps_milli = modeMaxFpsMilli(ret, req->pixel_rate);
+		LOGI("Selected sensor mode %s(%#x) %dx%d, max %llu.%03llufps%s for requested %dx%d@%d",
+			v4l2MbusFmtName(ret->mbus_code), ret->mbus_code, ret->width, ret->height,
+			(unsigned long long)(fps_milli / 1000), (unsigned long long)(fps_milli % 1000),
+			ret->min_interval.numerator ? "" : " (estimated)",
+			req->width, req->height, req->fps);
+		if (!best)
+			LOGE("No sensor mode satisfies %dx%d@%d, using the closest one", req->width, req->height, req->fps);
+	}
+
+	return ret;
+}
@@ -11,6 +11,16 @@ typedef struct SubdevPad {
 	struct v4l2_rect native, crop, crop_bounds, crop_default;
 } SubdevPad;
 
+// Enumerated frame size for a pad and media bus code
+typedef struct SubdevMode {
+	int pad;
+	uint32_t mbus_code;
+	uint32_t width, height;
+
+	// Shortest enumerated frame interval, zero if the subdev doesn't enumerate intervals
+	struct v4l2_fract min_interval;
+} SubdevMode;
+
 typedef struct Subdev {
 	int fd;
 
@@ -21,6 +31,8 @@ typedef struct Subdev {
 	int pads_count;
 
 	V4l2Controls controls;
+
+	Array /*T(SubdevMode)*/ modes;
 } Subdev;
 
 //Subdev *subdevOpen(const char *name);
@@ -36,3 +48,22 @@ typedef struct SubdevSet {
 
 // Sets set.rect and mbus_code that it could set
 int subdevSet(Subdev *sd, SubdevSet *set);
+
+// Bits per pixel of raw bayer and greyscale media bus codes, 0 for anything else
+uint32_t subdevMbusCodeBits(uint32_t mbus_code);
+
+typedef struct SubdevModeRequest {
+	int pad;
+	uint32_t width, height;
+
+	// Minimum frame rate, 0 for any
+	uint32_t fps;
+
+	// V4L2_CID_PIXEL_RATE, estimates frame rate for modes without enumerated intervals. 0 if unknown
+	int64_t pixel_rate;
+} SubdevModeRequest;
+
+// Picks raw mode that covers requested size and frame rate with the least bits per frame, i.e. the least
+// CSI-2 bandwidth. Falls back to the fastest mode that covers the size, then to the fastest mode.
+// Returns NULL if there are no raw modes
+const SubdevMode *subdevSelectMode(const Subdev *sd, const SubdevModeRequest *req);
@@ -0,0 +1,170 @@
+// malincam-trace: decodes trace ring written by malincam, see trace.h
+// Usage: malincam-trace [-f] [path]
+//   -f  follow, keep printing new records
+
+#include "trace.h"
+#include "uvc-print.h"
+#include "v4l2-print.h"
+#include "common.h"
+
+#include <sys/mman.h> // mmap
+#include <sys/stat.h> // fstat
+#include <fcntl.h> // open
+#include <unistd.h> // usleep, close
+#include <errno.h>
+#include <string.h> // strerror, strcmp
+
+static const char *levelName(uint32_t level) {
+	switch (level) {
+		case TRACE_LEVEL_ERROR: return "ERR";
+		case TRACE_LEVEL_INFO: return "INF";
+		case TRACE_LEVEL_VERBOSE: return "VRB";
+	}
+	return "???";
+}
+
+// See UsbDispatchTag in UVC.c
+static void printDispatchTag(uint32_t tag) {
+	const int interface = tag & 0xff;
+	const int entity = (tag >> 8) & 0xff;
+	const int control = (tag >> 16) & 0xff;
+	printf("interface=%s(%d) entity=%s(%d) control=%s(%d)",
+		uvcInterfaceName(interface), interface,
+		uvcEntityName(interface, entity), entity,
+		uvcControlName(interface, entity, control), control);
+}
+
+static void printRecord(const TraceRecord *rec) {
+	const uint32_t *const a = rec->args;
+	printf("%llu.%06llu [%s] %s: ",
+		(unsigned long long)(rec->timestamp_us / 1000000ull),
+		(unsigned long long)(rec->timestamp_us % 1000000ull),
+		levelName(rec->level), traceEventName(rec->event));
+
+	switch (rec->event) {
+		case TRACE_EV_UVC_SETUP:
+			{
+				const struct usb_ctrlrequest req = {
+					.bRequestType = a[0],
+					.bRequest = a[1],
+					.wValue = a[2],
+					.wIndex = a[3],
+					.wLength = a[4],
+				};
+				char buf[256];
+				uvcFormatSetupPacket(buf, sizeof(buf), &req);
+				printf("%s ", buf);
+				printDispatchTag((req.wIndex & 0xff) | (req.wIndex >> 8) << 8 | (req.wValue >> 8) << 16);
+			}
+			break;
+
+		case TRACE_EV_UVC_SETUP_RESPONSE:
+			printDispatchTag(a[0]);
+			printf(" length=%d bRequestErrorCode=%02x", (int)a[1], a[2]);
+			break;
+
+		case TRACE_EV_UVC_CONTROL_NOT_FOUND:
+			printDispatchTag(a[0]);
+			printf(" request=%s(%02x)", uvcRequestName(a[1]), a[1]);
+			break;
+
+		case TRACE_EV_UVC_DATA:
+			printf("length=%u ", a[0]);
+			if (a[1])
+				printDispatchTag(a[1]);
+			else
+				printf("no data phase control");
+			break;
+
+		case TRACE_EV_PUMP_SKIP:
+			printf("fd=%u type=%s skipped buffer[%u] for buffer[%u]", a[0], v4l2BufTypeName(a[1]), a[2], a[3]);
+			break;
+
+		case TRACE_EV_POLL_IDLE:
+			printf("slept for %.3fms", a[0] / 1000.);
+			break;
+
+		case TRACE_EV_DQBUF:
+			printf("fd=%u type=%s index=%u sequence=%u bytesused=%u", a[0], v4l2BufTypeName(a[1]), a[2], a[3], a[4]);
+			break;
+
+		case TRACE_EV_QBUF:
+			printf("fd=%u type=%s index=%u bytesused=%u", a[0], v4l2BufTypeName(a[1]), a[2], a[3]);
+			break;
+
+		default:
+			printf("%08x %08x %08x %08x %08x", a[0], a[1], a[2], a[3], a[4]);
+			break;
+	}
+
+	printf("\n");
+}
+
+int main(int argc, const char *argv[]) {
+	int follow = 0;
+	const char *path = TRACE_DEFAULT_PATH;
+	for (int i = 1; i < argc; ++i) {
+		if (0 == strcmp(argv[i], "-f"))
+			follow = 1;
+		else
+			path = argv[i];
+	}
+
+	const int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		LOGE("Failed to open \"%s\": %d, %s", path, errno, strerror(errno));
+		return 1;
+	}
+
+	struct stat st;
+	if (0 != fstat(fd, &st) || (size_t)st.st_size < sizeof(TraceRingHeader)) {
+		LOGE("\"%s\" is not a trace ring", path);
+		return 1;
+	}
+
+	const TraceRingHeader *const header = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (header == MAP_FAILED) {
+		LOGE("Failed to mmap \"%s\": %d, %s", path, errno, strerror(errno));
+		return 1;
+	}
+
+	if (header->magic != TRACE_MAGIC || header->version != TRACE_VERSION || header->record_size != sizeof(TraceRecord)
+		|| sizeof(*header) + (size_t)header->capacity * header->record_size > (size_t)st.st_size) {
+		LOGE("\"%s\": unsupported trace ring format (magic=%08x version=%u record_size=%u)",
+			path, header->magic, header->version, header->record_size);
+		return 1;
+	}
+
+	const TraceRecord *const records = (const TraceRecord*)(header + 1);
+	const uint64_t capacity = header->capacity;
+
+	uint64_t pos = 0;
+	for (;;) {
+		const uint64_t head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+		if (head - pos > capacity) {
+			if (pos)
+				printf("... lost %llu records\n", (unsigned long long)(head - capacity - pos));
+			pos = head - capacity;
+		}
+
+		for (; pos < head; ++pos) {
+			const TraceRecord rec = records[pos & (capacity - 1)];
+
+			// Writer could have lapped us while copying
+			const uint64_t new_head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+			if (new_head - pos > capacity || rec.seq != (uint32_t)pos)
+				break;
+
+			printRecord(&rec);
+		}
+
+		if (!follow)
+			break;
+
+		fflush(stdout);
+		usleep(100 * 1000);
+	}
+
+	return 0;
+}
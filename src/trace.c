@@ -0,0 +1,118 @@
+#include "trace.h"
+
+#include "common.h"
+
+#include <sys/mman.h> // mmap
+#include <fcntl.h> // open
+#include <unistd.h> // ftruncate, close
+#include <stdlib.h> // calloc
+#include <errno.h>
+#include <string.h> // strerror
+#include <time.h> // clock_gettime
+
+static struct {
+	TraceRingHeader *header;
+	TraceRecord *records;
+	uint32_t mask;
+	size_t size;
+	int mapped;
+} g_trace = {0};
+
+const char *traceEventName(uint32_t event) {
+	switch (event) {
+		case TRACE_EV_NONE: return "NONE";
+		case TRACE_EV_UVC_SETUP: return "UVC_SETUP";
+		case TRACE_EV_UVC_SETUP_RESPONSE: return "UVC_SETUP_RESPONSE";
+		case TRACE_EV_UVC_CONTROL_NOT_FOUND: return "UVC_CONTROL_NOT_FOUND";
+		case TRACE_EV_UVC_DATA: return "UVC_DATA";
+		case TRACE_EV_PUMP_SKIP: return "PUMP_SKIP";
+		case TRACE_EV_POLL_IDLE: return "POLL_IDLE";
+		case TRACE_EV_DQBUF: return "DQBUF";
+		case TRACE_EV_QBUF: return "QBUF";
+	}
+	return "UNKNOWN";
+}
+
+int traceOpen(const char *path, uint32_t capacity) {
+	traceClose();
+
+	uint32_t cap = 1;
+	while (cap < capacity)
+		cap <<= 1;
+
+	const size_t size = sizeof(TraceRingHeader) + (size_t)cap * sizeof(TraceRecord);
+	void *mem = NULL;
+
+	const int fd = path ? open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644) : -1;
+	if (fd >= 0) {
+		if (0 == ftruncate(fd, size)) {
+			mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			if (mem == MAP_FAILED)
+				mem = NULL;
+		}
+
+		if (!mem)
+			LOGE("Unable to map trace ring %s: %d, %s", path, errno, strerror(errno));
+
+		close(fd);
+	} else if (path) {
+		LOGE("Unable to open trace ring %s: %d, %s", path, errno, strerror(errno));
+	}
+
+	g_trace.mapped = !!mem;
+	if (!mem) {
+		// Still trace into private memory, useful from a debugger/core dump
+		mem = calloc(1, size);
+		if (!mem)
+			return -ENOMEM;
+	}
+
+	g_trace.size = size;
+	g_trace.header = mem;
+	g_trace.records = (TraceRecord*)(g_trace.header + 1);
+	g_trace.mask = cap - 1;
+
+	*g_trace.header = (TraceRingHeader){
+		.magic = TRACE_MAGIC,
+		.version = TRACE_VERSION,
+		.capacity = cap,
+		.record_size = sizeof(TraceRecord),
+		.head = 0,
+	};
+
+	LOGI("Trace ring: %s, %u records, level=%d", g_trace.mapped ? path : "(private)", cap, TRACE_LEVEL);
+	return g_trace.mapped ? 0 : -EIO;
+}
+
+void traceClose(void) {
+	if (!g_trace.header)
+		return;
+
+	if (g_trace.mapped)
+		munmap(g_trace.header, g_trace.size);
+	else
+		free(g_trace.header);
+
+	g_trace.header = NULL;
+	g_trace.records = NULL;
+}
+
+void traceWrite(int level, TraceEvent event, const uint32_t args[TRACE_MAX_ARGS]) {
+	TraceRingHeader *const header = g_trace.header;
+	if (!header)
+		return;
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	// Frame and control threads both trace: claim a slot, fill it, then publish it by its seq.
+	// Reader drops records whose seq doesn't match their position yet
+	const uint64_t pos = __atomic_fetch_add(&header->head, 1, __ATOMIC_ACQ_REL);
+	TraceRecord *const rec = g_trace.records + (pos & g_trace.mask);
+	rec->timestamp_us = ts.tv_sec * 1000000ull + ts.tv_nsec / 1000ull;
+	rec->event = event;
+	rec->level = level;
+	memcpy(rec->args, args, sizeof(rec->args));
+
+	__atomic_store_n(&rec->seq, (uint32_t)pos, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <stdint.h>
+
+// Binary trace ring: fixed-size records with raw arguments, formatting is deferred to the reader (malincam-trace).
+// The ring lives in a shared file mapping, so it can be read live or after a crash.
+// Meant for hot paths where LOGI() would stall the loop on a slow console.
+
+#define TRACE_LEVEL_NONE 0
+#define TRACE_LEVEL_ERROR 1
+#define TRACE_LEVEL_INFO 2
+#define TRACE_LEVEL_VERBOSE 3
+
+// Compile-time level, records above it compile to nothing
+#ifndef TRACE_LEVEL
+#define TRACE_LEVEL TRACE_LEVEL_INFO
+#endif
+
+#define TRACE_MAX_ARGS 5
+
+#define TRACE_DEFAULT_PATH "/dev/shm/malincam.trace"
+
+typedef enum {
+	TRACE_EV_NONE = 0,
+
+	// bRequestType, bRequest, wValue, wIndex, wLength
+	TRACE_EV_UVC_SETUP,
+
+	// dispatch tag, response length (negative is STALL), bRequestErrorCode
+	TRACE_EV_UVC_SETUP_RESPONSE,
+
+	// dispatch tag, bRequest
+	TRACE_EV_UVC_CONTROL_NOT_FOUND,
+
+	// data length, dispatch tag of data phase control or 0
+	TRACE_EV_UVC_DATA,
+
+	// src fd, src buf type, skipped buffer index, replacement buffer index
+	TRACE_EV_PUMP_SKIP,
+
+	// slept us
+	TRACE_EV_POLL_IDLE,
+
+	// fd, buf type, index, sequence, bytesused
+	TRACE_EV_DQBUF,
+
+	// fd, buf type, index, bytesused
+	TRACE_EV_QBUF,
+
+	TRACE_EV__COUNT,
+} TraceEvent;
+
+typedef struct {
+	uint64_t timestamp_us; // CLOCK_MONOTONIC
+	uint32_t seq; // lower 32 bits of record position, lets the reader detect overwritten records
+	uint16_t event; // TraceEvent
+	uint16_t level; // TRACE_LEVEL_*
+	uint32_t args[TRACE_MAX_ARGS];
+	uint32_t reserved_;
+} TraceRecord;
+
+#define TRACE_MAGIC 0x4352544du // "MTRC"
+#define TRACE_VERSION 1
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t capacity; // in records, power of two
+	uint32_t record_size;
+
+	// Total records written, records live at [head - capacity, head)
+	uint64_t head;
+} TraceRingHeader;
+
+// Creates or truncates the ring file at path, capacity is rounded up to power of two
+// Falls back to process-private memory if the file cannot be mapped
+// Returns 0 on success
+int traceOpen(const char *path, uint32_t capacity);
+void traceClose(void);
+
+void traceWrite(int level, TraceEvent event, const uint32_t args[TRACE_MAX_ARGS]);
+
+const char *traceEventName(uint32_t event);
+
+#define TRACE_ARGS_(...) ((const uint32_t[TRACE_MAX_ARGS]){__VA_ARGS__})
+
+// Disabled levels still type-check arguments and keep them "used", but never evaluate them
+#define TRACE_NOP_(...) ((void)sizeof(TRACE_ARGS_(__VA_ARGS__)))
+
+#if TRACE_LEVEL >= TRACE_LEVEL_ERROR
+#define TRACEE(event, ...) traceWrite(TRACE_LEVEL_ERROR, event, TRACE_ARGS_(__VA_ARGS__))
+#else
+#define TRACEE(event, ...) TRACE_NOP_(__VA_ARGS__)
+#endif
+
+#if TRACE_LEVEL >= TRACE_LEVEL_INFO
+#define TRACEI(event, ...) traceWrite(TRACE_LEVEL_INFO, event, TRACE_ARGS_(__VA_ARGS__))
+#else
+#define TRACEI(event, ...) TRACE_NOP_(__VA_ARGS__)
+#endif
+
+#if TRACE_LEVEL >= TRACE_LEVEL_VERBOSE
+#define TRACEV(event, ...) traceWrite(TRACE_LEVEL_VERBOSE, event, TRACE_ARGS_(__VA_ARGS__))
+#else
+#define TRACEV(event, ...) TRACE_NOP_(__VA_ARGS__)
+#endif
@@ -0,0 +1,98 @@
+// malincam-unpack-bench: throughput of the raw unpacking kernels, see unpack.h
+// Usage: malincam-unpack-bench [width height [iterations]]
+// Defaults to a binned HQ camera frame. Unicam row padding is included, so the numbers match what the
+// raw pipeline sees. SIMD results are checked against the scalar ones.
+
+#include "unpack.h"
+#include "common.h"
+
+#include <stdlib.h> // malloc, atoi
+#include <string.h> // memcmp
+
+// Unicam bytesperline alignment
+#define BENCH_STRIDE_ALIGN 32
+
+typedef struct {
+	uint32_t width, height;
+	uint32_t src_stride;
+	const uint8_t *src;
+	int iterations;
+} BenchFrame;
+
+// Returns microseconds per frame
+static double benchKernel(const BenchFrame *f, unpack_row_f *func, uint16_t *dst) {
+	// Warm up caches and page tables
+	unpackImage(func, dst, f->width * 2, f->src, f->src_stride, f->width, f->height);
+
+	const uint64_t begin_us = monotonicUs();
+	for (int i = 0; i < f->iterations; ++i)
+		unpackImage(func, dst, f->width * 2, f->src, f->src_stride, f->width, f->height);
+	return (double)(monotonicUs() - begin_us) / f->iterations;
+}
+
+static int benchBits(BenchFrame *f, int bits) {
+	f->src_stride = ((f->width * bits + 7) / 8 + BENCH_STRIDE_ALIGN - 1) & ~(BENCH_STRIDE_ALIGN - 1);
+	const size_t src_size = (size_t)f->src_stride * f->height;
+	const size_t dst_size = (size_t)f->width * 2 * f->height;
+
+	uint8_t *const src = malloc(src_size);
+	uint16_t *const reference = malloc(dst_size);
+	uint16_t *const dst = malloc(dst_size);
+	if (!src || !reference || !dst) {
+		LOGE("Unable to allocate %zu bytes", src_size + dst_size * 2);
+		return 1;
+	}
+
+	srand(bits);
+	for (size_t i = 0; i < src_size; ++i)
+		src[i] = rand();
+	f->src = src;
+
+	const UnpackKernels *const kernels[] = {&unpack_kernels_scalar, unpackKernelsBest()};
+	const int count = kernels[1] == kernels[0] ? 1 : 2;
+	const double mpix = (double)f->width * f->height / 1e6;
+
+	int result = 0;
+	double scalar_us = 0;
+	for (int i = 0; i < count; ++i) {
+		unpack_row_f *const func = unpackRowFunc(kernels[i], bits);
+		const double us = benchKernel(f, func, i == 0 ? reference : dst);
+		if (i == 0)
+			scalar_us = us;
+
+		const int match = i == 0 || 0 == memcmp(reference, dst, dst_size);
+		printf("RAW%d %6s: %8.3f ms/frame %8.1f Mpix/s %8.1f MB/s in %8.1f MB/s out %5.2fx%s\n",
+			bits, kernels[i]->name, us / 1000., mpix / us * 1e6,
+			src_size / us, dst_size / us, scalar_us / us,
+			match ? "" : " MISMATCH");
+		if (!match)
+			result = 1;
+	}
+
+	free(dst);
+	free(reference);
+	free(src);
+	return result;
+}
+
+int main(int argc, const char *argv[]) {
+	BenchFrame f = {
+		.width = 2028,
+		.height = 1520,
+		.iterations = 100,
+	};
+
+	if (argc >= 3) {
+		f.width = atoi(argv[1]);
+		f.height = atoi(argv[2]);
+	}
+	if (argc >= 4)
+		f.iterations = atoi(argv[3]);
+	if (!f.width || !f.height || f.iterations <= 0) {
+		LOGE("Usage: %s [width height [iterations]]", argv[0]);
+		return 1;
+	}
+
+	printf("%ux%u, %d iterations\n", f.width, f.height, f.iterations);
+	return benchBits(&f, 10) | benchBits(&f, 12);
+}
@@ -0,0 +1,186 @@
+#include "unpack.h"
+
+#include <stddef.h> // NULL
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#define UNPACK_NEON
+#elif defined(__x86_64__) || defined(__i386__)
+#include <tmmintrin.h>
+#define UNPACK_SSSE3
+#endif
+
+// Partial last group is read whole, CSI-2 lines are always whole groups
+static void unpackRaw10Scalar(uint16_t *dst, const uint8_t *src, uint32_t samples) {
+	for (; samples >= 4; samples -= 4, src += 5, dst += 4) {
+		const uint8_t lo = src[4];
+		dst[0] = (src[0] << 8) | ((lo << 6) & 0xc0);
+		dst[1] = (src[1] << 8) | ((lo << 4) & 0xc0);
+		dst[2] = (src[2] << 8) | ((lo << 2) & 0xc0);
+		dst[3] = (src[3] << 8) | (lo & 0xc0);
+	}
+
+	for (uint32_t i = 0; i < samples; ++i)
+		dst[i] = (src[i] << 8) | ((src[4] << (6 - 2 * i)) & 0xc0);
+}
+
+static void unpackRaw12Scalar(uint16_t *dst, const uint8_t *src, uint32_t samples) {
+	for (; samples >= 2; samples -= 2, src += 3, dst += 2) {
+		const uint8_t lo = src[2];
+		dst[0] = (src[0] << 8) | ((lo << 4) & 0xf0);
+		dst[1] = (src[1] << 8) | (lo & 0xf0);
+	}
+
+	if (samples)
+		dst[0] = (src[0] << 8) | ((src[2] << 4) & 0xf0);
+}
+
+const UnpackKernels unpack_kernels_scalar = {
+	.name = "scalar",
+	.raw10 = unpackRaw10Scalar,
+	.raw12 = unpackRaw12Scalar,
+};
+
+#if defined(UNPACK_NEON) || defined(UNPACK_SSSE3)
+// 8 samples per 16 byte load. Each 16 bit lane gets the sample's high bits in its high byte and the byte with
+// its low bits in the low byte, then the multiply shifts the low bits to the top of the low byte and the mask
+// drops the neighbours' ones. Indices with the top bit set produce zero on both NEON and SSSE3
+#define Z 0x80
+typedef struct {
+	uint8_t hi[16];
+	uint8_t lo[16];
+	uint16_t mul[8];
+	uint16_t mask;
+
+	// Consumed per 8 samples
+	int bytes;
+
+	unpack_row_f *tail;
+} UnpackShuffle;
+
+static const UnpackShuffle raw10_shuffle = {
+	.hi = {Z, 0, Z, 1, Z, 2, Z, 3, Z, 5, Z, 6, Z, 7, Z, 8},
+	.lo = {4, Z, 4, Z, 4, Z, 4, Z, 9, Z, 9, Z, 9, Z, 9, Z},
+	.mul = {64, 16, 4, 1, 64, 16, 4, 1},
+	.mask = 0xc0,
+	.bytes = 10,
+	.tail = unpackRaw10Scalar,
+};
+
+static const UnpackShuffle raw12_shuffle = {
+	.hi = {Z, 0, Z, 1, Z, 3, Z, 4, Z, 6, Z, 7, Z, 9, Z, 10},
+	.lo = {2, Z, 2, Z, 5, Z, 5, Z, 8, Z, 8, Z, 11, Z, 11, Z},
+	.mul = {16, 1, 16, 1, 16, 1, 16, 1},
+	.mask = 0xf0,
+	.bytes = 12,
+	.tail = unpackRaw12Scalar,
+};
+#undef Z
+
+// Loads are 16 bytes, so the last few groups of a row are left to the scalar tail, which never reads past them
+#define UNPACK_SIMD_MIN_SAMPLES 16
+#endif
+
+#if defined(UNPACK_NEON)
+static inline uint8x16_t shuffleBytes(uint8x16_t v, uint8x16_t idx) {
+#if defined(__aarch64__)
+	return vqtbl1q_u8(v, idx);
+#else
+	const uint8x8x2_t table = {{vget_low_u8(v), vget_high_u8(v)}};
+	return vcombine_u8(vtbl2_u8(table, vget_low_u8(idx)), vtbl2_u8(table, vget_high_u8(idx)));
+#endif
+}
+
+static void unpackNeon(const UnpackShuffle *s, uint16_t *dst, const uint8_t *src, uint32_t samples) {
+	const uint8x16_t hi = vld1q_u8(s->hi);
+	const uint8x16_t lo = vld1q_u8(s->lo);
+	const uint16x8_t mul = vld1q_u16(s->mul);
+	const uint16x8_t mask = vdupq_n_u16(s->mask);
+
+	for (; samples >= UNPACK_SIMD_MIN_SAMPLES; samples -= 8, src += s->bytes, dst += 8) {
+		const uint8x16_t v = vld1q_u8(src);
+		const uint16x8_t h = vreinterpretq_u16_u8(shuffleBytes(v, hi));
+		const uint16x8_t l = vandq_u16(vmulq_u16(vreinterpretq_u16_u8(shuffleBytes(v, lo)), mul), mask);
+		vst1q_u16(dst, vorrq_u16(h, l));
+	}
+
+	s->tail(dst, src, samples);
+}
+
+static void unpackRaw10Neon(uint16_t *dst, const uint8_t *src, uint32_t samples) {
+	unpackNeon(&raw10_shuffle, dst, src, samples);
+}
+
+static void unpackRaw12Neon(uint16_t *dst, const uint8_t *src, uint32_t samples) {
+	unpackNeon(&raw12_shuffle, dst, src, samples);
+}
+
+static const UnpackKernels unpack_kernels_simd = {
+	.name = "neon",
+	.raw10 = unpackRaw10Neon,
+	.raw12 = unpackRaw12Neon,
+};
+#endif // UNPACK_NEON
+
+#if defined(UNPACK_SSSE3)
+// Not in the x86-64 baseline, picked at runtime
+__attribute__((target("ssse3")))
+static void unpackSsse3(const UnpackShuffle *s, uint16_t *dst, const uint8_t *src, uint32_t samples) {
+	const __m128i hi = _mm_loadu_si128((const __m128i*)s->hi);
+	const __m128i lo = _mm_loadu_si128((const __m128i*)s->lo);
+	const __m128i mul = _mm_loadu_si128((const __m128i*)s->mul);
+	const __m128i mask = _mm_set1_epi16(s->mask);
+
+	for (; samples >= UNPACK_SIMD_MIN_SAMPLES; samples -= 8, src += s->bytes, dst += 8) {
+		const __m128i v = _mm_loadu_si128((const __m128i*)src);
+		const __m128i h = _mm_shuffle_epi8(v, hi);
+		const __m128i l = _mm_and_si128(_mm_mullo_epi16(_mm_shuffle_epi8(v, lo), mul), mask);
+		_mm_storeu_si128((__m128i*)dst, _mm_or_si128(h, l));
+	}
+
+	s->tail(dst, src, samples);
+}
+
+static void unpackRaw10Ssse3(uint16_t *dst, const uint8_t *src, uint32_t samples) {
+	unpackSsse3(&raw10_shuffle, dst, src, samples);
+}
+
+static void unpackRaw12Ssse3(uint16_t *dst, const uint8_t *src, uint32_t samples) {
+	unpackSsse3(&raw12_shuffle, dst, src, samples);
+}
+
+static const UnpackKernels unpack_kernels_simd = {
+	.name = "ssse3",
+	.raw10 = unpackRaw10Ssse3,
+	.raw12 = unpackRaw12Ssse3,
+};
+#endif // UNPACK_SSSE3
+
+const UnpackKernels *unpackKernelsBest(void) {
+#if defined(UNPACK_NEON)
+	return &unpack_kernels_simd;
+#elif defined(UNPACK_SSSE3)
+	if (__builtin_cpu_supports("ssse3"))
+		return &unpack_kernels_simd;
+	return &unpack_kernels_scalar;
+#else
+	return &unpack_kernels_scalar;
+#endif
+}
+
+unpack_row_f *unpackRowFunc(const UnpackKernels *kernels, int bits) {
+	switch (bits) {
+		case 10: return kernels->raw10;
+		case 12: return kernels->raw12;
+	}
+	return NULL;
+}
+
+void unpackImage(unpack_row_f *func, uint16_t *dst, uint32_t dst_stride,
+		const uint8_t *src, uint32_t src_stride, uint32_t width, uint32_t height) {
+	for (uint32_t y = 0; y < height; ++y) {
+		func(dst, src, width);
+		dst = (uint16_t*)((uint8_t*)dst + dst_stride);
+		src += src_stride;
+	}
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdint.h>
+
+// Unpacking of MIPI CSI-2 packed raw samples, as unicam stores them, into 16 bits per sample.
+// Samples come out MSB aligned with zero low bits, i.e. as V4L2_PIX_FMT_SBGGR16 and friends.
+// RAW10: 4 samples in 5 bytes, high 8 bits of each followed by a byte with the low 2 bits of all four.
+// RAW12: 2 samples in 3 bytes, high 8 bits of each followed by a byte with the low 4 bits of both.
+
+// Unpacks one row. Reads whole groups only, src doesn't need any alignment or padding past the last group
+typedef void (unpack_row_f)(uint16_t *dst, const uint8_t *src, uint32_t samples);
+
+typedef struct {
+	const char *name;
+	unpack_row_f *raw10;
+	unpack_row_f *raw12;
+} UnpackKernels;
+
+// Reference implementation, available everywhere
+extern const UnpackKernels unpack_kernels_scalar;
+
+// NEON or SSSE3 if the CPU has them, scalar otherwise
+const UnpackKernels *unpackKernelsBest(void);
+
+// Row function for bits per sample, NULL if there's no unpacking for it
+unpack_row_f *unpackRowFunc(const UnpackKernels *kernels, int bits);
+
+// Strides are in bytes
+void unpackImage(unpack_row_f *func, uint16_t *dst, uint32_t dst_stride,
+	const uint8_t *src, uint32_t src_stride, uint32_t width, uint32_t height);
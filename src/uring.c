@@ -0,0 +1,189 @@
+#include "uring.h"
+
+#include "common.h"
+
+#include <sys/syscall.h>
+#include <sys/mman.h> // mmap
+#include <unistd.h> // syscall, close
+#include <signal.h> // _NSIG
+#include <errno.h>
+#include <string.h> // memset, strerror
+#include <time.h>
+
+static int sysUringSetup(unsigned entries, struct io_uring_params *params) {
+	return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sysUringEnter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, const void *arg, size_t argsz) {
+	return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+#define RING_PTR(base, offset) ((void*)((char*)(base) + (offset)))
+
+int uringInit(Uring *u, unsigned entries) {
+	memset(u, 0, sizeof(*u));
+	u->fd = -1;
+
+	struct io_uring_params params = {0};
+	const int fd = sysUringSetup(entries, &params);
+	if (fd < 0) {
+		const int err = errno;
+		LOGE("io_uring_setup(%u) failed: %d, %s", entries, err, strerror(err));
+		return -err;
+	}
+
+	u->fd = fd;
+	u->features = params.features;
+
+	u->sq.ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	u->cq.ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+	const int single_mmap = !!(params.features & IORING_FEAT_SINGLE_MMAP);
+	if (single_mmap && u->cq.ring_size > u->sq.ring_size)
+		u->sq.ring_size = u->cq.ring_size;
+
+	u->sq.ring = mmap(NULL, u->sq.ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (u->sq.ring == MAP_FAILED) {
+		u->sq.ring = NULL;
+		goto fail;
+	}
+
+	if (single_mmap) {
+		u->cq.ring = u->sq.ring;
+	} else {
+		u->cq.ring = mmap(NULL, u->cq.ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		if (u->cq.ring == MAP_FAILED) {
+			u->cq.ring = NULL;
+			goto fail;
+		}
+	}
+
+	u->sq.sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	u->sq.sqes = mmap(NULL, u->sq.sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (u->sq.sqes == MAP_FAILED) {
+		u->sq.sqes = NULL;
+		goto fail;
+	}
+
+	u->sq.head = RING_PTR(u->sq.ring, params.sq_off.head);
+	u->sq.tail = RING_PTR(u->sq.ring, params.sq_off.tail);
+	u->sq.ring_mask = RING_PTR(u->sq.ring, params.sq_off.ring_mask);
+	u->sq.ring_entries = RING_PTR(u->sq.ring, params.sq_off.ring_entries);
+	u->sq.array = RING_PTR(u->sq.ring, params.sq_off.array);
+
+	u->cq.head = RING_PTR(u->cq.ring, params.cq_off.head);
+	u->cq.tail = RING_PTR(u->cq.ring, params.cq_off.tail);
+	u->cq.ring_mask = RING_PTR(u->cq.ring, params.cq_off.ring_mask);
+	u->cq.cqes = RING_PTR(u->cq.ring, params.cq_off.cqes);
+
+	// SQ array is an indirection we don't need, map it 1:1 once
+	for (unsigned i = 0; i < params.sq_entries; ++i)
+		u->sq.array[i] = i;
+
+	return 0;
+
+fail:
+	{
+		const int err = errno;
+		LOGE("Failed to mmap io_uring rings: %d, %s", err, strerror(err));
+		uringDestroy(u);
+		return -err;
+	}
+}
+
+void uringDestroy(Uring *u) {
+	if (u->sq.sqes)
+		munmap(u->sq.sqes, u->sq.sqes_size);
+
+	if (u->cq.ring && u->cq.ring != u->sq.ring)
+		munmap(u->cq.ring, u->cq.ring_size);
+
+	if (u->sq.ring)
+		munmap(u->sq.ring, u->sq.ring_size);
+
+	if (u->fd >= 0)
+		close(u->fd);
+
+	memset(u, 0, sizeof(*u));
+	u->fd = -1;
+}
+
+static int uringEnter(Uring *u, unsigned wait_nr, int timeout_ms) {
+	const unsigned to_submit = u->sq.pending;
+	unsigned flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+
+	struct __kernel_timespec ts = {
+		.tv_sec = timeout_ms / 1000,
+		.tv_nsec = (timeout_ms % 1000) * 1000000ll,
+	};
+	struct io_uring_getevents_arg arg = {
+		.sigmask = 0,
+		.sigmask_sz = _NSIG / 8,
+		.ts = (uint64_t)(uintptr_t)&ts,
+	};
+
+	const void *argp = NULL;
+	size_t argsz = 0;
+	if (wait_nr && timeout_ms >= 0) {
+		flags |= IORING_ENTER_EXT_ARG;
+		argp = &arg;
+		argsz = sizeof(arg);
+	}
+
+	u->enters++;
+	const int result = sysUringEnter(u->fd, to_submit, wait_nr, flags, argp, argsz);
+	const int error = errno;
+
+	// Consumed entries are gone even when waiting fails afterwards, e.g. with -ETIME, and the result only
+	// counts them on success. The kernel SQ head is right either way
+	u->sq.pending = *u->sq.tail - __atomic_load_n(u->sq.head, __ATOMIC_ACQUIRE);
+
+	return result < 0 ? -error : result;
+}
+
+struct io_uring_sqe *uringGetSqe(Uring *u) {
+	const unsigned entries = *u->sq.ring_entries;
+	unsigned head = __atomic_load_n(u->sq.head, __ATOMIC_ACQUIRE);
+	unsigned tail = *u->sq.tail;
+
+	if (tail - head >= entries) {
+		const int result = uringEnter(u, 0, 0);
+		if (result < 0) {
+			LOGE("io_uring_enter(flush) failed: %d, %s", -result, strerror(-result));
+			return NULL;
+		}
+
+		head = __atomic_load_n(u->sq.head, __ATOMIC_ACQUIRE);
+		if (tail - head >= entries)
+			return NULL;
+	}
+
+	struct io_uring_sqe *const sqe = u->sq.sqes + (tail & *u->sq.ring_mask);
+	memset(sqe, 0, sizeof(*sqe));
+
+	// Without SQPOLL the kernel reads SQ only inside io_uring_enter(),
+	// so publishing tail before the caller fills the sqe is fine
+	__atomic_store_n(u->sq.tail, tail + 1, __ATOMIC_RELEASE);
+	u->sq.pending++;
+	return sqe;
+}
+
+int uringSubmitAndWait(Uring *u, unsigned wait_nr, int timeout_ms) {
+	for (;;) {
+		const int result = uringEnter(u, wait_nr, timeout_ms);
+		if (result == -EINTR)
+			continue;
+		return result;
+	}
+}
+
+int uringPopCqe(Uring *u, struct io_uring_cqe *out) {
+	const unsigned head = *u->cq.head;
+	const unsigned tail = __atomic_load_n(u->cq.tail, __ATOMIC_ACQUIRE);
+	if (head == tail)
+		return 0;
+
+	*out = u->cq.cqes[head & *u->cq.ring_mask];
+	__atomic_store_n(u->cq.head, head + 1, __ATOMIC_RELEASE);
+	return 1;
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <linux/io_uring.h>
+#include <stddef.h> // size_t
+#include <stdint.h>
+
+// Minimal io_uring wrapper over raw syscalls, no liburing dependency
+typedef struct Uring {
+	int fd;
+	unsigned features;
+
+	// Number of io_uring_enter() calls made
+	uint64_t enters;
+
+	struct {
+		unsigned *head, *tail, *ring_mask, *ring_entries, *array;
+		struct io_uring_sqe *sqes;
+		size_t sqes_size;
+		void *ring;
+		size_t ring_size;
+
+		// Locally prepared, not yet submitted
+		unsigned pending;
+	} sq;
+
+	struct {
+		unsigned *head, *tail, *ring_mask;
+		struct io_uring_cqe *cqes;
+		void *ring;
+		size_t ring_size;
+	} cq;
+} Uring;
+
+// Returns 0 on success, -errno on failure (e.g. -ENOSYS if io_uring is not available)
+int uringInit(Uring *u, unsigned entries);
+void uringDestroy(Uring *u);
+
+// Returns zeroed sqe, flushing pending sqes into the kernel if SQ is full
+// Returns NULL on failure
+struct io_uring_sqe *uringGetSqe(Uring *u);
+
+// Submits pending sqes and waits for at least wait_nr completions or timeout_ms (<0 for infinite)
+// Returns >= 0 on success, -ETIME on timeout, -errno on failure
+int uringSubmitAndWait(Uring *u, unsigned wait_nr, int timeout_ms);
+
+// Returns 1 and copies the next completion into out, 0 if CQ is empty
+int uringPopCqe(Uring *u, struct io_uring_cqe *out);
@@ -0,0 +1,174 @@
+#include "uvc-print.h"
+
+#include <linux/usb/video.h>
+#include <stdio.h> // snprintf
+
+const char *uvcRequestName(int request) {
+	switch (request) {
+		case UVC_GET_LEN: return "UVC_GET_LEN";
+		case UVC_GET_INFO: return "UVC_GET_INFO";
+		case UVC_SET_CUR: return "UVC_SET_CUR";
+		case UVC_GET_CUR: return "UVC_GET_CUR";
+		case UVC_GET_MIN: return "UVC_GET_MIN";
+		case UVC_GET_DEF: return "UVC_GET_DEF";
+		case UVC_GET_MAX: return "UVC_GET_MAX";
+		case UVC_GET_RES: return "UVC_GET_RES";
+	}
+	return "UNKNOWN";
+}
+
+const char *usbSpeedName(enum usb_device_speed speed) {
+	switch (speed) {
+		case USB_SPEED_UNKNOWN: return "USB_SPEED_UNKNOWN";
+		case USB_SPEED_LOW: return "USB_SPEED_LOW";
+		case USB_SPEED_FULL: return "USB_SPEED_FULL";
+		case USB_SPEED_HIGH: return "USB_SPEED_HIGH";
+		case USB_SPEED_WIRELESS: return "USB_SPEED_WIRELESS";
+		case USB_SPEED_SUPER: return "USB_SPEED_SUPER";
+		case USB_SPEED_SUPER_PLUS: return "USB_SPEED_SUPER_PLUS";
+	}
+
+	return "UNKNOWN";
+}
+
+const char *uvcInterfaceName(int interface) {
+	switch (interface) {
+		case UVC_INTF_VIDEO_CONTROL: return "UVC_INTF_VIDEO_CONTROL";
+		case UVC_INTF_VIDEO_STREAMING: return "UVC_INTF_VIDEO_STREAMING";
+		default: return "UNKNOWN";
+	}
+}
+
+const char *uvcEntityName(int interface, int entity_id) {
+	switch(interface) {
+		case UVC_INTF_VIDEO_CONTROL:
+			switch (entity_id) {
+				case UVC_VC_ENT_INTERFACE: return "UVC_VC_ENT_INTERFACE";
+				case UVC_VC_ENT_CAMERA_TERMINAL_ID: return "UVC_VC_ENT_CAMERA_TERMINAL_ID";
+				case UVC_VC_ENT_PROCESSING_UNIT_ID: return "UVC_VC_ENT_PROCESSING_UNIT_ID";
+				case UVC_VC_ENT_OUTPUT_TERMINAL_ID: return "UVC_VC_ENT_OUTPUT_TERMINAL_ID";
+				default: return "UNKNOWN";
+			}
+		case UVC_INTF_VIDEO_STREAMING:
+			switch (entity_id) {
+				case 0: return "UVC_VS_ENT_INTERFACE";
+				default: return "UNKNOWN";
+			}
+		default: return "UNKNOWN";
+	}
+}
+
+const char *uvcControlName(int interface, int entity_id, int control_selector) {
+	switch(interface) {
+		case UVC_INTF_VIDEO_CONTROL:
+			switch (entity_id) {
+				case UVC_VC_ENT_INTERFACE:
+					switch (control_selector) {
+						case UVC_VC_CONTROL_UNDEFINED: return "UVC_VC_CONTROL_UNDEFINED";
+						case UVC_VC_VIDEO_POWER_MODE_CONTROL: return "UVC_VC_VIDEO_POWER_MODE_CONTROL";
+						case UVC_VC_REQUEST_ERROR_CODE_CONTROL: return "UVC_VC_REQUEST_ERROR_CODE_CONTROL";
+						default: return "UNKNOWN";
+					}
+				case UVC_VC_ENT_CAMERA_TERMINAL_ID:
+					switch (control_selector) {
+						case UVC_CT_CONTROL_UNDEFINED: return "UVC_CT_CONTROL_UNDEFINED";
+						case UVC_CT_SCANNING_MODE_CONTROL: return "UVC_CT_SCANNING_MODE_CONTROL";
+						case UVC_CT_AE_MODE_CONTROL: return "UVC_CT_AE_MODE_CONTROL";
+						case UVC_CT_AE_PRIORITY_CONTROL: return "UVC_CT_AE_PRIORITY_CONTROL";
+						case UVC_CT_EXPOSURE_TIME_ABSOLUTE_CONTROL: return "UVC_CT_EXPOSURE_TIME_ABSOLUTE_CONTROL";
+						case UVC_CT_EXPOSURE_TIME_RELATIVE_CONTROL: return "UVC_CT_EXPOSURE_TIME_RELATIVE_CONTROL";
+						case UVC_CT_FOCUS_ABSOLUTE_CONTROL: return "UVC_CT_FOCUS_ABSOLUTE_CONTROL";
+						case UVC_CT_FOCUS_RELATIVE_CONTROL: return "UVC_CT_FOCUS_RELATIVE_CONTROL";
+						case UVC_CT_FOCUS_AUTO_CONTROL: return "UVC_CT_FOCUS_AUTO_CONTROL";
+						case UVC_CT_IRIS_ABSOLUTE_CONTROL: return "UVC_CT_IRIS_ABSOLUTE_CONTROL";
+						case UVC_CT_IRIS_RELATIVE_CONTROL: return "UVC_CT_IRIS_RELATIVE_CONTROL";
+						case UVC_CT_ZOOM_ABSOLUTE_CONTROL: return "UVC_CT_ZOOM_ABSOLUTE_CONTROL";
+						case UVC_CT_ZOOM_RELATIVE_CONTROL: return "UVC_CT_ZOOM_RELATIVE_CONTROL";
+						case UVC_CT_PANTILT_ABSOLUTE_CONTROL: return "UVC_CT_PANTILT_ABSOLUTE_CONTROL";
+						case UVC_CT_PANTILT_RELATIVE_CONTROL: return "UVC_CT_PANTILT_RELATIVE_CONTROL";
+						case UVC_CT_ROLL_ABSOLUTE_CONTROL: return "UVC_CT_ROLL_ABSOLUTE_CONTROL";
+						case UVC_CT_ROLL_RELATIVE_CONTROL: return "UVC_CT_ROLL_RELATIVE_CONTROL";
+						case UVC_CT_PRIVACY_CONTROL: return "UVC_CT_PRIVACY_CONTROL";
+						default: return "UNKNOWN";
+					}
+				case UVC_VC_ENT_PROCESSING_UNIT_ID:
+					switch (control_selector) {
+						case UVC_PU_CONTROL_UNDEFINED: return "UVC_PU_CONTROL_UNDEFINED";
+						case UVC_PU_BACKLIGHT_COMPENSATION_CONTROL: return "UVC_PU_BACKLIGHT_COMPENSATION_CONTROL";
+						case UVC_PU_BRIGHTNESS_CONTROL: return "UVC_PU_BRIGHTNESS_CONTROL";
+						case UVC_PU_CONTRAST_CONTROL: return "UVC_PU_CONTRAST_CONTROL";
+						case UVC_PU_GAIN_CONTROL: return "UVC_PU_GAIN_CONTROL";
+						case UVC_PU_POWER_LINE_FREQUENCY_CONTROL: return "UVC_PU_POWER_LINE_FREQUENCY_CONTROL";
+						case UVC_PU_HUE_CONTROL: return "UVC_PU_HUE_CONTROL";
+						case UVC_PU_SATURATION_CONTROL: return "UVC_PU_SATURATION_CONTROL";
+						case UVC_PU_SHARPNESS_CONTROL: return "UVC_PU_SHARPNESS_CONTROL";
+						case UVC_PU_GAMMA_CONTROL: return "UVC_PU_GAMMA_CONTROL";
+						case UVC_PU_WHITE_BALANCE_TEMPERATURE_CONTROL: return "UVC_PU_WHITE_BALANCE_TEMPERATURE_CONTROL";
+						case UVC_PU_WHITE_BALANCE_TEMPERATURE_AUTO_CONTROL: return "UVC_PU_WHITE_BALANCE_TEMPERATURE_AUTO_CONTROL";
+						case UVC_PU_WHITE_BALANCE_COMPONENT_CONTROL: return "UVC_PU_WHITE_BALANCE_COMPONENT_CONTROL";
+						case UVC_PU_WHITE_BALANCE_COMPONENT_AUTO_CONTROL: return "UVC_PU_WHITE_BALANCE_COMPONENT_AUTO_CONTROL";
+						case UVC_PU_DIGITAL_MULTIPLIER_CONTROL: return "UVC_PU_DIGITAL_MULTIPLIER_CONTROL";
+						case UVC_PU_DIGITAL_MULTIPLIER_LIMIT_CONTROL: return "UVC_PU_DIGITAL_MULTIPLIER_LIMIT_CONTROL";
+						case UVC_PU_HUE_AUTO_CONTROL: return "UVC_PU_HUE_AUTO_CONTROL";
+						case UVC_PU_ANALOG_VIDEO_STANDARD_CONTROL: return "UVC_PU_ANALOG_VIDEO_STANDARD_CONTROL";
+						case UVC_PU_ANALOG_LOCK_STATUS_CONTROL: return "UVC_PU_ANALOG_LOCK_STATUS_CONTROL";
+						default: return "UNKNOWN";
+					}
+				case UVC_VC_ENT_OUTPUT_TERMINAL_ID:
+					switch (control_selector) {
+						default: return "UNKNOWN";
+					}
+				default: return "UNKNOWN";
+			}
+		case UVC_INTF_VIDEO_STREAMING:
+			switch (entity_id) {
+				case 0:
+					switch (control_selector) {
+						case UVC_VS_CONTROL_UNDEFINED: return "UVC_VS_CONTROL_UNDEFINED";
+						case UVC_VS_PROBE_CONTROL: return "UVC_VS_PROBE_CONTROL";
+						case UVC_VS_COMMIT_CONTROL: return "UVC_VS_COMMIT_CONTROL";
+						case UVC_VS_STILL_PROBE_CONTROL: return "UVC_VS_STILL_PROBE_CONTROL";
+						case UVC_VS_STILL_COMMIT_CONTROL: return "UVC_VS_STILL_COMMIT_CONTROL";
+						case UVC_VS_STILL_IMAGE_TRIGGER_CONTROL: return "UVC_VS_STILL_IMAGE_TRIGGER_CONTROL";
+						case UVC_VS_STREAM_ERROR_CODE_CONTROL: return "UVC_VS_STREAM_ERROR_CODE_CONTROL";
+						case UVC_VS_GENERATE_KEY_FRAME_CONTROL: return "UVC_VS_GENERATE_KEY_FRAME_CONTROL";
+						case UVC_VS_UPDATE_FRAME_SEGMENT_CONTROL: return "UVC_VS_UPDATE_FRAME_SEGMENT_CONTROL";
+						case UVC_VS_SYNC_DELAY_CONTROL: return "UVC_VS_SYNC_DELAY_CONTROL";
+						default: return "UNKNOWN";
+					}
+				default: return "UNKNOWN";
+			}
+		default: return "UNKNOWN";
+	}
+}
+
+int uvcFormatSetupPacket(char *buf, size_t size, const struct usb_ctrlrequest *req) {
+	const char transfer_direction = (req->bRequestType & USB_DIR_IN) ? '>' : '<';
+
+	char type = '?';
+	switch (req->bRequestType & USB_TYPE_MASK) {
+		case USB_TYPE_STANDARD: type = 'S'; break;
+		case USB_TYPE_CLASS: type = 'C'; break;
+		case USB_TYPE_VENDOR: type = 'V'; break;
+	}
+
+	char recipient = '?';
+	switch (req->bRequestType & USB_RECIP_MASK) {
+		case USB_RECIP_DEVICE: recipient = 'D'; break;
+		case USB_RECIP_INTERFACE: recipient = 'I'; break;
+		case USB_RECIP_ENDPOINT: recipient = 'E'; break;
+		case USB_RECIP_OTHER: recipient = 'O'; break;
+		case USB_RECIP_PORT: recipient = 'P'; break;
+		case USB_RECIP_RPIPE: recipient = 'R'; break;
+	}
+
+	const int if_or_endpoint = req->wIndex & 0xff;
+	const int entity_id = req->wIndex >> 8;
+
+	return snprintf(buf, size, "bRequestType=%c%c%c(%02x) bRequest=%s(%02x) wIndex=[ent=%d if=%d](%04x) wValue=%04x wLength=%d",
+		transfer_direction, type, recipient, req->bRequestType,
+		uvcRequestName(req->bRequest), req->bRequest,
+		entity_id, if_or_endpoint, req->wIndex,
+		req->wValue,
+		req->wLength);
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <linux/usb/ch9.h>
+#include <stddef.h> // size_t
+
+// These are hardcoded in uvc-gadget, see drivers/usb/gadget/function/f_uvc.c
+// Alternatively, configfs could be parsed instead lol:
+// /sys/kernel/config/usb_gadget/g1/functions/uvc.0/control/bInterfaceNumber
+// /sys/kernel/config/usb_gadget/g1/functions/uvc.0/streaming/bInterfaceNumber
+#define UVC_INTF_VIDEO_CONTROL			0
+#define UVC_INTF_VIDEO_STREAMING		1
+
+// Units/terminals structure and IDs are also hardcoded,
+// see `uvc_alloc_inst()` function in the same file
+#define UVC_VC_ENT_INTERFACE 0
+#define UVC_VC_ENT_CAMERA_TERMINAL_ID 1
+#define UVC_VC_ENT_PROCESSING_UNIT_ID 2
+#define UVC_VC_ENT_OUTPUT_TERMINAL_ID 3
+
+#define UVC_VS_ENT_INTERFACE 0
+
+const char *uvcRequestName(int request);
+const char *usbSpeedName(enum usb_device_speed speed);
+const char *uvcInterfaceName(int interface);
+const char *uvcEntityName(int interface, int entity_id);
+const char *uvcControlName(int interface, int entity_id, int control_selector);
+
+// Formats setup packet fields with names, returns snprintf() result
+int uvcFormatSetupPacket(char *buf, size_t size, const struct usb_ctrlrequest *req);